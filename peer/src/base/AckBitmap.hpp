@@ -0,0 +1,82 @@
+#ifndef __ACK_BITMAP_H__
+#define __ACK_BITMAP_H__
+
+#include "Headers.hpp"
+
+namespace wga {
+// Tracks which packet numbers have arrived.  The frame is anchored at the
+// largest packet number seen so far, and bit i of the bitmap marks packet
+// (largest - 1 - i).  Anchoring at the top instead of at the first hole means
+// a lost packet never wedges the window: its contents get resent in a new
+// packet and the old number simply falls off the end.
+class AckBitmap {
+ public:
+  static constexpr uint64_t WINDOW = 64;
+
+  AckBitmap() : largest(0), bits(0) {}
+  AckBitmap(uint64_t _largest, uint64_t _bits)
+      : largest(_largest), bits(_bits) {}
+
+  // Returns true if the packet was not already recorded.  Packets older than
+  // the window can't be tracked and always return false.
+  bool markReceived(uint64_t packetNumber) {
+    if (packetNumber == 0) {
+      return false;
+    }
+    if (packetNumber > largest) {
+      uint64_t shift = packetNumber - largest;
+      if (largest == 0 || shift > WINDOW) {
+        bits = 0;
+      } else if (shift == WINDOW) {
+        bits = (1ULL << (WINDOW - 1));
+      } else {
+        bits = (bits << shift) | (1ULL << (shift - 1));
+      }
+      largest = packetNumber;
+      return true;
+    }
+    if (packetNumber == largest) {
+      return false;
+    }
+    uint64_t distance = largest - packetNumber;
+    if (distance > WINDOW) {
+      return false;
+    }
+    uint64_t mask = 1ULL << (distance - 1);
+    if (bits & mask) {
+      return false;
+    }
+    bits |= mask;
+    return true;
+  }
+
+  bool contains(uint64_t packetNumber) const {
+    if (packetNumber == 0 || packetNumber > largest) {
+      return false;
+    }
+    if (packetNumber == largest) {
+      return true;
+    }
+    uint64_t distance = largest - packetNumber;
+    if (distance > WINDOW) {
+      return false;
+    }
+    return (bits >> (distance - 1)) & 1;
+  }
+
+  // The oldest packet number this frame can still say anything about.
+  uint64_t getOldest() const {
+    return largest > WINDOW ? largest - WINDOW : 1;
+  }
+
+  bool empty() const { return largest == 0; }
+  uint64_t getLargest() const { return largest; }
+  uint64_t getBits() const { return bits; }
+
+ protected:
+  uint64_t largest;
+  uint64_t bits;
+};
+}  // namespace wga
+
+#endif  // __ACK_BITMAP_H__
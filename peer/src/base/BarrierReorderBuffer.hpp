@@ -0,0 +1,79 @@
+#ifndef __BARRIER_REORDER_BUFFER_H__
+#define __BARRIER_REORDER_BUFFER_H__
+
+#include "Headers.hpp"
+#include "RpcId.hpp"
+
+namespace wga {
+// Enforces barriers on the receiving side.  Every request carries the number
+// of requests its sender made before the request's barrier.  A request is
+// handed out only once that many have been handed out already, so a barrier
+// generation never overtakes the one before it while the sender is free to
+// have several generations in flight.
+class BarrierReorderBuffer {
+ public:
+  BarrierReorderBuffer()
+      : currentBarrier(0), releasedRequests(0), heldRequests(0) {}
+
+  // Takes a new (not duplicate) request and returns every request that can
+  // be handled now, in order.
+  vector<IdPayload> push(const IdPayload& idPayload, uint64_t priorRequests) {
+    vector<IdPayload> ready;
+    int64_t barrier = idPayload.id.barrier;
+    if (!isReady(barrier, priorRequests)) {
+      auto& generation = held[barrier];
+      generation.priorRequests = priorRequests;
+      generation.requests.push_back(idPayload);
+      heldIds.insert(idPayload.id);
+      heldRequests++;
+      return ready;
+    }
+    release(idPayload, ready);
+    // Releasing may have completed the generation something else waits on
+    while (!held.empty() &&
+           isReady(held.begin()->first, held.begin()->second.priorRequests)) {
+      for (const auto& it : held.begin()->second.requests) {
+        heldIds.erase(it.id);
+        heldRequests--;
+        release(it, ready);
+      }
+      held.erase(held.begin());
+    }
+    return ready;
+  }
+
+  bool contains(const RpcId& rpcId) const {
+    return heldIds.find(rpcId) != heldIds.end();
+  }
+
+  bool empty() const { return heldRequests == 0; }
+  int64_t size() const { return heldRequests; }
+
+ protected:
+  class Generation {
+   public:
+    Generation() : priorRequests(0) {}
+
+    uint64_t priorRequests;
+    vector<IdPayload> requests;
+  };
+
+  int64_t currentBarrier;
+  uint64_t releasedRequests;
+  int64_t heldRequests;
+  map<int64_t, Generation> held;
+  unordered_set<RpcId> heldIds;
+
+  bool isReady(int64_t barrier, uint64_t priorRequests) const {
+    return barrier <= currentBarrier || releasedRequests >= priorRequests;
+  }
+
+  void release(const IdPayload& idPayload, vector<IdPayload>& ready) {
+    currentBarrier = max(currentBarrier, idPayload.id.barrier);
+    releasedRequests++;
+    ready.push_back(idPayload);
+  }
+};
+}  // namespace wga
+
+#endif  // __BARRIER_REORDER_BUFFER_H__
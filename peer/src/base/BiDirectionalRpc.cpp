@@ -4,15 +4,145 @@
 
 namespace wga {
 bool ALL_RPC_FLAKY = false;
+bool ENABLE_SEQUENCED_RPC_IDS = true;
+bool ENABLE_FORWARD_ERROR_CORRECTION = true;
+
+// Time between clock probes while bootstrapping, so they don't queue behind
+// each other and skew the samples
+#define CLOCK_PROBE_INTERVAL (5 * 1000)
+
+// Clock probes waiting on a reply at once
+#define MAX_CLOCK_PROBES_IN_FLIGHT (4)
+
+// Cap on packets we remember for acknowledgement when the other side goes
+// quiet.  Anything dropped here is still covered by the resend path.
+#define MAX_SENT_PACKETS (4096)
+
+// Largest datagram we build unless told otherwise.  Small enough to cross
+// most tunnels and PPPoE links without IP fragmentation.
+#define DEFAULT_MAX_PACKET_SIZE (1200)
+
+// Packet type, packet number and the three ack fields, each at their
+// largest msgpack encoding.
+#define MAX_PACKET_HEADER_SIZE (1 + 4 * 9)
+
+// Fragment frame type, rpc type, rpc id, offset, frame size and the piece's
+// length prefix, each at their largest msgpack encoding.
+#define MAX_FRAGMENT_HEADER_SIZE (1 + 1 + (1 + 2 * 9) + 2 * 5 + 5)
+
+// Parity packet type, first packet number, the offsets of the rest of the
+// group, the XOR of the lengths and the parity bytes' length prefix.  Data
+// packets leave this much room so their parity fits in a packet too.
+#define MAX_PARITY_HEADER_SIZE \
+  (1 + 9 + (5 + ParityEncoder::MAX_GROUP_SIZE) + 5 + 5)
+
+// Data packets we keep for rebuilding lost ones from parity.  Enough for the
+// widest groups at the deepest interleave, with room for reordering.
+#define MAX_PARITY_PACKETS \
+  (2 * ParityEncoder::MAX_GROUP_SIZE * ParityEncoder::MAX_DEPTH)
+
+// Bytes of partially received fragmented rpcs we hold per connection
+#define MAX_REASSEMBLY_BYTES (4 * 1024 * 1024)
+
+// Largest datagram path mtu discovery will try: an ethernet mtu minus the
+// IPv6 and UDP headers.
+#define MAX_PROBED_PACKET_SIZE (1452)
+
+// Later packets that must be acknowledged before an unacknowledged packet
+// counts as lost rather than reordered (as in QUIC)
+#define PACKET_REORDER_THRESHOLD (3)
+
+// Submissions that can wait for the owning thread.  Past this, callers take
+// the lock and do the work themselves.
+#define SUBMISSION_QUEUE_SIZE (1024)
+
+// Unreliable messages waiting on the send budget.  Past this the oldest are
+// dropped.
+#define MAX_QUEUED_UNRELIABLE (1024)
+
+// Unreliable messages kept for polling when no handler is set.  Past this the
+// oldest are dropped, they were unreliable anyway.
+#define MAX_INCOMING_UNRELIABLE (1024)
+
+namespace {
+// One frame pulled out of a DATA packet
+struct ReceivedFrame {
+  RpcHeader type;
+  IdPayload idPayload;
+  UnreliableMessage unreliable;
+  uint64_t priorRequests;
+  StreamPosition streamPosition;
+  int64_t requestReceiveTime;
+  int64_t replySendTime;
+  RpcHeader fragmentType;
+  uint32_t fragmentOffset;
+  uint32_t fragmentFrameSize;
+};
+
+// Returns false for frame types we don't know
+bool readFrame(MessageReader& reader, ReceivedFrame& frame) {
+  frame.type = (RpcHeader)reader.readPrimitive<unsigned char>();
+  frame.requestReceiveTime = frame.replySendTime = 0;
+  frame.priorRequests = 0;
+  frame.fragmentType = REQUEST;
+  frame.fragmentOffset = frame.fragmentFrameSize = 0;
+  if (frame.type == REQUEST) {
+    frame.idPayload.id = reader.readClass<RpcId>();
+    frame.priorRequests = reader.readPrimitive<uint64_t>();
+    frame.streamPosition.stream = reader.readPrimitive<uint32_t>();
+    frame.streamPosition.sequence = reader.readPrimitive<uint64_t>();
+  } else if (frame.type == REPLY) {
+    frame.idPayload.id = reader.readClass<RpcId>();
+    frame.requestReceiveTime = reader.readPrimitive<int64_t>();
+    frame.replySendTime = reader.readPrimitive<int64_t>();
+  } else if (frame.type == UNRELIABLE_SEQUENCED) {
+    frame.unreliable.sequenced = true;
+    frame.unreliable.channel = reader.readPrimitive<uint32_t>();
+    frame.unreliable.sequence = reader.readPrimitive<uint64_t>();
+  } else if (frame.type == FRAGMENT) {
+    frame.fragmentType = (RpcHeader)reader.readPrimitive<unsigned char>();
+    frame.idPayload.id = reader.readClass<RpcId>();
+    frame.fragmentOffset = reader.readPrimitive<uint32_t>();
+    frame.fragmentFrameSize = reader.readPrimitive<uint32_t>();
+  } else if (frame.type != UNRELIABLE && frame.type != PADDING) {
+    LOG(ERROR) << "Got invalid frame type: " << frame.type;
+    return false;
+  }
+  frame.idPayload.payload = reader.readPrimitive<string>();
+  frame.unreliable.payload = frame.idPayload.payload;
+  return true;
+}
+}  // namespace
 
 BiDirectionalRpc::BiDirectionalRpc(bool connectedToHost)
-    : processedRequests(128 * 1024),
+    : sentRequestCount(0),
+      processedRequests(128 * 1024),
       processedReplies(128 * 1024),
+      nextPacketNumber(1),
+      acknowledgePending(false),
+      processingSealedPacket(false),
+      newestSealedPacket(0),
+      receivedNewestSealedPacket(false),
+      maxPacketSize(DEFAULT_MAX_PACKET_SIZE),
+      fragmentReassembler(MAX_REASSEMBLY_BYTES),
+      mtuProber(DEFAULT_MAX_PACKET_SIZE, MAX_PROBED_PACKET_SIZE),
+      mtuDiscovery(false),
+      congestionController(DEFAULT_MAX_PACKET_SIZE),
+      parityEnabled(false),
+      parityDecoder(MAX_PARITY_PACKETS),
+      nextSettledPacket(1),
+      packetsRecoveredByPeer(0),
       onBarrier(0),
       onId(0),
+      sequencedRpcIds(false),
+      sequenceSide(0),
       flaky(ALL_RPC_FLAKY),
       shuttingDown(false),
-      clockSynchronizer(GlobalClock::timeHandler, connectedToHost, true) {}
+      submissions(SUBMISSION_QUEUE_SIZE),
+      drainingSubmissions(false),
+      clockSynchronizer(GlobalClock::timeHandler, connectedToHost, true),
+      clockBootstrapping(false),
+      nextClockProbeTime(0) {}
 
 BiDirectionalRpc::~BiDirectionalRpc() {}
 
@@ -22,185 +152,538 @@ void BiDirectionalRpc::sendShutdown() {
     return;
   }
   LOG(INFO) << "SHUTTING DOWN RPC";
-  requestOneWay("SHUTDOWN");
+  requestOneWay("SHUTDOWN", CONTROL_STREAM);
+}
+
+void BiDirectionalRpc::shutdown() { shuttingDown = true; }
+
+void BiDirectionalRpc::barrier() {
+  if (!isOwnerThread() &&
+      submissions.tryPush(RpcSubmission(SUBMIT_BARRIER, ""))) {
+    scheduleDrain();
+    return;
+  }
+  lock_guard<recursive_mutex> guard(mutex);
+  // Anything submitted earlier belongs before the barrier
+  drainSubmissions();
+  onBarrier++;
 }
 
-void BiDirectionalRpc::shutdown() {
+void BiDirectionalRpc::drainSubmissions() {
   lock_guard<recursive_mutex> guard(mutex);
-  shuttingDown = true;
+  if (drainingSubmissions) {
+    // Sending a request can flush, which drains again.  The outer loop will
+    // pick up the rest.
+    return;
+  }
+  drainingSubmissions = true;
+  RpcSubmission submission;
+  while (submissions.tryPop(submission)) {
+    switch (submission.type) {
+      case SUBMIT_REQUEST_ONE_WAY:
+        sendOneWayRequest(submission.payload, submission.channel);
+        break;
+      case SUBMIT_BARRIER:
+        onBarrier++;
+        break;
+      case SUBMIT_UNRELIABLE:
+      case SUBMIT_UNRELIABLE_SEQUENCED: {
+        UnreliableMessage message;
+        message.sequenced = (submission.type == SUBMIT_UNRELIABLE_SEQUENCED);
+        message.channel = submission.channel;
+        message.payload = submission.payload;
+        queueUnreliable(message);
+      } break;
+    }
+  }
+  drainingSubmissions = false;
 }
 
 void BiDirectionalRpc::initTimeShift() {
-  // Send a bunch of heartbeats to stabilize any timeshift calculations
   // This has to be done in a separate thread from heartbeat()
-  for (int a = 0; a < 20; a++) {
-    LOG(INFO) << "ON INITIAL PING: " << a;
-    RpcId reqId;
-    {
-      lock_guard<recursive_mutex> guard(mutex);
-      reqId = request("PING");
-    }
-    while (true) {
-      {
-        lock_guard<recursive_mutex> guard(mutex);
-        if (hasIncomingReplyWithId(reqId) || hasProcessedReplyWithId(reqId)) {
-          break;
-        }
-      }
-      VLOG(1) << "WAITING ON REPLY: " << reqId.id;
-      microsleep(1000);
-    }
+  startClockBootstrap();
+  unique_lock<recursive_mutex> lock(mutex);
+  while (!clockSynchronizer.isBootstrapped()) {
+    sendClockProbes();
+    flush();
+    // handleReply wakes us up.  The timeout spaces out the probes.
+    replyCondition.wait_for(lock,
+                            chrono::microseconds(CLOCK_PROBE_INTERVAL));
+  }
+}
+
+void BiDirectionalRpc::startClockBootstrap() {
+  lock_guard<recursive_mutex> guard(mutex);
+  if (clockSynchronizer.isBootstrapped()) {
+    // Carried over from a session we resumed
+    LOG(INFO) << "Clock already synchronized, skipping initial pings";
+    return;
+  }
+  clockBootstrapping = true;
+}
+
+void BiDirectionalRpc::sendClockProbes(int64_t now) {
+  lock_guard<recursive_mutex> guard(mutex);
+  if (!clockBootstrapping) {
+    return;
+  }
+  if (clockSynchronizer.isBootstrapped()) {
+    clockBootstrapping = false;
+    clockProbes.clear();
+    return;
+  }
+  if (now < nextClockProbeTime ||
+      clockProbes.size() >= MAX_CLOCK_PROBES_IN_FLIGHT || !readyToSend() ||
+      shuttingDown) {
+    return;
   }
+  nextClockProbeTime = now + CLOCK_PROBE_INTERVAL;
+  // One-way, the reply still times the clock but isn't kept
+  RpcId rpcId = createRpcId();
+  oneWayRequests.insert(rpcId);
+  clockProbes.insert(rpcId);
+  requestWithId(IdPayload(rpcId, "PING"), CONTROL_STREAM);
 }
 
 void BiDirectionalRpc::heartbeat() {
   lock_guard<recursive_mutex> guard(mutex);
-  // TODO: If the outgoingReplies/requests is high, and we have recently
-  // received data, flush a lot of data out
   VLOG(1) << "BEAT: " << int64_t(this);
-  if (!outgoingReplies.empty() || !outgoingRequests.empty()) {
-    VLOG(1) << "RESENDING MESSAGES: " << outgoingRequests.size() << " "
-            << outgoingReplies.size();
-    resendRandomOutgoingMessage();
-  } else if (readyToSend() && !shuttingDown) {
-    VLOG(1) << "RESENDING MESSAGES: " << outgoingRequests.size() << " "
-            << "SENDING HEARTBEAT";
-    requestOneWay("PING");
+  drainSubmissions();
+  resendExpiredMessages();
+  probePathMtu();
+  sendClockProbes();
+  checkTimeouts(monotonicTimeMicros());
+  if (outgoingReplies.empty() && outgoingRequests.empty() && readyToSend() &&
+      !shuttingDown) {
+    VLOG(1) << "SENDING HEARTBEAT";
+    requestOneWay("PING", CONTROL_STREAM);
   }
+  flush();
+  publishStats(monotonicTimeMicros());
 }
 
-void BiDirectionalRpc::resendRandomOutgoingMessage() {
+void BiDirectionalRpc::resendExpiredMessages() {
   lock_guard<recursive_mutex> guard(mutex);
-  if (!outgoingReplies.empty()) {
-    // Re-send a random reply
-    DRAW_FROM_UNORDERED(it, outgoingReplies);
-    sendReply(it->first, it->second, true);
-  } else if (!outgoingRequests.empty()) {
-    // Re-send a random request
-    DRAW_FROM_UNORDERED(it, outgoingRequests);
-    sendRequest(it->first, it->second, true);
-  } else {
+  int64_t now = monotonicTimeMicros();
+  vector<pair<int64_t, RpcId>> expired;
+  for (const auto& it : retransmitTimers) {
+    if (it.second.deadline <= now) {
+      expired.push_back(make_pair(it.second.firstSendTime, it.first));
+    }
+  }
+  if (!expired.empty()) {
+    VLOG(1) << "RESENDING MESSAGES: " << expired.size();
+    // Whatever has been waiting the longest goes out first
+    sort(expired.begin(), expired.end());
+    for (const auto& it : expired) {
+      resendOutgoingMessage(it.second, now);
+    }
+  }
+  detectLostPackets(0, now);
+  int64_t deadline = getNextRetransmitDeadline();
+  if (deadline != numeric_limits<int64_t>::max()) {
+    scheduleRetransmit(deadline);
   }
+  flush();
 }
 
-bool BiDirectionalRpc::receive(const string& message) {
+void BiDirectionalRpc::resendOldestOutgoingMessage() {
   lock_guard<recursive_mutex> guard(mutex);
+  auto oldest = retransmitTimers.end();
+  for (auto it = retransmitTimers.begin(); it != retransmitTimers.end(); it++) {
+    if (it->second.deadline == numeric_limits<int64_t>::max()) {
+      // Delivered, waiting on a reply
+      continue;
+    }
+    if (oldest == retransmitTimers.end() ||
+        it->second.firstSendTime < oldest->second.firstSendTime) {
+      oldest = it;
+    }
+  }
+  if (oldest != retransmitTimers.end()) {
+    resendOutgoingMessage(oldest->first, monotonicTimeMicros());
+  }
+  flush();
+}
+
+void BiDirectionalRpc::resendOutgoingMessage(const RpcId& rpcId,
+                                             int64_t now) {
+  auto replyIt = outgoingReplies.find(rpcId);
+  if (replyIt != outgoingReplies.end()) {
+    queueReply(replyIt->first);
+  } else {
+    auto requestIt = outgoingRequests.find(rpcId);
+    if (requestIt == outgoingRequests.end()) {
+      // Already acknowledged
+      retransmitTimers.erase(rpcId);
+      return;
+    }
+    queueRequest(requestIt->first);
+  }
+  auto& timer = retransmitTimers[rpcId];
+  timer.retransmits++;
+  timer.lastSendTime = now;
+  timer.deadline =
+      now + clockSynchronizer.getRetransmissionTimeout(timer.retransmits);
+  stats.retransmits++;
+}
+
+bool BiDirectionalRpc::armRetransmitTimer(const RpcId& rpcId, int64_t now) {
+  if (retransmitTimers.find(rpcId) != retransmitTimers.end()) {
+    // Already went out once, resends keep the timer they have
+    return false;
+  }
+  RetransmitTimer timer;
+  timer.firstSendTime = timer.lastSendTime = now;
+  timer.deadline = now + clockSynchronizer.getRetransmissionTimeout(0);
+  retransmitTimers[rpcId] = timer;
+  scheduleRetransmit(timer.deadline);
+  return true;
+}
+
+void BiDirectionalRpc::checkSpuriousRetransmit(const RpcId& rpcId,
+                                               int64_t packetSendTime) {
+  auto it = retransmitTimers.find(rpcId);
+  if (it != retransmitTimers.end() && it->second.retransmits > 0 &&
+      packetSendTime < it->second.lastSendTime) {
+    // A copy sent before the last resend got through, so the resend was
+    // wasted.
+    stats.spuriousRetransmits++;
+  }
+}
+
+int64_t BiDirectionalRpc::getNextRetransmitDeadline() {
+  int64_t deadline = numeric_limits<int64_t>::max();
+  for (const auto& it : retransmitTimers) {
+    deadline = min(deadline, it.second.deadline);
+  }
+  return deadline;
+}
+
+ReceiveResult BiDirectionalRpc::receive(const string& message) {
+  return receivePacket(message.size(),
+                       [this, &message]() { return processPacket(message); });
+}
+
+ReceiveResult BiDirectionalRpc::receiveOpened(PacketOpenResult result,
+                                              const string& opened,
+                                              size_t sealedSize) {
+  return receivePacket(sealedSize, [this, result, &opened]() {
+    return processOpenedPacket(result, opened);
+  });
+}
+
+ReceiveResult BiDirectionalRpc::receivePacket(size_t size,
+                                              const function<bool()>& process) {
+  ReceiveResult result;
+  vector<pair<RpcExecutor, function<void()>>> deliveries;
+  {
+    lock_guard<recursive_mutex> guard(mutex);
+    stats.packetsReceived++;
+    stats.bytesReceived += int64_t(size) + getPacketOverhead();
+    receivedNewestSealedPacket = false;
+    if (!process()) {
+      result = RECEIVE_INVALID;
+    } else if (receivedNewestSealedPacket) {
+      result = RECEIVE_AUTHENTICATED;
+    } else {
+      result = RECEIVE_ACCEPTED;
+    }
+    deliveries.swap(pendingDeliveries);
+    int64_t now = monotonicTimeMicros();
+    if (statsPublisher.isPublishDue(now)) {
+      publishStats(now);
+    }
+  }
+  // Handlers run without the lock, so they are free to take their own locks
+  // and call back into this connection.
+  for (auto& it : deliveries) {
+    if (it.first) {
+      it.first(it.second);
+    } else {
+      it.second();
+    }
+  }
+  return result;
+}
+
+void BiDirectionalRpc::queueDelivery(RpcHandler handler, RpcExecutor executor,
+                                     const IdPayload& idPayload) {
+  pendingDeliveries.push_back(
+      make_pair(executor, [handler, idPayload]() { handler(idPayload); }));
+}
+
+bool BiDirectionalRpc::processSealedPacket(const string& message) {
+  PacketOpenResult result =
+      openPacket(message.data() + 1, message.size() - 1, &openedPacket);
+  return processOpenedPacket(result, openedPacket);
+}
+
+bool BiDirectionalRpc::processOpenedPacket(PacketOpenResult result,
+                                           const string& opened) {
+  if (result == PACKET_UNREADABLE) {
+    VLOG(1) << "Dropping a sealed packet we can't open yet";
+    return true;
+  }
+  if (result == PACKET_REPLAYED) {
+    // Dropped before it costs a decrypt
+    stats.duplicatePackets++;
+    return true;
+  }
+  if (result != PACKET_OPENED || opened.empty() ||
+      (unsigned char)opened[0] == SEALED) {
+    LOG(WARNING) << "Got a sealed packet that doesn't open";
+    return false;
+  }
+  bool wasSealed = processingSealedPacket;
+  processingSealedPacket = true;
+  bool valid = processPacket(opened);
+  processingSealedPacket = wasSealed;
+  return valid;
+}
+
+bool BiDirectionalRpc::processPacket(const string& message) {
   VLOG(1) << "Receiving message with length " << message.length();
+  if (!message.empty() && (unsigned char)message[0] == SEALED) {
+    // Opened once, then everything in it is parsed in the clear
+    return processSealedPacket(message);
+  }
   MessageReader reader;
   reader.load(message);
   RpcHeader header = (RpcHeader)reader.readPrimitive<unsigned char>();
+  // Unsealed packets can't carry anything but the handshake.  Even one
+  // without frames would hand us a forged ack bitmap.
+  bool mustBeHandshake = !processingSealedPacket && requiresSealedPackets() &&
+                         (header == DATA || header == PARITY);
+  if (mustBeHandshake && header == PARITY) {
+    LOG(WARNING) << "Got an unsealed parity packet";
+    return false;
+  }
+  if (!processingSealedPacket && requiresSealedPackets() &&
+      header == ACKNOWLEDGE) {
+    // Acks go inside sealed packets now.  This one may be from before the
+    // other side could seal, but its bitmap proves nothing.
+    VLOG(1) << "Dropping an unsealed ack";
+    return true;
+  }
   if (flaky && (rand() % 100 == 0)) {
     // Pretend we never got the message
     LOG(INFO) << "FLAKE";
   } else {
     VLOG(1) << "GOT PACKET WITH HEADER " << header;
     switch (header) {
-      case REQUEST: {
+      case DATA: {
+        uint64_t packetNumber = reader.readPrimitive<uint64_t>();
+        uint64_t packetsRecovered;
+        AckBitmap ackFrame = readAcknowledgeFrame(reader, &packetsRecovered);
+        vector<ReceivedFrame> frames;
+        // Packets with only unreliable frames don't need an ack
+        bool needsAcknowledge = false;
+        bool refused = false;
         while (reader.sizeRemaining()) {
-          RpcId rpcId = reader.readClass<RpcId>();
-          string payload = reader.readPrimitive<string>();
-          if (!validatePacket(rpcId, payload)) {
+          ReceivedFrame frame;
+          if (!readFrame(reader, frame)) {
             return false;
           }
-          handleRequest(rpcId, payload);
-        }
-      } break;
-      case REPLY: {
-        while (reader.sizeRemaining()) {
-          RpcId uid = reader.readClass<RpcId>();
-          int64_t requestReceiveTime = reader.readPrimitive<int64_t>();
-          int64_t replySendTime = reader.readPrimitive<int64_t>();
-          string payload = reader.readPrimitive<string>();
-          if (!validatePacket(uid, payload)) {
+          if (mustBeHandshake && !(frame.type == REQUEST &&
+                                   IS_HANDSHAKE_RPCID(frame.idPayload.id))) {
+            LOG(WARNING) << "Got an unsealed frame after sealing was negotiated";
             return false;
           }
-          handleReply(uid, payload, requestReceiveTime, replySendTime);
+          if (frame.type != UNRELIABLE && frame.type != UNRELIABLE_SEQUENCED) {
+            needsAcknowledge = true;
+          }
+          if (frame.type == PADDING) {
+            continue;
+          }
+          if (frame.type == FRAGMENT) {
+            string whole;
+            FragmentResult result = handleFragment(
+                frame.fragmentType, frame.idPayload.id, frame.fragmentOffset,
+                frame.fragmentFrameSize, frame.idPayload.payload, &whole);
+            if (result == FRAGMENT_REFUSED) {
+              refused = true;
+            }
+            if (result != FRAGMENT_COMPLETE) {
+              continue;
+            }
+            MessageReader frameReader;
+            frameReader.load(whole);
+            if (!readFrame(frameReader, frame) ||
+                (frame.type != REQUEST && frame.type != REPLY)) {
+              LOG(ERROR) << "Got invalid fragmented frame";
+              return false;
+            }
+          }
+          if (!validatePacket(frame.type, frame.idPayload.id,
+                              frame.idPayload.payload)) {
+            return false;
+          }
+          frames.push_back(frame);
+        }
+        if (mustBeHandshake && frames.empty()) {
+          LOG(WARNING) << "Got an unsealed packet without the handshake";
+          return false;
+        }
+        // Only once it checked out, so a forgery can't spoil a rebuild
+        parityDecoder.addPacket(packetNumber, message);
+        bool newPacket = false;
+        if (refused) {
+          // Leave the packet unacknowledged so the sender keeps the pieces
+          // we had no room for.  Rpcs in it are deduplicated when they come
+          // back, unreliable messages are dropped.
+          VLOG(1) << "Not acknowledging packet " << packetNumber;
+        } else {
+          bool reordered = packetNumber < receivedPackets.getLargest();
+          newPacket = receivedPackets.markReceived(packetNumber);
+          acknowledgePending |= needsAcknowledge;
+          if (!newPacket) {
+            stats.duplicatePackets++;
+          } else if (reordered) {
+            stats.packetsReordered++;
+          }
+          if (processingSealedPacket && packetNumber > newestSealedPacket) {
+            // The packet number was sealed with the rest, so only the
+            // other side could have sent this one, and just now
+            newestSealedPacket = packetNumber;
+            receivedNewestSealedPacket = true;
+          }
+        }
+        if (!mustBeHandshake) {
+          // Anyone could have sent the handshake, so only a sealed packet
+          // can say what arrived
+          handleAcknowledge(ackFrame, packetsRecovered);
+        }
+        for (const auto& it : frames) {
+          if (it.type == REQUEST) {
+            handleRequest(it.idPayload.id, it.idPayload.payload,
+                          it.priorRequests, it.streamPosition);
+          } else if (it.type == REPLY) {
+            handleReply(it.idPayload.id, it.idPayload.payload,
+                        it.requestReceiveTime, it.replySendTime);
+          } else if (newPacket) {
+            // Rpcs are deduplicated by id, unreliable messages by packet
+            handleUnreliable(it.unreliable);
+          }
         }
       } break;
       case ACKNOWLEDGE: {
-        RpcId uid = reader.readClass<RpcId>();
+        uint64_t packetsRecovered;
+        AckBitmap ackFrame = readAcknowledgeFrame(reader, &packetsRecovered);
         string payload = reader.readPrimitive<string>();
-        if (!validatePacket(uid, payload)) {
+        if (!validatePacket(ACKNOWLEDGE, RpcId(), payload)) {
           return false;
         }
-        VLOG(1) << "ACK UID " << uid.str();
-        for (auto it = outgoingReplies.begin(); it != outgoingReplies.end();
-             it++) {
-          VLOG(1) << "REPLY UID " << it->first.str();
-          if (it->first == uid) {
-            clockSynchronizer.eraseRequestRecieveTime(it->first);
-            outgoingReplies.erase(it);
-            break;
-          }
-        }
+        VLOG(1) << "ACK UP TO " << ackFrame.getLargest();
+        handleAcknowledge(ackFrame, packetsRecovered);
+      } break;
+      case PARITY: {
+        ParityGroup parity;
+        parity.firstPacketNumber = reader.readPrimitive<uint64_t>();
+        parity.offsets = reader.readPrimitive<string>();
+        parity.count = int(parity.offsets.size()) + 1;
+        parity.lengthXor = reader.readPrimitive<uint32_t>();
+        parity.bytes = reader.readPrimitive<string>();
+        handleParity(parity);
       } break;
       default: {
-        LOGFATAL << "Got invalid header: " << header << " in message "
-                 << message;
+        LOG(WARNING) << "Got invalid header: " << header;
+        return false;
       }
     }
+    if (acknowledgePending) {
+      // Nothing we sent while handling this packet carried the ack
+      scheduleAcknowledge();
+    }
   }
   return true;
 }
 
 void BiDirectionalRpc::handleRequest(const RpcId& rpcId,
-                                     const string& payload) {
+                                     const string& payload,
+                                     uint64_t priorRequests,
+                                     const StreamPosition& position) {
   VLOG(1) << "GOT REQUEST: " << rpcId.str();
 
-  bool skip = (incomingRequests.find(rpcId) != incomingRequests.end());
-  skip |= processedRequests.exists(rpcId);
+  bool skip = isProcessed(REQUEST, rpcId);
   if (!skip) {
     for (const auto& it : outgoingReplies) {
       if (it.first == rpcId) {
         // We already processed this request.  Send the reply again
         skip = true;
-        sendReply(it.first, it.second, false);
+        queueReply(it.first);
         break;
       }
     }
   }
 
-  if (!skip) {
-    addIncomingRequest(IdPayload(rpcId, payload));
-    auto it = incomingRequests.find(rpcId);
-    if (it != incomingRequests.end() && it->second == "PING") {
-      // heartbeat, send reply right away
-      reply(rpcId, "PONG");
-      return;
-    }
-    if (it != incomingRequests.end() && it->second == "SHUTDOWN") {
-      LOG(INFO) << "GOT SHUTDOWN REQUEST";
-      // Shutdown request, handle and send reply
-      shutdown();
-      reply(rpcId, "SHUTDOWN_REPLY");
-      return;
+  if (skip) {
+    stats.duplicateRpcs++;
+  } else {
+    incomingStreamPositions[rpcId] = position;
+    // Barriers hold back whole generations, then each ordered stream waits
+    // on its own gaps.  A stream never runs ahead of a barrier, so this
+    // can't deadlock.
+    for (const auto& it :
+         reorderBuffer.push(IdPayload(rpcId, payload), priorRequests)) {
+      const StreamPosition& itPosition = incomingStreamPositions[it.id];
+      for (const auto& ready : streamReorderBuffer.push(
+               it, itPosition.stream, itPosition.sequence)) {
+        deliverRequest(ready);
+      }
     }
   }
 }
 
+void BiDirectionalRpc::deliverRequest(const IdPayload& idPayload) {
+  const RpcId& rpcId = idPayload.id;
+  addIncomingRequest(idPayload);
+  auto it = incomingRequests.find(rpcId);
+  if (it == incomingRequests.end()) {
+    // Dropped (for example before the handshake), a resend will bring it back
+    incomingStreamPositions.erase(rpcId);
+    return;
+  }
+  stats.deliveredBytes += it->second.size();
+  if (it != incomingRequests.end() && it->second == "PING") {
+    // heartbeat, send reply right away
+    reply(rpcId, "PONG");
+    return;
+  }
+  if (it != incomingRequests.end() && it->second == "SHUTDOWN") {
+    LOG(INFO) << "GOT SHUTDOWN REQUEST";
+    // Shutdown request, handle and send reply
+    shutdown();
+    reply(rpcId, "SHUTDOWN_REPLY");
+    return;
+  }
+  if (it != incomingRequests.end() && requestHandler) {
+    queueDelivery(requestHandler, requestExecutor,
+                  IdPayload(it->first, it->second));
+  }
+}
+
 void BiDirectionalRpc::handleReply(const RpcId& rpcId, const string& payload,
                                    int64_t requestReceiveTime,
                                    int64_t replySendTime) {
   VLOG(1) << "GOT REPLY: " << rpcId.id;
-  bool skip = false;
-  if (incomingReplies.find(rpcId) != incomingReplies.end() ||
-      processedReplies.exists(rpcId)) {
-    // We already received this reply.  Send acknowledge again and skip.
-    sendAcknowledge(rpcId);
-    skip = true;
-  }
-  if (!skip) {
+  // If we already received this reply, the packet ack covers it
+  bool skip = isProcessed(REPLY, rpcId);
+  if (skip) {
+    stats.duplicateRpcs++;
+  } else {
     // Stop sending the request once you get the reply
-    bool deletedRequest = false;
-    for (auto it = outgoingRequests.begin(); it != outgoingRequests.end();
-         it++) {
-      if (it->first == rpcId) {
-        outgoingRequests.erase(it);
-        deletedRequest = true;
-        tryToSendBarrier();
-        break;
-      }
+    bool retransmitted = false;
+    auto timerIt = retransmitTimers.find(rpcId);
+    if (timerIt != retransmitTimers.end()) {
+      retransmitted = timerIt->second.retransmits > 0;
+      retransmitTimers.erase(timerIt);
     }
+    bool deletedRequest = outgoingRequests.erase(rpcId) > 0;
+    deletedRequest |= deliveredRequests.erase(rpcId) > 0;
+    clockProbes.erase(rpcId);
+    outgoingStreamPositions.erase(rpcId);
+    outgoingFragments.erase(make_pair(REQUEST, rpcId));
     if (deletedRequest) {
       auto it = oneWayRequests.find(rpcId);
       if (it != oneWayRequests.end()) {
@@ -209,48 +692,105 @@ void BiDirectionalRpc::handleReply(const RpcId& rpcId, const string& payload,
         oneWayRequests.erase(it);
       } else {
         // Add a reply to be processed
+        stats.deliveredBytes += payload.size();
         addIncomingReply(rpcId, payload);
+        auto replyIt = incomingReplies.find(rpcId);
+        if (replyIt != incomingReplies.end() && replyHandler) {
+          queueDelivery(replyHandler, replyExecutor,
+                        IdPayload(replyIt->first, replyIt->second));
+          processedReplies.put(rpcId);
+          incomingReplies.erase(replyIt);
+        }
       }
-      sendAcknowledge(rpcId);
-      clockSynchronizer.handleReply(rpcId, requestReceiveTime, replySendTime);
-    } else {
-      // We must have processed both this request and reply.  Send the
-      // acknowledge again.
-      sendAcknowledge(rpcId);
+      clockSynchronizer.handleReply(rpcId, requestReceiveTime, replySendTime,
+                                    retransmitted);
+      replyCondition.notify_all();
     }
   }
 }
 
-RpcId BiDirectionalRpc::request(const string& payload) {
-  lock_guard<recursive_mutex> guard(mutex);
+RpcId BiDirectionalRpc::createRpcId() {
+  if (sequencedRpcIds) {
+    onId++;
+    return RpcId::fromSequence(onBarrier, sequenceSide, onId);
+  }
   auto fullUuid = sole::uuid4();
-  auto uuid = RpcId(onBarrier, fullUuid.cd);
-  auto idPayload = IdPayload(uuid, payload);
-  requestWithId(idPayload);
-  return uuid;
+  return RpcId(onBarrier, fullUuid.cd);
 }
 
-void BiDirectionalRpc::requestOneWay(const string& payload) {
+void BiDirectionalRpc::openStream(uint32_t stream, StreamPriority priority,
+                                  bool ordered) {
   lock_guard<recursive_mutex> guard(mutex);
-  auto fullUuid = sole::uuid4();
-  auto uuid = RpcId(onBarrier, fullUuid.cd);
-  oneWayRequests.insert(uuid);
-  auto idPayload = IdPayload(uuid, payload);
-  requestWithId(idPayload);
+  if (stream == CONTROL_STREAM) {
+    LOGFATAL << "The control stream is reserved";
+  }
+  auto it = streams.find(stream);
+  if (it != streams.end()) {
+    if (it->second.ordered != ordered) {
+      LOGFATAL << "Tried to change the ordering of stream " << stream;
+    }
+    it->second.priority = priority;
+    return;
+  }
+  streams[stream] = StreamConfig(priority, ordered);
 }
 
-void BiDirectionalRpc::requestWithId(const IdPayload& idPayload) {
+RpcId BiDirectionalRpc::request(const string& payload, uint32_t stream) {
   lock_guard<recursive_mutex> guard(mutex);
-  if (outgoingRequests.empty() ||
-      outgoingRequests.begin()->first.barrier == onBarrier) {
-    // We can send the request immediately
-    outgoingRequests[idPayload.id] = idPayload.payload;
-    clockSynchronizer.createRequest(idPayload.id);
-    sendRequest(idPayload.id, idPayload.payload, false);
-  } else {
-    // We have to wait for existing requests from an older barrier
-    delayedRequests[idPayload.id] = idPayload.payload;
+  // Keep submitted one-way requests ahead of this one
+  drainSubmissions();
+  auto rpcId = createRpcId();
+  auto idPayload = IdPayload(rpcId, payload);
+  requestWithId(idPayload, stream);
+  return rpcId;
+}
+
+void BiDirectionalRpc::requestOneWay(const string& payload, uint32_t stream) {
+  if (!isOwnerThread() &&
+      submissions.tryPush(
+          RpcSubmission(SUBMIT_REQUEST_ONE_WAY, payload, stream))) {
+    scheduleDrain();
+    return;
+  }
+  lock_guard<recursive_mutex> guard(mutex);
+  drainSubmissions();
+  sendOneWayRequest(payload, stream);
+}
+
+void BiDirectionalRpc::sendOneWayRequest(const string& payload,
+                                         uint32_t stream) {
+  auto rpcId = createRpcId();
+  oneWayRequests.insert(rpcId);
+  auto idPayload = IdPayload(rpcId, payload);
+  requestWithId(idPayload, stream);
+}
+
+bool BiDirectionalRpc::requestWithId(const IdPayload& idPayload,
+                                     uint32_t stream) {
+  lock_guard<recursive_mutex> guard(mutex);
+  int64_t barrier = idPayload.id.barrier;
+  if (!barrierPriorRequests.empty() &&
+      barrier < barrierPriorRequests.rbegin()->first) {
+    LOG(ERROR) << "Requests must be made in barrier order: " << barrier
+               << " < " << barrierPriorRequests.rbegin()->first;
+    return false;
+  }
+  if (barrierPriorRequests.find(barrier) == barrierPriorRequests.end()) {
+    // First request of a new generation
+    barrierPriorRequests[barrier] = sentRequestCount;
   }
+  sentRequestCount++;
+  StreamPosition position(stream, 0);
+  auto streamIt = streams.find(stream);
+  if (streamIt != streams.end() && streamIt->second.ordered) {
+    position.sequence = ++streamIt->second.lastSequence;
+  }
+  outgoingStreamPositions[idPayload.id] = position;
+  // The other side holds this back until older generations are through, so
+  // it can go out right away.
+  outgoingRequests[idPayload.id] = idPayload.payload;
+  queueRequest(idPayload.id);
+  return true;
 }
 
 void BiDirectionalRpc::reply(const RpcId& rpcId, const string& payload) {
@@ -260,124 +800,804 @@ void BiDirectionalRpc::reply(const RpcId& rpcId, const string& payload) {
     LOGFATAL << "Tried to reply but had no request: " << rpcId.id;
   }
   incomingRequests.erase(it);
-  processedRequests.put(rpcId, true);
+  processedRequests.put(rpcId);
   outgoingReplies[rpcId] = payload;
-  sendReply(rpcId, payload, false);
+  queueReply(rpcId);
 }
 
-void BiDirectionalRpc::tryToSendBarrier() {
-  if (delayedRequests.empty()) {
-    // Nothing to send
-    return;
+StreamPriority BiDirectionalRpc::getStreamPriority(uint32_t stream) {
+  if (stream == CONTROL_STREAM) {
+    return PRIORITY_CONTROL;
   }
-  if (outgoingRequests.empty()) {
-    // There are no outgoing requests, we can send the next barrier
-    int64_t lowestBarrier = delayedRequests.begin()->first.barrier;
-    for (const auto& it : delayedRequests) {
-      lowestBarrier = min(lowestBarrier, it.first.barrier);
-    }
+  auto it = streams.find(stream);
+  if (it == streams.end()) {
+    return PRIORITY_NORMAL;
+  }
+  return it->second.priority;
+}
 
-    for (auto it = delayedRequests.begin(); it != delayedRequests.end();) {
-      if (it->first.barrier == lowestBarrier) {
-        outgoingRequests[it->first] = it->second;
-        clockSynchronizer.createRequest(it->first);
-        sendRequest(it->first, it->second, false);
-        it = delayedRequests.erase(it);
-      } else {
-        it++;
+StreamPriority BiDirectionalRpc::getFramePriority(RpcHeader type,
+                                                  const RpcId& id) {
+  // A reply is as urgent as the request it answers
+  const auto& positions =
+      (type == REQUEST) ? outgoingStreamPositions : incomingStreamPositions;
+  auto it = positions.find(id);
+  if (it == positions.end()) {
+    return PRIORITY_NORMAL;
+  }
+  return getStreamPriority(it->second.stream);
+}
+
+void BiDirectionalRpc::pruneBarrierPriorRequests() {
+  // Keep the newest generation, later requests may still join it
+  while (barrierPriorRequests.size() > 1) {
+    int64_t oldest = barrierPriorRequests.begin()->first;
+    for (const auto& it : outgoingRequests) {
+      if (it.first.barrier == oldest) {
+        return;
       }
     }
+    barrierPriorRequests.erase(barrierPriorRequests.begin());
   }
 }
 
-void BiDirectionalRpc::sendRequest(const RpcId& id, const string& payload,
-                                   bool batch) {
-  VLOG(1) << "SENDING REQUEST: " << id.str();
-  MessageWriter writer;
-  writer.start();
-  set<RpcId> rpcsSent;
+void BiDirectionalRpc::queueRequest(const RpcId& id) {
+  VLOG(1) << "QUEUEING REQUEST: " << id.str();
+  if (queuedRequests.insert(id).second) {
+    queuedFrames.push_back(make_pair(REQUEST, id));
+  }
+  scheduleFlush();
+}
 
-  rpcsSent.insert(id);
-  writer.writePrimitive<unsigned char>(REQUEST);
-  writer.writeClass<RpcId>(id);
-  writer.writePrimitive<string>(payload);
-  if (batch) {
-    // Try to attach more requests to this packet
-    int i = 0;
-    while (!outgoingRequests.empty() &&
-           rpcsSent.size() < outgoingRequests.size()) {
-      DRAW_FROM_UNORDERED(it, outgoingRequests);
-      if (rpcsSent.find(it->first) != rpcsSent.end()) {
-        // Drew an rpc that's already in the packet.  Just bail for now, maybe
-        // in the future do something more clever.
-        break;
+void BiDirectionalRpc::queueReply(const RpcId& id) {
+  VLOG(1) << "QUEUEING REPLY: " << id.str();
+  if (queuedReplies.insert(id).second) {
+    queuedFrames.push_back(make_pair(REPLY, id));
+  }
+  scheduleFlush();
+}
+
+void BiDirectionalRpc::flush() {
+  lock_guard<recursive_mutex> guard(mutex);
+  drainSubmissions();
+  if (queuedFrames.empty() && queuedUnreliable.empty()) {
+    return;
+  }
+  vector<pair<RpcHeader, RpcId>> frames;
+  frames.swap(queuedFrames);
+  queuedRequests.clear();
+  queuedReplies.clear();
+  vector<UnreliableMessage> unreliable;
+  unreliable.swap(queuedUnreliable);
+
+  // Highest priority first, queue order within a priority
+  vector<pair<StreamPriority, int>> order;
+  for (int a = 0; a < int(frames.size()); a++) {
+    order.push_back(
+        make_pair(getFramePriority(frames[a].first, frames[a].second), a));
+  }
+  sort(order.begin(), order.end());
+
+  int64_t budget = getFrameBudget();
+  int64_t sendBudget = getSendBudget();
+  int64_t bytesSent = 0;
+  bool outOfBudget = false;
+  MessageWriter writer;
+  // Frames are written straight into the packet that carries them
+  PacketBufferPtr packetFrames = PacketBufferPool::acquire();
+  SentPacket sentPacket;
+  vector<UnreliableMessage> packetUnreliable;
+  StreamPriority packetPriority = PRIORITY_LOW;
+  vector<pair<RpcHeader, RpcId>> deferred;
+  vector<UnreliableMessage> deferredUnreliable;
+  int numPackets = 0;
+  auto closePacket = [&]() {
+    int64_t size = int64_t(packetFrames->size()) + MAX_PACKET_HEADER_SIZE +
+                   getPacketOverhead();
+    // Control rpcs are small and rare, and the connection is stuck without
+    // them, so they ignore the budget.
+    if (packetPriority != PRIORITY_CONTROL &&
+        (outOfBudget || bytesSent + size > sendBudget)) {
+      // Everything after this is lower priority and waits as well
+      outOfBudget = true;
+      for (const auto& it : sentPacket.requests) {
+        deferred.push_back(make_pair(REQUEST, it));
       }
-      int size = int(sizeof(RpcId) + it->second.length());
-      if (size + writer.size() > 400) {
-        // Too big
-        break;
+      for (const auto& it : sentPacket.replies) {
+        deferred.push_back(make_pair(REPLY, it));
+      }
+      for (const auto& it : sentPacket.fragments) {
+        deferred.push_back(make_pair(it.type, it.id));
+      }
+      deferredUnreliable.insert(deferredUnreliable.end(),
+                                packetUnreliable.begin(),
+                                packetUnreliable.end());
+      packetFrames->clear();
+    } else {
+      sendDataPacket(packetFrames, sentPacket);
+      bytesSent += size;
+      numPackets++;
+      packetFrames = PacketBufferPool::acquire();
+    }
+    sentPacket = SentPacket();
+    packetUnreliable.clear();
+  };
+  // Where the frame being written starts in the packet
+  size_t frameStart = 0;
+  auto startFrame = [&]() {
+    frameStart = packetFrames->size();
+    writer.start(packetFrames.get());
+  };
+  // Takes the frame being written back out of the packet
+  auto takeFrame = [&]() {
+    writer.start();
+    string frameBytes(packetFrames->data() + frameStart,
+                      packetFrames->size() - frameStart);
+    packetFrames->truncate(frameStart);
+    return frameBytes;
+  };
+  // Keeps the frame being written in the packet, unless it overflows the
+  // packet or has to go alone.  Then it moves to a packet of its own, which
+  // is the only time a frame is copied.
+  auto endFrame = [&](StreamPriority priority, bool alone) {
+    // A frame that is too big on its own still goes out, alone
+    if (frameStart > 0 &&
+        (alone || int64_t(packetFrames->size()) > budget)) {
+      string frameBytes = takeFrame();
+      closePacket();
+      packetFrames->append(frameBytes);
+      frameStart = 0;
+    }
+    writer.start();
+    if (frameStart == 0) {
+      packetPriority = priority;
+    }
+  };
+  for (const auto& it : order) {
+    const auto& frame = frames[it.second];
+    auto fragmentsIt = outgoingFragments.find(frame);
+    if (fragmentsIt == outgoingFragments.end()) {
+      startFrame();
+      if (!writeFrame(writer, frame.first, frame.second)) {
+        // Acknowledged or answered since it was queued
+        takeFrame();
+        continue;
+      }
+      if (writer.size() <= budget) {
+        // Session keys can't be sealed, so they go alone
+        bool handshake =
+            frame.first == REQUEST && IS_HANDSHAKE_RPCID(frame.second);
+        endFrame(it.first, handshake);
+        if (frame.first == REQUEST) {
+          sentPacket.requests.push_back(frame.second);
+        } else {
+          sentPacket.replies.push_back(frame.second);
+        }
+        if (handshake) {
+          closePacket();
+        }
+        continue;
+      }
+      // Too big for a packet, so it goes in pieces that are acknowledged
+      // and resent on their own.
+      string frameBytes = takeFrame();
+      int64_t pieceSize = max(int64_t(MAX_FRAGMENT_HEADER_SIZE),
+                              budget - MAX_FRAGMENT_HEADER_SIZE);
+      fragmentsIt = outgoingFragments
+                        .insert(make_pair(
+                            frame, OutgoingFragments(frameBytes, pieceSize)))
+                        .first;
+    } else if (!isOutgoing(frame.first, frame.second)) {
+      outgoingFragments.erase(fragmentsIt);
+      continue;
+    }
+    const OutgoingFragments& fragments = fragmentsIt->second;
+    for (uint32_t index = 0; index < fragments.getCount(); index++) {
+      if (fragments.isAcknowledged(index)) {
+        continue;
+      }
+      startFrame();
+      writeFragmentFrame(writer, frame.first, frame.second, fragments, index);
+      endFrame(it.first, false);
+      sentPacket.fragments.push_back(
+          SentFragment(frame.first, frame.second, fragments.getOffset(index),
+                       uint32_t(fragments.getPiece(index).size())));
+    }
+  }
+  // Unreliable messages fill whatever room the rpcs left
+  for (const auto& it : unreliable) {
+    startFrame();
+    writeUnreliableFrame(writer, it);
+    endFrame(PRIORITY_LOW, false);
+    packetUnreliable.push_back(it);
+  }
+  if (!packetFrames->empty()) {
+    closePacket();
+  }
+  for (const auto& it : deferred) {
+    // Back in the queue without asking for another flush.  The next
+    // heartbeat, resend or game update picks them up once there is budget.
+    if (it.first == REQUEST) {
+      if (queuedRequests.insert(it.second).second) {
+        queuedFrames.push_back(it);
       }
-      i++;
-      rpcsSent.insert(it->first);
-      writer.writeClass<RpcId>(it->first);
-      writer.writePrimitive<string>(it->second);
+    } else if (queuedReplies.insert(it.second).second) {
+      queuedFrames.push_back(it);
     }
-    VLOG(1) << "Attached " << i << " extra packets";
   }
-  send(writer.finish());
+  if (!deferredUnreliable.empty()) {
+    // Only the newest message on a sequenced channel is worth the wait
+    unordered_map<uint32_t, uint64_t> newest;
+    for (const auto& it : deferredUnreliable) {
+      if (it.sequenced) {
+        newest[it.channel] = max(newest[it.channel], it.sequence);
+      }
+    }
+    for (const auto& it : deferredUnreliable) {
+      if (!it.sequenced || it.sequence == newest[it.channel]) {
+        queuedUnreliable.push_back(it);
+      } else {
+        stats.unreliableDropped++;
+      }
+    }
+    if (queuedUnreliable.size() > MAX_QUEUED_UNRELIABLE) {
+      stats.unreliableDropped +=
+          queuedUnreliable.size() - MAX_QUEUED_UNRELIABLE;
+      queuedUnreliable.erase(
+          queuedUnreliable.begin(),
+          queuedUnreliable.end() - MAX_QUEUED_UNRELIABLE);
+    }
+  }
+  stats.framesDeferred += deferred.size();
+  if (outOfBudget) {
+    schedulePacedFlush();
+  }
+  VLOG(1) << "Flushed " << frames.size() << " rpcs and " << unreliable.size()
+          << " unreliable messages in " << numPackets << " packets, "
+          << deferred.size() << " rpcs and " << deferredUnreliable.size()
+          << " unreliable messages deferred";
 }
 
-void BiDirectionalRpc::sendReply(const RpcId& id, const string& payload,
-                                 bool batch) {
-  lock_guard<recursive_mutex> guard(mutex);
-  VLOG(1) << "SENDING REPLY: " << id.str();
-  set<RpcId> rpcsSent;
+void BiDirectionalRpc::writeFragmentFrame(MessageWriter& writer,
+                                          RpcHeader type, const RpcId& id,
+                                          const OutgoingFragments& fragments,
+                                          uint32_t index) {
+  writer.writePrimitive<unsigned char>(FRAGMENT);
+  writer.writePrimitive<unsigned char>(type);
+  writer.writeClass<RpcId>(id);
+  writer.writePrimitive<uint32_t>(fragments.getOffset(index));
+  writer.writePrimitive<uint32_t>(fragments.getFrameSize());
+  writer.writePrimitive<string>(fragments.getPiece(index));
+}
 
-  rpcsSent.insert(id);
-  MessageWriter writer;
-  writer.start();
+bool BiDirectionalRpc::isOutgoing(RpcHeader type, const RpcId& id) {
+  if (type == REQUEST) {
+    return outgoingRequests.find(id) != outgoingRequests.end();
+  }
+  return outgoingReplies.find(id) != outgoingReplies.end();
+}
+
+bool BiDirectionalRpc::isProcessed(RpcHeader type, const RpcId& id) {
+  if (type == REQUEST) {
+    return incomingRequests.find(id) != incomingRequests.end() ||
+           processedRequests.exists(id) || reorderBuffer.contains(id) ||
+           streamReorderBuffer.contains(id);
+  }
+  return incomingReplies.find(id) != incomingReplies.end() ||
+         processedReplies.exists(id);
+}
+
+FragmentResult BiDirectionalRpc::handleFragment(RpcHeader type,
+                                                const RpcId& id,
+                                                uint32_t offset,
+                                                uint32_t frameSize,
+                                                const string& piece,
+                                                string* frame) {
+  if (type != REQUEST && type != REPLY) {
+    LOG(ERROR) << "Got a fragment of an invalid frame type: " << type;
+    return FRAGMENT_REFUSED;
+  }
+  if (isProcessed(type, id)) {
+    // A resend of a piece we no longer need
+    return FRAGMENT_STORED;
+  }
+  return fragmentReassembler.add(type, id, offset, frameSize, piece, frame);
+}
+
+bool BiDirectionalRpc::writeFrame(MessageWriter& writer, RpcHeader type,
+                                  const RpcId& id) {
+  if (type == REQUEST) {
+    auto it = outgoingRequests.find(id);
+    if (it == outgoingRequests.end()) {
+      return false;
+    }
+    writer.writePrimitive<unsigned char>(REQUEST);
+    writer.writeClass<RpcId>(id);
+    // Generations are only pruned once none of their requests are left
+    auto priorIt = barrierPriorRequests.find(id.barrier);
+    writer.writePrimitive<uint64_t>(
+        priorIt == barrierPriorRequests.end() ? 0 : priorIt->second);
+    const StreamPosition& position = outgoingStreamPositions[id];
+    writer.writePrimitive<uint32_t>(position.stream);
+    writer.writePrimitive<uint64_t>(position.sequence);
+    writer.writePrimitive<string>(it->second);
+    return true;
+  }
+  auto it = outgoingReplies.find(id);
+  if (it == outgoingReplies.end()) {
+    return false;
+  }
   writer.writePrimitive<unsigned char>(REPLY);
   writer.writeClass<RpcId>(id);
   auto replyDuration = clockSynchronizer.getReplyDuration(id);
   writer.writePrimitive<int64_t>(replyDuration.first);
   writer.writePrimitive<int64_t>(replyDuration.second);
-  writer.writePrimitive<string>(payload);
-  if (batch) {
-    // Try to attach more replies to this packet
-    int i = 0;
-    while (!outgoingReplies.empty() &&
-           rpcsSent.size() < outgoingReplies.size()) {
-      DRAW_FROM_UNORDERED(it, outgoingReplies);
-      if (rpcsSent.find(it->first) != rpcsSent.end()) {
-        // Drew an rpc that's already in the packet.  Just bail for now, maybe
-        // in the future do something more clever.
-        break;
-      }
-      int size = int(sizeof(RpcId) + it->second.length());
-      if (size + writer.size() > 400) {
-        // Too big
-        break;
-      }
-      i++;
-      rpcsSent.insert(it->first);
-      writer.writeClass<RpcId>(it->first);
-      auto replyDuration = clockSynchronizer.getReplyDuration(it->first);
-      writer.writePrimitive<int64_t>(replyDuration.first);
-      writer.writePrimitive<int64_t>(replyDuration.second);
-      writer.writePrimitive<string>(it->second);
+  writer.writePrimitive<string>(it->second);
+  return true;
+}
+
+void BiDirectionalRpc::sendUnreliable(const string& payload) {
+  submitUnreliable(SUBMIT_UNRELIABLE, 0, payload);
+}
+
+void BiDirectionalRpc::sendUnreliableSequenced(uint32_t channel,
+                                               const string& payload) {
+  submitUnreliable(SUBMIT_UNRELIABLE_SEQUENCED, channel, payload);
+}
+
+void BiDirectionalRpc::submitUnreliable(RpcSubmissionType type,
+                                        uint32_t channel,
+                                        const string& payload) {
+  if (!isOwnerThread() &&
+      submissions.tryPush(RpcSubmission(type, payload, channel))) {
+    scheduleDrain();
+    return;
+  }
+  lock_guard<recursive_mutex> guard(mutex);
+  drainSubmissions();
+  UnreliableMessage message;
+  message.sequenced = (type == SUBMIT_UNRELIABLE_SEQUENCED);
+  message.channel = channel;
+  message.payload = payload;
+  queueUnreliable(message);
+}
+
+void BiDirectionalRpc::queueUnreliable(const UnreliableMessage& message) {
+  queuedUnreliable.push_back(message);
+  if (message.sequenced) {
+    queuedUnreliable.back().sequence = ++unreliableSequences[message.channel];
+  }
+  scheduleFlush();
+}
+
+void BiDirectionalRpc::writeUnreliableFrame(MessageWriter& writer,
+                                            const UnreliableMessage& message) {
+  if (message.sequenced) {
+    writer.writePrimitive<unsigned char>(UNRELIABLE_SEQUENCED);
+    writer.writePrimitive<uint32_t>(message.channel);
+    writer.writePrimitive<uint64_t>(message.sequence);
+  } else {
+    writer.writePrimitive<unsigned char>(UNRELIABLE);
+  }
+  writer.writePrimitive<string>(message.payload);
+}
+
+void BiDirectionalRpc::handleUnreliable(const UnreliableMessage& message) {
+  if (message.sequenced) {
+    uint64_t& latest = latestUnreliableSequences[message.channel];
+    if (message.sequence <= latest) {
+      VLOG(1) << "Dropping stale message on channel " << message.channel
+              << ": " << message.sequence << " <= " << latest;
+      return;
     }
-    VLOG(1) << "Attached " << i << " extra packets";
+    latest = message.sequence;
+  }
+  stats.deliveredBytes += message.payload.size();
+  addIncomingUnreliable(message);
+}
+
+void BiDirectionalRpc::addIncomingUnreliable(const UnreliableMessage& message) {
+  if (unreliableHandler) {
+    auto handler = unreliableHandler;
+    pendingDeliveries.push_back(make_pair(
+        unreliableExecutor, [handler, message]() { handler(message); }));
+    return;
+  }
+  incomingUnreliable.push_back(message);
+  while (incomingUnreliable.size() > MAX_INCOMING_UNRELIABLE) {
+    incomingUnreliable.pop_front();
   }
-  send(writer.finish());
 }
 
-void BiDirectionalRpc::sendAcknowledge(const RpcId& uid) {
+void BiDirectionalRpc::sendDataPacket(const PacketBufferPtr& packet,
+                                      const SentPacket& sentPacket) {
   MessageWriter writer;
   writer.start();
+  uint64_t packetNumber = startPacket(writer, DATA);
+  // Frames are self-delimiting msgpack objects, so the header can go in
+  // front of them as-is.
+  writer.finishInFront(packet.get());
+  int64_t size = int64_t(packet->size()) + getPacketOverhead();
+  int64_t now = monotonicTimeMicros();
+  bool ackEliciting = !sentPacket.requests.empty() ||
+                      !sentPacket.replies.empty() ||
+                      !sentPacket.fragments.empty();
+  if (ackEliciting) {
+    auto& sent = sentPackets[packetNumber];
+    sent = sentPacket;
+    sent.sendTime = now;
+    sent.bytes = size;
+  }
+  onPacketSent(size, ackEliciting);
+  // An rpc held back by the send budget hasn't been sent, so its timer only
+  // starts here.  The clock is timed from here too, time spent queued
+  // isn't part of the round trip.
+  for (const auto& it : sentPacket.requests) {
+    if (armRetransmitTimer(it, now)) {
+      clockSynchronizer.createRequest(it);
+    }
+  }
+  for (const auto& it : sentPacket.replies) {
+    armRetransmitTimer(it, now);
+  }
+  for (const auto& it : sentPacket.fragments) {
+    if (armRetransmitTimer(it.id, now) && it.type == REQUEST) {
+      clockSynchronizer.createRequest(it.id);
+    }
+  }
+  // Parity covers the packet before it is sealed, the parity packet is
+  // sealed itself
+  ParityGroup parity;
+  bool parityReady =
+      parityEnabled &&
+      size <= maxPacketSize - int64_t(MAX_PARITY_HEADER_SIZE) &&
+      parityEncoder.add(packetNumber, packet->data(), packet->size(), &parity);
+  if (!sentPacket.requests.empty() &&
+      IS_HANDSHAKE_RPCID(sentPacket.requests.front())) {
+    // The other side needs the session key to open anything else
+    send(packet);
+  } else {
+    sendSealed(packet);
+  }
+  if (parityReady) {
+    sendParityPacket(parity);
+  }
+}
+
+void BiDirectionalRpc::sendSealed(const PacketBufferPtr& packet) {
+  if (sealPacket(packet.get())) {
+    *packet->prepend(1) = char(SEALED);
+  }
+  send(packet);
+}
+
+void BiDirectionalRpc::sendParityPacket(const ParityGroup& parity) {
+  auto packet = PacketBufferPool::acquire();
+  MessageWriter writer;
+  writer.start(packet.get());
+  writer.writePrimitive<unsigned char>(PARITY);
+  writer.writePrimitive<uint64_t>(parity.firstPacketNumber);
+  writer.writePrimitive<string>(parity.offsets);
+  writer.writePrimitive<uint32_t>(parity.lengthXor);
+  writer.writePrimitive<string>(parity.bytes);
+  stats.parityPacketsSent++;
+  onPacketSent(int64_t(packet->size()) + getPacketOverhead(), false);
+  sendSealed(packet);
+}
+
+void BiDirectionalRpc::onPacketSent(int64_t bytes, bool ackEliciting) {
+  stats.packetsSent++;
+  stats.bytesSent += bytes;
+  congestionController.onPacketSent(bytes, ackEliciting,
+                                    monotonicTimeMicros());
+}
+
+void BiDirectionalRpc::publishStats(int64_t now) {
+  ConnectionStats snapshot = stats;
+  snapshot.smoothedRtt = clockSynchronizer.getSmoothedRtt();
+  snapshot.lossRate = lossEstimator.getLossRate();
+  snapshot.sendingRate = congestionController.getSendingRate();
+  snapshot.congestionWindow = congestionController.getCongestionWindow();
+  snapshot.bytesInFlight = congestionController.getBytesInFlight();
+  statsPublisher.publish(snapshot, now);
+}
+
+void BiDirectionalRpc::handleParity(const ParityGroup& parity) {
+  uint64_t packetNumber;
+  string packet;
+  if (!parityDecoder.recover(parity, receivedPackets, &packetNumber,
+                             &packet)) {
+    return;
+  }
+  if (packet.empty() || (unsigned char)packet[0] != DATA) {
+    LOG(ERROR) << "Parity rebuilt something that isn't a data packet";
+    return;
+  }
+  VLOG(1) << "Rebuilt packet " << packetNumber << " from parity";
+  stats.packetsRecovered++;
+  if (!processPacket(packet)) {
+    // Don't hold a bad rebuild against the endpoint
+    LOG(ERROR) << "Rebuilt packet " << packetNumber << " is invalid";
+  }
+}
+
+int64_t BiDirectionalRpc::getFrameBudget() {
+  int64_t budget =
+      maxPacketSize - getPacketOverhead() - MAX_PACKET_HEADER_SIZE;
+  if (parityEnabled && parityEncoder.enabled()) {
+    // Only while parity is going out, so its packets fit too
+    budget -= MAX_PARITY_HEADER_SIZE;
+  }
+  return budget;
+}
+
+uint64_t BiDirectionalRpc::startPacket(MessageWriter& writer,
+                                       RpcHeader header) {
+  uint64_t packetNumber = nextPacketNumber++;
+  while (sentPackets.size() >= MAX_SENT_PACKETS) {
+    onPacketLost(sentPackets.begin()->second, monotonicTimeMicros());
+    sentPackets.erase(sentPackets.begin());
+  }
+  writer.writePrimitive<unsigned char>(header);
+  writer.writePrimitive<uint64_t>(packetNumber);
+  writeAcknowledgeFrame(writer);
+  return packetNumber;
+}
+
+void BiDirectionalRpc::writeAcknowledgeFrame(MessageWriter& writer) {
+  writer.writePrimitive<uint64_t>(receivedPackets.getLargest());
+  writer.writePrimitive<uint64_t>(receivedPackets.getBits());
+  // Rebuilt packets are acknowledged like any other, so the sender learns
+  // about their loss from this running count
+  writer.writePrimitive<uint64_t>(uint64_t(stats.packetsRecovered));
+  acknowledgePending = false;
+}
+
+AckBitmap BiDirectionalRpc::readAcknowledgeFrame(MessageReader& reader,
+                                                 uint64_t* packetsRecovered) {
+  uint64_t largest = reader.readPrimitive<uint64_t>();
+  uint64_t bits = reader.readPrimitive<uint64_t>();
+  *packetsRecovered = reader.readPrimitive<uint64_t>();
+  return AckBitmap(largest, bits);
+}
+
+void BiDirectionalRpc::handleAcknowledge(const AckBitmap& ackFrame,
+                                         uint64_t packetsRecovered) {
+  if (ackFrame.empty()) {
+    return;
+  }
+  int64_t now = monotonicTimeMicros();
+  // Anything older than the frame can never be acknowledged now.  Those rpcs
+  // are still in the outgoing maps and will go out again in a new packet.
+  auto oldest = sentPackets.lower_bound(ackFrame.getOldest());
+  for (auto it = sentPackets.begin(); it != oldest; it++) {
+    onPacketLost(it->second, now);
+  }
+  sentPackets.erase(sentPackets.begin(), oldest);
+  for (auto it = sentPackets.begin();
+       it != sentPackets.end() && it->first <= ackFrame.getLargest();) {
+    if (!ackFrame.contains(it->first)) {
+      it++;
+      continue;
+    }
+    if (it->second.bytes && !it->second.lost) {
+      congestionController.onPacketAcknowledged(it->second.bytes,
+                                                it->second.sendTime, now);
+      statsPublisher.addRttSample(now - it->second.sendTime);
+    }
+    if (it->second.bytes) {
+      mtuProber.onPacketAcknowledged(it->second.bytes);
+    }
+    for (const auto& rpcId : it->second.replies) {
+      acknowledgeReply(rpcId, it->second.sendTime);
+    }
+    for (const auto& rpcId : it->second.requests) {
+      acknowledgeRequest(rpcId, it->second.sendTime);
+    }
+    for (const auto& fragment : it->second.fragments) {
+      acknowledgeFragment(fragment, it->second.sendTime);
+    }
+    if (it->second.probeSize) {
+      mtuProber.onProbeAcknowledged(it->second.probeSize, now);
+      if (mtuDiscovery && maxPacketSize != mtuProber.getMtu()) {
+        LOG(INFO) << "Path mtu is now " << mtuProber.getMtu();
+        maxPacketSize = mtuProber.getMtu();
+      }
+    }
+    it = sentPackets.erase(it);
+  }
+  detectLostPackets(ackFrame.getLargest(), now);
+  checkBlackHole(now);
+  updateLossEstimate(ackFrame, packetsRecovered);
+  pruneBarrierPriorRequests();
+  if (!queuedFrames.empty() || !queuedUnreliable.empty()) {
+    // The window may have room for what flush() held back
+    scheduleFlush();
+  }
+}
+
+void BiDirectionalRpc::detectLostPackets(uint64_t largestAcknowledged,
+                                         int64_t now) {
+  int64_t timeout = clockSynchronizer.getRetransmissionTimeout(0);
+  for (auto& it : sentPackets) {
+    if (it.first + PACKET_REORDER_THRESHOLD > largestAcknowledged &&
+        it.second.sendTime + timeout > now) {
+      // Every later packet is newer still
+      break;
+    }
+    if (!it.second.probeSize) {
+      // Probes that don't make it say nothing about congestion
+      onPacketLost(it.second, now);
+    }
+  }
+}
+
+void BiDirectionalRpc::updateLossEstimate(const AckBitmap& ackFrame,
+                                          uint64_t packetsRecovered) {
+  if (packetsRecovered > packetsRecoveredByPeer) {
+    // Each of these was settled as received, or will be.  An acknowledge
+    // only covers a window of packets, so that is all it can add.
+    uint64_t recoveries =
+        min(packetsRecovered - packetsRecoveredByPeer, AckBitmap::WINDOW);
+    for (uint64_t a = 0; a < recoveries; a++) {
+      lossEstimator.addRecovery();
+    }
+    packetsRecoveredByPeer = packetsRecovered;
+  }
+  if (ackFrame.getLargest() <= PACKET_REORDER_THRESHOLD) {
+    return;
+  }
+  // Packets this far behind the newest one acknowledged have arrived by now
+  // or never will.  Older ones the frame can't speak for are skipped.
+  uint64_t settled = ackFrame.getLargest() - PACKET_REORDER_THRESHOLD;
+  nextSettledPacket = max(nextSettledPacket, ackFrame.getOldest());
+  for (; nextSettledPacket <= settled; nextSettledPacket++) {
+    auto it = sentPackets.find(nextSettledPacket);
+    if (it != sentPackets.end() && it->second.probeSize) {
+      // Probes are meant to be too big sometimes
+      continue;
+    }
+    lossEstimator.addOutcome(!ackFrame.contains(nextSettledPacket));
+  }
+  if (parityEnabled) {
+    int groupSize = parityEncoder.getGroupSize();
+    parityEncoder.adapt(lossEstimator);
+    if (parityEncoder.getGroupSize() != groupSize) {
+      LOG(INFO) << "Loss rate " << lossEstimator.getLossRate()
+                << ", sending parity every "
+                << parityEncoder.getGroupSize() << " packets over "
+                << parityEncoder.getDepth() << " interleaved groups";
+    }
+  }
+}
+
+void BiDirectionalRpc::onPacketLost(SentPacket& packet, int64_t now) {
+  if (packet.lost || !packet.bytes) {
+    return;
+  }
+  // Kept around in case it was only reordered.  The rpcs it carried are
+  // resent by their own timers either way.
+  packet.lost = true;
+  stats.packetsLost++;
+  congestionController.onPacketLost(packet.bytes, packet.sendTime, now);
+  mtuProber.onPacketLost(packet.bytes);
+  // The reply to a lost probe only comes after a resend, so it no longer
+  // holds up the next probe
+  for (const auto& it : packet.requests) {
+    clockProbes.erase(it);
+  }
+}
+
+void BiDirectionalRpc::checkBlackHole(int64_t now) {
+  if (!mtuDiscovery || !mtuProber.isBlackHole()) {
+    return;
+  }
+  LOG(INFO) << "Packets keep getting lost at " << maxPacketSize
+            << " bytes, falling back to " << mtuProber.getBaseSize();
+  mtuProber.onBlackHole(now);
+  maxPacketSize = mtuProber.getMtu();
+  int64_t pieceSize = getFrameBudget() - MAX_FRAGMENT_HEADER_SIZE;
+  for (auto& it : outgoingFragments) {
+    if (it.second.getPieceSize() > pieceSize) {
+      it.second.split(pieceSize);
+    }
+  }
+}
+
+void BiDirectionalRpc::acknowledgeReply(const RpcId& rpcId,
+                                        int64_t packetSendTime) {
+  auto replyIt = outgoingReplies.find(rpcId);
+  if (replyIt != outgoingReplies.end()) {
+    VLOG(1) << "ACK REPLY " << rpcId.str();
+    checkSpuriousRetransmit(rpcId, packetSendTime);
+    retransmitTimers.erase(rpcId);
+    clockSynchronizer.eraseRequestRecieveTime(rpcId);
+    incomingStreamPositions.erase(rpcId);
+    outgoingReplies.erase(replyIt);
+  }
+}
+
+void BiDirectionalRpc::acknowledgeRequest(const RpcId& rpcId,
+                                          int64_t packetSendTime) {
+  auto requestIt = outgoingRequests.find(rpcId);
+  if (requestIt != outgoingRequests.end()) {
+    VLOG(1) << "ACK REQUEST " << rpcId.str();
+    checkSpuriousRetransmit(rpcId, packetSendTime);
+    // Keep the timer around so the reply knows whether it was resent
+    auto timerIt = retransmitTimers.find(rpcId);
+    if (timerIt != retransmitTimers.end()) {
+      timerIt->second.deadline = numeric_limits<int64_t>::max();
+    }
+    deliveredRequests.insert(rpcId);
+    outgoingStreamPositions.erase(rpcId);
+    outgoingRequests.erase(requestIt);
+  }
+}
+
+void BiDirectionalRpc::acknowledgeFragment(const SentFragment& fragment,
+                                           int64_t packetSendTime) {
+  auto it = outgoingFragments.find(make_pair(fragment.type, fragment.id));
+  if (it == outgoingFragments.end() ||
+      !it->second.acknowledge(fragment.offset, fragment.length)) {
+    return;
+  }
+  // That was the last missing piece, so the whole rpc made it across
+  outgoingFragments.erase(it);
+  if (fragment.type == REQUEST) {
+    acknowledgeRequest(fragment.id, packetSendTime);
+  } else {
+    acknowledgeReply(fragment.id, packetSendTime);
+  }
+}
+
+void BiDirectionalRpc::enableMtuDiscovery() {
+  lock_guard<recursive_mutex> guard(mutex);
+  mtuDiscovery = true;
+  mtuProber = PathMtuProber(maxPacketSize, MAX_PROBED_PACKET_SIZE);
+}
+
+void BiDirectionalRpc::probePathMtu() {
+  if (!mtuDiscovery || !readyToSend()) {
+    return;
+  }
+  int64_t now = monotonicTimeMicros();
+  mtuProber.checkTimeout(now);
+  int64_t size = mtuProber.getProbeSize(now);
+  if (!size) {
+    return;
+  }
+  VLOG(1) << "Probing path mtu with " << size << " bytes";
+  sendMtuProbe(size);
+  mtuProber.onProbeSent(size,
+                        now + clockSynchronizer.getRetransmissionTimeout(0));
+}
+
+void BiDirectionalRpc::sendMtuProbe(int64_t size) {
+  auto packet = PacketBufferPool::acquire();
+  MessageWriter writer;
+  writer.start(packet.get());
+  uint64_t packetNumber = startPacket(writer, DATA);
+  auto& sent = sentPackets[packetNumber];
+  sent.sendTime = monotonicTimeMicros();
+  sent.probeSize = size;
+  onPacketSent(size, false);
+  // Padding frame type and the string's length prefix
+  int64_t paddingSize =
+      size - getPacketOverhead() - int64_t(packet->size()) - (1 + 5);
+  writer.writePrimitive<unsigned char>(PADDING);
+  writer.writePrimitive<string>(string(max(int64_t(0), paddingSize), '\0'));
+  sendSealed(packet);
+}
+
+void BiDirectionalRpc::sendAcknowledge() {
+  auto packet = PacketBufferPool::acquire();
+  MessageWriter writer;
+  writer.start(packet.get());
   writer.writePrimitive<unsigned char>(ACKNOWLEDGE);
-  writer.writeClass<RpcId>(uid);
+  writeAcknowledgeFrame(writer);
   writer.writePrimitive<string>("ACK_OK");
-  send(writer.finish());
+  onPacketSent(int64_t(packet->size()) + getPacketOverhead(), false);
+  sendSealed(packet);
 }
 
 void BiDirectionalRpc::addIncomingRequest(const IdPayload& idPayload) {
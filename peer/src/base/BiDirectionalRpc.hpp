@@ -1,32 +1,195 @@
 #ifndef __BIDIRECTIONAL_RPC_H__
 #define __BIDIRECTIONAL_RPC_H__
 
+#include "AckBitmap.hpp"
+#include "BarrierReorderBuffer.hpp"
+#include "BoundedMpscQueue.hpp"
 #include "ClockSynchronizer.hpp"
+#include "CongestionController.hpp"
+#include "ConnectionStats.hpp"
+#include "ForwardErrorCorrection.hpp"
+#include "FragmentBuffer.hpp"
 #include "Headers.hpp"
+#include "LossEstimator.hpp"
 #include "MessageReader.hpp"
 #include "MessageWriter.hpp"
+#include "PacketBuffer.hpp"
+#include "PathMtuProber.hpp"
 #include "PidController.hpp"
+#include "RpcDedupWindow.hpp"
 #include "RpcId.hpp"
+#include "StreamReorderBuffer.hpp"
 
 namespace wga {
-class IdPayload {
+// DATA, ACKNOWLEDGE and PARITY start a packet.  The rest tag the frames
+// inside a DATA packet, which can mix all kinds.
+enum RpcHeader {
+  REQUEST = 1,
+  REPLY = 2,
+  ACKNOWLEDGE = 3,
+  DATA = 4,
+  UNRELIABLE = 5,
+  UNRELIABLE_SEQUENCED = 6,
+  // One piece of a request or reply frame too big for a packet
+  FRAGMENT = 7,
+  // Fills out path mtu probes
+  PADDING = 8,
+  // The XOR of a group of DATA packets, for rebuilding one that was lost
+  PARITY = 9,
+  // A whole packet, encrypted by the transport (see sealPacket())
+  SEALED = 10,
+};
+
+// What openPacket() made of a sealed packet
+enum PacketOpenResult {
+  PACKET_OPENED = 1,
+  // We don't have the key yet, the sender will resend what matters
+  PACKET_UNREADABLE = 2,
+  // Didn't authenticate
+  PACKET_FORGED = 3,
+  // Opened before, a duplicate on the network or someone replaying it
+  PACKET_REPLAYED = 4,
+};
+
+// What receive() made of a datagram.  Only RECEIVE_INVALID is false.
+enum ReceiveResult {
+  // Malformed or forged, whoever sent it can be banned
+  RECEIVE_INVALID = 0,
+  // Harmless, but no proof that the other side sent it just now: it was
+  // unsealed, replayed, reordered or not readable yet
+  RECEIVE_ACCEPTED = 1,
+  // A sealed packet that opened and is the newest we have seen
+  RECEIVE_AUTHENTICATED = 2,
+};
+
+// A piece of a fragmented rpc, as the byte range of the frame it carried
+class SentFragment {
  public:
-  IdPayload() {}
-  IdPayload(const RpcId& _id, const string& _payload)
-      : id(_id), payload(_payload) {}
+  SentFragment() : type(REQUEST), offset(0), length(0) {}
+  SentFragment(RpcHeader _type, const RpcId& _id, uint32_t _offset,
+               uint32_t _length)
+      : type(_type), id(_id), offset(_offset), length(_length) {}
 
+  RpcHeader type;
   RpcId id;
+  uint32_t offset;
+  uint32_t length;
+};
+
+// The rpcs carried by a packet, so an acknowledge of the packet can retire
+// all of them at once.
+class SentPacket {
+ public:
+  SentPacket() : sendTime(0), probeSize(0), bytes(0), lost(false) {}
+
+  int64_t sendTime;
+  vector<RpcId> requests;
+  vector<RpcId> replies;
+  vector<SentFragment> fragments;
+  // Non-zero for path mtu probes
+  int64_t probeSize;
+  // Size on the wire, counted against the congestion window until the
+  // packet is acknowledged or declared lost
+  int64_t bytes;
+  bool lost;
+};
+
+// Resend schedule for one unacknowledged rpc.  Times are from
+// monotonicTimeMicros().
+class RetransmitTimer {
+ public:
+  RetransmitTimer()
+      : firstSendTime(0), lastSendTime(0), deadline(0), retransmits(0) {}
+
+  int64_t firstSendTime;
+  int64_t lastSendTime;
+  int64_t deadline;
+  int retransmits;
+};
+
+// Work handed to the thread that owns the connection by other threads
+enum RpcSubmissionType {
+  SUBMIT_REQUEST_ONE_WAY = 1,
+  SUBMIT_BARRIER = 2,
+  SUBMIT_UNRELIABLE = 3,
+  SUBMIT_UNRELIABLE_SEQUENCED = 4,
+};
+
+class RpcSubmission {
+ public:
+  RpcSubmission() : type(SUBMIT_BARRIER), channel(0) {}
+  RpcSubmission(RpcSubmissionType _type, const string& _payload,
+                uint32_t _channel = 0)
+      : type(_type), payload(_payload), channel(_channel) {}
+
+  RpcSubmissionType type;
   string payload;
+  // The stream for requests, the channel for unreliable messages
+  uint32_t channel;
+};
+
+// When the send budget is tight, queued rpcs go out in this order and the
+// rest wait for the next flush.
+enum StreamPriority {
+  PRIORITY_CONTROL = 0,
+  PRIORITY_HIGH = 1,
+  PRIORITY_NORMAL = 2,
+  PRIORITY_LOW = 3,
+};
+
+// Handshakes, heartbeats and shutdowns.  Always open, unordered, and served
+// ahead of everything else.
+const uint32_t CONTROL_STREAM = 0;
+// Where requests go unless the caller picks a stream
+const uint32_t DEFAULT_STREAM = 1;
+
+class StreamConfig {
+ public:
+  StreamConfig()
+      : priority(PRIORITY_NORMAL), ordered(false), lastSequence(0) {}
+  StreamConfig(StreamPriority _priority, bool _ordered)
+      : priority(_priority), ordered(_ordered), lastSequence(0) {}
+
+  StreamPriority priority;
+  bool ordered;
+  uint64_t lastSequence;
+};
+
+// Where a request sits in its stream.  Requests on unordered streams have
+// sequence 0.
+class StreamPosition {
+ public:
+  StreamPosition() : stream(DEFAULT_STREAM), sequence(0) {}
+  StreamPosition(uint32_t _stream, uint64_t _sequence)
+      : stream(_stream), sequence(_sequence) {}
+
+  uint32_t stream;
+  uint64_t sequence;
 };
 
 extern bool ALL_RPC_FLAKY;
+extern bool ENABLE_SEQUENCED_RPC_IDS;
+extern bool ENABLE_FORWARD_ERROR_CORRECTION;
 
-enum RpcHeader {
-  REQUEST = 1,
-  REPLY = 2,
-  ACKNOWLEDGE = 3,
+// A message that is never stored, resent or acknowledged.  Sequenced
+// messages carry a per-channel counter so the receiver can drop anything
+// older than what it already has.
+class UnreliableMessage {
+ public:
+  UnreliableMessage() : sequenced(false), channel(0), sequence(0) {}
+
+  bool sequenced;
+  uint32_t channel;
+  uint64_t sequence;
+  string payload;
 };
 
+// Runs a delivery somewhere other than the receiving thread, for example by
+// posting it to a game loop's task queue.
+typedef function<void(function<void()>)> RpcExecutor;
+typedef function<void(const IdPayload&)> RpcHandler;
+typedef function<void(const UnreliableMessage&)> UnreliableHandler;
+
 class BiDirectionalRpc {
  public:
   BiDirectionalRpc(bool connectedToHost);
@@ -34,19 +197,61 @@ class BiDirectionalRpc {
 
   void sendShutdown();
   void shutdown();
+  // Bootstraps the clock and waits until it settles.  Use
+  // startClockBootstrap() to bootstrap many connections at once.
   void initTimeShift();
-  void heartbeat();
-  void barrier() {
-    lock_guard<recursive_mutex> guard(mutex);
-    onBarrier++;
+  // Starts sending timestamp probes, spaced out and a few at a time, until
+  // the clock synchronizer settles.  Probes go out from sendClockProbes()
+  // and heartbeat().
+  void startClockBootstrap();
+  void sendClockProbes() { sendClockProbes(monotonicTimeMicros()); }
+  // Probes are spaced out from now, monotonicTimeMicros() or a test's clock
+  void sendClockProbes(int64_t now);
+  bool isClockBootstrapped() { return clockSynchronizer.isBootstrapped(); }
+  double getClockBootstrapProgress() {
+    return clockSynchronizer.getBootstrapProgress();
   }
+  void heartbeat();
+  void barrier();
 
-  RpcId request(const string& payload);
-  void requestOneWay(const string& payload);
-  virtual void requestWithId(const IdPayload& idPayload);
+  // Sets up a stream for request() and requestOneWay().  Requests on an
+  // ordered stream are handed out on the other side in the order they were
+  // made, and only wait on each other.  Streams that were never opened are
+  // unordered with normal priority.
+  void openStream(uint32_t stream, StreamPriority priority, bool ordered);
+
+  RpcId request(const string& payload, uint32_t stream = DEFAULT_STREAM);
+  void requestOneWay(const string& payload, uint32_t stream = DEFAULT_STREAM);
+  // Returns false if the id belongs to an older barrier than a request
+  // already made, since the other side may have moved past it.
+  virtual bool requestWithId(const IdPayload& idPayload,
+                             uint32_t stream = DEFAULT_STREAM);
   virtual void reply(const RpcId& rpcId, const string& payload);
   inline void replyOneWay(const RpcId& rpcId) { reply(rpcId, "OK"); }
 
+  // Fire and forget on the same connection and session as the rpcs.  The
+  // message may be lost or arrive out of order, and costs no resends or
+  // acks.
+  void sendUnreliable(const string& payload);
+  // Like sendUnreliable(), but the receiver drops anything older than the
+  // newest message it has seen on the channel (latest wins).
+  void sendUnreliableSequenced(uint32_t channel, const string& payload);
+
+  bool hasIncomingUnreliable() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return !incomingUnreliable.empty();
+  }
+
+  UnreliableMessage getFirstIncomingUnreliable() {
+    lock_guard<recursive_mutex> guard(mutex);
+    if (incomingUnreliable.empty()) {
+      LOGFATAL << "Tried to get an unreliable message when there was none";
+    }
+    UnreliableMessage message = incomingUnreliable.front();
+    incomingUnreliable.pop_front();
+    return message;
+  }
+
   bool hasIncomingRequest() {
     lock_guard<recursive_mutex> guard(mutex);
     return !incomingRequests.empty();
@@ -76,7 +281,7 @@ class BiDirectionalRpc {
     }
     IdPayload idPayload = IdPayload(incomingReplies.begin()->first,
                                     incomingReplies.begin()->second);
-    processedReplies.put(idPayload.id, true);
+    processedReplies.put(idPayload.id);
     incomingReplies.erase(incomingReplies.begin());
     return idPayload;
   }
@@ -98,27 +303,81 @@ class BiDirectionalRpc {
       LOGFATAL << "Tried to get a reply that didn't exist!";
     }
     string payload = it->second;
-    processedReplies.put(it->first, true);
+    processedReplies.put(it->first);
     incomingReplies.erase(it);
     return payload;
   }
 
   void setFlaky(bool _flaky) { flaky = _flaky; }
 
-  virtual bool receive(const string& message);
+  // Called with each new request as soon as its packet is decoded, outside
+  // the connection lock.  The request stays pending until reply() is called
+  // for it.  Without an executor the handler runs on the receiving thread.
+  void setRequestHandler(RpcHandler handler,
+                         RpcExecutor executor = RpcExecutor()) {
+    lock_guard<recursive_mutex> guard(mutex);
+    requestHandler = handler;
+    requestExecutor = executor;
+  }
+
+  // Called with each unreliable message that survives sequencing.  Without
+  // a handler they queue up for getFirstIncomingUnreliable().
+  void setUnreliableHandler(UnreliableHandler handler,
+                            RpcExecutor executor = RpcExecutor()) {
+    lock_guard<recursive_mutex> guard(mutex);
+    unreliableHandler = handler;
+    unreliableExecutor = executor;
+  }
+
+  // Called with each reply to a request().  The reply is consumed, so it
+  // won't show up in getFirstIncomingReply().
+  void setReplyHandler(RpcHandler handler,
+                       RpcExecutor executor = RpcExecutor()) {
+    lock_guard<recursive_mutex> guard(mutex);
+    replyHandler = handler;
+    replyExecutor = executor;
+  }
+
+  // Switches new requests from random ids to a dense per-connection
+  // sequence.  Both sides must agree on who gets which side bit.
+  void enableSequencedRpcIds(uint64_t side) {
+    lock_guard<recursive_mutex> guard(mutex);
+    sequencedRpcIds = true;
+    sequenceSide = side;
+  }
+
+  // Back to random ids for new requests.  Ids already handed out stay with
+  // their rpcs, and the sequence picks up after them if it comes back.
+  void disableSequencedRpcIds() {
+    lock_guard<recursive_mutex> guard(mutex);
+    sequencedRpcIds = false;
+  }
+
+  bool hasSequencedRpcIds() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return sequencedRpcIds;
+  }
+
+  virtual ReceiveResult receive(const string& message);
+  // Like receive(), for a sealed packet that was already opened off the
+  // connection's thread.  sealedSize is what came off the wire.
+  ReceiveResult receiveOpened(PacketOpenResult result, const string& opened,
+                              size_t sealedSize);
 
   virtual bool hasWork() {
     lock_guard<recursive_mutex> guard(mutex);
-    for (const auto& it : delayedRequests) {
-      if (!it.second.empty()) {
-        return true;
-      }
+    if (!submissions.empty()) {
+      return true;
     }
     for (const auto& it : outgoingRequests) {
       if (!it.second.empty()) {
         return true;
       }
     }
+    if (!deliveredRequests.empty() || !reorderBuffer.empty() ||
+        !streamReorderBuffer.empty()) {
+      return true;
+    }
     for (const auto& it : incomingRequests) {
       if (!it.second.empty()) {
         return true;
@@ -151,48 +410,319 @@ class BiDirectionalRpc {
     return clockSynchronizer.getHalfPingUpperBound();
   }
 
-  inline bool isShuttingDown() {
+  inline bool isShuttingDown() { return shuttingDown; }
+
+  virtual bool readyToSend() { return true; }
+
+  void resendExpiredMessages();
+  void resendOldestOutgoingMessage();
+
+  // Runs everything other threads submitted.  Called on the owning thread.
+  void drainSubmissions();
+
+  // Packs every queued request and reply into as few datagrams as
+  // maxPacketSize allows and sends them.
+  void flush();
+
+  // Upper bound on the size of a datagram, including whatever the transport
+  // adds (see getPacketOverhead()).  Rpcs that don't fit are fragmented.
+  // Turns off path mtu discovery.
+  void setMaxPacketSize(int64_t size) {
     lock_guard<recursive_mutex> guard(mutex);
-    return shuttingDown;
+    maxPacketSize = size;
+    mtuDiscovery = false;
   }
 
-  virtual bool readyToSend() { return true; }
+  // Probes upward from the current max packet size during heartbeats, and
+  // raises the max packet size as probes get through.
+  void enableMtuDiscovery();
 
-  void resendRandomOutgoingMessage();
+  int64_t getMaxPacketSize() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return maxPacketSize;
+  }
+
+  int64_t getRetransmitCount() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return stats.retransmits;
+  }
+
+  // The latest snapshot, at most a heartbeat or PUBLISH_INTERVAL old.  Never
+  // waits on the connection lock, so it is safe to poll from a game loop.
+  ConnectionStats getStats() { return statsPublisher.getPublished(); }
+
+  // Bytes per second the congestion controller currently allows
+  double getSendingRate() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return congestionController.getSendingRate();
+  }
+
+  int64_t getCongestionWindow() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return congestionController.getCongestionWindow();
+  }
+
+  // Sends parity packets when the other side loses enough packets to make
+  // them worth it.  Recent packets are kept to rebuild lost ones as soon as
+  // the other side sends parity of its own.  Only call this once the other
+  // side understands parity packets.
+  void enableForwardErrorCorrection() {
+    lock_guard<recursive_mutex> guard(mutex);
+    parityEnabled = true;
+  }
+
+  // Stops sending parity.  Open groups are dropped, their packets go
+  // unprotected.
+  void disableForwardErrorCorrection() {
+    lock_guard<recursive_mutex> guard(mutex);
+    parityEnabled = false;
+    parityEncoder.configure(0, 1);
+  }
+
+  bool hasForwardErrorCorrection() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return parityEnabled;
+  }
+
+  // Lost packets rebuilt from parity, which never needed a resend
+  int64_t getRecoveredPacketCount() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return stats.packetsRecovered;
+  }
+
+  // Resends where the original copy turned out to have arrived
+  int64_t getSpuriousRetransmitCount() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return stats.spuriousRetransmits;
+  }
 
  protected:
-  unordered_map<RpcId, string> delayedRequests;
   unordered_map<RpcId, string> outgoingRequests;
+  // Requests the other side has acknowledged but not replied to yet.  These
+  // no longer need to be resent.
+  unordered_set<RpcId> deliveredRequests;
   unordered_map<RpcId, string> incomingRequests;
   unordered_set<RpcId> oneWayRequests;
 
+  // How many requests we made before each barrier generation that still has
+  // requests in flight.  Sent with every request for the reorder buffer on
+  // the other side.
+  map<int64_t, uint64_t> barrierPriorRequests;
+  uint64_t sentRequestCount;
+  // Incoming requests waiting on an earlier barrier generation
+  BarrierReorderBuffer reorderBuffer;
+
+  unordered_map<uint32_t, StreamConfig> streams;
+  // Stream of every request we are still sending, and of every request we
+  // got that is still waiting on its reply to be acknowledged.  Used to write
+  // request frames and to pick what goes out first.
+  unordered_map<RpcId, StreamPosition> outgoingStreamPositions;
+  unordered_map<RpcId, StreamPosition> incomingStreamPositions;
+  // Incoming requests waiting on an earlier request in their stream
+  StreamReorderBuffer streamReorderBuffer;
+
   unordered_map<RpcId, string> outgoingReplies;
   unordered_map<RpcId, string> incomingReplies;
 
-  lru_cache<RpcId, bool> processedRequests;
-  lru_cache<RpcId, bool> processedReplies;
+  vector<UnreliableMessage> queuedUnreliable;
+  deque<UnreliableMessage> incomingUnreliable;
+  // Last sequence number sent and received on each sequenced channel
+  unordered_map<uint32_t, uint64_t> unreliableSequences;
+  unordered_map<uint32_t, uint64_t> latestUnreliableSequences;
+
+  RpcDedupWindow processedRequests;
+  RpcDedupWindow processedReplies;
+
+  AckBitmap receivedPackets;
+  map<uint64_t, SentPacket> sentPackets;
+  uint64_t nextPacketNumber;
+  bool acknowledgePending;
+  // The sealed packet being processed, opened.  Kept between packets so
+  // opening one doesn't allocate.
+  string openedPacket;
+  // Whether the frames being processed came in a sealed packet
+  bool processingSealedPacket;
+  // Largest packet number that came in a sealed packet
+  uint64_t newestSealedPacket;
+  // Whether the datagram being received was a sealed DATA packet newer
+  // than any before it, which a replay can never be
+  bool receivedNewestSealedPacket;
+
+  // Rpcs waiting for the next flush, in the order they were queued
+  vector<pair<RpcHeader, RpcId>> queuedFrames;
+  unordered_set<RpcId> queuedRequests;
+  unordered_set<RpcId> queuedReplies;
+  int64_t maxPacketSize;
+
+  // Rpcs that went out in pieces, until every piece is acknowledged
+  map<pair<RpcHeader, RpcId>, OutgoingFragments> outgoingFragments;
+  FragmentReassembler fragmentReassembler;
+  PathMtuProber mtuProber;
+  bool mtuDiscovery;
+  CongestionController congestionController;
+
+  bool parityEnabled;
+  ParityEncoder parityEncoder;
+  ParityDecoder parityDecoder;
+  // The fate of every packet we sent, as acknowledges settle it
+  LossEstimator lossEstimator;
+  uint64_t nextSettledPacket;
+  // The other side's running count of our packets it rebuilt from parity
+  uint64_t packetsRecoveredByPeer;
+
+  unordered_map<RpcId, RetransmitTimer> retransmitTimers;
+  // Counters only, the rest is filled in by publishStats()
+  ConnectionStats stats;
+  ConnectionStatsPublisher statsPublisher;
 
   int64_t onBarrier;
   uint64_t onId;
+  bool sequencedRpcIds;
+  uint64_t sequenceSide;
   bool flaky;
   recursive_mutex mutex;
-  bool shuttingDown;
+  atomic<bool> shuttingDown;
+
+  // One-way requests and barriers from threads that don't own the
+  // connection.  Pushing takes no lock, so a game thread broadcasting every
+  // frame never waits on the network thread.
+  BoundedMpscQueue<RpcSubmission> submissions;
+  bool drainingSubmissions;
 
   ClockSynchronizer clockSynchronizer;
+  bool clockBootstrapping;
+  int64_t nextClockProbeTime;
+  // Probes still waiting on their reply
+  unordered_set<RpcId> clockProbes;
+
+  RpcHandler requestHandler;
+  RpcExecutor requestExecutor;
+  RpcHandler replyHandler;
+  RpcExecutor replyExecutor;
+  UnreliableHandler unreliableHandler;
+  RpcExecutor unreliableExecutor;
+  // Handler calls collected while decoding a packet, run once the lock is
+  // released
+  vector<pair<RpcExecutor, function<void()>>> pendingDeliveries;
+  // Signalled whenever a reply arrives
+  condition_variable_any replyCondition;
 
-  void handleRequest(const RpcId& rpcId, const string& payload);
+  bool processPacket(const string& message);
+  bool processSealedPacket(const string& message);
+  bool processOpenedPacket(PacketOpenResult result, const string& opened);
+  // Does the bookkeeping around processing one datagram
+  ReceiveResult receivePacket(size_t size, const function<bool()>& process);
+  void queueDelivery(RpcHandler handler, RpcExecutor executor,
+                     const IdPayload& idPayload);
+  RpcId createRpcId();
+  void sendOneWayRequest(const string& payload, uint32_t stream);
+  // Whether the calling thread is the one that runs this connection.  Calls
+  // from anywhere else go through the submission queue when they can.
+  virtual bool isOwnerThread() { return true; }
+  // Asks the owning thread to call drainSubmissions() soon
+  virtual void scheduleDrain() { drainSubmissions(); }
+  void handleRequest(const RpcId& rpcId, const string& payload,
+                     uint64_t priorRequests, const StreamPosition& position);
+  void deliverRequest(const IdPayload& idPayload);
+  void pruneBarrierPriorRequests();
   virtual void handleReply(const RpcId& rpcId, const string& payload,
                            int64_t requestReceiveTime, int64_t replySendTime);
-  void tryToSendBarrier();
-  void sendRequest(const RpcId& id, const string& payload, bool batch);
-  void sendReply(const RpcId& id, const string& payload, bool batch);
-  virtual void sendAcknowledge(const RpcId& uid);
+  void queueRequest(const RpcId& id);
+  void queueReply(const RpcId& id);
+  void submitUnreliable(RpcSubmissionType type, uint32_t channel,
+                        const string& payload);
+  virtual void queueUnreliable(const UnreliableMessage& message);
+  void writeUnreliableFrame(MessageWriter& writer,
+                            const UnreliableMessage& message);
+  void handleUnreliable(const UnreliableMessage& message);
+  virtual void addIncomingUnreliable(const UnreliableMessage& message);
+  // Asks the transport to call flush() soon.  Without a timer, queued rpcs go
+  // out right away.
+  virtual void scheduleFlush() { flush(); }
+  // Bytes flush() may send right now.  Rpcs past the budget wait for the
+  // next flush, highest priority first.
+  virtual int64_t getSendBudget() { return numeric_limits<int64_t>::max(); }
+  // Asks the transport to call flush() once the send budget has room again.
+  // Without a timer, deferred rpcs wait for the next flush.
+  virtual void schedulePacedFlush() {}
+  StreamPriority getStreamPriority(uint32_t stream);
+  StreamPriority getFramePriority(RpcHeader type, const RpcId& id);
+  bool writeFrame(MessageWriter& writer, RpcHeader type, const RpcId& id);
+  void writeFragmentFrame(MessageWriter& writer, RpcHeader type,
+                          const RpcId& id, const OutgoingFragments& fragments,
+                          uint32_t index);
+  bool isOutgoing(RpcHeader type, const RpcId& id);
+  // Whether a request or reply frame would be thrown away as a duplicate
+  bool isProcessed(RpcHeader type, const RpcId& id);
+  FragmentResult handleFragment(RpcHeader type, const RpcId& id,
+                                uint32_t offset, uint32_t frameSize,
+                                const string& piece, string* frame);
+  // Puts the packet header in front of the frames and sends them
+  void sendDataPacket(const PacketBufferPtr& packet,
+                      const SentPacket& sentPacket);
+  void sendParityPacket(const ParityGroup& parity);
+  // Seals the packet if the transport wants to, then sends it
+  void sendSealed(const PacketBufferPtr& packet);
+  // Encrypts a packet that is about to go out where it is, growing it into
+  // its headroom.  Returns false to send it as it is.  Packets carrying the
+  // session key never come through here.
+  virtual bool sealPacket(PacketBuffer* packet) { return false; }
+  // Undoes sealPacket() on the bytes after the SEALED header, into opened
+  virtual PacketOpenResult openPacket(const char* sealed, size_t size,
+                                      string* opened) {
+    return PACKET_FORGED;
+  }
+  // Whether everything but a packet carrying only the session key must
+  // come sealed
+  virtual bool requiresSealedPackets() { return false; }
+  // Accounts for a datagram we are about to send
+  void onPacketSent(int64_t bytes, bool ackEliciting);
+  void publishStats(int64_t now);
+  void handleParity(const ParityGroup& parity);
+  // Room for frames in a packet
+  int64_t getFrameBudget();
+  // Bytes the transport adds to every datagram
+  virtual int64_t getPacketOverhead() { return 0; }
+  uint64_t startPacket(MessageWriter& writer, RpcHeader header);
+  void writeAcknowledgeFrame(MessageWriter& writer);
+  AckBitmap readAcknowledgeFrame(MessageReader& reader,
+                                 uint64_t* packetsRecovered);
+  void handleAcknowledge(const AckBitmap& ackFrame, uint64_t packetsRecovered);
+  // Declares packets lost once PACKET_REORDER_THRESHOLD later packets were
+  // acknowledged, or once they are a retransmission timeout old
+  void detectLostPackets(uint64_t largestAcknowledged, int64_t now);
+  void onPacketLost(SentPacket& packet, int64_t now);
+  // Drops to the base packet size when the prober sees a black hole
+  void checkBlackHole(int64_t now);
+  void updateLossEstimate(const AckBitmap& ackFrame,
+                          uint64_t packetsRecovered);
+  void acknowledgeRequest(const RpcId& rpcId, int64_t packetSendTime);
+  void acknowledgeReply(const RpcId& rpcId, int64_t packetSendTime);
+  void acknowledgeFragment(const SentFragment& fragment,
+                           int64_t packetSendTime);
+  void probePathMtu();
+  void sendMtuProbe(int64_t size);
+  virtual void scheduleAcknowledge() { sendAcknowledge(); }
+  // Returns true when this is the rpc's first send
+  bool armRetransmitTimer(const RpcId& rpcId, int64_t now);
+  void resendOutgoingMessage(const RpcId& rpcId, int64_t now);
+  void checkSpuriousRetransmit(const RpcId& rpcId, int64_t packetSendTime);
+  int64_t getNextRetransmitDeadline();
+  // Asks the transport to call resendExpiredMessages() at the deadline.
+  // Without a timer, heartbeat() is the only thing that resends.
+  virtual void scheduleRetransmit(int64_t deadline) {}
+  // Called from heartbeat() for timeouts the transport keeps itself
+  virtual void checkTimeouts(int64_t now) {}
+  virtual void sendAcknowledge();
   virtual void addIncomingRequest(const IdPayload& idPayload);
   virtual void addIncomingReply(const RpcId& uid, const string& payload) {
     incomingReplies.emplace(uid, payload);
   }
-  virtual void send(const string& message) = 0;
-  bool validatePacket(const RpcId& rpcId, const string& payload) {
+  virtual void send(const PacketBufferPtr& packet) = 0;
+  // Whether a frame (or an acknowledge packet) can be trusted.  Sealed
+  // packets were authenticated as a whole, see processingSealedPacket.
+  virtual bool validatePacket(RpcHeader type, const RpcId& rpcId,
+                              const string& payload) {
     return true;
   }
 };
@@ -0,0 +1,85 @@
+#ifndef __BOUNDED_MPSC_QUEUE_H__
+#define __BOUNDED_MPSC_QUEUE_H__
+
+#include "Headers.hpp"
+
+namespace wga {
+// Fixed size ring that any number of threads can push into and one thread
+// pops from, without locks.  Each slot carries a sequence number that tells
+// producers and the consumer whose turn it is (Vyukov's bounded queue).  With
+// a single producer it doubles as an SPSC queue.
+template <typename T>
+class BoundedMpscQueue {
+ public:
+  explicit BoundedMpscQueue(size_t capacity)
+      : mask(capacity - 1),
+        cells(new Cell[capacity]),
+        enqueuePos(0),
+        dequeuePos(0) {
+    if (capacity < 2 || (capacity & (capacity - 1))) {
+      LOGFATAL << "Queue capacity must be a power of two: " << capacity;
+    }
+    for (size_t a = 0; a < capacity; a++) {
+      cells[a].sequence.store(a, memory_order_relaxed);
+    }
+  }
+
+  // Returns false when the queue is full.
+  bool tryPush(T t) {
+    size_t pos = enqueuePos.load(memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells[pos & mask];
+      size_t sequence = cell->sequence.load(memory_order_acquire);
+      intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+      if (diff == 0) {
+        if (enqueuePos.compare_exchange_weak(pos, pos + 1,
+                                             memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueuePos.load(memory_order_relaxed);
+      }
+    }
+    cell->data = std::move(t);
+    cell->sequence.store(pos + 1, memory_order_release);
+    return true;
+  }
+
+  // Only one thread may pop at a time.
+  bool tryPop(T& t) {
+    size_t pos = dequeuePos.load(memory_order_relaxed);
+    Cell* cell = &cells[pos & mask];
+    size_t sequence = cell->sequence.load(memory_order_acquire);
+    if (intptr_t(sequence) - intptr_t(pos + 1) < 0) {
+      return false;
+    }
+    t = std::move(cell->data);
+    cell->sequence.store(pos + mask + 1, memory_order_release);
+    dequeuePos.store(pos + 1, memory_order_relaxed);
+    return true;
+  }
+
+  // A snapshot; other threads may push right after.
+  bool empty() const {
+    return dequeuePos.load(memory_order_relaxed) ==
+           enqueuePos.load(memory_order_relaxed);
+  }
+
+ protected:
+  struct Cell {
+    atomic<size_t> sequence;
+    T data;
+  };
+
+  size_t mask;
+  unique_ptr<Cell[]> cells;
+  // Producers and the consumer hammer different ends, keep them apart
+  alignas(64) atomic<size_t> enqueuePos;
+  alignas(64) atomic<size_t> dequeuePos;
+};
+}  // namespace wga
+
+#endif  // __BOUNDED_MPSC_QUEUE_H__
@@ -4,14 +4,15 @@
 
 namespace wga {
 void ClockSynchronizer::handleReply(const RpcId& id, int64_t requestReceiveTime,
-                                    int64_t replySendTime) {
+                                    int64_t replySendTime,
+                                    bool retransmitted) {
   lock_guard<mutex> guard(clockMutex);
   int64_t requestSendTime = requestSendTimeMap.at(id);
   requestSendTimeMap.erase(requestSendTimeMap.find(id));
   int64_t replyReceiveTime =
       timeHandler->currentTimeMicros() + timeHandler->getTimeShift();
   updateDrift(requestSendTime, requestReceiveTime, replySendTime,
-              replyReceiveTime);
+              replyReceiveTime, !retransmitted);
 }
 
 double ClockSynchronizer::getOffset() {
@@ -19,10 +20,55 @@ double ClockSynchronizer::getOffset() {
   return timeHandler->getOffsetEstimator()->getMean();
 }
 
+ClockState ClockSynchronizer::getState() {
+  lock_guard<mutex> guard(clockMutex);
+  ClockState state;
+  state.bootstrapped = bootstrapped;
+  state.baselineOffset = baselineOffset;
+  state.count = count;
+  state.ping = pingEstimator.getMean();
+  state.smoothedRtt = rttEstimator.getSmoothedRtt();
+  state.rttVariation = rttEstimator.getRttVariation();
+  return state;
+}
+
+void ClockSynchronizer::restoreState(const ClockState& state) {
+  lock_guard<mutex> guard(clockMutex);
+  if (count > 0 || !state.bootstrapped) {
+    return;
+  }
+  bootstrapped = true;
+  baselineOffset = state.baselineOffset;
+  count = state.count;
+  pingEstimator.addSample(state.ping);
+  rttEstimator.restore(state.smoothedRtt, state.rttVariation);
+}
+
+double ClockSynchronizer::getBootstrapProgress() {
+  lock_guard<mutex> guard(clockMutex);
+  if (bootstrapped) {
+    return 1.0;
+  }
+  double progress = double(count) / MAX_BOOTSTRAP_SAMPLES;
+  if (count >= MIN_BOOTSTRAP_SAMPLES) {
+    // The error shrinks with the square root of the samples
+    double error = getBaselineError();
+    double errorProgress =
+        (error > 0) ? pow(BOOTSTRAP_TOLERANCE / error, 2.0) : 1.0;
+    progress = max(progress, errorProgress);
+  }
+  // Only 1 once it is actually done
+  return min(0.99, progress);
+}
+
+double ClockSynchronizer::getBaselineError() {
+  return sqrt(baselineEstimator.getVariance() / double(count));
+}
+
 void ClockSynchronizer::updateDrift(int64_t requestSendTime,
                                     int64_t requestReceiptTime,
                                     int64_t replySendTime,
-                                    int64_t replyReceiveTime) {
+                                    int64_t replyReceiveTime, bool updateRtt) {
   int64_t ping_2 = int64_t(pingEstimator.getMean() / 2.0);
   int64_t timeOffsetRequest =
       -1 * ((requestReceiptTime - requestSendTime) - ping_2);
@@ -31,6 +77,9 @@ void ClockSynchronizer::updateDrift(int64_t requestSendTime,
   int64_t ping = (replyReceiveTime - requestSendTime) -
                  (replySendTime - requestReceiptTime);
   pingEstimator.addSample(min(1000.0*1000.0, double(ping)));
+  if (updateRtt) {
+    rttEstimator.addSample(max(0.0, double(ping)));
+  }
   if (log) {
     LOG_EVERY_N(100, INFO) << "Time offset: " << timeOffset << " "
                            << int64_t(
@@ -43,15 +92,25 @@ void ClockSynchronizer::updateDrift(int64_t requestSendTime,
   }
   auto oldMean = timeHandler->getOffsetEstimator()->getMean();
   count++;
+  // Samples only go to the optimizer once they are measured against a
+  // settled baseline
+  bool baselineSettled = bootstrapped;
+  if (!bootstrapped) {
+    // Average to get the baseline, until it stops moving
+    baselineEstimator.addSample(double(timeOffset));
+    baselineOffset = int64_t(baselineEstimator.getMean());
+    if (count >= MAX_BOOTSTRAP_SAMPLES ||
+        (count >= MIN_BOOTSTRAP_SAMPLES &&
+         getBaselineError() <= BOOTSTRAP_TOLERANCE)) {
+      bootstrapped = true;
+      if (log) {
+        LOG(INFO) << "Clock baseline settled after " << count
+                  << " samples: " << baselineOffset;
+      }
+    }
+  }
   if (connectedToHost) {
-    if (count < 10) {
-      // timeHandler->getOffsetOptimizer()->force(timeOffset);
-      baselineOffset += timeOffset;
-    } else if (count == 10) {
-      // Average to get final baseline
-      baselineOffset += timeOffset;
-      baselineOffset /= count;
-    } else {
+    if (baselineSettled) {
       timeHandler->getOffsetOptimizer()->updateWithLabel(
           (timeOffset - baselineOffset) / 1000000.0);
       timeHandler->getOffsetEstimator()->addSample(
@@ -4,11 +4,31 @@
 #include "AdamOptimizer.hpp"
 #include "Headers.hpp"
 #include "RpcId.hpp"
+#include "RttEstimator.hpp"
 #include "SlidingWindowEstimator.hpp"
 #include "TimeHandler.hpp"
 #include "WelfordEstimator.hpp"
 
 namespace wga {
+// What a connection learned about the other side's clock, kept so a resumed
+// session doesn't start over
+struct ClockState {
+  bool bootstrapped;
+  int64_t baselineOffset;
+  int64_t count;
+  double ping;
+  double smoothedRtt;
+  double rttVariation;
+
+  ClockState()
+      : bootstrapped(false),
+        baselineOffset(0),
+        count(0),
+        ping(0),
+        smoothedRtt(0),
+        rttVariation(0) {}
+};
+
 class ClockSynchronizer {
  public:
   ClockSynchronizer(shared_ptr<TimeHandler> _timeHandler, bool _connectedToHost,
@@ -17,6 +37,7 @@ class ClockSynchronizer {
         count(0),
         connectedToHost(_connectedToHost),
         log(_log),
+        bootstrapped(false),
         baselineOffset(0) {}
 
   int64_t createRequest(const RpcId& id) {
@@ -55,8 +76,10 @@ class ClockSynchronizer {
     requestReceiveTimeMap.erase(it);
   }
 
+  // Replies to resent requests still sync the clock, but are kept out of the
+  // rtt estimate because we can't tell which send they answer.
   void handleReply(const RpcId& id, int64_t requestReceiveTime,
-                   int64_t replySendTime);
+                   int64_t replySendTime, bool retransmitted = false);
 
   double getPing() {
     lock_guard<mutex> guard(clockMutex);
@@ -70,19 +93,56 @@ class ClockSynchronizer {
     return pingEstimator.getUpperBound() / 2.0;
   }
 
+  int64_t getRetransmissionTimeout(int retransmits) {
+    lock_guard<mutex> guard(clockMutex);
+    return rttEstimator.getRetransmissionTimeout(retransmits);
+  }
+
+  double getSmoothedRtt() {
+    lock_guard<mutex> guard(clockMutex);
+    return rttEstimator.getSmoothedRtt();
+  }
+
+  // Whether the baseline offset is settled.  That takes at least
+  // MIN_BOOTSTRAP_SAMPLES samples and at most MAX_BOOTSTRAP_SAMPLES, in
+  // between it's done once the standard error of the mean offset is under
+  // BOOTSTRAP_TOLERANCE.
+  bool isBootstrapped() {
+    lock_guard<mutex> guard(clockMutex);
+    return bootstrapped;
+  }
+
+  // How far along the baseline is, from 0 to 1 once it is settled
+  double getBootstrapProgress();
+
+  ClockState getState();
+  // Only takes a settled state, and only before our own first sample
+  void restoreState(const ClockState& state);
+
  protected:
   void updateDrift(int64_t requestSendTime, int64_t requestReceiptTime,
-                   int64_t replySendTime, int64_t replyReceiveTime);
+                   int64_t replySendTime, int64_t replyReceiveTime,
+                   bool updateRtt);
 
   shared_ptr<TimeHandler> timeHandler;
   unordered_map<RpcId, int64_t> requestSendTimeMap;
   unordered_map<RpcId, int64_t> requestReceiveTimeMap;
   SlidingWindowEstimator pingEstimator;
+  RttEstimator rttEstimator;
   int64_t count;
   bool connectedToHost;
   bool log;
+  bool bootstrapped;
   int64_t baselineOffset;
+  WelfordEstimator baselineEstimator;
   mutex clockMutex;
+
+  double getBaselineError();
+
+  constexpr static int64_t MIN_BOOTSTRAP_SAMPLES = 5;
+  constexpr static int64_t MAX_BOOTSTRAP_SAMPLES = 40;
+  // Standard error of the baseline offset we settle for, in microseconds
+  constexpr static double BOOTSTRAP_TOLERANCE = 1000.0;
 };
 }  // namespace wga
 
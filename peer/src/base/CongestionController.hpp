@@ -0,0 +1,167 @@
+#pragma once
+
+#include "Headers.hpp"
+
+namespace wga {
+// Delay based congestion control (LEDBAT, RFC 6817) with token bucket
+// pacing.  The window grows while the round trip stays close to the lowest
+// one seen recently and shrinks as a queue builds up.  It is cut in half at
+// most once per round trip when packets are lost.  Packets are spread out at
+// the window's rate instead of going out in bursts.  Sizes are in bytes and
+// times in microseconds.
+class CongestionController {
+ public:
+  CongestionController(int64_t _packetSize)
+      : packetSize(_packetSize),
+        congestionWindow(INITIAL_WINDOW_PACKETS * _packetSize),
+        bytesInFlight(0),
+        smoothedRtt(0),
+        recoveryStartTime(-1),
+        tokens(double(BURST_PACKETS * _packetSize)),
+        lastRefillTime(-1),
+        baseDelayBucketStart(-1) {}
+
+  // ackEliciting packets count against the window until they are
+  // acknowledged or lost.  Every packet uses up pacing tokens.
+  void onPacketSent(int64_t bytes, bool ackEliciting, int64_t now) {
+    refill(now);
+    tokens -= double(bytes);
+    if (ackEliciting) {
+      bytesInFlight += bytes;
+    }
+  }
+
+  void onPacketAcknowledged(int64_t bytes, int64_t sendTime, int64_t now) {
+    bool windowLimited = 2 * bytesInFlight >= congestionWindow;
+    bytesInFlight = max(int64_t(0), bytesInFlight - bytes);
+    int64_t rtt = max(int64_t(0), now - sendTime);
+    addDelaySample(rtt, now);
+    double offTarget =
+        double(TARGET_QUEUING_DELAY - getQueuingDelay()) / TARGET_QUEUING_DELAY;
+    offTarget = min(1.0, offTarget);
+    if (offTarget > 0 && !windowLimited) {
+      // The game isn't sending enough to tell whether the path has room for
+      // more
+      return;
+    }
+    congestionWindow += int64_t(GAIN * offTarget * double(bytes) *
+                                double(packetSize) / congestionWindow);
+    clampWindow();
+  }
+
+  void onPacketLost(int64_t bytes, int64_t sendTime, int64_t now) {
+    bytesInFlight = max(int64_t(0), bytesInFlight - bytes);
+    if (sendTime <= recoveryStartTime) {
+      // Sent before the last cut, which already accounted for it
+      return;
+    }
+    recoveryStartTime = now;
+    congestionWindow /= 2;
+    clampWindow();
+  }
+
+  // Bytes that may go out right now
+  int64_t getSendBudget(int64_t now) {
+    refill(now);
+    return max(int64_t(0), min(congestionWindow - bytesInFlight,
+                               int64_t(tokens)));
+  }
+
+  // How long until the pacer has bytes to spend, or 0 if the window is what
+  // holds them back
+  int64_t getPacingDelay(int64_t bytes, int64_t now) {
+    refill(now);
+    if (tokens >= double(bytes)) {
+      return 0;
+    }
+    return max(int64_t(1),
+               int64_t((double(bytes) - tokens) / getPacingRate()));
+  }
+
+  // Bytes per second the window allows at the current round trip
+  double getSendingRate() const {
+    return double(congestionWindow) * 1000.0 * 1000.0 / getRtt();
+  }
+
+  int64_t getCongestionWindow() const { return congestionWindow; }
+  int64_t getBytesInFlight() const { return bytesInFlight; }
+
+  int64_t getQueuingDelay() const {
+    if (currentDelays.empty()) {
+      return 0;
+    }
+    return *min_element(currentDelays.begin(), currentDelays.end()) -
+           *min_element(baseDelays.begin(), baseDelays.end());
+  }
+
+ protected:
+  int64_t packetSize;
+  int64_t congestionWindow;
+  int64_t bytesInFlight;
+  double smoothedRtt;
+  int64_t recoveryStartTime;
+  double tokens;
+  int64_t lastRefillTime;
+  // Lowest round trip in each of the last few minutes
+  deque<int64_t> baseDelays;
+  int64_t baseDelayBucketStart;
+  // The latest round trips, whose minimum filters out noise
+  deque<int64_t> currentDelays;
+
+  constexpr static int64_t INITIAL_WINDOW_PACKETS = 10;
+  constexpr static int64_t MIN_WINDOW_PACKETS = 2;
+  constexpr static int64_t MAX_WINDOW = 16 * 1024 * 1024;
+  // Games care about latency, so this is well below LEDBAT's 100ms
+  constexpr static int64_t TARGET_QUEUING_DELAY = 25 * 1000;
+  constexpr static double GAIN = 1.0;
+  constexpr static int BASE_DELAY_BUCKETS = 10;
+  constexpr static int64_t BASE_DELAY_BUCKET_LENGTH = 60 * 1000 * 1000LL;
+  constexpr static int CURRENT_DELAY_SAMPLES = 4;
+  // Round trip assumed until the first acknowledge
+  constexpr static int64_t INITIAL_RTT = 100 * 1000;
+  // Pacing runs a bit ahead of the window so acks keep it full
+  constexpr static double PACING_GAIN = 1.25;
+  constexpr static int64_t BURST_PACKETS = 10;
+
+  double getRtt() const {
+    return smoothedRtt > 0 ? smoothedRtt : double(INITIAL_RTT);
+  }
+
+  // Bytes per microsecond
+  double getPacingRate() const {
+    return PACING_GAIN * double(congestionWindow) / getRtt();
+  }
+
+  void refill(int64_t now) {
+    if (lastRefillTime >= 0 && now > lastRefillTime) {
+      tokens = min(double(BURST_PACKETS * packetSize),
+                   tokens + getPacingRate() * double(now - lastRefillTime));
+    }
+    lastRefillTime = max(lastRefillTime, now);
+  }
+
+  void addDelaySample(int64_t rtt, int64_t now) {
+    smoothedRtt = smoothedRtt > 0 ? (7.0 * smoothedRtt + double(rtt)) / 8.0
+                                  : double(rtt);
+    currentDelays.push_back(rtt);
+    if (int(currentDelays.size()) > CURRENT_DELAY_SAMPLES) {
+      currentDelays.pop_front();
+    }
+    if (baseDelays.empty() ||
+        now - baseDelayBucketStart >= BASE_DELAY_BUCKET_LENGTH) {
+      baseDelays.push_back(rtt);
+      baseDelayBucketStart = now;
+      if (int(baseDelays.size()) > BASE_DELAY_BUCKETS) {
+        baseDelays.pop_front();
+      }
+    } else {
+      baseDelays.back() = min(baseDelays.back(), rtt);
+    }
+  }
+
+  void clampWindow() {
+    congestionWindow = min(MAX_WINDOW, max(MIN_WINDOW_PACKETS * packetSize,
+                                           congestionWindow));
+  }
+};
+}  // namespace wga
@@ -0,0 +1,45 @@
+#ifndef __CONNECTION_ID_H__
+#define __CONNECTION_ID_H__
+
+#include "Headers.hpp"
+
+// Once connection ids are negotiated, datagrams start with WGA_MAGIC, this
+// marker and the id the receiver gave the connection (4 bytes, little
+// endian), so the receiver can route them without knowing the endpoint.
+// The marker is never a valid RpcHeader, which is what otherwise follows
+// the magic.
+//
+// An id lasts as long as its connection and is never rotated, so someone
+// watching the wire can link a connection's datagrams across a change of
+// address.  Hiding that would take fresh ids handed out over the encrypted
+// channel for every new path.  It isn't worth it while the session key
+// handshake, ids included, goes out in the clear anyway.
+#define CONNECTION_ID_MARKER ((unsigned char)0xC1)
+#define CONNECTION_ID_SIZE (4)
+
+namespace wga {
+inline string makeConnectionIdPrefix(uint32_t connectionId) {
+  string prefix = WGA_MAGIC;
+  prefix += char(CONNECTION_ID_MARKER);
+  for (int a = 0; a < CONNECTION_ID_SIZE; a++) {
+    prefix += char((connectionId >> (8 * a)) & 0xff);
+  }
+  return prefix;
+}
+
+// Reads the id from a datagram with the magic already stripped
+inline bool readConnectionId(const char* data, size_t size,
+                             uint32_t* connectionId) {
+  if (size < 1 + CONNECTION_ID_SIZE ||
+      (unsigned char)data[0] != CONNECTION_ID_MARKER) {
+    return false;
+  }
+  *connectionId = 0;
+  for (int a = 0; a < CONNECTION_ID_SIZE; a++) {
+    *connectionId |= uint32_t((unsigned char)data[1 + a]) << (8 * a);
+  }
+  return true;
+}
+}  // namespace wga
+
+#endif  // __CONNECTION_ID_H__
@@ -0,0 +1,170 @@
+#ifndef __CONNECTION_STATS_H__
+#define __CONNECTION_STATS_H__
+
+#include "Headers.hpp"
+
+namespace wga {
+// Health of one connection.  The counters run for the life of the
+// connection, the rates cover roughly the last RATE_WINDOW, and times are in
+// microseconds.
+class ConnectionStats {
+ public:
+  ConnectionStats()
+      : sampleTime(0),
+        packetsSent(0),
+        bytesSent(0),
+        packetsReceived(0),
+        bytesReceived(0),
+        packetsLost(0),
+        packetsReordered(0),
+        duplicatePackets(0),
+        packetsRecovered(0),
+        parityPacketsSent(0),
+        retransmits(0),
+        spuriousRetransmits(0),
+        duplicateRpcs(0),
+        framesDeferred(0),
+        unreliableDropped(0),
+        deliveredBytes(0),
+        endpointSwitches(0),
+        smoothedRtt(0),
+        rttP50(0),
+        rttP90(0),
+        rttP99(0),
+        lossRate(0),
+        sendingRate(0),
+        congestionWindow(0),
+        bytesInFlight(0),
+        sendBytesPerSecond(0),
+        receiveBytesPerSecond(0),
+        goodputBytesPerSecond(0),
+        retransmitsPerSecond(0) {}
+
+  // When this snapshot was taken, from monotonicTimeMicros()
+  int64_t sampleTime;
+
+  int64_t packetsSent;
+  int64_t bytesSent;
+  int64_t packetsReceived;
+  int64_t bytesReceived;
+  // Our packets the other side never acknowledged
+  int64_t packetsLost;
+  // Packets that showed up after a later one, including ones rebuilt from
+  // parity
+  int64_t packetsReordered;
+  int64_t duplicatePackets;
+  // Lost packets rebuilt from parity
+  int64_t packetsRecovered;
+  int64_t parityPacketsSent;
+  int64_t retransmits;
+  // Resends where the original copy turned out to have arrived
+  int64_t spuriousRetransmits;
+  // Requests and replies thrown away because we already had them
+  int64_t duplicateRpcs;
+  // Rpcs held back for a later flush by the send budget
+  int64_t framesDeferred;
+  // Unreliable messages superseded or pushed out while waiting on the send
+  // budget
+  int64_t unreliableDropped;
+  // Payload bytes handed to the game
+  int64_t deliveredBytes;
+  int64_t endpointSwitches;
+
+  double smoothedRtt;
+  // Over the most recent packet round trips
+  int64_t rttP50;
+  int64_t rttP90;
+  int64_t rttP99;
+  // Exponentially weighted fraction of our packets that were lost
+  double lossRate;
+  // Bytes per second the congestion controller allows
+  double sendingRate;
+  int64_t congestionWindow;
+  int64_t bytesInFlight;
+
+  double sendBytesPerSecond;
+  double receiveBytesPerSecond;
+  double goodputBytesPerSecond;
+  double retransmitsPerSecond;
+};
+
+// Hands snapshots of a connection's stats to other threads.  The connection
+// fills in the counters under its own lock and publishes every so often.
+// Readers only take the publisher's lock, which is held just long enough to
+// copy a snapshot.
+class ConnectionStatsPublisher {
+ public:
+  ConnectionStatsPublisher() : nextRttSample(0), lastPublishTime(0) {}
+
+  void addRttSample(int64_t rtt) {
+    if (int(rttSamples.size()) < MAX_RTT_SAMPLES) {
+      rttSamples.push_back(rtt);
+      return;
+    }
+    rttSamples[nextRttSample] = rtt;
+    nextRttSample = (nextRttSample + 1) % MAX_RTT_SAMPLES;
+  }
+
+  bool isPublishDue(int64_t now) const {
+    return now - lastPublishTime >= PUBLISH_INTERVAL;
+  }
+
+  // Fills in the percentiles and rates, then makes the snapshot visible
+  void publish(ConnectionStats snapshot, int64_t now) {
+    snapshot.sampleTime = now;
+    lastPublishTime = now;
+    if (!rttSamples.empty()) {
+      vector<int64_t> sorted = rttSamples;
+      snapshot.rttP50 = getPercentile(sorted, 0.5);
+      snapshot.rttP90 = getPercentile(sorted, 0.9);
+      snapshot.rttP99 = getPercentile(sorted, 0.99);
+    }
+    history.push_back(snapshot);
+    // Keep the newest snapshot at least RATE_WINDOW old as the baseline
+    while (history.size() > 1 &&
+           history[1].sampleTime <= now - RATE_WINDOW) {
+      history.pop_front();
+    }
+    const ConnectionStats& baseline = history.front();
+    double seconds = double(now - baseline.sampleTime) / (1000.0 * 1000.0);
+    if (seconds > 0) {
+      snapshot.sendBytesPerSecond =
+          double(snapshot.bytesSent - baseline.bytesSent) / seconds;
+      snapshot.receiveBytesPerSecond =
+          double(snapshot.bytesReceived - baseline.bytesReceived) / seconds;
+      snapshot.goodputBytesPerSecond =
+          double(snapshot.deliveredBytes - baseline.deliveredBytes) / seconds;
+      snapshot.retransmitsPerSecond =
+          double(snapshot.retransmits - baseline.retransmits) / seconds;
+    }
+    lock_guard<mutex> guard(publishMutex);
+    published = snapshot;
+  }
+
+  ConnectionStats getPublished() {
+    lock_guard<mutex> guard(publishMutex);
+    return published;
+  }
+
+  static int64_t getPercentile(vector<int64_t>& samples, double fraction) {
+    size_t index = min(samples.size() - 1,
+                       size_t(fraction * double(samples.size())));
+    nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+  }
+
+ protected:
+  vector<int64_t> rttSamples;
+  int nextRttSample;
+  int64_t lastPublishTime;
+  deque<ConnectionStats> history;
+  mutex publishMutex;
+  ConnectionStats published;
+
+  constexpr static int MAX_RTT_SAMPLES = 256;
+  constexpr static int64_t PUBLISH_INTERVAL = 100 * 1000;
+  constexpr static int64_t RATE_WINDOW = 1000 * 1000;
+};
+}  // namespace wga
+
+#endif  // __CONNECTION_STATS_H__
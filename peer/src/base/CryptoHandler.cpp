@@ -9,7 +9,11 @@ namespace wga {
 
 CryptoHandler::CryptoHandler(const PrivateKey& _myPrivateKey,
                              const PublicKey& _otherPublicKey)
-    : myPrivateKey(_myPrivateKey), otherPublicKey(_otherPublicKey) {
+    : myPrivateKey(_myPrivateKey),
+      otherPublicKey(_otherPublicKey),
+      counterNonces(false),
+      keyGeneration(0),
+      outgoingCounter(0) {
   lock_guard<mutex> guard(cryptoInitMutex);
   if (!calledInit) {
     if (-1 == sodium_init()) {
@@ -50,9 +54,20 @@ bool CryptoHandler::receiveIncomingSessionKey(
     LOGFATAL << "Tried to receive a session key when one already exists!";
   }
 
+  return openSessionKey(otherSessionKey, &incomingSessionKey);
+}
+
+bool CryptoHandler::checkIncomingSessionKey(
+    const EncryptedSessionKey& otherSessionKey) {
+  SessionKey sessionKey;
+  return openSessionKey(otherSessionKey, &sessionKey);
+}
+
+bool CryptoHandler::openSessionKey(const EncryptedSessionKey& otherSessionKey,
+                                   SessionKey* sessionKey) {
   Nonce nonce;
   memcpy(nonce.data(), otherSessionKey.data(), sizeof(Nonce));
-  if (crypto_box_open_easy(incomingSessionKey.data(),
+  if (crypto_box_open_easy(sessionKey->data(),
                            otherSessionKey.data() + sizeof(Nonce),
                            otherSessionKey.size() - sizeof(Nonce), nonce.data(),
                            otherPublicKey.data(), myPrivateKey.data()) != 0) {
@@ -61,45 +76,211 @@ bool CryptoHandler::receiveIncomingSessionKey(
   return true;
 }
 
+SessionKey CryptoHandler::deriveKey(const SessionKey& secret,
+                                    const string& input) {
+  SessionKey key;
+  SODIUM_FAIL(crypto_generichash(key.data(), key.size(),
+                                 (const uint8_t*)input.data(), input.length(),
+                                 secret.data(), secret.size()));
+  return key;
+}
+
+SessionKey CryptoHandler::getResumptionSecret() {
+  if (outgoingSessionKey == emptySessionKey ||
+      incomingSessionKey == emptySessionKey) {
+    LOGFATAL << "Tried to resume a session that never started!";
+  }
+  // Ordered by public key so both sides hash the same bytes
+  const SessionKey& first =
+      (myPublicKey < otherPublicKey) ? outgoingSessionKey : incomingSessionKey;
+  const SessionKey& second =
+      (myPublicKey < otherPublicKey) ? incomingSessionKey : outgoingSessionKey;
+  string input = "wga resumption";
+  input.append((const char*)second.data(), second.size());
+  return deriveKey(first, input);
+}
+
+void CryptoHandler::resumeOutgoingSessionKey(const SessionKey& secret,
+                                             const Nonce& nonce) {
+  if (outgoingSessionKey != emptySessionKey) {
+    LOGFATAL << "Tried to generate a session key when one already exists!";
+  }
+  string input((const char*)myPublicKey.data(), myPublicKey.size());
+  input.append((const char*)nonce.data(), nonce.size());
+  outgoingSessionKey = deriveKey(secret, input);
+}
+
+void CryptoHandler::resumeIncomingSessionKey(const SessionKey& secret,
+                                             const Nonce& nonce) {
+  if (incomingSessionKey != emptySessionKey) {
+    LOGFATAL << "Tried to receive a session key when one already exists!";
+  }
+  string input((const char*)otherPublicKey.data(), otherPublicKey.size());
+  input.append((const char*)nonce.data(), nonce.size());
+  incomingSessionKey = deriveKey(secret, input);
+}
+
+string CryptoHandler::getTicketId(const SessionKey& secret) {
+  return keyToString(deriveKey(secret, "wga ticket id"));
+}
+
+void CryptoHandler::clearSessionKeys() {
+  outgoingSessionKey.fill(0);
+  incomingSessionKey.fill(0);
+  // The next keys are new, so their counters are too, and the next handshake
+  // decides whether they are used at all
+  counterNonces = false;
+  outgoingCounter = 0;
+  incomingWindow = ReplayWindow();
+  keyGeneration++;
+}
+
 string CryptoHandler::encrypt(const string& buffer) {
+  string retval;
+  retval.reserve(ENCRYPTION_HEADROOM + buffer.length());
+  retval.resize(ENCRYPTION_HEADROOM);
+  retval += buffer;
+  encryptInPlace(&retval);
+  return retval;
+}
+
+void CryptoHandler::encryptInPlace(string* buffer) {
+  encryptInPlace(&(*buffer)[0], buffer->length());
+}
+
+void CryptoHandler::encryptInPlace(char* buffer, size_t length) {
   if (outgoingSessionKey == emptySessionKey) {
     LOGFATAL << "Tried to use a session key when one doesn't exist!";
   }
-  string retval(
-      crypto_secretbox_NONCEBYTES + buffer.length() + crypto_secretbox_MACBYTES,
-      '\0');
-  randombytes_buf(&retval[0], sizeof(Nonce));
+  if (length < ENCRYPTION_HEADROOM) {
+    LOGFATAL << "Tried to encrypt without room for the nonce and mac";
+  }
+  uint8_t* start = (uint8_t*)buffer;
+  randombytes_buf(start, sizeof(Nonce));
+  // The mac goes in front of the ciphertext, so the ciphertext lands right
+  // on top of the message.  libsodium allows the overlap.
   SODIUM_FAIL(crypto_secretbox_easy(
-      (uint8_t*)&retval[sizeof(Nonce)],  // Encrypted message
-      (const uint8_t*)buffer.c_str(),    // Original message
-      buffer.length(),                   // Original message length
-      (const uint8_t*)&retval[0],        // Nonce
-      outgoingSessionKey.data()          // Session Key
+      start + sizeof(Nonce),          // Encrypted message
+      start + ENCRYPTION_HEADROOM,    // Original message
+      length - ENCRYPTION_HEADROOM,   // Original message length
+      start,                          // Nonce
+      outgoingSessionKey.data()       // Session Key
       ));
-  return retval;
 }
 
 optional<string> CryptoHandler::decrypt(const string& buffer) {
+  string retval;
+  if (!decryptInto(buffer.data(), buffer.length(), &retval)) {
+    return nullopt;
+  }
+  return retval;
+}
+
+bool CryptoHandler::decryptInto(const char* buffer, size_t length,
+                                string* decrypted) {
   if (incomingSessionKey == emptySessionKey) {
     LOGFATAL << "Tried to use a session key when one doesn't exist!";
   }
-  if (buffer.length() <
-      (crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES)) {
-    return nullopt;
+  if (length < ENCRYPTION_HEADROOM) {
+    return false;
+  }
+  // Keeps whatever capacity the buffer already has
+  decrypted->resize(length - ENCRYPTION_HEADROOM);
+  return crypto_secretbox_open_easy(
+             (uint8_t*)&(*decrypted)[0],              // Decrypted message
+             (const uint8_t*)(buffer + sizeof(Nonce)),  // Encrypted message
+             length - sizeof(Nonce),    // Encrypted message length
+             (const uint8_t*)buffer,    // Nonce
+             incomingSessionKey.data()  // Session Key
+             ) == 0;
+}
+
+Nonce CryptoHandler::makeCounterNonce(uint64_t counter) {
+  // Each direction has its own key, so a counter never repeats under one
+  Nonce nonce;
+  nonce.fill(0);
+  for (int a = 0; a < 8; a++) {
+    nonce[a] = uint8_t((counter >> (8 * a)) & 0xff);
+  }
+  return nonce;
+}
+
+bool CryptoHandler::readCounter(const char* buffer, size_t length,
+                                uint64_t* counter) {
+  if (length < COUNTER_SEAL_HEADROOM) {
+    return false;
+  }
+  uint32_t truncated = 0;
+  for (int a = 0; a < int(COUNTER_NONCE_BYTES); a++) {
+    truncated |= uint32_t((unsigned char)buffer[a]) << (8 * a);
   }
-  string retval((buffer.length() - crypto_secretbox_NONCEBYTES) -
-                    crypto_secretbox_MACBYTES,
-                '\0');
+  *counter = incomingWindow.expand(truncated);
+  return true;
+}
+
+void CryptoHandler::sealInPlace(char* buffer, size_t length) {
+  if (!counterNonces) {
+    encryptInPlace(buffer, length);
+    return;
+  }
+  if (outgoingSessionKey == emptySessionKey) {
+    LOGFATAL << "Tried to use a session key when one doesn't exist!";
+  }
+  if (length < COUNTER_SEAL_HEADROOM) {
+    LOGFATAL << "Tried to encrypt without room for the nonce and mac";
+  }
+  uint64_t counter = ++outgoingCounter;
+  Nonce nonce = makeCounterNonce(counter);
+  uint8_t* start = (uint8_t*)buffer;
+  memcpy(start, nonce.data(), COUNTER_NONCE_BYTES);
+  SODIUM_FAIL(crypto_secretbox_easy(
+      start + COUNTER_NONCE_BYTES,     // Encrypted message
+      start + COUNTER_SEAL_HEADROOM,   // Original message
+      length - COUNTER_SEAL_HEADROOM,  // Original message length
+      nonce.data(),                    // Nonce
+      outgoingSessionKey.data()        // Session Key
+      ));
+}
+
+bool CryptoHandler::isReplayed(const char* buffer, size_t length) {
+  uint64_t counter;
+  if (!counterNonces || !readCounter(buffer, length, &counter)) {
+    return false;
+  }
+  return !incomingWindow.canAccept(counter);
+}
+
+bool CryptoHandler::openInto(const char* buffer, size_t length,
+                             string* opened, bool* replayed) {
+  if (!counterNonces) {
+    return decryptInto(buffer, length, opened);
+  }
+  if (incomingSessionKey == emptySessionKey) {
+    LOGFATAL << "Tried to use a session key when one doesn't exist!";
+  }
+  uint64_t counter;
+  if (!readCounter(buffer, length, &counter)) {
+    return false;
+  }
+  if (!incomingWindow.canAccept(counter)) {
+    if (replayed != NULL) {
+      *replayed = true;
+    }
+    return false;
+  }
+  Nonce nonce = makeCounterNonce(counter);
+  opened->resize(length - COUNTER_SEAL_HEADROOM);
   if (crypto_secretbox_open_easy(
-          (uint8_t*)&retval[0],  // Decrypted message
-          (const uint8_t*)(buffer.c_str() +
-                           sizeof(Nonce)),  // Encrypted message
-          buffer.length() - sizeof(Nonce),  // Encrypted message length
-          (const uint8_t*)buffer.c_str(),   // Nonce
-          incomingSessionKey.data()         // Session Key
+          (uint8_t*)&(*opened)[0],                             // Decrypted
+          (const uint8_t*)(buffer + COUNTER_NONCE_BYTES),      // Encrypted
+          length - COUNTER_NONCE_BYTES,  // Encrypted message length
+          nonce.data(),                  // Nonce
+          incomingSessionKey.data()      // Session Key
           ) != 0) {
-    return nullopt;
+    return false;
   }
-  return retval;
+  // Only authentic packets move the window
+  incomingWindow.accept(counter);
+  return true;
 }
 }  // namespace wga
@@ -4,6 +4,7 @@
 #include <sodium.h>
 
 #include "Headers.hpp"
+#include "ReplayWindow.hpp"
 
 #define SODIUM_FAIL(X)                                         \
   {                                                            \
@@ -102,6 +103,23 @@ class CryptoHandler {
 
   EncryptedSessionKey generateOutgoingSessionKey();
   bool receiveIncomingSessionKey(const EncryptedSessionKey& otherSessionKey);
+  // Whether a session key really came from the other side, without taking it
+  bool checkIncomingSessionKey(const EncryptedSessionKey& otherSessionKey);
+
+  // Both sides derive the same secret from the keys of a finished session.
+  // A later session derives each direction's key from it and a nonce the
+  // sender picks, so it can send before hearing from the other side.
+  SessionKey getResumptionSecret();
+  void resumeOutgoingSessionKey(const SessionKey& secret, const Nonce& nonce);
+  void resumeIncomingSessionKey(const SessionKey& secret, const Nonce& nonce);
+  // Names a resumption secret without giving it away
+  static string getTicketId(const SessionKey& secret);
+  // Forgets both session keys and the nonce mode, to start over with a full
+  // handshake
+  void clearSessionKeys();
+  // Changes every time the session keys are cleared, so a buffer readied
+  // for sealing under the old keys can be told apart
+  uint32_t getKeyGeneration() { return keyGeneration; }
 
   bool canDecrypt() { return incomingSessionKey != emptySessionKey; }
   bool canEncrypt() { return outgoingSessionKey != emptySessionKey; }
@@ -110,7 +128,39 @@ class CryptoHandler {
   PublicKey getOtherPublicKey() { return otherPublicKey; }
 
   string encrypt(const string& buffer);
+  // Encrypts everything after the first ENCRYPTION_HEADROOM bytes where it
+  // is, and fills the headroom in with the nonce and mac.  The result is
+  // the same as encrypt() of the bytes after the headroom.
+  void encryptInPlace(string* buffer);
+  void encryptInPlace(char* buffer, size_t length);
   optional<string> decrypt(const string& buffer);
+  // Like decrypt(), but into a buffer the caller reuses
+  bool decryptInto(const char* buffer, size_t length, string* decrypted);
+
+  // Switches sealInPlace()/openInto() to counter nonces.  Each direction
+  // numbers what it seals, only the low COUNTER_NONCE_BYTES of the counter
+  // go on the wire, and replays are refused before anything is decrypted.
+  // Only for buffers that are sealed once and never resent as they are.
+  void enableCounterNonces() { counterNonces = true; }
+  bool hasCounterNonces() { return counterNonces; }
+  // Room sealInPlace() needs in front of the message
+  size_t getSealHeadroom() {
+    return counterNonces ? COUNTER_SEAL_HEADROOM : ENCRYPTION_HEADROOM;
+  }
+  // encryptInPlace() with the nonce picked by the session mode
+  void sealInPlace(char* buffer, size_t length);
+  // Whether a sealed buffer was opened before, or is too old to tell
+  bool isReplayed(const char* buffer, size_t length);
+  // When it fails because of a replay, sets replayed, which saves asking
+  // isReplayed() first
+  bool openInto(const char* buffer, size_t length, string* opened,
+                bool* replayed = NULL);
+
+  constexpr static size_t ENCRYPTION_HEADROOM =
+      crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES;
+  constexpr static size_t COUNTER_NONCE_BYTES = 4;
+  constexpr static size_t COUNTER_SEAL_HEADROOM =
+      COUNTER_NONCE_BYTES + crypto_secretbox_MACBYTES;
 
  protected:
   PrivateKey myPublicKey;
@@ -119,6 +169,17 @@ class CryptoHandler {
   SessionKey outgoingSessionKey;
   SessionKey incomingSessionKey;
   SessionKey emptySessionKey;
+  bool counterNonces;
+  uint32_t keyGeneration;
+  // Last counter we sealed with
+  uint64_t outgoingCounter;
+  ReplayWindow incomingWindow;
+
+  static Nonce makeCounterNonce(uint64_t counter);
+  static SessionKey deriveKey(const SessionKey& secret, const string& input);
+  bool openSessionKey(const EncryptedSessionKey& otherSessionKey,
+                      SessionKey* sessionKey);
+  bool readCounter(const char* buffer, size_t length, uint64_t* counter);
 
  private:
 };
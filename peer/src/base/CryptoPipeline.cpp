@@ -0,0 +1,20 @@
+#include "CryptoPipeline.hpp"
+
+namespace wga {
+bool ENABLE_CRYPTO_PIPELINE = false;
+
+CryptoPipeline::CryptoPipeline(int threadCount) {
+  work.emplace(ioService);
+  for (int a = 0; a < threadCount; a++) {
+    threads.emplace_back([this]() { ioService.run(); });
+  }
+}
+
+CryptoPipeline::~CryptoPipeline() {
+  // The threads finish what is queued, then run out of work
+  work.reset();
+  for (auto& it : threads) {
+    it.join();
+  }
+}
+}  // namespace wga
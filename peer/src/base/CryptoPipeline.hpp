@@ -0,0 +1,43 @@
+#ifndef __CRYPTO_PIPELINE_H__
+#define __CRYPTO_PIPELINE_H__
+
+#include "Headers.hpp"
+
+namespace wga {
+// Seals and opens packets on a pool of threads instead of the io thread, so
+// a session with many peers spreads its crypto over the cores.  Off by
+// default, read when a NetEngine is created.
+extern bool ENABLE_CRYPTO_PIPELINE;
+
+// Runs work for many connections on a pool of threads.  Each connection
+// queues its work on a lane of its own.  Work on one lane runs in the order
+// it was queued, one piece at a time, so nonce counters and replay windows
+// never see two threads at once and packets leave in the order they were
+// sealed.  Lanes are strands, so no lock is held across connections.
+class CryptoPipeline {
+ public:
+  explicit CryptoPipeline(int threadCount);
+  // Waits for the work already queued
+  ~CryptoPipeline();
+
+  // Leaves a core for the io thread
+  static int getDefaultThreadCount() {
+    return max(1, int(std::thread::hardware_concurrency()) - 1);
+  }
+
+  shared_ptr<Strand> makeLane() { return make_shared<Strand>(ioService); }
+
+  void run(const shared_ptr<Strand>& lane, function<void()> work) {
+    lane->post(work);
+  }
+
+  int getThreadCount() { return int(threads.size()); }
+
+ protected:
+  asio::io_service ioService;
+  optional<asio::io_service::work> work;
+  vector<thread> threads;
+};
+}  // namespace wga
+
+#endif  // __CRYPTO_PIPELINE_H__
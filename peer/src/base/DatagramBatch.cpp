@@ -0,0 +1,157 @@
+#include "DatagramBatch.hpp"
+
+// Most datagrams handed to one sendmmsg
+#define MAX_SEND_BATCH (64)
+
+namespace wga {
+bool ENABLE_BATCHED_IO = true;
+
+int sendDatagramBatch(udp::socket& socket, const udp::endpoint& destination,
+                      const string& prefix,
+                      const vector<PacketBufferPtr>& packets,
+                      vector<PacketBufferPtr>* unsent) {
+  int syscalls = 0;
+#ifdef __linux__
+  if (useBatchedIo()) {
+    size_t count = min(packets.size(), size_t(MAX_SEND_BATCH));
+    vector<iovec> iovecs(count * 2);
+    vector<mmsghdr> headers(count);
+    size_t next = 0;
+    while (next < packets.size()) {
+      size_t batch = min(packets.size() - next, count);
+      for (size_t a = 0; a < batch; a++) {
+        const PacketBuffer& packet = *packets[next + a];
+        iovecs[a * 2].iov_base = (void*)prefix.data();
+        iovecs[a * 2].iov_len = prefix.size();
+        iovecs[a * 2 + 1].iov_base = (void*)packet.data();
+        iovecs[a * 2 + 1].iov_len = packet.size();
+        memset(&headers[a], 0, sizeof(mmsghdr));
+        headers[a].msg_hdr.msg_name = (void*)destination.data();
+        headers[a].msg_hdr.msg_namelen = socklen_t(destination.size());
+        headers[a].msg_hdr.msg_iov = &iovecs[a * 2];
+        headers[a].msg_hdr.msg_iovlen = 2;
+      }
+      int sent = sendmmsg(socket.native_handle(), headers.data(),
+                          (unsigned int)batch, 0);
+      syscalls++;
+      if (sent < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+          // Nothing more fits right now, the rest goes back to the caller
+          if (unsent != NULL) {
+            unsent->insert(unsent->end(), packets.begin() + next,
+                           packets.end());
+          } else {
+            LOG(ERROR) << "Dropping " << (packets.size() - next)
+                       << " packets, the send buffer is full";
+          }
+          break;
+        }
+        LOG(ERROR) << "Got error trying to send: " << strerror(errno);
+        if (errno != EMSGSIZE) {
+          // The socket or the destination is bad, the rest would fail too
+          break;
+        }
+        // Only the first datagram is at fault, skip it
+        sent = 1;
+      }
+      next += sent;
+    }
+    return syscalls;
+  }
+#endif
+  for (size_t a = 0; a < packets.size(); a++) {
+    array<asio::const_buffer, 2> buffers = {asio::buffer(prefix),
+                                            packets[a]->asBuffer()};
+    syscalls++;
+    asio::error_code error;
+    socket.send_to(buffers, destination, 0, error);
+    if (error == asio::error::would_block && unsent != NULL) {
+      unsent->insert(unsent->end(), packets.begin() + a, packets.end());
+      break;
+    }
+    if (error) {
+      LOG(ERROR) << "Got error trying to send: " << error.message();
+    }
+  }
+  return syscalls;
+}
+
+DatagramReceiveRing::DatagramReceiveRing()
+    : slots(size_t(BATCH_SIZE) * SLOT_SIZE) {
+#ifdef __linux__
+  iovecs.resize(BATCH_SIZE);
+  addresses.resize(BATCH_SIZE);
+  headers.resize(BATCH_SIZE);
+  for (int a = 0; a < BATCH_SIZE; a++) {
+    iovecs[a].iov_base = &slots[size_t(a) * SLOT_SIZE];
+    iovecs[a].iov_len = SLOT_SIZE;
+  }
+#endif
+}
+
+int DatagramReceiveRing::drain(udp::socket& socket, const Handler& handler) {
+  int syscalls = 0;
+#ifdef __linux__
+  for (int batch = 0; batch < MAX_BATCHES_PER_DRAIN; batch++) {
+    // recvmmsg writes the lengths back, so the headers are reset each time
+    for (int a = 0; a < BATCH_SIZE; a++) {
+      memset(&headers[a], 0, sizeof(mmsghdr));
+      headers[a].msg_hdr.msg_name = &addresses[a];
+      headers[a].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+      headers[a].msg_hdr.msg_iov = &iovecs[a];
+      headers[a].msg_hdr.msg_iovlen = 1;
+    }
+    int received = recvmmsg(socket.native_handle(), headers.data(),
+                            BATCH_SIZE, MSG_DONTWAIT, NULL);
+    syscalls++;
+    if (received < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG(ERROR) << "Got error when trying to receive packets: "
+                   << strerror(errno);
+      }
+      break;
+    }
+    for (int a = 0; a < received; a++) {
+      const msghdr& message = headers[a].msg_hdr;
+      if (message.msg_flags & MSG_TRUNC) {
+        VLOG(1) << "Dropping truncated datagram";
+        continue;
+      }
+      udp::endpoint from;
+      memcpy(from.data(), &addresses[a], message.msg_namelen);
+      from.resize(message.msg_namelen);
+      handler((const char*)iovecs[a].iov_base, headers[a].msg_len, from);
+    }
+    if (received < BATCH_SIZE) {
+      // The socket is empty, no need to ask again to find out
+      break;
+    }
+  }
+#else
+  asio::error_code error;
+  for (int a = 0; a < BATCH_SIZE * MAX_BATCHES_PER_DRAIN; a++) {
+    if (!socket.available(error) || error) {
+      break;
+    }
+    udp::endpoint from;
+    size_t size =
+        socket.receive_from(asio::buffer(slots.data(), SLOT_SIZE), from, 0,
+                            error);
+    syscalls++;
+    if (error) {
+      LOG(ERROR) << "Got error when trying to receive packets: "
+                 << error.message();
+      break;
+    }
+    handler(slots.data(), size, from);
+  }
+#endif
+  return syscalls;
+}
+}  // namespace wga
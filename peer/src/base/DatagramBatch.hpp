@@ -0,0 +1,65 @@
+#ifndef __DATAGRAM_BATCH_H__
+#define __DATAGRAM_BATCH_H__
+
+#include "Headers.hpp"
+#include "PacketBuffer.hpp"
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
+namespace wga {
+// Moves datagrams with sendmmsg/recvmmsg, many per system call, instead of
+// one send_to/receive_from each.  Only on Linux, elsewhere this has no
+// effect.
+extern bool ENABLE_BATCHED_IO;
+
+inline bool useBatchedIo() {
+#ifdef __linux__
+  return ENABLE_BATCHED_IO;
+#else
+  return false;
+#endif
+}
+
+// Sends the packets to one destination, each with prefix in front of it.
+// Batches them when useBatchedIo() says so.  If the socket's send buffer
+// fills up, stops and leaves the packets that didn't go out, in order, in
+// unsent so they can follow once the socket is writable.  Returns the
+// number of system calls it took.
+int sendDatagramBatch(udp::socket& socket, const udp::endpoint& destination,
+                      const string& prefix,
+                      const vector<PacketBufferPtr>& packets,
+                      vector<PacketBufferPtr>* unsent = NULL);
+
+// Drains a socket into a ring of receive buffers, BATCH_SIZE datagrams per
+// recvmmsg.  Meant to run when the socket is readable, it never blocks.
+class DatagramReceiveRing {
+ public:
+  typedef function<void(const char* data, size_t size,
+                        const udp::endpoint& from)>
+      Handler;
+
+  DatagramReceiveRing();
+
+  // Hands every waiting datagram to handler, up to MAX_BATCHES_PER_DRAIN
+  // batches so one busy socket can't starve the io thread.  Returns the
+  // number of system calls it took.
+  int drain(udp::socket& socket, const Handler& handler);
+
+  constexpr static int BATCH_SIZE = 32;
+  // Big enough for any datagram
+  constexpr static size_t SLOT_SIZE = 64 * 1024;
+  constexpr static int MAX_BATCHES_PER_DRAIN = 8;
+
+ protected:
+  vector<char> slots;
+#ifdef __linux__
+  vector<iovec> iovecs;
+  vector<sockaddr_storage> addresses;
+  vector<mmsghdr> headers;
+#endif
+};
+}  // namespace wga
+
+#endif  // __DATAGRAM_BATCH_H__
@@ -1,19 +1,53 @@
 #include "EncryptedMultiEndpointHandler.hpp"
 
+// Most of the dictionary we build from primed words.  Matches can only
+// reach back 64k, and the newest words go at the end where they are closest.
+#define MAX_DICTIONARY_SIZE (16 * 1024)
+// How long a resumed session waits for the other side's half (microseconds)
+#define RESUME_TIMEOUT (5 * 1000 * 1000)
+
 namespace wga {
+bool ENABLE_CONNECTION_IDS = true;
+bool ENABLE_PACKET_ENCRYPTION = true;
+bool ENABLE_COUNTER_NONCES = true;
+bool ENABLE_SESSION_RESUMPTION = true;
+
 EncryptedMultiEndpointHandler::EncryptedMultiEndpointHandler(
     shared_ptr<udp::socket> _localSocket, shared_ptr<NetEngine> _netEngine,
     shared_ptr<CryptoHandler> _cryptoHandler,
     const vector<udp::endpoint>& endpoints,
     bool connectedToHost)
     : MultiEndpointHandler(_netEngine, _localSocket, endpoints, connectedToHost),
-      cryptoHandler(_cryptoHandler) {
+      cryptoHandler(_cryptoHandler),
+      myCapabilities(getLocalCapabilities()),
+      localConnectionId(0),
+      remoteConnectionId(0),
+      sharedCapabilities(0),
+      compressionEnabled(false),
+      packetEncryptionEnabled(false),
+      dictionaryChanged(false),
+      nextDictionaryId(1),
+      pendingDictionaryId(0),
+      resumedSession(false),
+      resumeStartTime(0),
+      ticketIssued(false) {
+  packetPrefix = WGA_MAGIC;
   if (cryptoHandler->canDecrypt() || cryptoHandler->canEncrypt()) {
     LOGFATAL << "Created endpoint handler with session key";
   }
 }
 
+EncryptedMultiEndpointHandler::~EncryptedMultiEndpointHandler() {
+  if (ticketIssued) {
+    // The next session picks up the clock where this one left it
+    SessionTicketCache::updateClockState(cryptoHandler->getMyPublicKey(),
+                                         cryptoHandler->getOtherPublicKey(),
+                                         clockSynchronizer.getState());
+  }
+}
+
 void EncryptedMultiEndpointHandler::sendSessionKey() {
+  lock_guard<recursive_mutex> guard(mutex);
   // Send session key as a one-way rpc
   {
     IdPayload idPayload;
@@ -23,22 +57,332 @@ void EncryptedMultiEndpointHandler::sendSessionKey() {
         CryptoHandler::keyToString(cryptoHandler->getMyPublicKey()));
     writer.writePrimitive(CryptoHandler::keyToString(
         cryptoHandler->generateOutgoingSessionKey()));
+    // Older peers stop reading after the key, so this is safe to append
+    writer.writePrimitive(myCapabilities);
+    writer.writePrimitive(localConnectionId);
     idPayload.payload = writer.finish();
     VLOG(1) << idPayload.payload;
     idPayload.id = SESSION_KEY_RPCID;
     oneWayRequests.insert(idPayload.id);
-    MultiEndpointHandler::requestWithId(idPayload);
+    MultiEndpointHandler::requestWithId(idPayload, CONTROL_STREAM);
+  }
+  issueSessionTicket();
+}
+
+bool EncryptedMultiEndpointHandler::resumeSession() {
+  lock_guard<recursive_mutex> guard(mutex);
+  if (!ENABLE_SESSION_RESUMPTION || !ENABLE_PACKET_ENCRYPTION) {
+    return false;
+  }
+  if (cryptoHandler->canEncrypt()) {
+    LOGFATAL << "Tried to resume a session that already started";
+  }
+  if (!resumeTicket) {
+    // Unless the other side's resumption already took it out
+    resumeTicket = SessionTicketCache::take(cryptoHandler->getMyPublicKey(),
+                                            cryptoHandler->getOtherPublicKey());
+    if (!resumeTicket) {
+      return false;
+    }
+  }
+  Nonce nonce;
+  randombytes_buf(nonce.data(), nonce.size());
+  cryptoHandler->resumeOutgoingSessionKey(resumeTicket->secret, nonce);
+  resumedSession = true;
+  resumeStartTime = monotonicTimeMicros();
+  // Sealed from the first packet on, the way the last session agreed.  The
+  // other side's capabilities are applied when its half arrives.
+  applyCapabilities(resumeTicket->capabilities);
+  clockSynchronizer.restoreState(resumeTicket->clockState);
+
+  IdPayload idPayload;
+  MessageWriter writer;
+  writer.start();
+  writer.writePrimitive(
+      CryptoHandler::keyToString(cryptoHandler->getMyPublicKey()));
+  writer.writePrimitive(CryptoHandler::getTicketId(resumeTicket->secret));
+  writer.writePrimitive(CryptoHandler::keyToString(nonce));
+  writer.writePrimitive(myCapabilities);
+  writer.writePrimitive(localConnectionId);
+  idPayload.payload = writer.finish();
+  idPayload.id = RESUME_SESSION_RPCID;
+  oneWayRequests.insert(idPayload.id);
+  MultiEndpointHandler::requestWithId(idPayload, CONTROL_STREAM);
+  LOG(INFO) << "Resuming session";
+
+  if (cryptoHandler->canDecrypt()) {
+    // Their resumption came first and couldn't be answered until now
+    answerResumption();
+  }
+  issueSessionTicket();
+  return true;
+}
+
+void EncryptedMultiEndpointHandler::receiveResumption(
+    const IdPayload& idPayload) {
+  if (!cryptoHandler->canDecrypt()) {
+    MessageReader reader;
+    reader.load(idPayload.payload);
+    PublicKey publicKey =
+        CryptoHandler::stringToKey<PublicKey>(reader.readPrimitive<string>());
+    if (publicKey != cryptoHandler->getOtherPublicKey()) {
+      LOG(ERROR) << "Somehow got the wrong public key: "
+                 << CryptoHandler::keyToString(publicKey) << " != "
+                 << CryptoHandler::keyToString(
+                        cryptoHandler->getOtherPublicKey());
+      return;
+    }
+    string ticketId = reader.readPrimitive<string>();
+    Nonce nonce =
+        CryptoHandler::stringToKey<Nonce>(reader.readPrimitive<string>());
+    uint32_t otherCapabilities = reader.readPrimitive<uint32_t>();
+    uint32_t otherConnectionId = reader.readPrimitive<uint32_t>();
+    if (cryptoHandler->canEncrypt() && !resumedSession) {
+      // Our session key is out, they fall back when it arrives
+      LOG(INFO) << "Ignoring resumption, we already sent a session key";
+      return;
+    }
+    // Nothing authenticates this yet, so a ticket id we don't have changes
+    // nothing.  If they really can't resume, they send their session key,
+    // or we give up on them in checkTimeouts().
+    if (!resumeTicket) {
+      resumeTicket =
+          SessionTicketCache::take(cryptoHandler->getMyPublicKey(),
+                                   cryptoHandler->getOtherPublicKey(), ticketId);
+      if (!resumeTicket) {
+        LOG(INFO) << "Can't resume the session, no ticket with that id";
+        return;
+      }
+    } else if (CryptoHandler::getTicketId(resumeTicket->secret) != ticketId) {
+      LOG(INFO) << "Can't resume the session, we hold a different ticket";
+      return;
+    }
+    cryptoHandler->resumeIncomingSessionKey(resumeTicket->secret, nonce);
+    remoteConnectionId = otherConnectionId;
+    applyCapabilities(otherCapabilities);
+    clockSynchronizer.restoreState(resumeTicket->clockState);
+    issueSessionTicket();
+  }
+  if (cryptoHandler->canEncrypt()) {
+    answerResumption();
+  }
+}
+
+void EncryptedMultiEndpointHandler::answerResumption() {
+  // Both halves are in, so a session key from here on is a stale one
+  resumeTicket.reset();
+  if (isProcessed(REQUEST, RESUME_SESSION_RPCID)) {
+    return;
+  }
+  // The answer is sealed, so this waits until we have our own key
+  MultiEndpointHandler::addIncomingRequest(
+      IdPayload(RESUME_SESSION_RPCID, ""));
+  reply(RESUME_SESSION_RPCID, "OK");
+}
+
+void EncryptedMultiEndpointHandler::fallBackToHandshake() {
+  LOG(INFO) << "Falling back to a full handshake";
+  bool started = resumedSession;
+  cryptoHandler->clearSessionKeys();
+  resumeTicket.reset();
+  resumedSession = false;
+  ticketIssued = false;
+  // The handshake negotiates these again instead of taking the ticket's word
+  sharedCapabilities = 0;
+  disableSequencedRpcIds();
+  compressionEnabled = false;
+  disableForwardErrorCorrection();
+  packetEncryptionEnabled = false;
+  remoteConnectionId = 0;
+  packetPrefix = WGA_MAGIC;
+  if (started) {
+    // What we sent is resealed with the new key when it is resent
+    sendSessionKey();
+  }
+}
+
+void EncryptedMultiEndpointHandler::checkTimeouts(int64_t now) {
+  if (resumedSession && resumeTicket &&
+      now - resumeStartTime > RESUME_TIMEOUT) {
+    LOG(INFO) << "The other side never resumed";
+    fallBackToHandshake();
+  }
+}
+
+void EncryptedMultiEndpointHandler::issueSessionTicket() {
+  if (!ENABLE_SESSION_RESUMPTION || ticketIssued || !packetEncryptionEnabled ||
+      !cryptoHandler->canEncrypt() || !cryptoHandler->canDecrypt()) {
+    return;
+  }
+  ticketIssued = true;
+  SessionTicket ticket;
+  ticket.secret = cryptoHandler->getResumptionSecret();
+  ticket.capabilities = sharedCapabilities;
+  ticket.clockState = clockSynchronizer.getState();
+  SessionTicketCache::store(cryptoHandler->getMyPublicKey(),
+                            cryptoHandler->getOtherPublicKey(), ticket);
+}
+
+void EncryptedMultiEndpointHandler::setLocalConnectionId(
+    uint32_t connectionId) {
+  lock_guard<recursive_mutex> guard(mutex);
+  localConnectionId = connectionId;
+  if (ENABLE_CONNECTION_IDS && localConnectionId) {
+    myCapabilities |= CAPABILITY_CONNECTION_IDS;
+  }
+}
+
+uint32_t EncryptedMultiEndpointHandler::getLocalCapabilities() {
+  uint32_t capabilities = 0;
+  if (ENABLE_SEQUENCED_RPC_IDS) {
+    capabilities |= CAPABILITY_SEQUENCED_RPC_IDS;
+  }
+  if (ENABLE_PAYLOAD_COMPRESSION) {
+    capabilities |= CAPABILITY_COMPRESSION;
+  }
+  if (ENABLE_FORWARD_ERROR_CORRECTION) {
+    capabilities |= CAPABILITY_FORWARD_ERROR_CORRECTION;
+  }
+  if (ENABLE_PACKET_ENCRYPTION) {
+    capabilities |= CAPABILITY_PACKET_ENCRYPTION;
+    if (ENABLE_COUNTER_NONCES) {
+      capabilities |= CAPABILITY_COUNTER_NONCES;
+    }
+  }
+  return capabilities;
+}
+
+void EncryptedMultiEndpointHandler::applyCapabilities(
+    uint32_t otherCapabilities) {
+  uint32_t shared = myCapabilities & otherCapabilities;
+  sharedCapabilities = shared;
+  LOG(INFO) << "Session capabilities: " << myCapabilities << " & "
+            << otherCapabilities << " = " << shared;
+  if (shared & CAPABILITY_SEQUENCED_RPC_IDS) {
+    // Both sides see the same pair of keys, so this splits the id space
+    uint64_t side =
+        (cryptoHandler->getMyPublicKey() < cryptoHandler->getOtherPublicKey())
+            ? 0
+            : 1;
+    enableSequencedRpcIds(side);
+  }
+  if (shared & CAPABILITY_COMPRESSION) {
+    // Every payload after the handshake starts with its encoding
+    compressionEnabled = true;
+  }
+  if (shared & CAPABILITY_FORWARD_ERROR_CORRECTION) {
+    // Parity only goes out once losses show up
+    enableForwardErrorCorrection();
+  }
+  if ((shared & CAPABILITY_CONNECTION_IDS) && remoteConnectionId) {
+    packetPrefix = makeConnectionIdPrefix(remoteConnectionId);
+  }
+  if (shared & CAPABILITY_PACKET_ENCRYPTION) {
+    // Nothing was encrypted before this, we couldn't until now
+    packetEncryptionEnabled = true;
+    if (shared & CAPABILITY_COUNTER_NONCES) {
+      // Sealed packets are never resent as they are, so a repeat is a
+      // replay
+      cryptoHandler->enableCounterNonces();
+    }
+  }
+}
+
+void EncryptedMultiEndpointHandler::primeCompressionDictionary(
+    const vector<string>& words) {
+  lock_guard<recursive_mutex> guard(mutex);
+  for (const auto& it : words) {
+    if (dictionaryWordSet.insert(it).second) {
+      dictionaryWords.push_back(it);
+      dictionaryChanged = true;
+    }
+  }
+}
+
+string EncryptedMultiEndpointHandler::buildDictionary() {
+  string dictionary;
+  for (auto it = dictionaryWords.rbegin(); it != dictionaryWords.rend();
+       it++) {
+    if (dictionary.size() + it->size() > MAX_DICTIONARY_SIZE) {
+      break;
+    }
+    dictionary = *it + dictionary;
+  }
+  return dictionary;
+}
+
+void EncryptedMultiEndpointHandler::sendDictionaryIfChanged() {
+  if (!compressionEnabled || !dictionaryChanged || pendingDictionaryId ||
+      !readyToSend()) {
+    return;
+  }
+  dictionaryChanged = false;
+  pendingDictionaryId = nextDictionaryId++;
+  pendingDictionary = buildDictionary();
+  VLOG(1) << "Sending compression dictionary " << pendingDictionaryId
+          << " with size " << pendingDictionary.size();
+  MessageWriter writer;
+  writer.start();
+  writer.writePrimitive<uint32_t>(pendingDictionaryId);
+  writer.writePrimitive<string>(pendingDictionary);
+  requestWithId(
+      IdPayload(RpcId(onBarrier, DICTIONARY_RPC_ID_TAG | pendingDictionaryId),
+                writer.finish()),
+      CONTROL_STREAM);
+}
+
+string EncryptedMultiEndpointHandler::sealPayload(const string& payload) {
+  if (packetEncryptionEnabled) {
+    return compressionEnabled ? compressor.compress(payload) : payload;
+  }
+  // Room for the nonce and mac is left in front, so the encoded payload is
+  // encrypted where it is
+  string sealed;
+  if (compressionEnabled) {
+    sealed = compressor.compress(payload, CryptoHandler::ENCRYPTION_HEADROOM);
+  } else {
+    sealed.reserve(CryptoHandler::ENCRYPTION_HEADROOM + payload.size());
+    sealed.resize(CryptoHandler::ENCRYPTION_HEADROOM);
+    sealed += payload;
+  }
+  cryptoHandler->encryptInPlace(&sealed);
+  return sealed;
+}
+
+optional<string> EncryptedMultiEndpointHandler::openPayload(
+    const string& payload) {
+  if (packetEncryptionEnabled) {
+    // validatePacket() made sure it came in a sealed packet
+    return decodePayload(payload);
+  }
+  auto decrypted = cryptoHandler->decrypt(payload);
+  if (!decrypted) {
+    return nullopt;
+  }
+  return decodePayload(*decrypted);
+}
+
+optional<string> EncryptedMultiEndpointHandler::decodePayload(
+    const string& payload) {
+  if (!compressionEnabled) {
+    return payload;
   }
+  return compressor.decompress(payload);
 }
 
-void EncryptedMultiEndpointHandler::requestWithId(const IdPayload& idPayload) {
+bool EncryptedMultiEndpointHandler::requestWithId(const IdPayload& idPayload,
+                                                  uint32_t stream) {
+  lock_guard<recursive_mutex> guard(mutex);
   if (!readyToSend()) {
     // These are heartbeats that can't go out yet
     LOGFATAL << "Tried to send data before we were ready: " << readyToReceive();
   }
+  // A new dictionary goes out first, so the other side gets it as soon as
+  // possible
+  sendDictionaryIfChanged();
   IdPayload encryptedIdPayload =
-      IdPayload(idPayload.id, cryptoHandler->encrypt(idPayload.payload));
-  MultiEndpointHandler::requestWithId(encryptedIdPayload);
+      IdPayload(idPayload.id, sealPayload(idPayload.payload));
+  return MultiEndpointHandler::requestWithId(encryptedIdPayload, stream);
 }
 
 void EncryptedMultiEndpointHandler::reply(const RpcId& rpcId,
@@ -49,7 +393,7 @@ void EncryptedMultiEndpointHandler::reply(const RpcId& rpcId,
     LOGFATAL << "Got reply before we were ready, something went wrong "
              << readyToReceive();
   }
-  string encryptedPayload = cryptoHandler->encrypt(payload);
+  string encryptedPayload = sealPayload(payload);
   MultiEndpointHandler::reply(rpcId, encryptedPayload);
 }
 
@@ -59,10 +403,6 @@ void EncryptedMultiEndpointHandler::addIncomingRequest(
   if (idPayload.id == SESSION_KEY_RPCID) {
     // Handshaking
     LOG(INFO) << "GOT HANDSHAKE";
-    if (cryptoHandler->canDecrypt()) {
-      LOG(WARNING) << "We already got the key, skipping request";
-      return;
-    }
     MessageReader reader;
     reader.load(idPayload.payload);
     PublicKey publicKey =
@@ -77,27 +417,59 @@ void EncryptedMultiEndpointHandler::addIncomingRequest(
     EncryptedSessionKey encryptedSessionKey =
         CryptoHandler::stringToKey<EncryptedSessionKey>(
             reader.readPrimitive<string>());
-    bool result = cryptoHandler->receiveIncomingSessionKey(encryptedSessionKey);
-    if (!result) {
+    if (!cryptoHandler->checkIncomingSessionKey(encryptedSessionKey)) {
       LOG(ERROR) << "Invalid session key";
       return;
     }
+    if (resumeTicket) {
+      // They couldn't resume, so neither can we
+      fallBackToHandshake();
+    }
+    if (cryptoHandler->canDecrypt()) {
+      LOG(WARNING) << "We already got the key, skipping request";
+      return;
+    }
+    cryptoHandler->receiveIncomingSessionKey(encryptedSessionKey);
+    uint32_t otherCapabilities = 0;
+    if (reader.sizeRemaining()) {
+      otherCapabilities = reader.readPrimitive<uint32_t>();
+    }
+    if (reader.sizeRemaining()) {
+      remoteConnectionId = reader.readPrimitive<uint32_t>();
+    }
+    applyCapabilities(otherCapabilities);
+    issueSessionTicket();
     MultiEndpointHandler::addIncomingRequest(idPayload);
     reply(idPayload.id, "OK");
     return;
   }
+  if (idPayload.id == RESUME_SESSION_RPCID) {
+    receiveResumption(idPayload);
+    return;
+  }
 
   if (!readyToReceive()) {
     LOG(INFO) << "Tried to receive data before we were ready";
     return;
   }
-  auto decryptedString = cryptoHandler->decrypt(idPayload.payload);
+  auto decryptedString = openPayload(idPayload.payload);
   if (!decryptedString) {
     // Corrupt message, ignore
     VLOG(1) << "Got a corrupt packet: " << idPayload.payload;
     return;
   }
   IdPayload decryptedIdPayload = IdPayload(idPayload.id, *decryptedString);
+  if (isDictionaryRpcId(idPayload.id)) {
+    MessageReader reader;
+    reader.load(decryptedIdPayload.payload);
+    uint32_t dictionaryId = reader.readPrimitive<uint32_t>();
+    compressor.addIncomingDictionary(dictionaryId,
+                                     reader.readPrimitive<string>());
+    VLOG(1) << "Got compression dictionary " << dictionaryId;
+    MultiEndpointHandler::addIncomingRequest(decryptedIdPayload);
+    reply(idPayload.id, "OK");
+    return;
+  }
   VLOG(1) << "GOT REQUEST WITH PAYLOAD SIZE: "
           << decryptedIdPayload.payload.length();
   MultiEndpointHandler::addIncomingRequest(decryptedIdPayload);
@@ -110,43 +482,143 @@ void EncryptedMultiEndpointHandler::addIncomingReply(const RpcId& uid,
     LOG(ERROR) << "Got reply before we were ready, something went wrong";
     return;
   }
-  auto decryptedPayload = cryptoHandler->decrypt(payload);
+  auto decryptedPayload = openPayload(payload);
   if (!decryptedPayload) {
     LOG(ERROR) << "Got corrupt packet";
     return;
   }
+  if (isDictionaryRpcId(uid)) {
+    // The other side has our dictionary, start compressing with it
+    if (uint32_t(uid.id) == pendingDictionaryId) {
+      compressor.setOutgoingDictionary(pendingDictionaryId, pendingDictionary);
+      pendingDictionaryId = 0;
+      pendingDictionary.clear();
+    }
+    return;
+  }
   VLOG(1) << "GOT REPLY WITH PAYLOAD SIZE: " << decryptedPayload->length();
   MultiEndpointHandler::addIncomingReply(uid, *decryptedPayload);
 }
 
-void EncryptedMultiEndpointHandler::sendAcknowledge(const RpcId& uid) {
+void EncryptedMultiEndpointHandler::queueUnreliable(
+    const UnreliableMessage& message) {
+  if (!readyToSend()) {
+    // Nobody is waiting on it, so it isn't worth failing over
+    VLOG(1) << "Dropping unreliable message sent before the handshake";
+    return;
+  }
+  UnreliableMessage encryptedMessage = message;
+  encryptedMessage.payload = sealPayload(message.payload);
+  MultiEndpointHandler::queueUnreliable(encryptedMessage);
+}
+
+void EncryptedMultiEndpointHandler::addIncomingUnreliable(
+    const UnreliableMessage& message) {
+  auto decryptedPayload = openPayload(message.payload);
+  if (!decryptedPayload) {
+    LOG(ERROR) << "Got corrupt packet";
+    return;
+  }
+  UnreliableMessage decryptedMessage = message;
+  decryptedMessage.payload = *decryptedPayload;
+  MultiEndpointHandler::addIncomingUnreliable(decryptedMessage);
+}
+
+void EncryptedMultiEndpointHandler::sendAcknowledge() {
+  if (!cryptoHandler->canEncrypt()) {
+    // The ack will ride along with the first packet we can send
+    return;
+  }
+  if (packetEncryptionEnabled) {
+    // Sealed with the rest of the packet
+    MultiEndpointHandler::sendAcknowledge();
+    return;
+  }
+  auto packet = PacketBufferPool::acquire();
   MessageWriter writer;
-  writer.start();
+  writer.start(packet.get());
   writer.writePrimitive<unsigned char>(ACKNOWLEDGE);
-  writer.writeClass<RpcId>(uid);
+  writeAcknowledgeFrame(writer);
   writer.writePrimitive<string>(cryptoHandler->encrypt("ACK_OK"));
-  send(writer.finish());
+  onPacketSent(int64_t(packet->size()) + getPacketOverhead(), false);
+  send(packet);
 }
 
-void EncryptedMultiEndpointHandler::send(const string& message) {
-  string header = WGA_MAGIC;
-  string messageWithHeader = header + message;
-  MultiEndpointHandler::send(messageWithHeader);
+bool EncryptedMultiEndpointHandler::validatePacket(RpcHeader type,
+                                                   const RpcId& rpcId,
+                                                   const string& payload) {
+  if (processingSealedPacket) {
+    // Authenticated when the packet was opened
+    return true;
+  }
+  if (type == REQUEST && IS_HANDSHAKE_RPCID(rpcId)) {
+    return true;
+  }
+  if (type == ACKNOWLEDGE) {
+    // Acks from before the other side could seal.  Before we have the key
+    // there is nothing to check them against.
+    if (!cryptoHandler->canDecrypt()) {
+      return true;
+    }
+    bool result = bool(cryptoHandler->decrypt(payload));
+    if (!result) {
+      LOG(WARNING) << "Got an ack intended for someone else (or malformed)";
+    }
+    return result;
+  }
+  if (packetEncryptionEnabled) {
+    // Payloads aren't encrypted on their own anymore, so anything else in
+    // the clear is forged
+    LOG(WARNING) << "Got an unsealed frame after sealing was negotiated";
+    return false;
+  }
+  // Payloads are authenticated when they are decrypted
+  return true;
 }
 
-bool EncryptedMultiEndpointHandler::validatePacket(const RpcId& rpcId,
-                                                   const string& payload) {
-  if (rpcId == SESSION_KEY_RPCID) {
+bool EncryptedMultiEndpointHandler::sealPacket(PacketBuffer* packet) {
+  if (!packetEncryptionEnabled || !cryptoHandler->canEncrypt()) {
+    return false;
+  }
+  size_t length = packet->size();
+  size_t headroom = cryptoHandler->getSealHeadroom();
+  char* start = packet->prepend(headroom);
+  if (netEngine->getCryptoPipeline() != NULL) {
+    // Sealed on the way to the socket, after the SEALED header goes on
+    packet->sealPending = true;
+    packet->sealGeneration = cryptoHandler->getKeyGeneration();
+    packet->sealCounterNonces = cryptoHandler->hasCounterNonces();
     return true;
   }
-  if (!cryptoHandler->canDecrypt()) {
-    LOG(WARNING) << "Tried to validate packet but we can't decrypt yet";
+  cryptoHandler->sealInPlace(start, headroom + length);
+  return true;
+}
+
+bool EncryptedMultiEndpointHandler::finishSealing(PacketBuffer* packet) {
+  if (packet->sealGeneration != cryptoHandler->getKeyGeneration() ||
+      packet->sealCounterNonces != cryptoHandler->hasCounterNonces() ||
+      !cryptoHandler->canEncrypt()) {
+    // We fell back to a handshake while it waited, what it carried is
+    // resent with the new keys
+    VLOG(1) << "Dropping a packet sealed for old keys";
     return false;
   }
-  bool result = bool(cryptoHandler->decrypt(payload));
-  if (!result) {
-    LOG(WARNING) << "Got a packet intended for someone else (or malformed)";
+  // Everything after the SEALED header
+  cryptoHandler->sealInPlace(packet->data() + 1, packet->size() - 1);
+  return true;
+}
+
+PacketOpenResult EncryptedMultiEndpointHandler::openPacket(const char* sealed,
+                                                           size_t size,
+                                                           string* opened) {
+  if (!cryptoHandler->canDecrypt()) {
+    // Their session key is still on its way
+    return PACKET_UNREADABLE;
+  }
+  bool replayed = false;
+  if (!cryptoHandler->openInto(sealed, size, opened, &replayed)) {
+    return replayed ? PACKET_REPLAYED : PACKET_FORGED;
   }
-  return result;
+  return PACKET_OPENED;
 }
 }  // namespace wga
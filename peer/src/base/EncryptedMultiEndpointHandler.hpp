@@ -1,13 +1,45 @@
 #ifndef __ENCRYPTED_MULTI_ENDPOINT_HANDLER_H__
 #define __ENCRYPTED_MULTI_ENDPOINT_HANDLER_H__
 
+#include "ConnectionId.hpp"
 #include "CryptoHandler.hpp"
 #include "Headers.hpp"
 #include "MultiEndpointHandler.hpp"
 #include "NetEngine.hpp"
+#include "PayloadCompressor.hpp"
 #include "RpcId.hpp"
+#include "SessionTicket.hpp"
 
 namespace wga {
+// Optional features advertised in the session key handshake.  A feature is
+// only used when both sides advertise it.
+enum SessionCapability {
+  CAPABILITY_SEQUENCED_RPC_IDS = 1 << 0,
+  CAPABILITY_COMPRESSION = 1 << 1,
+  CAPABILITY_FORWARD_ERROR_CORRECTION = 1 << 2,
+  CAPABILITY_CONNECTION_IDS = 1 << 3,
+  CAPABILITY_PACKET_ENCRYPTION = 1 << 4,
+  CAPABILITY_COUNTER_NONCES = 1 << 5,
+};
+
+extern bool ENABLE_CONNECTION_IDS;
+// Encrypts whole packets instead of every payload in them
+extern bool ENABLE_PACKET_ENCRYPTION;
+// Seals packets with counter nonces and refuses replayed ones, needs
+// packet encryption
+extern bool ENABLE_COUNTER_NONCES;
+// Keeps a ticket for each finished session, so the next session with that
+// peer can skip the handshake.  Needs packet encryption.
+extern bool ENABLE_SESSION_RESUMPTION;
+
+// Rpcs that hand the other side a new compression dictionary.  The low 32
+// bits are the dictionary id.  Neither random nor sequenced ids ever have
+// the top two bits clear, so these can't collide with normal rpcs.
+#define DICTIONARY_RPC_ID_TAG (1ULL << 32)
+inline bool isDictionaryRpcId(const RpcId& rpcId) {
+  return (rpcId.id >> 32) == 1;
+}
+
 class EncryptedMultiEndpointHandler : public MultiEndpointHandler {
  public:
   EncryptedMultiEndpointHandler(shared_ptr<udp::socket> _localSocket,
@@ -16,10 +48,36 @@ class EncryptedMultiEndpointHandler : public MultiEndpointHandler {
                                 const vector<udp::endpoint>& endpoints,
                                 bool connectedToHost);
 
-  virtual ~EncryptedMultiEndpointHandler() {}
+  virtual ~EncryptedMultiEndpointHandler();
 
   void sendSessionKey();
-  virtual void requestWithId(const IdPayload& idPayload);
+  // Starts the session from the ticket of our last one with this peer
+  // instead of sending a session key.  We can send as soon as this
+  // returns.  Returns false when there is no ticket, then it's up to the
+  // caller to sendSessionKey().  If the other side can't resume, it sends
+  // its session key and we fall back to a full handshake.
+  bool resumeSession();
+
+  // The id the other side puts on datagrams for this connection.  Set by
+  // the multiplexer before the session key goes out, 0 means none.
+  void setLocalConnectionId(uint32_t connectionId);
+  uint32_t getLocalConnectionId() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return localConnectionId;
+  }
+
+  // Adds words that keep showing up in payloads (key names, for example) to
+  // the dictionary used to compress what we send.  The new dictionary goes
+  // to the other side on the control stream and is used once it arrives.
+  void primeCompressionDictionary(const vector<string>& words);
+
+  int64_t getCompressionBytesSaved() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return compressor.getBytesSaved();
+  }
+
+  virtual bool requestWithId(const IdPayload& idPayload,
+                             uint32_t stream = DEFAULT_STREAM);
   virtual void reply(const RpcId& rpcId, const string& payload);
   shared_ptr<CryptoHandler> getCryptoHandler() { return cryptoHandler; }
   virtual bool readyToSend() {
@@ -30,14 +88,29 @@ class EncryptedMultiEndpointHandler : public MultiEndpointHandler {
         return false;
       }
     }
+    if (deliveredRequests.find(SESSION_KEY_RPCID) !=
+        deliveredRequests.end()) {
+      return false;
+    }
     for (const auto& it : outgoingReplies) {
       if (it.first == SESSION_KEY_RPCID) {
         return false;
       }
     }
+    if (resumedSession) {
+      // The other side derives our key from the ticket, no need to wait
+      return cryptoHandler->canEncrypt();
+    }
     return readyToReceive();
   }
 
+  // Opens a datagram that starts with the SEALED header, for receiving it
+  // with receiveOpened().  Called from the crypto pipeline.
+  PacketOpenResult openSealed(const string& message, string* opened) {
+    lock_guard<recursive_mutex> guard(mutex);
+    return openPacket(message.data() + 1, message.size() - 1, opened);
+  }
+
   bool readyToReceive() {
     lock_guard<recursive_mutex> guard(mutex);
     return cryptoHandler->canDecrypt() && cryptoHandler->canEncrypt();
@@ -45,11 +118,67 @@ class EncryptedMultiEndpointHandler : public MultiEndpointHandler {
 
  protected:
   shared_ptr<CryptoHandler> cryptoHandler;
+  uint32_t myCapabilities;
+  uint32_t localConnectionId;
+  // Ours on their side, 0 until negotiated
+  uint32_t remoteConnectionId;
+  uint32_t sharedCapabilities;
+  bool compressionEnabled;
+  // Packets are sealed as a whole and payloads only encoded
+  bool packetEncryptionEnabled;
+  PayloadCompressor compressor;
+  vector<string> dictionaryWords;
+  unordered_set<string> dictionaryWordSet;
+  bool dictionaryChanged;
+  uint32_t nextDictionaryId;
+  // Dictionary sent to the other side and not acknowledged yet (id 0 when
+  // there is none)
+  uint32_t pendingDictionaryId;
+  string pendingDictionary;
+  // Our key came from a ticket.  Cleared if we fall back to a handshake.
+  bool resumedSession;
+  // Ticket we are resuming with, until the other side's half arrives
+  optional<SessionTicket> resumeTicket;
+  // When our half went out, for giving up on theirs
+  int64_t resumeStartTime;
+  bool ticketIssued;
+  void receiveResumption(const IdPayload& idPayload);
+  void answerResumption();
+  void fallBackToHandshake();
+  void issueSessionTicket();
+  void sendDictionaryIfChanged();
+  string buildDictionary();
+  // Compresses and encrypts a payload in one buffer.  With packet
+  // encryption the packet is encrypted instead, so this only compresses.
+  string sealPayload(const string& payload);
+  optional<string> openPayload(const string& payload);
+  optional<string> decodePayload(const string& payload);
+  uint32_t getLocalCapabilities();
+  void applyCapabilities(uint32_t otherCapabilities);
   virtual void addIncomingRequest(const IdPayload& idPayload);
   virtual void addIncomingReply(const RpcId& uid, const string& payload);
-  virtual void send(const string& message);
-  virtual void sendAcknowledge(const RpcId& uid);
-  bool validatePacket(const RpcId& rpcId, const string& payload);
+  virtual void queueUnreliable(const UnreliableMessage& message);
+  virtual void addIncomingUnreliable(const UnreliableMessage& message);
+  virtual void sendAcknowledge();
+  virtual bool validatePacket(RpcHeader type, const RpcId& rpcId,
+                              const string& payload);
+  virtual bool sealPacket(PacketBuffer* packet);
+  virtual bool finishSealing(PacketBuffer* packet);
+  virtual PacketOpenResult openPacket(const char* sealed, size_t size,
+                                      string* opened);
+  virtual bool requiresSealedPackets() { return packetEncryptionEnabled; }
+  // Falls back to a handshake when the other side never answers our
+  // resumption.  It may hold a different ticket, and a resumption it can't
+  // read never makes it send its session key.
+  virtual void checkTimeouts(int64_t now);
+  virtual int64_t getPacketOverhead() {
+    int64_t overhead = MultiEndpointHandler::getPacketOverhead();
+    if (packetEncryptionEnabled) {
+      // The SEALED header, nonce and mac
+      overhead += 1 + int64_t(cryptoHandler->getSealHeadroom());
+    }
+    return overhead;
+  }
 };
 }  // namespace wga
 
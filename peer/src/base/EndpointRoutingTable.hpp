@@ -0,0 +1,82 @@
+#ifndef __ENDPOINT_ROUTING_TABLE_H__
+#define __ENDPOINT_ROUTING_TABLE_H__
+
+#include "Headers.hpp"
+
+namespace wga {
+struct EndpointHash {
+  size_t operator()(const udp::endpoint& endpoint) const {
+    // FNV-1a over the raw socket address, which holds the address and port
+    const unsigned char* bytes = (const unsigned char*)endpoint.data();
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t a = 0; a < endpoint.size(); a++) {
+      hash = (hash ^ bytes[a]) * 1099511628211ULL;
+    }
+    return size_t(hash);
+  }
+};
+
+// Maps what a datagram says about where it came from (its endpoint or its
+// connection id) to the connection it belongs to.  Reads are copy-free and never wait on a writer: they take the
+// current snapshot of the map and look the endpoint up in it.  Writers copy
+// the map, change the copy and publish it, which is fine because endpoints
+// come and go a few times per connection.  Routes don't keep connections
+// alive.
+template <typename Key, typename T, typename Hash = std::hash<Key>>
+class RoutingTable {
+ public:
+  typedef unordered_map<Key, weak_ptr<T>, Hash> Routes;
+
+  RoutingTable() : routes(make_shared<const Routes>()) {}
+
+  shared_ptr<T> find(const Key& key) const {
+    shared_ptr<const Routes> snapshot = atomic_load(&routes);
+    auto it = snapshot->find(key);
+    if (it == snapshot->end()) {
+      return shared_ptr<T>();
+    }
+    return it->second.lock();
+  }
+
+  // The first connection to claim a key keeps it while it is alive.
+  // Returns false if someone else has it.
+  bool add(const Key& key, const shared_ptr<T>& owner) {
+    lock_guard<mutex> guard(writeMutex);
+    auto it = routes->find(key);
+    if (it != routes->end()) {
+      shared_ptr<T> current = it->second.lock();
+      if (current) {
+        return current == owner;
+      }
+    }
+    auto next = make_shared<Routes>(*routes);
+    (*next)[key] = owner;
+    atomic_store(&routes, shared_ptr<const Routes>(next));
+    return true;
+  }
+
+  // Only removes the route if it leads to owner
+  void remove(const Key& key, const T* owner) {
+    lock_guard<mutex> guard(writeMutex);
+    auto it = routes->find(key);
+    if (it == routes->end() || it->second.lock().get() != owner) {
+      return;
+    }
+    auto next = make_shared<Routes>(*routes);
+    next->erase(key);
+    atomic_store(&routes, shared_ptr<const Routes>(next));
+  }
+
+  size_t size() const { return atomic_load(&routes)->size(); }
+
+ protected:
+  // Serializes writers, readers never take it
+  mutex writeMutex;
+  shared_ptr<const Routes> routes;
+};
+
+template <typename T>
+using EndpointRoutingTable = RoutingTable<udp::endpoint, T, EndpointHash>;
+}  // namespace wga
+
+#endif  // __ENDPOINT_ROUTING_TABLE_H__
@@ -0,0 +1,235 @@
+#ifndef __FORWARD_ERROR_CORRECTION_H__
+#define __FORWARD_ERROR_CORRECTION_H__
+
+#include "AckBitmap.hpp"
+#include "Headers.hpp"
+#include "LossEstimator.hpp"
+
+namespace wga {
+// The XOR of a group of data packets, padded to the longest one.  Any one
+// packet of the group can be rebuilt from the parity and the others.
+class ParityGroup {
+ public:
+  ParityGroup() : firstPacketNumber(0), lengthXor(0), count(0) {}
+
+  uint64_t firstPacketNumber;
+  // How far each packet after the first is from it, one byte each
+  string offsets;
+  uint32_t lengthXor;
+  string bytes;
+  int count;
+
+  // Returns false if the packet is too far from the first to be described
+  bool add(uint64_t packetNumber, const char* packet, size_t length) {
+    if (count == 0) {
+      firstPacketNumber = packetNumber;
+    } else {
+      uint64_t offset = packetNumber - firstPacketNumber;
+      if (packetNumber <= firstPacketNumber || offset > 255) {
+        return false;
+      }
+      offsets += char(offset);
+    }
+    count++;
+    lengthXor ^= uint32_t(length);
+    xorInto(packet, length);
+    return true;
+  }
+
+  bool add(uint64_t packetNumber, const string& packet) {
+    return add(packetNumber, packet.data(), packet.size());
+  }
+
+  vector<uint64_t> getPacketNumbers() const {
+    vector<uint64_t> packetNumbers = {firstPacketNumber};
+    for (unsigned char offset : offsets) {
+      packetNumbers.push_back(firstPacketNumber + offset);
+    }
+    return packetNumbers;
+  }
+
+  void xorInto(const char* packet, size_t length) {
+    if (bytes.size() < length) {
+      bytes.resize(length, '\0');
+    }
+    for (size_t a = 0; a < length; a++) {
+      bytes[a] ^= packet[a];
+    }
+  }
+};
+
+// Builds parity packets over the data packets we send.  Consecutive packets
+// go to depth interleaved groups, so a burst of up to depth losses costs
+// each group at most one packet.  A group closes after groupSize packets,
+// which makes the overhead one parity packet per groupSize data packets.
+// Group size 0 turns parity off.
+class ParityEncoder {
+ public:
+  ParityEncoder()
+      : groupSize(0), depth(1), nextLane(0), relaxOutcomes(0) {}
+
+  bool enabled() const { return groupSize > 0; }
+  int getGroupSize() const { return groupSize; }
+  int getDepth() const { return depth; }
+
+  void configure(int _groupSize, int _depth) {
+    groupSize = _groupSize;
+    depth = max(1, _depth);
+    // Open groups are dropped, their packets go unprotected
+    lanes.assign(depth, ParityGroup());
+    nextLane = 0;
+  }
+
+  // Fills parity and returns true when the packet closes a group
+  bool add(uint64_t packetNumber, const char* packet, size_t length,
+           ParityGroup* parity) {
+    if (!groupSize) {
+      return false;
+    }
+    ParityGroup& lane = lanes[nextLane];
+    nextLane = (nextLane + 1) % depth;
+    if (!lane.add(packetNumber, packet, length)) {
+      lane = ParityGroup();
+      lane.add(packetNumber, packet, length);
+    }
+    if (lane.count < groupSize) {
+      return false;
+    }
+    *parity = lane;
+    lane = ParityGroup();
+    return true;
+  }
+
+  bool add(uint64_t packetNumber, const string& packet, ParityGroup* parity) {
+    return add(packetNumber, packet.data(), packet.size(), parity);
+  }
+
+  // Picks the redundancy for the measured loss.  The other side reports the
+  // packets parity rebuilt, so they still count as lost here.  Redundancy
+  // is added as soon as losses show up, and taken away one step at a time
+  // after RELAX_OUTCOMES packets go by.
+  void adapt(const LossEstimator& loss) {
+    int wantedSize = 0;
+    if (loss.getLossRate() >= MIN_LOSS_RATE) {
+      wantedSize = min(MAX_GROUP_SIZE,
+                       max(MIN_GROUP_SIZE, int(GROUP_LOSS_TARGET /
+                                               loss.getLossRate())));
+    }
+    int wantedDepth = min(
+        MAX_DEPTH, max(1, int(lround(loss.getMeanBurstLength()))));
+    if (wantedSize &&
+        (!groupSize || wantedSize < groupSize || wantedDepth > depth)) {
+      if (groupSize) {
+        configure(min(groupSize, wantedSize), max(depth, wantedDepth));
+      } else {
+        configure(wantedSize, wantedDepth);
+      }
+      relaxOutcomes = loss.getOutcomes();
+      return;
+    }
+    if (!groupSize || loss.getOutcomes() - relaxOutcomes < RELAX_OUTCOMES) {
+      return;
+    }
+    relaxOutcomes = loss.getOutcomes();
+    if (groupSize < MAX_GROUP_SIZE) {
+      configure(groupSize + 1, max(wantedDepth, depth - 1));
+    } else if (!wantedSize) {
+      configure(0, 1);
+    }
+  }
+
+  constexpr static int MAX_GROUP_SIZE = 16;
+  constexpr static int MAX_DEPTH = 4;
+
+ protected:
+  int groupSize;
+  int depth;
+  vector<ParityGroup> lanes;
+  int nextLane;
+  int64_t relaxOutcomes;
+
+  constexpr static int MIN_GROUP_SIZE = 2;
+  // Below this, resends are cheaper than parity
+  constexpr static double MIN_LOSS_RATE = 0.005;
+  // Expected losses per group.  One is all a group can repair.
+  constexpr static double GROUP_LOSS_TARGET = 0.25;
+  constexpr static int64_t RELAX_OUTCOMES = 256;
+};
+
+// Keeps the data packets we got once the other side sends parity, and
+// rebuilds a missing one when its group's parity shows up.  Nothing is
+// copied until the first parity packet, or once parity stops for longer
+// than maxPackets packets.
+class ParityDecoder {
+ public:
+  ParityDecoder(int _maxPackets)
+      : maxPackets(_maxPackets), active(false), packetsSinceParity(0) {}
+
+  // Starts keeping packets, as a parity packet does
+  void activate() {
+    active = true;
+    packetsSinceParity = 0;
+  }
+
+  bool isActive() const { return active; }
+
+  void addPacket(uint64_t packetNumber, const string& packet) {
+    if (!active) {
+      return;
+    }
+    if (++packetsSinceParity > maxPackets) {
+      // The other side turned parity off
+      active = false;
+      packets.clear();
+      return;
+    }
+    packets[packetNumber] = packet;
+    while (int(packets.size()) > maxPackets) {
+      packets.erase(packets.begin());
+    }
+  }
+
+  // Succeeds when exactly one packet of the group is missing
+  bool recover(const ParityGroup& parity, const AckBitmap& received,
+               uint64_t* packetNumber, string* packet) {
+    activate();
+    if (parity.count == 0) {
+      return false;
+    }
+    int missing = 0;
+    string bytes = parity.bytes;
+    uint32_t length = parity.lengthXor;
+    for (uint64_t it : parity.getPacketNumbers()) {
+      auto packetIt = packets.find(it);
+      if (packetIt != packets.end()) {
+        if (bytes.size() < packetIt->second.size()) {
+          return false;
+        }
+        for (size_t a = 0; a < packetIt->second.size(); a++) {
+          bytes[a] ^= packetIt->second[a];
+        }
+        length ^= uint32_t(packetIt->second.size());
+      } else if (received.contains(it)) {
+        // Got it, but it is no longer kept (or came before parity did)
+        return false;
+      } else {
+        missing++;
+        *packetNumber = it;
+      }
+    }
+    if (missing != 1 || length > bytes.size()) {
+      return false;
+    }
+    *packet = bytes.substr(0, length);
+    return true;
+  }
+
+ protected:
+  int maxPackets;
+  bool active;
+  int packetsSinceParity;
+  map<uint64_t, string> packets;
+};
+}  // namespace wga
+
+#endif  // __FORWARD_ERROR_CORRECTION_H__
@@ -0,0 +1,161 @@
+#ifndef __FRAGMENT_BUFFER_H__
+#define __FRAGMENT_BUFFER_H__
+
+#include "Headers.hpp"
+#include "RpcId.hpp"
+
+namespace wga {
+// A request or reply frame too big for one packet, split into pieces that
+// are acknowledged and resent one at a time.  The frame is kept exactly as
+// it was first written, so a resent piece always matches the others even
+// after the frame is split again at a smaller size.
+class OutgoingFragments {
+ public:
+  OutgoingFragments() : pieceSize(0), remaining(0) {}
+  OutgoingFragments(const string& _frame, int64_t _pieceSize)
+      : frame(_frame) {
+    split(_pieceSize);
+  }
+
+  // Cuts the frame into pieces of at most _pieceSize bytes.  Acks already
+  // received are forgotten, the other side ignores bytes it already has.
+  void split(int64_t _pieceSize) {
+    pieceSize = _pieceSize;
+    offsets.clear();
+    for (size_t offset = 0; offset < frame.size(); offset += pieceSize) {
+      offsets.push_back(uint32_t(offset));
+    }
+    acknowledged.assign(offsets.size(), false);
+    remaining = uint32_t(offsets.size());
+  }
+
+  // Marks every piece inside the acknowledged byte range.  Returns true when
+  // that covered the last piece still missing.
+  bool acknowledge(uint32_t offset, uint32_t length) {
+    if (remaining == 0) {
+      return false;
+    }
+    for (uint32_t a = 0; a < offsets.size(); a++) {
+      if (!acknowledged[a] && offsets[a] >= offset &&
+          getEnd(a) <= uint64_t(offset) + length) {
+        acknowledged[a] = true;
+        remaining--;
+      }
+    }
+    return remaining == 0;
+  }
+
+  uint32_t getCount() const { return uint32_t(offsets.size()); }
+  uint32_t getOffset(uint32_t index) const { return offsets[index]; }
+  string getPiece(uint32_t index) const {
+    return frame.substr(offsets[index], getEnd(index) - offsets[index]);
+  }
+  bool isAcknowledged(uint32_t index) const { return acknowledged[index]; }
+  uint32_t getFrameSize() const { return uint32_t(frame.size()); }
+  int64_t getPieceSize() const { return pieceSize; }
+  bool complete() const { return remaining == 0; }
+
+ protected:
+  string frame;
+  int64_t pieceSize;
+  vector<uint32_t> offsets;
+  vector<bool> acknowledged;
+  uint32_t remaining;
+
+  uint64_t getEnd(uint32_t index) const {
+    return min(uint64_t(frame.size()), uint64_t(offsets[index]) + pieceSize);
+  }
+};
+
+enum FragmentResult {
+  FRAGMENT_STORED = 1,
+  FRAGMENT_COMPLETE = 2,
+  // No room.  The caller must not acknowledge the packet, so the sender
+  // keeps the piece and tries again later.
+  FRAGMENT_REFUSED = 3,
+};
+
+// Puts fragmented frames back together.  Each partial frame reserves its
+// full size when its first piece shows up, and new partial frames are
+// refused once maxBytes are reserved.  Nothing is ever evicted: the pieces
+// we hold were already acknowledged and won't be sent again.
+class FragmentReassembler {
+ public:
+  FragmentReassembler(int64_t _maxBytes)
+      : maxBytes(_maxBytes), reservedBytes(0) {}
+
+  // Fills frame when the piece completes it
+  FragmentResult add(unsigned char type, const RpcId& rpcId, uint32_t offset,
+                     uint32_t frameSize, const string& piece, string* frame) {
+    if (frameSize == 0 || int64_t(frameSize) > maxBytes ||
+        uint64_t(offset) + piece.size() > frameSize) {
+      LOG(ERROR) << "Got invalid fragment at " << offset << " of "
+                 << frameSize;
+      return FRAGMENT_REFUSED;
+    }
+    auto key = make_pair(type, rpcId);
+    auto it = partials.find(key);
+    if (it != partials.end() && it->second.data.size() != frameSize) {
+      LOG(ERROR) << "Fragment sizes don't match for " << rpcId.str();
+      reservedBytes -= it->second.data.size();
+      partials.erase(it);
+      it = partials.end();
+    }
+    if (it == partials.end()) {
+      if (!partials.empty() && reservedBytes + frameSize > maxBytes) {
+        VLOG(1) << "Reassembly buffer full, refusing fragment of "
+                << rpcId.str();
+        return FRAGMENT_REFUSED;
+      }
+      it = partials.insert(make_pair(key, Partial())).first;
+      it->second.data.resize(frameSize);
+      reservedBytes += frameSize;
+    }
+    Partial& partial = it->second;
+    partial.data.replace(offset, piece.size(), piece);
+    partial.addRange(offset, offset + uint32_t(piece.size()));
+    if (partial.covered < frameSize) {
+      return FRAGMENT_STORED;
+    }
+    frame->swap(partial.data);
+    reservedBytes -= frameSize;
+    partials.erase(it);
+    return FRAGMENT_COMPLETE;
+  }
+
+  bool empty() const { return partials.empty(); }
+  int64_t getReservedBytes() const { return reservedBytes; }
+
+ protected:
+  class Partial {
+   public:
+    Partial() : covered(0) {}
+
+    string data;
+    // Byte ranges we have, as start -> end, never overlapping
+    map<uint32_t, uint32_t> ranges;
+    uint32_t covered;
+
+    void addRange(uint32_t start, uint32_t end) {
+      auto it = ranges.upper_bound(start);
+      if (it != ranges.begin() && prev(it)->second >= start) {
+        it--;
+      }
+      while (it != ranges.end() && it->first <= end) {
+        start = min(start, it->first);
+        end = max(end, it->second);
+        covered -= it->second - it->first;
+        it = ranges.erase(it);
+      }
+      ranges[start] = end;
+      covered += end - start;
+    }
+  };
+
+  int64_t maxBytes;
+  int64_t reservedBytes;
+  map<pair<unsigned char, RpcId>, Partial> partials;
+};
+}  // namespace wga
+
+#endif  // __FRAGMENT_BUFFER_H__
@@ -44,11 +44,13 @@
 #include <atomic>
 #include <bitset>
 #include <chrono>
+#include <condition_variable>
 #include <ctime>
 #include <deque>
 #include <exception>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <random>
@@ -158,6 +160,9 @@ static const unsigned char SERVER_CLIENT_NONCE_MSB = 1;
   std::advance(ITERATOR, rand() % COLLECTION.size());
 
 namespace wga {
+// The io threads and the crypto pipeline both order work with these
+typedef asio::io_service::strand Strand;
+
 template <typename Out>
 inline void split(const std::string &s, char delim, Out result) {
   std::stringstream ss;
@@ -223,6 +228,12 @@ std::array<T, N> stringToArray(const V &v) {
 inline void microsleep(int64_t usec) {
   std::this_thread::sleep_for(std::chrono::microseconds(usec));
 }
+
+inline int64_t monotonicTimeMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
 }  // namespace wga
 
 #endif
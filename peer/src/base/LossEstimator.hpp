@@ -0,0 +1,45 @@
+#pragma once
+
+#include "Headers.hpp"
+
+namespace wga {
+// Packet loss rate and mean loss burst length, from the fate of each packet
+// in the order they were sent.  Both are exponentially weighted, so old
+// history fades out.
+class LossEstimator {
+ public:
+  LossEstimator()
+      : lossRate(0), meanBurstLength(1), burstLength(0), outcomes(0) {}
+
+  void addOutcome(bool lost) {
+    outcomes++;
+    lossRate = ((1.0 - ALPHA) * lossRate) + (ALPHA * (lost ? 1.0 : 0.0));
+    if (lost) {
+      burstLength++;
+      return;
+    }
+    if (burstLength) {
+      meanBurstLength = ((1.0 - BURST_ALPHA) * meanBurstLength) +
+                        (BURST_ALPHA * double(burstLength));
+      burstLength = 0;
+    }
+  }
+
+  // A packet already counted as received was really rebuilt from parity.
+  // Its outcome can't be taken back, so the loss goes on top of it.
+  void addRecovery() { lossRate = ((1.0 - ALPHA) * lossRate) + ALPHA; }
+
+  double getLossRate() const { return lossRate; }
+  double getMeanBurstLength() const { return meanBurstLength; }
+  int64_t getOutcomes() const { return outcomes; }
+
+ protected:
+  double lossRate;
+  double meanBurstLength;
+  int burstLength;
+  int64_t outcomes;
+
+  constexpr static double ALPHA = 1.0 / 256.0;
+  constexpr static double BURST_ALPHA = 1.0 / 8.0;
+};
+}  // namespace wga
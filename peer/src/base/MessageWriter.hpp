@@ -2,22 +2,42 @@
 #define __MESSAGE_WRITER_H__
 
 #include "Headers.hpp"
+#include "PacketBuffer.hpp"
 
 namespace wga {
 class MessageWriter {
  public:
-  MessageWriter() : packHandler(buffer) {}
+  MessageWriter() : packHandler(buffer), packet(NULL), packetStart(0) {}
 
-  inline void start() { buffer.clear(); }
+  inline void start() {
+    buffer.clear();
+    packet = NULL;
+  }
+
+  // Packs straight onto the end of the packet until the next start(), so
+  // nothing is copied on the way in
+  inline void start(PacketBuffer* _packet) {
+    buffer.clear();
+    packet = _packet;
+    packetStart = packet->size();
+  }
 
   template <typename T>
   inline void writePrimitive(const T& t) {
-    packHandler.pack(t);
+    if (packet != NULL) {
+      msgpack::packer<PacketBuffer>(*packet).pack(t);
+    } else {
+      packHandler.pack(t);
+    }
   }
 
   template <typename MAP>
   inline void writeMap(const MAP& m) {
-    packHandler.pack_map(uint32_t(m.size()));
+    if (packet != NULL) {
+      msgpack::packer<PacketBuffer>(*packet).pack_map(uint32_t(m.size()));
+    } else {
+      packHandler.pack_map(uint32_t(m.size()));
+    }
     for (auto& it : m) {
       writePrimitive(it.first);
       writePrimitive(it.second);
@@ -44,11 +64,24 @@ class MessageWriter {
     return s;
   }
 
-  inline int64_t size() { return buffer.size(); }
+  // Puts what was written in front of the packet, in its headroom.  Only
+  // for headers, which are written after what they go in front of.
+  inline void finishInFront(PacketBuffer* target) {
+    target->prepend(buffer.data(), buffer.size());
+    start();
+  }
+
+  // Bytes written since start()
+  inline int64_t size() {
+    return packet != NULL ? int64_t(packet->size() - packetStart)
+                          : int64_t(buffer.size());
+  }
 
  protected:
   msgpack::sbuffer buffer;
   msgpack::packer<msgpack::sbuffer> packHandler;
+  PacketBuffer* packet;
+  size_t packetStart;
 };
 }  // namespace wga
 
@@ -28,7 +28,7 @@ void MultiEndpointHandler::handleReply(const RpcId& rpcId,
                                 replySendTime);
 }
 
-void MultiEndpointHandler::send(const string& message) {
+void MultiEndpointHandler::send(const PacketBufferPtr& packet) {
   // LOG(INFO) << "SENDING MESSAGE: " << message;
   lock_guard<recursive_mutex> lock(mutex);
   if (lastUnrepliedSendTime == 0) {
@@ -41,7 +41,7 @@ void MultiEndpointHandler::send(const string& message) {
     update();
   }
 
-  UdpBiDirectionalRpc::send(message);
+  UdpBiDirectionalRpc::send(packet);
   /*
   if (lastUnrepliedSendTime + 5 < time(NULL)) {
     // Send on all channels
@@ -99,6 +99,35 @@ void MultiEndpointHandler::addEndpoints(
   }
 }
 
+void MultiEndpointHandler::setEndpointListener(EndpointListener listener) {
+  lock_guard<recursive_mutex> lock(mutex);
+  endpointListener = listener;
+  if (!endpointListener) {
+    return;
+  }
+  endpointListener(activeEndpoint, true);
+  for (const auto& it : alternativeEndpoints) {
+    endpointListener(it, true);
+  }
+  for (const auto& it : deadEndpoints) {
+    endpointListener(it, true);
+  }
+}
+
+bool MultiEndpointHandler::migrateToEndpoint(const udp::endpoint& endpoint) {
+  lock_guard<recursive_mutex> lock(mutex);
+  if (isEndpointBanned(endpoint)) {
+    return false;
+  }
+  if (activeEndpoint == endpoint) {
+    return true;
+  }
+  LOG(INFO) << "Migrating from endpoint " << activeEndpoint << " to "
+            << endpoint;
+  addEndpoint(endpoint);
+  return hasEndpointAndResurrectIfFound(endpoint);
+}
+
 void MultiEndpointHandler::update() {
   lock_guard<recursive_mutex> lock(mutex);
   if (lastUnrepliedSendTime == 0) {
@@ -116,7 +145,9 @@ void MultiEndpointHandler::update() {
 }
 
 void MultiEndpointHandler::killEndpoint() {
+  lock_guard<recursive_mutex> lock(mutex);
   auto previousEndpoint = activeEndpoint;
+  stats.endpointSwitches++;
   // We haven't got anything back for 5 seconds
   deadEndpoints.insert(activeEndpoint);
   if (!alternativeEndpoints.empty()) {
@@ -140,6 +171,7 @@ void MultiEndpointHandler::killEndpoint() {
 }
 
 void MultiEndpointHandler::banEndpoint(const udp::endpoint& newEndpoint) {
+  lock_guard<recursive_mutex> lock(mutex);
   LOG(INFO) << "Banning endpoint: " << newEndpoint;
   bannedEndpoints.insert(newEndpoint);
   if (activeEndpoint == newEndpoint) {
@@ -157,6 +189,9 @@ void MultiEndpointHandler::banEndpoint(const udp::endpoint& newEndpoint) {
       deadEndpoints.erase(it);
     }
   }
+  if (endpointListener) {
+    endpointListener(newEndpoint, false);
+  }
 }
 
 }  // namespace wga
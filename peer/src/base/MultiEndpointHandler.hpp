@@ -9,6 +9,12 @@
 namespace wga {
 class MultiEndpointHandler : public UdpBiDirectionalRpc {
  public:
+  // Told whenever an endpoint starts (routed) or stops leading to this
+  // connection.  Every endpoint that isn't banned leads here, including dead
+  // ones, since a packet from one resurrects it.
+  typedef function<void(const udp::endpoint& endpoint, bool routed)>
+      EndpointListener;
+
   MultiEndpointHandler(shared_ptr<NetEngine> _netEngine,
                        shared_ptr<udp::socket> _localSocket,
                        const vector<udp::endpoint>& endpoints,
@@ -20,6 +26,7 @@ class MultiEndpointHandler : public UdpBiDirectionalRpc {
   virtual bool hasEndpointAndResurrectIfFound(const udp::endpoint& endpoint);
   void addEndpoints(const vector<udp::endpoint>& newEndpoints);
   void addEndpoint(const udp::endpoint& newEndpoint) {
+    lock_guard<recursive_mutex> guard(mutex);
     if (bannedEndpoints.find(newEndpoint) != bannedEndpoints.end()) {
       return;
     }
@@ -33,9 +40,13 @@ class MultiEndpointHandler : public UdpBiDirectionalRpc {
       return;
     }
     alternativeEndpoints.insert(newEndpoint);
+    if (endpointListener) {
+      endpointListener(newEndpoint, true);
+    }
   }
   void banEndpoint(const udp::endpoint& newEndpoint);
   bool isEndpointBanned(const udp::endpoint& newEndpoint) {
+    lock_guard<recursive_mutex> guard(mutex);
     return bannedEndpoints.find(newEndpoint) != bannedEndpoints.end();
   }
   bool isConnectionDead() {
@@ -49,6 +60,7 @@ class MultiEndpointHandler : public UdpBiDirectionalRpc {
 	  return UdpBiDirectionalRpc::hasWork();
   }
   bool hasEndpoint(const udp::endpoint& newEndpoint) {
+    lock_guard<recursive_mutex> guard(mutex);
     if (bannedEndpoints.find(newEndpoint) != bannedEndpoints.end()) {
       return true;
     }
@@ -63,7 +75,13 @@ class MultiEndpointHandler : public UdpBiDirectionalRpc {
     }
     return false;
   }
+  // Starts with every endpoint we have now
+  void setEndpointListener(EndpointListener listener);
+  // Makes the endpoint the active one, learning it first if it is new.
+  // Returns false if it is banned.
+  bool migrateToEndpoint(const udp::endpoint& endpoint);
   set<udp::endpoint> aliveEndpoints() {
+      lock_guard<recursive_mutex> guard(mutex);
       auto result = alternativeEndpoints;
       result.insert(activeEndpoint);
       return result;
@@ -76,8 +94,9 @@ class MultiEndpointHandler : public UdpBiDirectionalRpc {
   set<udp::endpoint> alternativeEndpoints;
   set<udp::endpoint> deadEndpoints;
   set<udp::endpoint> bannedEndpoints;
+  EndpointListener endpointListener;
   void update();
-  virtual void send(const string& message);
+  virtual void send(const PacketBufferPtr& packet);
   void killEndpoint();
 };
 }  // namespace wga
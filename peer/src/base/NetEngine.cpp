@@ -0,0 +1,39 @@
+#include "NetEngine.hpp"
+
+namespace wga {
+int NET_ENGINE_IO_THREADS = 1;
+vector<int> NET_ENGINE_IO_CPUS;
+
+void NetEngine::start() {
+  for (int a = 0; a < ioThreadCount; a++) {
+    ioServiceThreads.push_back(make_shared<thread>([this]() {
+      LOG(ERROR) << "NET ENGINE STARTING";
+      runningEngine = this;
+      ioService->run();
+      runningEngine = NULL;
+      LOG(ERROR) << "NET ENGINE FINISHED";
+    }));
+    if (!ioThreadCpus.empty()) {
+      pinIoThread(ioServiceThreads.back().get(), a);
+    }
+  }
+}
+
+void NetEngine::pinIoThread(thread* ioThread, int index) {
+  int cpu = ioThreadCpus[index % ioThreadCpus.size()];
+#ifdef __linux__
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  int rc = pthread_setaffinity_np(ioThread->native_handle(), sizeof(cpus),
+                                  &cpus);
+  if (rc) {
+    LOG(WARNING) << "Could not pin io thread " << index << " to cpu " << cpu
+                 << ": " << rc;
+  }
+#else
+  LOG(WARNING) << "Can't pin io thread " << index << " to cpu " << cpu
+               << " on this platform";
+#endif
+}
+}  // namespace wga
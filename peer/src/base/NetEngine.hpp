@@ -1,16 +1,30 @@
 #ifndef __NET_ENGINE_H__
 #define __NET_ENGINE_H__
 
+#include "CryptoPipeline.hpp"
 #include "Headers.hpp"
 #include "PortMappingHandler.hpp"
 
 namespace wga {
+// Threads running the io service.  Each connection runs on its own strand,
+// so with more than one thread different peers are handled at once.
+extern int NET_ENGINE_IO_THREADS;
+// Cpus the io threads are pinned to, round robin.  Empty leaves them to the
+// scheduler.
+extern vector<int> NET_ENGINE_IO_CPUS;
+
 class NetEngine {
  public:
-  NetEngine() {
+  NetEngine(int _ioThreadCount = NET_ENGINE_IO_THREADS,
+            const vector<int>& _ioThreadCpus = NET_ENGINE_IO_CPUS)
+      : ioThreadCount(max(1, _ioThreadCount)), ioThreadCpus(_ioThreadCpus) {
     portMappingHandler = make_shared<PortMappingHandler>();
     ioService.reset(new asio::io_service());
     work.emplace(*ioService);
+    if (ENABLE_CRYPTO_PIPELINE) {
+      cryptoPipeline.reset(
+          new CryptoPipeline(CryptoPipeline::getDefaultThreadCount()));
+    }
   }
 
   ~NetEngine() {
@@ -19,13 +33,7 @@ class NetEngine {
     }
   }
 
-  void start() {
-    ioServiceThread.reset(new std::thread([this]() {
-      LOG(ERROR) << "NET ENGINE STARTING";
-      ioService->run();
-      LOG(ERROR) << "NET ENGINE FINISHED";
-    }));
-  }
+  void start();
 
   void shutdown() {
     LOG(INFO) << "SHUTTING DOWN: " << uint64_t(portMappingHandler.get());
@@ -36,18 +44,23 @@ class NetEngine {
       work.reset();  // let io_service run out of work
       LOG(INFO) << "Work cleared";
     });
-    LOG(INFO) << "Joining thread";
-    if (ioServiceThread && ioServiceThread->joinable()) {
-      LOG(INFO) << "Thread is joinable";
-      ioServiceThread->join();
+    LOG(INFO) << "Joining threads";
+    for (auto& it : ioServiceThreads) {
+      if (it->joinable()) {
+        it->join();
+      }
     }
     while (work.has_value()) {
       LOG(INFO) << "Waiting for work to finish";
       microsleep(1000 * 1000);
     }
+    // Only now that no io thread can be handing it work or reading it.
+    // Waits for crypto in flight, whose handlers are dropped with the
+    // io_service.
+    cryptoPipeline.reset();
     LOG(INFO) << "Resetting net engine";
     ioService.reset();
-    ioServiceThread.reset();
+    ioServiceThreads.clear();
   }
 
   template <typename F>
@@ -55,6 +68,14 @@ class NetEngine {
     return ioService->post(f);
   }
 
+  // Handlers posted through or wrapped by a strand never run at the same
+  // time as each other
+  inline shared_ptr<Strand> makeStrand() {
+    return make_shared<Strand>(*ioService);
+  }
+
+  int getIoThreadCount() { return ioThreadCount; }
+
   inline udp::socket* startUdpServer(int serverPort) {
     portMappingHandler->mapPort(
         serverPort, std::string("WGA: ") + std::to_string(serverPort));
@@ -90,11 +111,25 @@ class NetEngine {
 
   inline shared_ptr<asio::io_service> getIoService() { return ioService; }
 
+  // True when called from inside a handler run by one of our io threads
+  inline bool isIoThread() { return runningEngine == this; }
+
+  // NULL unless ENABLE_CRYPTO_PIPELINE was set
+  inline CryptoPipeline* getCryptoPipeline() { return cryptoPipeline.get(); }
+
  protected:
   shared_ptr<PortMappingHandler> portMappingHandler;
   shared_ptr<asio::io_service> ioService;
-  shared_ptr<thread> ioServiceThread;
+  int ioThreadCount;
+  vector<int> ioThreadCpus;
+  vector<shared_ptr<thread>> ioServiceThreads;
   optional<asio::io_service::work> work;
+  unique_ptr<CryptoPipeline> cryptoPipeline;
+
+  // The engine whose io service the current thread runs
+  inline static thread_local NetEngine* runningEngine = NULL;
+
+  void pinIoThread(thread* ioThread, int index);
 };
 }  // namespace wga
 
@@ -0,0 +1,99 @@
+#include "PacketBuffer.hpp"
+
+namespace wga {
+namespace {
+// Free buffers of one thread.  Only that thread touches it, so taking and
+// returning a buffer needs no lock.
+class LocalPool {
+ public:
+  ~LocalPool();
+
+  vector<PacketBuffer*> buffers;
+};
+
+// Plain pointer, so it is still readable while the thread's LocalPool is
+// being destroyed.  Buffers released after that are freed.
+thread_local LocalPool* localPool = NULL;
+thread_local bool localPoolDestroyed = false;
+
+mutex depotMutex;
+// Never destroyed, so buffers released during static destruction (by a
+// socket callback still in flight, say) have somewhere to go
+vector<PacketBuffer*>* depot = new vector<PacketBuffer*>();
+
+LocalPool* getLocalPool() {
+  if (localPool == NULL && !localPoolDestroyed) {
+    static thread_local LocalPool pool;
+    localPool = &pool;
+  }
+  return localPool;
+}
+
+LocalPool::~LocalPool() {
+  localPool = NULL;
+  localPoolDestroyed = true;
+  for (auto it : buffers) {
+    delete it;
+  }
+}
+}  // namespace
+
+void PacketBufferPtr::reset() {
+  if (buffer != NULL && --buffer->references == 0) {
+    PacketBufferPool::release(buffer);
+  }
+  buffer = NULL;
+}
+
+PacketBufferPtr PacketBufferPool::acquire() {
+  LocalPool* pool = getLocalPool();
+  if (pool != NULL && pool->buffers.empty()) {
+    // Refill from buffers other threads let go of
+    lock_guard<mutex> guard(depotMutex);
+    size_t count = min(depot->size(), BATCH_SIZE);
+    pool->buffers.insert(pool->buffers.end(), depot->end() - count,
+                         depot->end());
+    depot->resize(depot->size() - count);
+  }
+  PacketBuffer* buffer = NULL;
+  if (pool != NULL && !pool->buffers.empty()) {
+    buffer = pool->buffers.back();
+    pool->buffers.pop_back();
+  } else {
+    buffer = new PacketBuffer();
+  }
+  return PacketBufferPtr(buffer);
+}
+
+int64_t PacketBufferPool::getPooledCount() {
+  LocalPool* pool = getLocalPool();
+  return pool == NULL ? 0 : int64_t(pool->buffers.size());
+}
+
+void PacketBufferPool::release(PacketBuffer* buffer) {
+  LocalPool* pool = getLocalPool();
+  if (pool == NULL || buffer->capacity() > MAX_POOLED_CAPACITY) {
+    delete buffer;
+    return;
+  }
+  buffer->clear();
+  pool->buffers.push_back(buffer);
+  if (pool->buffers.size() < 2 * BATCH_SIZE) {
+    return;
+  }
+  // Hand a batch to the threads that build packets
+  {
+    lock_guard<mutex> guard(depotMutex);
+    if (depot->size() + BATCH_SIZE <= MAX_DEPOT_BUFFERS) {
+      depot->insert(depot->end(), pool->buffers.end() - BATCH_SIZE,
+                    pool->buffers.end());
+      pool->buffers.resize(pool->buffers.size() - BATCH_SIZE);
+      return;
+    }
+  }
+  for (size_t a = 0; a < BATCH_SIZE; a++) {
+    delete pool->buffers.back();
+    pool->buffers.pop_back();
+  }
+}
+}  // namespace wga
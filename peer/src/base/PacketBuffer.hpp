@@ -0,0 +1,158 @@
+#ifndef __PACKET_BUFFER_H__
+#define __PACKET_BUFFER_H__
+
+#include "Headers.hpp"
+
+namespace wga {
+// A datagram on its way out.  Frames are written into it once, then the
+// packet header goes in front of them in the headroom, so nothing between
+// the frame writer and the socket has to copy the packet to wrap it.
+class PacketBuffer {
+ public:
+  PacketBuffer()
+      : sealPending(false),
+        sealGeneration(0),
+        sealCounterNonces(false),
+        storage(HEADROOM + INITIAL_CAPACITY),
+        start(HEADROOM),
+        finish(HEADROOM),
+        references(0) {}
+
+  void clear() {
+    start = finish = HEADROOM;
+    sealPending = false;
+    sealGeneration = 0;
+    sealCounterNonces = false;
+  }
+
+  const char* data() const { return storage.data() + start; }
+  char* data() { return storage.data() + start; }
+  size_t size() const { return finish - start; }
+  bool empty() const { return start == finish; }
+  size_t capacity() const { return storage.size(); }
+
+  // Keeps only the first length bytes
+  void truncate(size_t length) { finish = min(finish, start + length); }
+
+  // Makes room for length bytes at the end and returns where they go
+  char* grow(size_t length) {
+    if (finish + length > storage.size()) {
+      storage.resize(max(storage.size() * 2, finish + length));
+    }
+    char* dest = storage.data() + finish;
+    finish += length;
+    return dest;
+  }
+
+  // Makes room for length bytes at the front and returns where they go
+  char* prepend(size_t length) {
+    if (length > start) {
+      // Only happens when headers outgrow HEADROOM
+      size_t extra = (length - start) + HEADROOM;
+      storage.insert(storage.begin(), extra, '\0');
+      start += extra;
+      finish += extra;
+    }
+    start -= length;
+    return storage.data() + start;
+  }
+
+  // msgpack's packer writes through this
+  void write(const char* bytes, size_t length) {
+    memcpy(grow(length), bytes, length);
+  }
+
+  void append(const string& s) { write(s.data(), s.size()); }
+
+  void prepend(const char* bytes, size_t length) {
+    memcpy(prepend(length), bytes, length);
+  }
+
+  asio::const_buffer asBuffer() const { return asio::buffer(data(), size()); }
+
+  string toString() const { return string(data(), size()); }
+
+  // Enough for every header we put in front of a packet, and for sealing
+  // it after that
+  constexpr static size_t HEADROOM = 128;
+  constexpr static size_t INITIAL_CAPACITY = 2048;
+
+  // Room for the seal is reserved, but the transport encrypts the packet
+  // on its way to the socket (see CryptoPipeline)
+  bool sealPending;
+  // The keys and nonce mode the seal's room was made for.  If either
+  // changed by the time the packet is sealed, it is dropped instead.
+  uint32_t sealGeneration;
+  bool sealCounterNonces;
+
+ protected:
+  vector<char> storage;
+  size_t start;
+  size_t finish;
+  // Held by PacketBufferPtr, so sharing a packet never allocates
+  atomic<int> references;
+
+  friend class PacketBufferPtr;
+};
+
+// A shared reference to a pooled packet.  The count lives in the buffer, and
+// the last reference hands the buffer back to PacketBufferPool.
+class PacketBufferPtr {
+ public:
+  PacketBufferPtr() : buffer(NULL) {}
+  explicit PacketBufferPtr(PacketBuffer* _buffer) : buffer(_buffer) {
+    if (buffer != NULL) {
+      buffer->references++;
+    }
+  }
+  PacketBufferPtr(const PacketBufferPtr& other)
+      : PacketBufferPtr(other.buffer) {}
+  PacketBufferPtr(PacketBufferPtr&& other) : buffer(other.buffer) {
+    other.buffer = NULL;
+  }
+  ~PacketBufferPtr() { reset(); }
+
+  PacketBufferPtr& operator=(PacketBufferPtr other) {
+    swap(buffer, other.buffer);
+    return *this;
+  }
+
+  void reset();
+
+  PacketBuffer* get() const { return buffer; }
+  PacketBuffer* operator->() const { return buffer; }
+  PacketBuffer& operator*() const { return *buffer; }
+  explicit operator bool() const { return buffer != NULL; }
+
+ protected:
+  PacketBuffer* buffer;
+};
+
+// Recycles packet buffers.  A buffer goes back to the pool when its last
+// reference is dropped, usually right after the socket sent it, so a steady
+// stream of packets stops allocating.  Each thread keeps its own free list.
+// Packets are usually built on one thread and sent on another, so whole
+// batches move through a shared depot, which is the only lock and is taken
+// once per batch.
+class PacketBufferPool {
+ public:
+  static PacketBufferPtr acquire();
+
+  // Buffers this thread can take without going to the depot
+  static int64_t getPooledCount();
+
+  // Buffers that grew past this are freed instead of pooled
+  constexpr static size_t MAX_POOLED_CAPACITY = 64 * 1024;
+  // Buffers that move to or from the depot at once
+  constexpr static size_t BATCH_SIZE = 32;
+  // Buffers the depot keeps, beyond that they are freed
+  constexpr static size_t MAX_DEPOT_BUFFERS = 256;
+
+ protected:
+  static void release(PacketBuffer* buffer);
+
+  friend class PacketBufferPtr;
+};
+}  // namespace wga
+
+#endif  // __PACKET_BUFFER_H__
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "Headers.hpp"
+
+namespace wga {
+// Packetization layer path mtu discovery (RFC 8899).  Starts from a size
+// every path should carry and binary searches upward with padded probe
+// packets.  An acknowledged probe raises the confirmed size, a size lost
+// MAX_PROBES times in a row caps the search.  Once the search settles it
+// starts over every RAISE_INTERVAL in case the path got better.  Ordinary
+// packets are watched for a black hole: big ones lost while small ones get
+// through.  All times are in microseconds.
+class PathMtuProber {
+ public:
+  PathMtuProber(int64_t _baseSize, int64_t _maxSize)
+      : baseSize(_baseSize),
+        maxSize(_maxSize),
+        confirmedSize(_baseSize),
+        failedSize(_maxSize + 1),
+        probeSize(0),
+        probeDeadline(0),
+        attempts(0),
+        nextSearchTime(0),
+        largeLosses(0),
+        smallDelivered(false),
+        blackHoleBackoff(MIN_BLACK_HOLE_BACKOFF) {}
+
+  // Largest packet known to get through
+  int64_t getMtu() const { return confirmedSize; }
+  int64_t getBaseSize() const { return baseSize; }
+
+  bool isSearching() const {
+    return failedSize - confirmedSize > SEARCH_GRANULARITY;
+  }
+
+  // Size of the probe to send now, or 0 if one is in flight or there is
+  // nothing left to search
+  int64_t getProbeSize(int64_t now) {
+    if (probeSize) {
+      return 0;
+    }
+    if (!isSearching()) {
+      if (nextSearchTime == 0 || now < nextSearchTime) {
+        return 0;
+      }
+      failedSize = maxSize + 1;
+      nextSearchTime = 0;
+      if (!isSearching()) {
+        return 0;
+      }
+    }
+    return confirmedSize + (failedSize - confirmedSize) / 2;
+  }
+
+  void onProbeSent(int64_t size, int64_t deadline) {
+    probeSize = size;
+    probeDeadline = deadline;
+  }
+
+  void onProbeAcknowledged(int64_t size, int64_t now) {
+    confirmedSize = max(confirmedSize, size);
+    failedSize = max(failedSize, confirmedSize + 1);
+    if (size == probeSize) {
+      probeSize = 0;
+      attempts = 0;
+    }
+    finishSearch(now);
+  }
+
+  // Declares the probe in flight lost once its deadline passes
+  void checkTimeout(int64_t now) {
+    if (!probeSize || now < probeDeadline) {
+      return;
+    }
+    attempts++;
+    if (attempts >= MAX_PROBES) {
+      failedSize = probeSize;
+      attempts = 0;
+    }
+    probeSize = 0;
+    finishSearch(now);
+  }
+
+  // Ordinary packets, not probes.  Anything that got through bigger than the
+  // base size clears the evidence of a black hole.
+  void onPacketAcknowledged(int64_t size) {
+    if (size > baseSize) {
+      largeLosses = 0;
+      smallDelivered = false;
+    } else {
+      smallDelivered = true;
+    }
+  }
+
+  void onPacketLost(int64_t size) {
+    if (size > baseSize) {
+      largeLosses++;
+    }
+  }
+
+  // Packets above the base size keep getting lost while small ones get
+  // through, so the path shrank under us.  Plain loss hits both sizes.
+  bool isBlackHole() const {
+    return confirmedSize > baseSize && largeLosses >= BLACK_HOLE_LOSSES &&
+           smallDelivered;
+  }
+
+  // Falls back to the base size and holds off searching again, longer each
+  // time, so a path that keeps shrinking doesn't flap
+  void onBlackHole(int64_t now) {
+    confirmedSize = baseSize;
+    failedSize = baseSize + 1;
+    probeSize = 0;
+    attempts = 0;
+    largeLosses = 0;
+    smallDelivered = false;
+    nextSearchTime = now + blackHoleBackoff;
+    blackHoleBackoff = min(blackHoleBackoff * 2, RAISE_INTERVAL);
+  }
+
+ protected:
+  int64_t baseSize;
+  int64_t maxSize;
+  int64_t confirmedSize;
+  // Smallest size known not to get through
+  int64_t failedSize;
+  int64_t probeSize;
+  int64_t probeDeadline;
+  int attempts;
+  int64_t nextSearchTime;
+  // Packets above the base size lost since one last got through
+  int largeLosses;
+  // Whether a base-size packet got through since then
+  bool smallDelivered;
+  int64_t blackHoleBackoff;
+
+  constexpr static int64_t SEARCH_GRANULARITY = 16;
+  constexpr static int MAX_PROBES = 3;
+  constexpr static int64_t RAISE_INTERVAL = 600 * 1000 * 1000LL;
+  constexpr static int BLACK_HOLE_LOSSES = 3;
+  constexpr static int64_t MIN_BLACK_HOLE_BACKOFF = 30 * 1000 * 1000LL;
+
+  void finishSearch(int64_t now) {
+    if (!isSearching() && nextSearchTime == 0) {
+      nextSearchTime = now + RAISE_INTERVAL;
+    }
+  }
+};
+}  // namespace wga
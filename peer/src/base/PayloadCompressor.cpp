@@ -0,0 +1,270 @@
+#include "PayloadCompressor.hpp"
+
+namespace wga {
+bool ENABLE_PAYLOAD_COMPRESSION = true;
+
+// Shortest back reference worth encoding
+#define MIN_MATCH (4)
+
+// Furthest a back reference can reach, including into the dictionary
+#define MAX_OFFSET (65535)
+
+#define HASH_BITS (12)
+
+// Encoding byte, dictionary id and raw size
+#define COMPRESSED_HEADER_SIZE (1 + 4 + 4)
+
+// Anything claiming to be bigger than this is corrupt
+#define MAX_DECOMPRESSED_SIZE (64 * 1024 * 1024)
+
+// Most we set aside up front for a payload.  The raw size comes from the
+// other side, so anything bigger grows as it is actually decoded.
+#define MAX_DECOMPRESSED_RESERVE (64 * 1024)
+
+// Dictionaries we keep from the other side.  It only sends a new one after
+// we acknowledged the last, so a few cover any payloads still in flight.
+#define MAX_INCOMING_DICTIONARIES (8)
+
+namespace {
+inline uint32_t read32(const string& s, size_t pos) {
+  uint32_t value;
+  memcpy(&value, s.data() + pos, sizeof(value));
+  return value;
+}
+
+inline uint32_t hashSequence(uint32_t sequence) {
+  return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+void writeLength(string& out, size_t length) {
+  while (length >= 255) {
+    out += char(255);
+    length -= 255;
+  }
+  out += char(length);
+}
+
+bool readLength(const string& in, size_t& pos, size_t& length) {
+  while (true) {
+    if (pos >= in.size()) {
+      return false;
+    }
+    unsigned char b = in[pos++];
+    length += b;
+    if (b != 255) {
+      return true;
+    }
+  }
+}
+
+// A token byte (literal count in the high nibble, match length - MIN_MATCH
+// in the low one, 15 meaning more follows), the literals, then the match
+// offset and the rest of its length.
+void writeSequence(string& out, const string& window, size_t literalStart,
+                   size_t literalLength, size_t offset, size_t matchLength) {
+  size_t extraMatch = matchLength - MIN_MATCH;
+  out += char((min(literalLength, size_t(15)) << 4) |
+              min(extraMatch, size_t(15)));
+  if (literalLength >= 15) {
+    writeLength(out, literalLength - 15);
+  }
+  out.append(window, literalStart, literalLength);
+  out += char(offset & 0xff);
+  out += char(offset >> 8);
+  if (extraMatch >= 15) {
+    writeLength(out, extraMatch - 15);
+  }
+}
+
+void writeUint32(string& out, uint32_t value) {
+  for (int a = 0; a < 4; a++) {
+    out += char((value >> (8 * a)) & 0xff);
+  }
+}
+
+uint32_t readUint32(const string& in, size_t pos) {
+  uint32_t value = 0;
+  for (int a = 0; a < 4; a++) {
+    value |= uint32_t((unsigned char)in[pos + a]) << (8 * a);
+  }
+  return value;
+}
+}  // namespace
+
+PayloadCompressor::PayloadCompressor()
+    : outgoingDictionaryId(0),
+      rawBytes(0),
+      encodedBytes(0),
+      bypassedPayloads(0) {
+  incomingDictionaries[0] = "";
+}
+
+string PayloadCompressor::compress(const string& payload, size_t headroom) {
+  rawBytes += payload.size();
+  string encoded;
+  if (payload.size() > MIN_MATCH) {
+    string block = compressBlock(outgoingDictionary, payload);
+    if (COMPRESSED_HEADER_SIZE + block.size() < 1 + payload.size()) {
+      encoded.reserve(headroom + COMPRESSED_HEADER_SIZE + block.size());
+      encoded.resize(headroom);
+      encoded += char(PAYLOAD_COMPRESSED);
+      writeUint32(encoded, outgoingDictionaryId);
+      writeUint32(encoded, uint32_t(payload.size()));
+      encoded += block;
+      encodedBytes += encoded.size() - headroom;
+      return encoded;
+    }
+  }
+  bypassedPayloads++;
+  encodedBytes += 1 + payload.size();
+  encoded.reserve(headroom + 1 + payload.size());
+  encoded.resize(headroom);
+  encoded += char(PAYLOAD_RAW);
+  encoded += payload;
+  return encoded;
+}
+
+optional<string> PayloadCompressor::decompress(const string& payload) {
+  if (payload.empty()) {
+    return nullopt;
+  }
+  if (payload[0] == PAYLOAD_RAW) {
+    return payload.substr(1);
+  }
+  if (payload[0] != PAYLOAD_COMPRESSED ||
+      payload.size() < COMPRESSED_HEADER_SIZE) {
+    return nullopt;
+  }
+  uint32_t dictionaryId = readUint32(payload, 1);
+  uint32_t rawSize = readUint32(payload, 5);
+  auto it = incomingDictionaries.find(dictionaryId);
+  if (it == incomingDictionaries.end()) {
+    LOG(ERROR) << "Got a payload for unknown dictionary " << dictionaryId;
+    return nullopt;
+  }
+  return decompressBlock(it->second, payload.substr(COMPRESSED_HEADER_SIZE),
+                         rawSize);
+}
+
+void PayloadCompressor::setOutgoingDictionary(uint32_t id,
+                                              const string& dictionary) {
+  outgoingDictionaryId = id;
+  outgoingDictionary =
+      dictionary.substr(dictionary.size() - min(dictionary.size(),
+                                                size_t(MAX_OFFSET)));
+}
+
+void PayloadCompressor::addIncomingDictionary(uint32_t id,
+                                              const string& dictionary) {
+  incomingDictionaries[id] =
+      dictionary.substr(dictionary.size() - min(dictionary.size(),
+                                                size_t(MAX_OFFSET)));
+  while (incomingDictionaries.size() > MAX_INCOMING_DICTIONARIES) {
+    // Ids only go up, and dictionary 0 is never used once there are others
+    incomingDictionaries.erase(incomingDictionaries.begin());
+  }
+}
+
+string PayloadCompressor::compressBlock(const string& dictionary,
+                                        const string& input) {
+  // The dictionary sits right before the input, so matches can reach into it
+  size_t dictionarySize = min(dictionary.size(), size_t(MAX_OFFSET));
+  string window = dictionary.substr(dictionary.size() - dictionarySize);
+  window += input;
+  size_t start = dictionarySize;
+  size_t end = window.size();
+  vector<int64_t> table(1 << HASH_BITS, -1);
+  for (size_t a = 0; a + MIN_MATCH <= start; a++) {
+    table[hashSequence(read32(window, a))] = a;
+  }
+
+  string out;
+  out.reserve(input.size() / 2 + 16);
+  size_t anchor = start;
+  size_t pos = start;
+  while (pos + MIN_MATCH <= end) {
+    uint32_t sequence = read32(window, pos);
+    uint32_t hash = hashSequence(sequence);
+    int64_t candidate = table[hash];
+    table[hash] = pos;
+    if (candidate < 0 || pos - candidate > MAX_OFFSET ||
+        read32(window, candidate) != sequence) {
+      pos++;
+      continue;
+    }
+    size_t matchLength = MIN_MATCH;
+    while (pos + matchLength < end &&
+           window[candidate + matchLength] == window[pos + matchLength]) {
+      matchLength++;
+    }
+    writeSequence(out, window, anchor, pos - anchor, pos - candidate,
+                  matchLength);
+    pos += matchLength;
+    anchor = pos;
+  }
+  // The last sequence is only literals
+  size_t literalLength = end - anchor;
+  out += char(min(literalLength, size_t(15)) << 4);
+  if (literalLength >= 15) {
+    writeLength(out, literalLength - 15);
+  }
+  out.append(window, anchor, literalLength);
+  return out;
+}
+
+optional<string> PayloadCompressor::decompressBlock(const string& dictionary,
+                                                    const string& block,
+                                                    size_t rawSize) {
+  if (rawSize > MAX_DECOMPRESSED_SIZE) {
+    return nullopt;
+  }
+  size_t dictionarySize = min(dictionary.size(), size_t(MAX_OFFSET));
+  string out = dictionary.substr(dictionary.size() - dictionarySize);
+  out.reserve(dictionarySize + min(rawSize, size_t(MAX_DECOMPRESSED_RESERVE)));
+  size_t limit = dictionarySize + rawSize;
+  size_t pos = 0;
+  while (true) {
+    if (pos >= block.size()) {
+      return nullopt;
+    }
+    unsigned char token = block[pos++];
+    size_t literalLength = token >> 4;
+    if (literalLength == 15 && !readLength(block, pos, literalLength)) {
+      return nullopt;
+    }
+    if (pos + literalLength > block.size() ||
+        out.size() + literalLength > limit) {
+      return nullopt;
+    }
+    out.append(block, pos, literalLength);
+    pos += literalLength;
+    if (pos == block.size()) {
+      break;
+    }
+    if (pos + 2 > block.size()) {
+      return nullopt;
+    }
+    size_t offset = (unsigned char)block[pos] |
+                    (size_t((unsigned char)block[pos + 1]) << 8);
+    pos += 2;
+    size_t matchLength = token & 15;
+    if (matchLength == 15 && !readLength(block, pos, matchLength)) {
+      return nullopt;
+    }
+    matchLength += MIN_MATCH;
+    if (offset == 0 || offset > out.size() ||
+        out.size() + matchLength > limit) {
+      return nullopt;
+    }
+    // Byte by byte, a match may overlap what it is copying
+    size_t from = out.size() - offset;
+    for (size_t a = 0; a < matchLength; a++) {
+      out += out[from + a];
+    }
+  }
+  if (out.size() != limit) {
+    return nullopt;
+  }
+  return out.substr(dictionarySize);
+}
+}  // namespace wga
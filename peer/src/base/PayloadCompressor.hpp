@@ -0,0 +1,58 @@
+#ifndef __PAYLOAD_COMPRESSOR_H__
+#define __PAYLOAD_COMPRESSOR_H__
+
+#include "Headers.hpp"
+
+namespace wga {
+extern bool ENABLE_PAYLOAD_COMPRESSION;
+
+// First byte of every payload on a connection that negotiated compression
+enum PayloadEncoding {
+  PAYLOAD_RAW = 0,
+  // Followed by the dictionary id and the raw size (4 bytes each, little
+  // endian) and an LZ77 block
+  PAYLOAD_COMPRESSED = 1,
+};
+
+// Compresses rpc and unreliable payloads before they are encrypted.  Each
+// side picks the dictionary for what it sends and tells the other side
+// about it before using it, so the receiver keeps every dictionary it was
+// sent, by id.  Dictionary 0 is empty and always known.
+//
+// The block format is a small LZ77 variant (LZ4-style sequences of literals
+// and back references) that can reach back into the dictionary, which is
+// what makes short payloads full of repeated key names compress at all.
+class PayloadCompressor {
+ public:
+  PayloadCompressor();
+
+  // Returns the payload tagged with its encoding.  Falls back to sending it
+  // raw when compressing doesn't make it smaller.  The result starts with
+  // headroom zero bytes the caller can fill in later.
+  string compress(const string& payload, size_t headroom = 0);
+  optional<string> decompress(const string& payload);
+
+  void setOutgoingDictionary(uint32_t id, const string& dictionary);
+  void addIncomingDictionary(uint32_t id, const string& dictionary);
+
+  int64_t getRawBytes() const { return rawBytes; }
+  int64_t getEncodedBytes() const { return encodedBytes; }
+  int64_t getBytesSaved() const { return rawBytes - encodedBytes; }
+  int64_t getBypassedPayloads() const { return bypassedPayloads; }
+
+  static string compressBlock(const string& dictionary, const string& input);
+  static optional<string> decompressBlock(const string& dictionary,
+                                          const string& block,
+                                          size_t rawSize);
+
+ protected:
+  uint32_t outgoingDictionaryId;
+  string outgoingDictionary;
+  map<uint32_t, string> incomingDictionaries;
+  int64_t rawBytes;
+  int64_t encodedBytes;
+  int64_t bypassedPayloads;
+};
+}  // namespace wga
+
+#endif  // __PAYLOAD_COMPRESSOR_H__
@@ -3,41 +3,91 @@
 namespace wga {
 PortMultiplexer::PortMultiplexer(shared_ptr<NetEngine> _netEngine,
                                  shared_ptr<udp::socket> _localSocket)
-    : netEngine(_netEngine), localSocket(_localSocket) {
+    : netEngine(_netEngine),
+      strand(_netEngine->makeStrand()),
+      localSocket(_localSocket),
+      routes(make_shared<RecipientRoutes>()),
+      connectionRoutes(make_shared<ConnectionRoutes>()) {
+  if (useBatchedIo()) {
+    receiveRing.reset(new DatagramReceiveRing());
+  }
+  receiveNext();
+}
+
+void PortMultiplexer::receiveNext() {
+  if (receiveRing) {
+    // Wait for the socket to be readable, then drain it in batches
+    localSocket->async_wait(
+        udp::socket::wait_read,
+        strand->wrap(std::bind(&PortMultiplexer::handleReadable, this,
+                               std::placeholders::_1)));
+    return;
+  }
   localSocket->async_receive_from(
       asio::buffer(receiveBuffer), receiveEndpoint,
-      std::bind(&PortMultiplexer::handleReceive, this, std::placeholders::_1,
-                std::placeholders::_2));
+      strand->wrap(std::bind(&PortMultiplexer::handleReceive, this,
+                             std::placeholders::_1, std::placeholders::_2)));
+}
+
+void PortMultiplexer::handleReadable(const asio::error_code& error) {
+  if (error == asio::error::operation_aborted) {
+    return;
+  }
+  if (error.value()) {
+    LOG(ERROR) << "Got error when waiting for packets: " << error.value()
+               << ": " << error.message();
+  } else {
+    receiveRing->drain(*localSocket, [this](const char* data, size_t size,
+                                            const udp::endpoint& from) {
+      lastSender = from;
+      handlePacket(data, size, from);
+    });
+  }
+  receiveNext();
 }
 
 void PortMultiplexer::closeSocket() {
-  netEngine->post([this] { localSocket->close(); });
+  // Not while the receive loop is using it
+  strand->post([this] { localSocket->close(); });
 }
 
-void PortMultiplexer::addRecipient(shared_ptr<EncryptedMultiEndpointHandler> recipient) {
-  lock_guard<recursive_mutex> guard(mut);
+void PortMultiplexer::addRecipient(
+    shared_ptr<EncryptedMultiEndpointHandler> recipient) {
+  // The socket is ours, so the recipient sends on our strand
+  recipient->setSocketStrand(strand);
+  // Who sent what is only known on the strand, and the recipients are only
+  // touched there
+  strand->dispatch([this, recipient]() {
+    banDuplicateEndpoints(recipient);
+    recipients.push_back(recipient);
+  });
 
-  // Ban any duplicate endpoints
-  auto eps = recipient->aliveEndpoints();
-  for (auto ep : eps) {
-    if (endpointsSeen.find(ep) != endpointsSeen.end() || ep == receiveEndpoint) {
-      // We've seen this endpoint more than once, ban it.
-      if (ep == receiveEndpoint) {
-        LOG(WARNING) << "Banning endpoint " << ep << " because it matches my recieve endpoint (" << receiveEndpoint << ").";
-      } else {
-        LOG(WARNING) << "Banning endpoint " << ep << " because two peers have it";
-      }
-      for (auto r : recipients) {
-        r->banEndpoint(ep);
-      }
-    } else {
-      LOG(INFO) << "ENDPOINT LOOKS GOOD: " << ep << " " << receiveEndpoint << endl;
-      // Mark it so we ban next time if we see it again.
-      endpointsSeen.insert(ep);
-    }
+  if (ENABLE_CONNECTION_IDS) {
+    uint32_t connectionId;
+    do {
+      randombytes_buf(&connectionId, sizeof(connectionId));
+    } while (connectionId == 0 || !connectionRoutes->add(connectionId,
+                                                         recipient));
+    recipient->setLocalConnectionId(connectionId);
   }
-
-  recipients.push_back(recipient);
+  // Capturing the table rather than this keeps the listener safe if the
+  // recipient outlives us
+  auto routingTable = routes;
+  weak_ptr<EncryptedMultiEndpointHandler> weakRecipient = recipient;
+  EncryptedMultiEndpointHandler* owner = recipient.get();
+  recipient->setEndpointListener(
+      [routingTable, weakRecipient, owner](const udp::endpoint& endpoint,
+                                           bool routed) {
+        if (!routed) {
+          routingTable->remove(endpoint, owner);
+          return;
+        }
+        auto recipient = weakRecipient.lock();
+        if (recipient && !routingTable->add(endpoint, recipient)) {
+          VLOG(1) << "Endpoint " << endpoint
+                  << " already belongs to another peer";
+        }
+      });
 }
 
 void PortMultiplexer::handleReceive(const asio::error_code& error,
@@ -49,60 +99,167 @@ void PortMultiplexer::handleReceive(const asio::error_code& error,
     LOG(ERROR) << "Got error when trying to receive packet on "
                << receiveEndpoint << ": " << error.value() << ": "
                << error.message();
-    localSocket->async_receive_from(
-        asio::buffer(receiveBuffer), receiveEndpoint,
-        std::bind(&PortMultiplexer::handleReceive, this, std::placeholders::_1,
-                  std::placeholders::_2));
+    receiveNext();
     return;
   }
-  lock_guard<recursive_mutex> guard(mut);
-  VLOG(2) << "GOT PACKET FROM " << receiveEndpoint << " WITH SIZE "
-          << bytesTransferred;
-  if (bytesTransferred < WGA_MAGIC.length()) {
-    VLOG(2) << "Packet is too small to contain header: " << bytesTransferred;
-  } else {
-    string packetString(receiveBuffer.data(), bytesTransferred);
+  lastSender = receiveEndpoint;
+  handlePacket(receiveBuffer.data(), bytesTransferred, receiveEndpoint);
+  receiveNext();
+}
 
-    string magicHeader = packetString.substr(0, WGA_MAGIC.length());
-    if (magicHeader != WGA_MAGIC) {
-      LOG(ERROR) << "Invalid packet header (total size):" << bytesTransferred
-                 << " data: " << packetString;
-    } else {
-      string packetContents = packetString.substr(WGA_MAGIC.length());
-      // We need to find out where this needs to go
-      shared_ptr<EncryptedMultiEndpointHandler> recipient;
-      for (auto& it : recipients) {
-        if (it->hasEndpointAndResurrectIfFound(receiveEndpoint)) {
-          recipient = it;
-        }
-      }
-      if (recipient.get() == NULL && packetContents.size() > 0) {
-        // We don't have any endpoint to receive this, so check the header
-        LOG(INFO) << "Do not know who should get packet, will check header";
-        for (auto& it : recipients) {
-          if (it->isEndpointBanned(receiveEndpoint)) {
-            continue;
+void PortMultiplexer::handlePacket(const char* data, size_t size,
+                                   const udp::endpoint& from) {
+  VLOG(2) << "GOT PACKET FROM " << from << " WITH SIZE " << size;
+  if (size < WGA_MAGIC.length()) {
+    VLOG(2) << "Packet is too small to contain header: " << size;
+    return;
+  }
+  if (memcmp(data, WGA_MAGIC.data(), WGA_MAGIC.length())) {
+    LOG(ERROR) << "Invalid packet header (total size):" << size
+               << " data: " << string(data, size);
+    return;
+  }
+  const char* contents = data + WGA_MAGIC.length();
+  size_t contentsSize = size - WGA_MAGIC.length();
+  uint32_t connectionId;
+  if (readConnectionId(contents, contentsSize, &connectionId)) {
+    handleConnectionPacket(connectionId, contents + 1 + CONNECTION_ID_SIZE,
+                           contentsSize - (1 + CONNECTION_ID_SIZE), from);
+    return;
+  }
+  string packetContents(contents, contentsSize);
+  // We need to find out where this needs to go
+  shared_ptr<EncryptedMultiEndpointHandler> recipient = routes->find(from);
+  if (recipient.get() == NULL) {
+    if (packetContents.size() > 0) {
+      claimEndpoint(packetContents, from);
+    }
+    return;
+  }
+  // The endpoint is checked and brought back on the recipient's strand,
+  // after the packet proved to be worth it
+  deliver(recipient, packetContents, [recipient, from](ReceiveResult result) {
+    if (result == RECEIVE_INVALID) {
+      recipient->banEndpoint(from);
+      return;
+    }
+    recipient->hasEndpointAndResurrectIfFound(from);
+  });
+}
+
+void PortMultiplexer::handleConnectionPacket(uint32_t connectionId,
+                                             const char* data, size_t size,
+                                             const udp::endpoint& from) {
+  shared_ptr<EncryptedMultiEndpointHandler> recipient =
+      connectionRoutes->find(connectionId);
+  if (recipient.get() == NULL) {
+    VLOG(1) << "Dropping packet from " << from << " for unknown connection "
+            << connectionId;
+    return;
+  }
+  // No need to guess who it is for, and no reason to ban the endpoint if
+  // it doesn't make sense
+  deliver(recipient, string(data, size),
+          [recipient, from](ReceiveResult result) {
+            if (result == RECEIVE_INVALID) {
+              VLOG(1) << "Dropping invalid packet from " << from;
+              return;
+            }
+            // The connection id is in the clear, so anyone can resend a
+            // packet they saw from their own address.  Only the newest
+            // sealed packet proves it came from the other side, then the
+            // connection follows a NAT rebinding right away.
+            if (result == RECEIVE_AUTHENTICATED) {
+              recipient->migrateToEndpoint(from);
+            }
+          });
+}
+
+void PortMultiplexer::deliver(
+    const shared_ptr<EncryptedMultiEndpointHandler>& recipient,
+    const string& packet, const function<void(ReceiveResult)>& done) {
+  CryptoPipeline* pipeline = netEngine->getCryptoPipeline();
+  if (pipeline == NULL || packet.empty() ||
+      (unsigned char)packet[0] != SEALED) {
+    if (netEngine->getIoThreadCount() == 1) {
+      // Nothing else could run meanwhile, so skip the hop
+      done(recipient->receive(packet));
+      return;
+    }
+    // Other peers' packets don't wait on this one
+    recipient->getStrand()->post([recipient, packet, done]() {
+      done(recipient->receive(packet));
+    });
+    return;
+  }
+  // Opened in order with the rest of the recipient's crypto, then handled
+  // on the recipient's strand like any other packet
+  pipeline->run(recipient->getCryptoLane(), [recipient, packet, done]() {
+    auto opened = make_shared<string>();
+    PacketOpenResult result = recipient->openSealed(packet, opened.get());
+    size_t sealedSize = packet.size();
+    recipient->getStrand()->post(
+        [recipient, result, opened, sealedSize, done]() {
+          done(recipient->receiveOpened(result, *opened, sealedSize));
+        });
+  });
+}
+
+void PortMultiplexer::claimEndpoint(const string& packet,
+                                    const udp::endpoint& from) {
+  if ((unsigned char)packet[0] != SEALED) {
+    VLOG(1) << "Dropping unsealed packet from unknown endpoint " << from;
+    return;
+  }
+  for (auto& it : recipients) {
+    if (it->isEndpointBanned(from)) {
+      continue;
+    }
+    // Only the recipient with the right key can open it
+    string opened;
+    if (it->openSealed(packet, &opened) != PACKET_OPENED) {
+      continue;
+    }
+    LOG(INFO) << "Endpoint " << from << " claimed by a sealed packet";
+    it->addEndpoint(from);
+    size_t sealedSize = packet.size();
+    auto recipient = it;
+    recipient->getStrand()->post(
+        [recipient, opened, sealedSize, from]() {
+          if (recipient->receiveOpened(PACKET_OPENED, opened, sealedSize) !=
+              RECEIVE_INVALID) {
+            recipient->hasEndpointAndResurrectIfFound(from);
           }
-          // Possible match, try it out
-          recipient = it;
-          recipient->addEndpoint(receiveEndpoint);
-          break;
-        }
-      }
-      if (recipient.get() == NULL) {
-        LOG(ERROR) << "Could not find receipient";
+        });
+    return;
+  }
+  VLOG(1) << "Dropping packet from " << from << ", nobody can open it";
+}
+
+void PortMultiplexer::banDuplicateEndpoints(
+    const shared_ptr<EncryptedMultiEndpointHandler>& recipient) {
+  for (auto ep : recipient->aliveEndpoints()) {
+    if (endpointsSeen.find(ep) != endpointsSeen.end() || ep == lastSender) {
+      // We've seen this endpoint more than once, ban it.
+      if (ep == lastSender) {
+        LOG(WARNING) << "Banning endpoint " << ep
+                     << " because it matches my recieve endpoint ("
+                     << lastSender << ").";
       } else {
-        if (!recipient->receive(packetContents)) {
-          recipient->banEndpoint(receiveEndpoint);
+        LOG(WARNING) << "Banning endpoint " << ep
+                     << " because two peers have it";
+      }
+      for (auto r : recipients) {
+        if (r != recipient) {
+          r->banEndpoint(ep);
         }
       }
+    } else {
+      LOG(INFO) << "ENDPOINT LOOKS GOOD: " << ep << " " << lastSender;
+      // Mark it so we ban next time if we see it again.
+      endpointsSeen.insert(ep);
     }
   }
-
-  localSocket->async_receive_from(
-      asio::buffer(receiveBuffer), receiveEndpoint,
-      std::bind(&PortMultiplexer::handleReceive, this, std::placeholders::_1,
-                std::placeholders::_2));
 }
 
 }  // namespace wga
@@ -1,7 +1,9 @@
 #ifndef __PORT_MULTIPLEXER_HPP__
 #define __PORT_MULTIPLEXER_HPP__
 
+#include "DatagramBatch.hpp"
 #include "EncryptedMultiEndpointHandler.hpp"
+#include "EndpointRoutingTable.hpp"
 #include "Headers.hpp"
 #include "NetEngine.hpp"
 
@@ -18,16 +20,54 @@ class PortMultiplexer {
   void addRecipient(shared_ptr<EncryptedMultiEndpointHandler> recipient);
 
  protected:
+  typedef EndpointRoutingTable<EncryptedMultiEndpointHandler> RecipientRoutes;
+  typedef RoutingTable<uint32_t, EncryptedMultiEndpointHandler>
+      ConnectionRoutes;
+
   void handleReceive(const asio::error_code& error,
                      std::size_t bytesTransferred);
+  void receiveNext();
+  void handleReadable(const asio::error_code& error);
+  // Hands a datagram to whoever it is for
+  void handlePacket(const char* data, size_t size, const udp::endpoint& from);
+  // Hands a datagram from an endpoint nobody has to the recipient that can
+  // open it.  Only sealed datagrams prove who they are for, anything else
+  // is dropped.
+  void claimEndpoint(const string& packet, const udp::endpoint& from);
+  // Bans endpoints that recipient shares with another recipient, or with
+  // whoever last sent us a datagram.  Runs on the strand.
+  void banDuplicateEndpoints(
+      const shared_ptr<EncryptedMultiEndpointHandler>& recipient);
+  void handleConnectionPacket(uint32_t connectionId, const char* data,
+                              size_t size, const udp::endpoint& from);
+  // Has the recipient receive the packet, opening it on the crypto pipeline
+  // first when there is one.  done gets what receive() said, on the
+  // recipient's strand.
+  void deliver(const shared_ptr<EncryptedMultiEndpointHandler>& recipient,
+               const string& packet,
+               const function<void(ReceiveResult)>& done);
 
   shared_ptr<NetEngine> netEngine;
+  // The receive loop runs on it, each recipient handles its packets on its
+  // own
+  shared_ptr<Strand> strand;
   shared_ptr<udp::socket> localSocket;
+  // Only touched on the strand
   vector<shared_ptr<EncryptedMultiEndpointHandler>> recipients;
+  // Every endpoint a recipient will take packets from.  The receive path
+  // reads it without a lock.
+  shared_ptr<RecipientRoutes> routes;
+  // Recipients by the connection id we gave them
+  shared_ptr<ConnectionRoutes> connectionRoutes;
 
+  // Filled in by async_receive_from
   udp::endpoint receiveEndpoint;
+  // Who the last datagram came from.  Only touched on the strand.
+  udp::endpoint lastSender;
   std::array<char, 1024 * 1024> receiveBuffer;
-  recursive_mutex mut;
+  // Only when batching
+  unique_ptr<DatagramReceiveRing> receiveRing;
+  // Only touched on the strand
   set<udp::endpoint> endpointsSeen;
 };
 }  // namespace wga
@@ -0,0 +1,50 @@
+#ifndef __REPLAY_WINDOW_H__
+#define __REPLAY_WINDOW_H__
+
+#include "Headers.hpp"
+#include "SequenceWindow.hpp"
+
+namespace wga {
+// Remembers which nonce counters we already opened, over the last
+// WINDOW_BITS counters.  Anything older than that is refused, the sender
+// resends whatever mattered in a new packet.
+class ReplayWindow {
+ public:
+  static constexpr uint64_t WINDOW_BITS = 2048;
+
+  // The counter closest to the newest one we opened that ends in the low
+  // 32 bits the sender put on the wire
+  uint64_t expand(uint32_t truncated) const {
+    const uint64_t span = 1ULL << 32;
+    uint64_t expected = window.getHighest() + 1;
+    uint64_t candidate = (expected & ~(span - 1)) | truncated;
+    if (candidate + span / 2 <= expected) {
+      candidate += span;
+    } else if (candidate > expected + span / 2 && candidate >= span) {
+      candidate -= span;
+    }
+    return candidate;
+  }
+
+  // Counters start at 1
+  bool canAccept(uint64_t counter) const {
+    if (counter == 0) {
+      return false;
+    }
+    if (window.isAhead(counter)) {
+      return true;
+    }
+    return !window.isBehind(counter) && !window.isMarked(counter);
+  }
+
+  // Only call once the counter's packet authenticated
+  void accept(uint64_t counter) { window.mark(counter); }
+
+  uint64_t getHighest() const { return window.getHighest(); }
+
+ protected:
+  SequenceWindow<WINDOW_BITS> window;
+};
+}  // namespace wga
+
+#endif  // __REPLAY_WINDOW_H__
@@ -0,0 +1,51 @@
+#ifndef __RPC_DEDUP_WINDOW_H__
+#define __RPC_DEDUP_WINDOW_H__
+
+#include "Headers.hpp"
+#include "RpcId.hpp"
+#include "SequenceWindow.hpp"
+
+namespace wga {
+// Remembers which rpcs were already processed.  Sequenced ids live in a
+// SequenceWindow over the last WINDOW_BITS sequence numbers.  Random
+// (legacy) ids fall back to an lru_cache, which is only allocated once one
+// shows up.
+class RpcDedupWindow {
+ public:
+  static constexpr uint64_t WINDOW_BITS = 16 * 1024;
+
+  RpcDedupWindow(size_t _legacyCapacity) : legacyCapacity(_legacyCapacity) {}
+
+  void put(const RpcId& rpcId) {
+    if (!rpcId.isSequenced()) {
+      if (legacy.get() == NULL) {
+        legacy.reset(new lru_cache<RpcId, bool>(legacyCapacity));
+      }
+      legacy->put(rpcId, true);
+      return;
+    }
+    window.mark(rpcId.getSequence());
+  }
+
+  // Sequenced ids that fell off the back of the window count as processed.
+  // The sender only gets that far behind after a very long outage, and
+  // replaying an old rpc is worse than dropping it.
+  bool exists(const RpcId& rpcId) const {
+    if (!rpcId.isSequenced()) {
+      return legacy.get() != NULL && legacy->exists(rpcId);
+    }
+    uint64_t sequence = rpcId.getSequence();
+    if (window.isAhead(sequence)) {
+      return false;
+    }
+    return window.isBehind(sequence) || window.isMarked(sequence);
+  }
+
+ protected:
+  SequenceWindow<WINDOW_BITS> window;
+  size_t legacyCapacity;
+  unique_ptr<lru_cache<RpcId, bool>> legacy;
+};
+}  // namespace wga
+
+#endif  // __RPC_DEDUP_WINDOW_H__
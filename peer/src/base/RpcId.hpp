@@ -19,8 +19,34 @@ class RpcId {
   string str() const { return to_string(barrier) + "/" + to_string(id); }
   bool empty() { return barrier == 0 && id == 0; }
 
+  // Ids from a uuid always have the top two bits set to 10 (the uuid
+  // variant), so 01 marks a per-connection sequence number instead.  The
+  // next bit says which side of the connection allocated it, so our
+  // requests and the other side's never collide.
+  static RpcId fromSequence(int64_t barrier, uint64_t side,
+                            uint64_t sequence) {
+    return RpcId(barrier,
+                 SEQUENCE_TAG | (side << 61) | (sequence & SEQUENCE_MASK));
+  }
+  bool isSequenced() const { return (id >> 62) == 1; }
+  uint64_t getSequenceSide() const { return (id >> 61) & 1; }
+  uint64_t getSequence() const { return id & SEQUENCE_MASK; }
+
   int64_t barrier;
   uint64_t id;
+
+  static const uint64_t SEQUENCE_TAG = 1ULL << 62;
+  static const uint64_t SEQUENCE_MASK = (1ULL << 61) - 1;
+};
+
+class IdPayload {
+ public:
+  IdPayload() {}
+  IdPayload(const RpcId& _id, const string& _payload)
+      : id(_id), payload(_payload) {}
+
+  RpcId id;
+  string payload;
 };
 }  // namespace wga
 
@@ -41,5 +67,10 @@ struct hash<wga::RpcId> {
 }  // namespace std
 
 #define SESSION_KEY_RPCID RpcId(0, 1)
+// Sent instead of the session key by a peer resuming an earlier session
+#define RESUME_SESSION_RPCID RpcId(0, 2)
+// Rpcs that set up the session keys, so they can't be sealed
+#define IS_HANDSHAKE_RPCID(X) \
+  ((X) == SESSION_KEY_RPCID || (X) == RESUME_SESSION_RPCID)
 
 #endif
@@ -8,21 +8,85 @@ RpcServer::RpcServer(shared_ptr<NetEngine> _netEngine,
 void RpcServer::addEndpoint(
     const string& id, shared_ptr<EncryptedMultiEndpointHandler> endpoint) {
   endpoints.insert(make_pair(id, endpoint));
+  for (const auto& it : streams) {
+    endpoint->openStream(it.first, it.second.first, it.second.second);
+  }
+  if (!compressionWords.empty()) {
+    endpoint->primeCompressionDictionary(compressionWords);
+  }
+  attachHandlers(id, endpoint);
   addRecipient(endpoint);
 }
 
-void RpcServer::broadcast(const string& payload) {
+void RpcServer::attachHandlers(
+    const string& id, shared_ptr<EncryptedMultiEndpointHandler> endpoint) {
+  if (requestHandler) {
+    auto handler = requestHandler;
+    endpoint->setRequestHandler(
+        [handler, id](const IdPayload& idPayload) {
+          handler(UserIdIdPayload(id, idPayload));
+        },
+        requestExecutor);
+  }
+  if (replyHandler) {
+    auto handler = replyHandler;
+    endpoint->setReplyHandler(
+        [handler, id](const IdPayload& idPayload) {
+          handler(UserIdIdPayload(id, idPayload));
+        },
+        replyExecutor);
+  }
+  if (unreliableHandler) {
+    auto handler = unreliableHandler;
+    endpoint->setUnreliableHandler(
+        [handler, id](const UnreliableMessage& message) {
+          handler(id, message);
+        },
+        unreliableExecutor);
+  }
+}
+
+void RpcServer::openStream(uint32_t stream, StreamPriority priority,
+                           bool ordered) {
+  streams[stream] = make_pair(priority, ordered);
   for (auto it : endpoints) {
-    it.second->requestOneWay(payload);
+    it.second->openStream(stream, priority, ordered);
   }
 }
 
-RpcId RpcServer::request(const string& userId, const string& payload) {
+void RpcServer::primeCompressionDictionary(const vector<string>& words) {
+  compressionWords.insert(compressionWords.end(), words.begin(), words.end());
+  for (auto it : endpoints) {
+    it.second->primeCompressionDictionary(words);
+  }
+}
+
+void RpcServer::broadcast(const string& payload, uint32_t stream) {
+  for (auto it : endpoints) {
+    it.second->requestOneWay(payload, stream);
+  }
+}
+
+void RpcServer::broadcastUnreliable(const string& payload) {
+  for (auto it : endpoints) {
+    it.second->sendUnreliable(payload);
+  }
+}
+
+void RpcServer::broadcastUnreliableSequenced(uint32_t channel,
+                                             const string& payload) {
+  for (auto it : endpoints) {
+    it.second->sendUnreliableSequenced(channel, payload);
+  }
+}
+
+RpcId RpcServer::request(const string& userId, const string& payload,
+                         uint32_t stream) {
   auto it = endpoints.find(userId);
   if (it == endpoints.end()) {
     LOGFATAL << "Tried to send to an invalid endpoint: " << userId;
   }
-  return it->second->request(payload);
+  return it->second->request(payload, stream);
 }
 
 optional<UserIdIdPayload> RpcServer::getIncomingRequest() {
@@ -34,6 +98,33 @@ optional<UserIdIdPayload> RpcServer::getIncomingRequest() {
   return nullopt;
 }
 
+void RpcServer::setRequestHandler(RpcServerHandler handler,
+                                  RpcExecutor executor) {
+  requestHandler = handler;
+  requestExecutor = executor;
+  for (auto it : endpoints) {
+    attachHandlers(it.first, it.second);
+  }
+}
+
+void RpcServer::setReplyHandler(RpcServerHandler handler,
+                                RpcExecutor executor) {
+  replyHandler = handler;
+  replyExecutor = executor;
+  for (auto it : endpoints) {
+    attachHandlers(it.first, it.second);
+  }
+}
+
+void RpcServer::setUnreliableHandler(RpcServerUnreliableHandler handler,
+                                     RpcExecutor executor) {
+  unreliableHandler = handler;
+  unreliableExecutor = executor;
+  for (auto it : endpoints) {
+    attachHandlers(it.first, it.second);
+  }
+}
+
 void RpcServer::reply(const string& id, const RpcId& rpcId,
                       const string& payload) {
   auto it = endpoints.find(id);
@@ -58,9 +149,35 @@ void RpcServer::heartbeat() {
   }
 }
 
-void RpcServer::resendRandomOutgoingMessage() {
+void RpcServer::flush() {
+  for (auto it : endpoints) {
+    it.second->flush();
+  }
+}
+
+void RpcServer::startClockBootstrap() {
+  for (auto it : endpoints) {
+    it.second->startClockBootstrap();
+  }
+}
+
+void RpcServer::sendClockProbes() {
   for (auto it : endpoints) {
-    it.second->resendRandomOutgoingMessage();
+    it.second->sendClockProbes();
+  }
+}
+
+map<string, double> RpcServer::getClockBootstrapProgress() {
+  map<string, double> retval;
+  for (const auto& it : endpoints) {
+    retval[it.first] = it.second->getClockBootstrapProgress();
+  }
+  return retval;
+}
+
+void RpcServer::resendOldestOutgoingMessage() {
+  for (auto it : endpoints) {
+    it.second->resendOldestOutgoingMessage();
   }
 }
 
@@ -156,6 +273,14 @@ map<string, pair<double, double>> RpcServer::getPeerLatency() {
   return retval;
 }
 
+map<string, ConnectionStats> RpcServer::getPeerStats() {
+  map<string, ConnectionStats> retval;
+  for (const auto& it : endpoints) {
+    retval[it.first] = it.second->getStats();
+  }
+  return retval;
+}
+
 double RpcServer::getHalfPingUpperBound() {
   double ping = 0;
   for (const auto& it : endpoints) {
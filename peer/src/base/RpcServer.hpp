@@ -21,6 +21,10 @@ class UserIdIdPayload {
   string payload;
 };
 
+typedef function<void(const UserIdIdPayload&)> RpcServerHandler;
+typedef function<void(const string& userId, const UnreliableMessage&)>
+    RpcServerUnreliableHandler;
+
 class RpcServer : public PortMultiplexer {
  public:
   RpcServer(shared_ptr<NetEngine> _netEngine,
@@ -29,18 +33,45 @@ class RpcServer : public PortMultiplexer {
   void addEndpoint(const string& id,
                    shared_ptr<EncryptedMultiEndpointHandler> endpoint);
 
-  void broadcast(const string& payload);
+  // Opens the stream on every endpoint, including ones added later.  See
+  // BiDirectionalRpc::openStream.
+  void openStream(uint32_t stream, StreamPriority priority, bool ordered);
+
+  // Primes every endpoint's compression dictionary, including ones added
+  // later.  See EncryptedMultiEndpointHandler::primeCompressionDictionary.
+  void primeCompressionDictionary(const vector<string>& words);
+
+  void broadcast(const string& payload, uint32_t stream = DEFAULT_STREAM);
+  void broadcastUnreliable(const string& payload);
+  void broadcastUnreliableSequenced(uint32_t channel, const string& payload);
 
-  RpcId request(const string& userId, const string& payload);
+  RpcId request(const string& userId, const string& payload,
+                uint32_t stream = DEFAULT_STREAM);
 
   optional<UserIdIdPayload> getIncomingRequest();
 
+  // Push-based alternative to getIncomingRequest()/getIncomingReply().  Also
+  // applies to endpoints added later.  See BiDirectionalRpc::setRequestHandler.
+  void setRequestHandler(RpcServerHandler handler,
+                         RpcExecutor executor = RpcExecutor());
+  void setReplyHandler(RpcServerHandler handler,
+                       RpcExecutor executor = RpcExecutor());
+  void setUnreliableHandler(RpcServerUnreliableHandler handler,
+                            RpcExecutor executor = RpcExecutor());
+
   void reply(const string& id, const RpcId& rpcId, const string& payload);
 
   optional<UserIdIdPayload> getIncomingReply();
 
   void heartbeat();
-  void resendRandomOutgoingMessage();
+  void flush();
+  // Bootstraps every peer's clock at once.  See
+  // BiDirectionalRpc::startClockBootstrap.
+  void startClockBootstrap();
+  void sendClockProbes();
+  // From 0 to 1 for each peer, 1 once its clock has settled
+  map<string, double> getClockBootstrapProgress();
+  void resendOldestOutgoingMessage();
   bool readyToSend();
   void runUntilInitialized();
   void sendShutdown();
@@ -61,10 +92,24 @@ class RpcServer : public PortMultiplexer {
 
   map<string, pair<double, double>> getPeerLatency();
 
+  // Latest stats snapshot of every peer.  Doesn't wait on any connection.
+  map<string, ConnectionStats> getPeerStats();
+
   double getHalfPingUpperBound();
 
  protected:
   map<string, shared_ptr<EncryptedMultiEndpointHandler>> endpoints;
+  map<uint32_t, pair<StreamPriority, bool>> streams;
+  vector<string> compressionWords;
+  RpcServerHandler requestHandler;
+  RpcExecutor requestExecutor;
+  RpcServerHandler replyHandler;
+  RpcExecutor replyExecutor;
+  RpcServerUnreliableHandler unreliableHandler;
+  RpcExecutor unreliableExecutor;
+
+  void attachHandlers(const string& id,
+                      shared_ptr<EncryptedMultiEndpointHandler> endpoint);
 };
 }  // namespace wga
 
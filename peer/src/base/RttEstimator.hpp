@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Headers.hpp"
+
+namespace wga {
+// Smoothed round trip time and variation (RFC 6298), used to pick how long to
+// wait before resending an rpc.  All times are in microseconds.
+class RttEstimator {
+ public:
+  RttEstimator() : smoothedRtt(0), rttVariation(0), hasSample(false) {}
+
+  void addSample(double rtt) {
+    if (!hasSample) {
+      smoothedRtt = rtt;
+      rttVariation = rtt / 2.0;
+      hasSample = true;
+      return;
+    }
+    rttVariation = ((1.0 - BETA) * rttVariation) +
+                   (BETA * fabs(smoothedRtt - rtt));
+    smoothedRtt = ((1.0 - ALPHA) * smoothedRtt) + (ALPHA * rtt);
+  }
+
+  int64_t getRetransmissionTimeout() {
+    if (!hasSample) {
+      return INITIAL_TIMEOUT;
+    }
+    double timeout =
+        smoothedRtt + max(double(CLOCK_GRANULARITY), 4.0 * rttVariation);
+    return min(MAX_TIMEOUT, max(MIN_TIMEOUT, int64_t(timeout)));
+  }
+
+  // Backed off timeout for an rpc that has already been resent
+  int64_t getRetransmissionTimeout(int retransmits) {
+    int shift = min(retransmits, MAX_BACKOFF_SHIFT);
+    return min(MAX_TIMEOUT, getRetransmissionTimeout() << shift);
+  }
+
+  double getSmoothedRtt() { return smoothedRtt; }
+  double getRttVariation() { return rttVariation; }
+
+  // Starts from an earlier connection's estimate instead of the first sample
+  void restore(double _smoothedRtt, double _rttVariation) {
+    smoothedRtt = _smoothedRtt;
+    rttVariation = _rttVariation;
+    hasSample = true;
+  }
+
+ protected:
+  double smoothedRtt;
+  double rttVariation;
+  bool hasSample;
+
+  constexpr static double ALPHA = 1.0 / 8.0;
+  constexpr static double BETA = 1.0 / 4.0;
+  constexpr static int64_t CLOCK_GRANULARITY = 1000;
+  constexpr static int64_t INITIAL_TIMEOUT = 250 * 1000;
+  constexpr static int64_t MIN_TIMEOUT = 20 * 1000;
+  constexpr static int64_t MAX_TIMEOUT = 2 * 1000 * 1000;
+  constexpr static int MAX_BACKOFF_SHIFT = 5;
+};
+}  // namespace wga
@@ -0,0 +1,57 @@
+#ifndef __SEQUENCE_WINDOW_H__
+#define __SEQUENCE_WINDOW_H__
+
+#include "Headers.hpp"
+
+namespace wga {
+// Remembers which of the last WINDOW_BITS sequence numbers were seen, in a
+// ring bitset, so a lookup is a shift and a mask.  What to make of numbers
+// that fell off the back is up to the caller.
+template <uint64_t WINDOW_BITS>
+class SequenceWindow {
+ public:
+  static_assert(WINDOW_BITS % 64 == 0, "The window must be whole words");
+
+  SequenceWindow() : words(WINDOW_BITS / 64, 0), highest(0) {}
+
+  // Newer than anything marked so far
+  bool isAhead(uint64_t sequence) const { return sequence > highest; }
+
+  // Too old for the window to remember
+  bool isBehind(uint64_t sequence) const {
+    return sequence <= highest && highest - sequence >= WINDOW_BITS;
+  }
+
+  // Only meaningful when the sequence is neither ahead nor behind
+  bool isMarked(uint64_t sequence) const {
+    return (words[(sequence % WINDOW_BITS) / 64] >> (sequence % 64)) & 1;
+  }
+
+  // Slides the window forward when the sequence is ahead.  Sequences that
+  // are behind are ignored.
+  void mark(uint64_t sequence) {
+    if (sequence > highest) {
+      if (sequence - highest >= WINDOW_BITS) {
+        fill(words.begin(), words.end(), 0);
+      } else {
+        // Forget whatever used to live in the slots we are moving over
+        for (uint64_t s = highest + 1; s < sequence; s++) {
+          words[(s % WINDOW_BITS) / 64] &= ~(1ULL << (s % 64));
+        }
+      }
+      highest = sequence;
+    } else if (highest - sequence >= WINDOW_BITS) {
+      return;
+    }
+    words[(sequence % WINDOW_BITS) / 64] |= (1ULL << (sequence % 64));
+  }
+
+  uint64_t getHighest() const { return highest; }
+
+ protected:
+  vector<uint64_t> words;
+  uint64_t highest;
+};
+}  // namespace wga
+
+#endif  // __SEQUENCE_WINDOW_H__
@@ -0,0 +1,73 @@
+#include "SessionTicket.hpp"
+
+namespace wga {
+namespace {
+mutex ticketMutex;
+// Never destroyed, so handlers going away during static destruction can
+// still save their clock state
+map<string, SessionTicket>* tickets = new map<string, SessionTicket>();
+
+string makeTicketKey(const PublicKey& myKey, const PublicKey& otherKey) {
+  string key((const char*)myKey.data(), myKey.size());
+  key.append((const char*)otherKey.data(), otherKey.size());
+  return key;
+}
+}  // namespace
+
+void SessionTicketCache::store(const PublicKey& myKey,
+                               const PublicKey& otherKey,
+                               const SessionTicket& ticket) {
+  lock_guard<mutex> guard(ticketMutex);
+  string key = makeTicketKey(myKey, otherKey);
+  if (tickets->size() >= MAX_TICKETS && tickets->find(key) == tickets->end()) {
+    tickets->erase(tickets->begin());
+  }
+  (*tickets)[key] = ticket;
+}
+
+optional<SessionTicket> SessionTicketCache::take(const PublicKey& myKey,
+                                                 const PublicKey& otherKey) {
+  lock_guard<mutex> guard(ticketMutex);
+  auto it = tickets->find(makeTicketKey(myKey, otherKey));
+  if (it == tickets->end()) {
+    return nullopt;
+  }
+  SessionTicket ticket = it->second;
+  tickets->erase(it);
+  return ticket;
+}
+
+optional<SessionTicket> SessionTicketCache::take(const PublicKey& myKey,
+                                                 const PublicKey& otherKey,
+                                                 const string& ticketId) {
+  lock_guard<mutex> guard(ticketMutex);
+  auto it = tickets->find(makeTicketKey(myKey, otherKey));
+  if (it == tickets->end() ||
+      CryptoHandler::getTicketId(it->second.secret) != ticketId) {
+    return nullopt;
+  }
+  SessionTicket ticket = it->second;
+  tickets->erase(it);
+  return ticket;
+}
+
+void SessionTicketCache::updateClockState(const PublicKey& myKey,
+                                          const PublicKey& otherKey,
+                                          const ClockState& clockState) {
+  lock_guard<mutex> guard(ticketMutex);
+  auto it = tickets->find(makeTicketKey(myKey, otherKey));
+  if (it != tickets->end()) {
+    it->second.clockState = clockState;
+  }
+}
+
+int64_t SessionTicketCache::size() {
+  lock_guard<mutex> guard(ticketMutex);
+  return int64_t(tickets->size());
+}
+
+void SessionTicketCache::clear() {
+  lock_guard<mutex> guard(ticketMutex);
+  tickets->clear();
+}
+}  // namespace wga
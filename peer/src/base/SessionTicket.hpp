@@ -0,0 +1,45 @@
+#ifndef __SESSION_TICKET_H__
+#define __SESSION_TICKET_H__
+
+#include "ClockSynchronizer.hpp"
+#include "CryptoHandler.hpp"
+#include "Headers.hpp"
+
+namespace wga {
+// Lets a peer we had a session with come back without a full handshake.
+// Both sides keep the same secret, so a ticket never goes on the wire.
+struct SessionTicket {
+  SessionKey secret;
+  // What the session negotiated, used until the other side confirms
+  uint32_t capabilities;
+  ClockState clockState;
+
+  SessionTicket() : capabilities(0) { secret.fill(0); }
+};
+
+// Tickets for the last session with each peer.  A ticket is taken out when
+// a session resumes with it, so a replayed resumption finds nothing.
+class SessionTicketCache {
+ public:
+  static void store(const PublicKey& myKey, const PublicKey& otherKey,
+                    const SessionTicket& ticket);
+  static optional<SessionTicket> take(const PublicKey& myKey,
+                                      const PublicKey& otherKey);
+  // Only takes the ticket if it has this id, so a resumption naming some
+  // other ticket leaves ours alone
+  static optional<SessionTicket> take(const PublicKey& myKey,
+                                      const PublicKey& otherKey,
+                                      const string& ticketId);
+  // Keeps the clock state of a session that is going away
+  static void updateClockState(const PublicKey& myKey,
+                               const PublicKey& otherKey,
+                               const ClockState& clockState);
+  static int64_t size();
+  static void clear();
+
+ protected:
+  constexpr static size_t MAX_TICKETS = 1024;
+};
+}  // namespace wga
+
+#endif  // __SESSION_TICKET_H__
@@ -0,0 +1,74 @@
+#ifndef __STREAM_REORDER_BUFFER_H__
+#define __STREAM_REORDER_BUFFER_H__
+
+#include "Headers.hpp"
+#include "RpcId.hpp"
+
+namespace wga {
+// Puts requests on ordered streams back in the order they were made.  Every
+// ordered request carries a per-stream sequence number starting at 1, and
+// each stream waits only on its own gaps, so a lost packet on one stream
+// never holds up another.
+class StreamReorderBuffer {
+ public:
+  StreamReorderBuffer() : heldRequests(0) {}
+
+  // Takes a new (not duplicate) request and returns every request that can
+  // be handled now, in order.  Sequence 0 means the stream is unordered.
+  vector<IdPayload> push(const IdPayload& idPayload, uint32_t stream,
+                         uint64_t sequence) {
+    vector<IdPayload> ready;
+    if (sequence == 0) {
+      ready.push_back(idPayload);
+      return ready;
+    }
+    auto& incoming = streams[stream];
+    if (sequence < incoming.nextSequence) {
+      // We passed this one on before but it was dropped further up (for
+      // example before the handshake finished), so let the resend through.
+      ready.push_back(idPayload);
+      return ready;
+    }
+    if (sequence > incoming.nextSequence) {
+      incoming.held[sequence] = idPayload;
+      heldIds.insert(idPayload.id);
+      heldRequests++;
+      return ready;
+    }
+    ready.push_back(idPayload);
+    incoming.nextSequence++;
+    while (!incoming.held.empty() &&
+           incoming.held.begin()->first == incoming.nextSequence) {
+      const IdPayload& next = incoming.held.begin()->second;
+      heldIds.erase(next.id);
+      heldRequests--;
+      ready.push_back(next);
+      incoming.held.erase(incoming.held.begin());
+      incoming.nextSequence++;
+    }
+    return ready;
+  }
+
+  bool contains(const RpcId& rpcId) const {
+    return heldIds.find(rpcId) != heldIds.end();
+  }
+
+  bool empty() const { return heldRequests == 0; }
+  int64_t size() const { return heldRequests; }
+
+ protected:
+  class IncomingStream {
+   public:
+    IncomingStream() : nextSequence(1) {}
+
+    uint64_t nextSequence;
+    map<uint64_t, IdPayload> held;
+  };
+
+  unordered_map<uint32_t, IncomingStream> streams;
+  unordered_set<RpcId> heldIds;
+  int64_t heldRequests;
+};
+}  // namespace wga
+
+#endif  // __STREAM_REORDER_BUFFER_H__
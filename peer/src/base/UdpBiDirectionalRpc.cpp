@@ -1,59 +1,228 @@
 #include "UdpBiDirectionalRpc.hpp"
 
+// How long to hold an ack back hoping it can ride on a request or reply
+#define ACKNOWLEDGE_DELAY_MS (5)
+
+// How long queued rpcs wait for company before going out.  Game code that
+// calls flush() at the end of its update never hits this.
+#define FLUSH_DELAY_MICROS (250)
+
 namespace wga {
-void UdpBiDirectionalRpc::send(const string& message) {
-  if (lastSendTime != time(NULL)) {
-    lastSendTime = time(NULL);
-    sendBytes = 0;
-  }
-  string localMessage = message;  // Needed to keep message in RAM
-  sendBytes += localMessage.size();
-  if (sendBytes > 20 * 1024) {
-    // 10 kb/sec max
-    LOG(INFO) << "Reached max throughput, dropping";
-    return;
-  }
-  for (int a=0;a<(doubleSends?2:1); a++) {
-    int64_t delay = 0;
-    if (flaky) {
-      while (true) {
-        int64_t number = int64_t(flakyDelayDist(generator));
-        if (number > 0 && number < 2000) {
-          delay = number;
-          break;
-        }
+void UdpBiDirectionalRpc::send(const PacketBufferPtr& packet) {
+  int64_t delay = 0;
+  if (flaky) {
+    while (true) {
+      int64_t number = int64_t(flakyDelayDist(generator));
+      if (number > 0 && number < 2000) {
+        delay = number;
+        break;
       }
     }
+  }
+
+  if (delay) {
+    auto timer = shared_ptr<asio::steady_timer>(netEngine->createTimer(
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(delay)));
+    timer->async_wait(
+        strand->wrap([this, packet, timer](const asio::error_code& error) {
+          if (error) {
+            return;
+          }
+          _send(packet);
+        }));
+  } else {
+    _send(packet);
+  }
+}
 
-    if (delay) {
-      auto timer = shared_ptr<asio::steady_timer>(netEngine->createTimer(
-          std::chrono::steady_clock::now() + std::chrono::milliseconds(delay)));
-      timer->async_wait([this, localMessage, timer](const asio::error_code& error) {
+void UdpBiDirectionalRpc::scheduleAcknowledge() {
+  if (acknowledgeScheduled) {
+    return;
+  }
+  acknowledgeScheduled = true;
+  auto timer = shared_ptr<asio::steady_timer>(netEngine->createTimer(
+      std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(ACKNOWLEDGE_DELAY_MS)));
+  timer->async_wait(
+      strand->wrap([this, timer](const asio::error_code& error) {
         if (error) {
           return;
         }
-        _send(localMessage);
-      });
-    } else {
-        _send(localMessage);
-    }
+        lock_guard<recursive_mutex> guard(this->mutex);
+        acknowledgeScheduled = false;
+        if (acknowledgePending) {
+          // No other traffic picked up the ack, send it on its own
+          sendAcknowledge();
+        }
+      }));
+}
+
+void UdpBiDirectionalRpc::scheduleRetransmit(int64_t deadline) {
+  if (retransmitDeadline && retransmitDeadline <= deadline) {
+    // An earlier wakeup is already pending and will reschedule this one
+    return;
+  }
+  retransmitDeadline = deadline;
+  int64_t delay = max(int64_t(0), deadline - monotonicTimeMicros());
+  auto timer = shared_ptr<asio::steady_timer>(netEngine->createTimer(
+      std::chrono::steady_clock::now() + std::chrono::microseconds(delay)));
+  timer->async_wait(strand->wrap(
+      [this, timer, deadline](const asio::error_code& error) {
+        if (error) {
+          return;
+        }
+        lock_guard<recursive_mutex> guard(this->mutex);
+        if (retransmitDeadline != deadline) {
+          // Superseded by an earlier wakeup
+          return;
+        }
+        retransmitDeadline = 0;
+        resendExpiredMessages();
+      }));
+}
+
+void UdpBiDirectionalRpc::scheduleFlush() {
+  if (flushScheduled) {
+    return;
+  }
+  flushScheduled = true;
+  auto timer = shared_ptr<asio::steady_timer>(netEngine->createTimer(
+      std::chrono::steady_clock::now() +
+      std::chrono::microseconds(FLUSH_DELAY_MICROS)));
+  timer->async_wait(
+      strand->wrap([this, timer](const asio::error_code& error) {
+        if (error) {
+          return;
+        }
+        lock_guard<recursive_mutex> guard(this->mutex);
+        flushScheduled = false;
+        flush();
+      }));
+}
+
+int64_t UdpBiDirectionalRpc::getSendBudget() {
+  return congestionController.getSendBudget(monotonicTimeMicros());
+}
+
+void UdpBiDirectionalRpc::schedulePacedFlush() {
+  if (pacedFlushScheduled) {
+    return;
+  }
+  int64_t delay =
+      congestionController.getPacingDelay(maxPacketSize, monotonicTimeMicros());
+  if (delay == 0) {
+    // Held back by the congestion window, the next acknowledge flushes
+    return;
+  }
+  pacedFlushScheduled = true;
+  auto timer = shared_ptr<asio::steady_timer>(netEngine->createTimer(
+      std::chrono::steady_clock::now() + std::chrono::microseconds(delay)));
+  timer->async_wait(
+      strand->wrap([this, timer](const asio::error_code& error) {
+        if (error) {
+          return;
+        }
+        lock_guard<recursive_mutex> guard(this->mutex);
+        pacedFlushScheduled = false;
+        flush();
+      }));
+}
+
+void UdpBiDirectionalRpc::scheduleDrain() {
+  if (drainScheduled.exchange(true)) {
+    // Already on its way, it will see this submission too
+    return;
   }
+  strand->post([this]() {
+    // Clear first so a submission racing with the drain posts again
+    drainScheduled = false;
+    drainSubmissions();
+  });
 }
 
-void UdpBiDirectionalRpc::_send(const string& localMessage) {
-  netEngine->post([this, localMessage]() {
+void UdpBiDirectionalRpc::_send(const PacketBufferPtr& packet) {
+  lock_guard<recursive_mutex> guard(this->mutex);
+  pendingPackets.push_back(packet);
+  if (sendScheduled) {
+    return;
+  }
+  // Everything sent until the io thread gets to this, usually one flush()
+  // worth, goes out together.  With batched io that is one system call.
+  sendScheduled = true;
+  strand->post([this]() {
     lock_guard<recursive_mutex> guard(this->mutex);
-    VLOG(1) << "IN SEND LAMBDA: " << localMessage.length() << " TO "
+    sendScheduled = false;
+    vector<PacketBufferPtr> packets;
+    packets.swap(pendingPackets);
+    VLOG(1) << "IN SEND LAMBDA: " << packets.size() << " packets TO "
             << this->activeEndpoint;
-    try {
-      int bytesSent = int(this->localSocket->send_to(
-          asio::buffer(localMessage), this->activeEndpoint));
-      VLOG(1) << bytesSent << " bytes sent";
-    } catch (const system_error& se) {
-      LOG(ERROR) << "Got error trying to send: " << se.what();
-      // At this point we should try a new endpoint
+    CryptoPipeline* pipeline = netEngine->getCryptoPipeline();
+    if (pipeline == NULL && (socketStrand == strand ||
+                             netEngine->getIoThreadCount() == 1)) {
+      // Nothing else could be using the socket.  The packets go back to the
+      // pool once sent.
+      sendPackets(packets);
+      return;
     }
+    // The connection may be let go of before the socket strand gets to it
+    shared_ptr<UdpBiDirectionalRpc> self = shared_from_this();
+    shared_ptr<Strand> sendStrand = socketStrand;
+    if (pipeline == NULL) {
+      sendStrand->post([self, packets]() { self->sendPackets(packets); });
+      return;
+    }
+    // Every batch goes through the pipeline, even one with nothing to seal,
+    // so batches leave in the order they were made.  The connection may be
+    // let go of while the batch is on a crypto thread too.
+    pipeline->run(cryptoLane, [self, sendStrand, packets]() {
+      vector<PacketBufferPtr> sealed;
+      sealed.reserve(packets.size());
+      {
+        lock_guard<recursive_mutex> guard(self->mutex);
+        for (const auto& it : packets) {
+          if (it->sealPending) {
+            it->sealPending = false;
+            if (!self->finishSealing(it.get())) {
+              continue;
+            }
+          }
+          sealed.push_back(it);
+        }
+      }
+      sendStrand->post([self, sealed]() { self->sendPackets(sealed); });
+    });
   });
 }
 
+void UdpBiDirectionalRpc::sendPackets(const vector<PacketBufferPtr>& packets) {
+  lock_guard<recursive_mutex> guard(this->mutex);
+  if (writeBlocked) {
+    blockedPackets.insert(blockedPackets.end(), packets.begin(),
+                          packets.end());
+    return;
+  }
+  sendDatagramBatch(*localSocket, activeEndpoint, packetPrefix, packets,
+                    &blockedPackets);
+  if (blockedPackets.empty()) {
+    return;
+  }
+  VLOG(1) << "Send buffer full, holding " << blockedPackets.size()
+          << " packets";
+  writeBlocked = true;
+  shared_ptr<UdpBiDirectionalRpc> self = shared_from_this();
+  localSocket->async_wait(
+      udp::socket::wait_write,
+      socketStrand->wrap([self](const asio::error_code& error) {
+        lock_guard<recursive_mutex> guard(self->mutex);
+        self->writeBlocked = false;
+        vector<PacketBufferPtr> packets;
+        packets.swap(self->blockedPackets);
+        if (error) {
+          LOG(ERROR) << "Got error waiting to send: " << error.message();
+          return;
+        }
+        self->sendPackets(packets);
+      }));
+}
+
 }  // namespace wga
@@ -2,37 +2,99 @@
 #define __UDP_BI_DIRECTIONAL_RPC_H__
 
 #include "BiDirectionalRpc.hpp"
+#include "DatagramBatch.hpp"
 #include "NetEngine.hpp"
 
 namespace wga {
-class UdpBiDirectionalRpc : public BiDirectionalRpc {
+class UdpBiDirectionalRpc
+    : public BiDirectionalRpc,
+      public enable_shared_from_this<UdpBiDirectionalRpc> {
  public:
   UdpBiDirectionalRpc(shared_ptr<NetEngine> _netEngine,
                       shared_ptr<udp::socket> _localSocket,
                       bool connectedToHost)
       : BiDirectionalRpc(connectedToHost),
         netEngine(_netEngine),
+        strand(_netEngine->makeStrand()),
+        socketStrand(strand),
         localSocket(_localSocket),
-        flakyDelayDist(100, 100) {}
+        flakyDelayDist(100, 100),
+        acknowledgeScheduled(false),
+        retransmitDeadline(0),
+        flushScheduled(false),
+        pacedFlushScheduled(false),
+        drainScheduled(false),
+        sendScheduled(false),
+        writeBlocked(false) {
+    CryptoPipeline* pipeline = _netEngine->getCryptoPipeline();
+    if (pipeline != NULL) {
+      cryptoLane = pipeline->makeLane();
+    }
+    enableMtuDiscovery();
+  }
 
   virtual ~UdpBiDirectionalRpc() {}
 
-  virtual void send(const string& message);
+  virtual void send(const PacketBufferPtr& packet);
 
   void setEndpoint(const udp::endpoint& destination) {
     activeEndpoint = destination;
   }
 
+  // Every timer and handler of this connection runs on it
+  shared_ptr<Strand> getStrand() { return strand; }
+
+  // Where whoever else uses the socket touches it.  Sends go through it so
+  // they never overlap that receive loop.  Set before the first send.
+  void setSocketStrand(shared_ptr<Strand> _socketStrand) {
+    lock_guard<recursive_mutex> guard(mutex);
+    socketStrand = _socketStrand;
+  }
+
+  // This connection's queue on the crypto pipeline, NULL without one
+  shared_ptr<Strand> getCryptoLane() { return cryptoLane; }
+
  protected:
   shared_ptr<NetEngine> netEngine;
+  shared_ptr<Strand> strand;
+  // The socket is only used from here, which is strand unless the socket
+  // is shared
+  shared_ptr<Strand> socketStrand;
+  shared_ptr<Strand> cryptoLane;
   shared_ptr<udp::socket> localSocket;
   udp::endpoint activeEndpoint;
+  // Goes on the wire in front of every packet, gathered from here rather
+  // than copied into the packet
+  string packetPrefix;
   normal_distribution<double> flakyDelayDist;
   default_random_engine generator;
-  time_t lastSendTime = 0;
-  int sendBytes = 0;
-  bool doubleSends = true;
-  void _send(const string& message);
+  bool acknowledgeScheduled;
+  int64_t retransmitDeadline;
+  bool flushScheduled;
+  bool pacedFlushScheduled;
+  atomic<bool> drainScheduled;
+  // Packets waiting for the io thread to send them together
+  vector<PacketBufferPtr> pendingPackets;
+  bool sendScheduled;
+  // Packets that didn't fit in the socket's send buffer, and any sent after
+  // them, waiting for it to drain
+  vector<PacketBufferPtr> blockedPackets;
+  bool writeBlocked;
+  void _send(const PacketBufferPtr& packet);
+  // Puts packets on the wire, behind any still waiting for the socket.
+  // Runs on the socket strand.
+  void sendPackets(const vector<PacketBufferPtr>& packets);
+  // Encrypts a packet whose seal was left to the crypto pipeline.  Returns
+  // false when the packet can't be sealed anymore and has to be dropped.
+  virtual bool finishSealing(PacketBuffer* packet) { return true; }
+  virtual void scheduleAcknowledge();
+  virtual void scheduleRetransmit(int64_t deadline);
+  virtual void scheduleFlush();
+  virtual int64_t getSendBudget();
+  virtual void schedulePacedFlush();
+  virtual bool isOwnerThread() { return strand->running_in_this_thread(); }
+  virtual void scheduleDrain();
+  virtual int64_t getPacketOverhead() { return int64_t(packetPrefix.length()); }
 };
 }  // namespace wga
 
@@ -25,6 +25,8 @@ MyPeer::MyPeer(const string& _userId, const PrivateKey& _privateKey,
   {
     netEngine.reset(new NetEngine());
     netEngine->start();
+    // Keeps the update loop serialized when the engine runs several threads
+    strand = netEngine->makeStrand();
 
     // Use STUN to get public IPs
     LOG(INFO) << "GETTTING PUBLIC IPs";
@@ -142,6 +144,11 @@ MyPeer::MyPeer(const string& _userId, const PrivateKey& _privateKey,
     LOG(ERROR) << "Setting reuse failed.  Socket may be bocked after exiting";
   }
   rpcServer.reset(new RpcServer(netEngine, localSocket));
+  rpcServer->setRequestHandler(
+      std::bind(&MyPeer::handleInputRequest, this, std::placeholders::_1));
+  rpcServer->setReplyHandler([](const UserIdIdPayload& reply) {
+    // We don't need to handle replies
+  });
   LOG(INFO) << "STARTED SERVER ON PORT: " << serverPort;
 
   client.reset(new HttpClientMuxer(lobbyHost + ":" + to_string(lobbyPort)));
@@ -208,7 +215,7 @@ void MyPeer::shutdown() {
     rpcServer.reset();
     client.reset();
 
-    netEngine->post([this]() {
+    strand->post([this]() {
       localSocket.reset();
       updateTimer.reset();
       stunEndpoints.clear();
@@ -285,8 +292,8 @@ void MyPeer::start() {
 
   updateTimer.reset(netEngine->createTimer(std::chrono::steady_clock::now() +
                                            std::chrono::seconds(1)));
-  updateTimer->async_wait(
-      std::bind(&MyPeer::checkForEndpoints, this, std::placeholders::_1));
+  updateTimer->async_wait(strand->wrap(
+      std::bind(&MyPeer::checkForEndpoints, this, std::placeholders::_1)));
   LOG(INFO) << "CALLING HEARTBEAT: "
             << std::chrono::duration_cast<std::chrono::seconds>(
                    updateTimer->expires_at().time_since_epoch())
@@ -339,8 +346,8 @@ void MyPeer::checkForEndpoints(const asio::error_code& error) {
   if (!result["ready"].get<bool>()) {
     updateTimer->expires_at(updateTimer->expires_at() +
                             asio::chrono::milliseconds(1000));
-    updateTimer->async_wait(
-        std::bind(&MyPeer::checkForEndpoints, this, std::placeholders::_1));
+    updateTimer->async_wait(strand->wrap(
+        std::bind(&MyPeer::checkForEndpoints, this, std::placeholders::_1)));
     LOG(INFO) << "Game is not ready, waiting...";
     return;
   }
@@ -404,7 +411,9 @@ void MyPeer::checkForEndpoints(const asio::error_code& error) {
       }
     }
     rpcServer->addEndpoint(id, endpointHandler);
-	  endpointHandler->sendSessionKey();
+	  if (!endpointHandler->resumeSession()) {
+	    endpointHandler->sendSessionKey();
+	  }
   }
 
   // this_thread::sleep_for(chrono::seconds(1));
@@ -482,35 +491,9 @@ void MyPeer::update(const asio::error_code& error) {
     rpcServer->heartbeat();
   }
 
-  for (const auto& it : peerData) {
-    auto peerKey = it.first;
-    if (peerKey == userId) {
-      continue;
-    }
-    auto endpointHandler = rpcServer->getEndpointHandler(peerKey);
-    while (endpointHandler->hasIncomingRequest()) {
-      auto idPayload = endpointHandler->getFirstIncomingRequest();
-      MessageReader reader;
-      reader.load(idPayload.payload);
-      for (int a = 0; a < INPUT_SEND_WINDOW_SIZE; a++) {
-        int64_t startTime = reader.readPrimitive<int64_t>();
-        int64_t endTime = reader.readPrimitive<int64_t>();
-        unordered_map<string, string> m =
-            reader.readMap<unordered_map<string, string>>();
-        LOG_EVERY_N(60, INFO)
-            << "GOT INPUTS: " << peerKey << " " << startTime << " " << endTime;
-        {
-          lock_guard<recursive_mutex> guard(peerDataMutex);
-          peerData[peerKey]->playerInputData.put(startTime, endTime, m);
-        }
-      }
-      endpointHandler->replyOneWay(idPayload.id);
-    }
-    while (endpointHandler->hasIncomingReply()) {
-      auto idPayload = endpointHandler->getFirstIncomingReply();
-      // We don't need to handle replies
-    }
-  }
+  rpcServer->sendClockProbes();
+  // Everything queued during this update goes out together
+  rpcServer->flush();
 
   updateCounter++;
   VLOG(1) << "UPDATE END";
@@ -518,15 +501,43 @@ void MyPeer::update(const asio::error_code& error) {
   if (!shuttingDown) {
     updateTimer->expires_at(updateTimer->expires_at() +
                             asio::chrono::milliseconds(1));
-    updateTimer->async_wait(
-        std::bind(&MyPeer::update, this, std::placeholders::_1));
+    updateTimer->async_wait(strand->wrap(
+        std::bind(&MyPeer::update, this, std::placeholders::_1)));
   } else {
     LOG(ERROR) << "Shutting down, stopping updates";
     updateFinished = true;
   }
 }
 
+void MyPeer::handleInputRequest(const UserIdIdPayload& request) {
+  // Runs on the io thread as soon as the packet is decoded
+  lock_guard<recursive_mutex> guard(peerDataMutex);
+  if (rpcServer.get() == NULL) {
+    // Connection has finished
+    return;
+  }
+  const string& peerKey = request.userId;
+  auto peerIt = peerData.find(peerKey);
+  if (peerIt == peerData.end() || peerIt->second.get() == NULL) {
+    LOG(ERROR) << "Got inputs from an unknown peer: " << peerKey;
+    return;
+  }
+  MessageReader reader;
+  reader.load(request.payload);
+  for (int a = 0; a < INPUT_SEND_WINDOW_SIZE; a++) {
+    int64_t startTime = reader.readPrimitive<int64_t>();
+    int64_t endTime = reader.readPrimitive<int64_t>();
+    unordered_map<string, string> m =
+        reader.readMap<unordered_map<string, string>>();
+    LOG_EVERY_N(60, INFO) << "GOT INPUTS: " << peerKey << " " << startTime
+                          << " " << endTime;
+    peerIt->second->playerInputData.put(startTime, endTime, m);
+  }
+  rpcServer->reply(peerKey, request.id, "OK");
+}
+
 bool MyPeer::initialized() {
+  map<string, double> progress;
   {
     lock_guard<recursive_mutex> guard(peerDataMutex);
     if (myData.get() == NULL) {
@@ -536,19 +547,33 @@ bool MyPeer::initialized() {
     if (!rpcServer->readyToSend()) {
       return false;
     }
+
+    if (!timeShiftInitialized) {
+      timeShiftInitialized = true;
+      // Every peer bootstraps at once, so this takes about as long as the
+      // slowest one.  The probes go out from update().
+      rpcServer->startClockBootstrap();
+    }
+    progress = rpcServer->getClockBootstrapProgress();
   }
 
-  if (!timeShiftInitialized) {
-    timeShiftInitialized = true;
-    for (const auto& it : peerData) {
-      auto peerKey = it.first;
-      if (peerKey == userId) {
-        continue;
-      }
-      auto endpointHandler = rpcServer->getEndpointHandler(peerKey);
-      endpointHandler->initTimeShift();
+  int settledPeers = 0;
+  string slowestPeer;
+  double slowestProgress = 1.0;
+  for (const auto& it : progress) {
+    if (it.second >= 1.0) {
+      settledPeers++;
+    } else if (it.second < slowestProgress) {
+      slowestPeer = it.first;
+      slowestProgress = it.second;
     }
   }
+  if (settledPeers < int(progress.size())) {
+    LOG(INFO) << "Synchronizing clocks: " << settledPeers << "/"
+              << progress.size() << " peers settled, " << slowestPeer
+              << " is " << int(slowestProgress * 100) << "% there";
+    return false;
+  }
 
   return true;
 }
@@ -604,6 +629,16 @@ void MyPeer::updateState(int64_t timestamp,
     lock_guard<recursive_mutex> guard(peerDataMutex);
     int64_t lastExpirationTime = myData->playerInputData.getExpirationTime();
     auto changedData = myData->playerInputData.getChanges(data);
+    vector<string> newKeys;
+    for (const auto& it : data) {
+      if (dictionaryKeys.insert(it.first).second) {
+        newKeys.push_back(it.first);
+      }
+    }
+    if (!newKeys.empty()) {
+      // Every input packet repeats these, so they make a good dictionary
+      rpcServer->primeCompressionDictionary(newKeys);
+    }
     myData->playerInputData.put(lastExpirationTime, timestamp, changedData);
     lastSendBuffer.push_back(
         make_tuple(lastExpirationTime, timestamp, changedData));
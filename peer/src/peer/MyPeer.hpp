@@ -77,6 +77,7 @@ class MyPeer {
   bool shuttingDown;
   bool updateFinished;
   shared_ptr<NetEngine> netEngine;
+  shared_ptr<Strand> strand;
   shared_ptr<HttpClientMuxer> client;
   string gameId;
   int serverPort;
@@ -88,6 +89,8 @@ class MyPeer {
   shared_ptr<udp::socket> localSocket;
   shared_ptr<asio::steady_timer> updateTimer;
   deque<tuple<int64_t, int64_t, unordered_map<string, string>>> lastSendBuffer;
+  // Input names already in the compression dictionary
+  unordered_set<string> dictionaryKeys;
   string lobbyHost;
   int lobbyPort;
   string gameName;
@@ -101,6 +104,7 @@ class MyPeer {
   vector<string> getMyIps();
   void updateEndpointServerHttp();
   void getInitialPosition();
+  void handleInputRequest(const UserIdIdPayload& request);
 };
 }  // namespace wga
 
@@ -0,0 +1,57 @@
+#include "Headers.hpp"
+
+#include "AckBitmap.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("AckBitmapSimple") {
+  AckBitmap bitmap;
+  REQUIRE(bitmap.empty());
+  REQUIRE(!bitmap.contains(1));
+
+  REQUIRE(bitmap.markReceived(1));
+  REQUIRE(bitmap.markReceived(2));
+  REQUIRE(bitmap.markReceived(4));
+  REQUIRE(!bitmap.markReceived(2));
+
+  REQUIRE(bitmap.getLargest() == 4);
+  REQUIRE(bitmap.contains(1));
+  REQUIRE(bitmap.contains(2));
+  REQUIRE(!bitmap.contains(3));
+  REQUIRE(bitmap.contains(4));
+  REQUIRE(!bitmap.contains(5));
+
+  // Late arrival fills the hole
+  REQUIRE(bitmap.markReceived(3));
+  REQUIRE(bitmap.contains(3));
+
+  // Round trip through the wire representation
+  AckBitmap copy(bitmap.getLargest(), bitmap.getBits());
+  for (uint64_t a = 1; a <= 4; a++) {
+    REQUIRE(copy.contains(a));
+  }
+}
+
+TEST_CASE("AckBitmapWindow") {
+  AckBitmap bitmap;
+  REQUIRE(bitmap.markReceived(10));
+  REQUIRE(bitmap.markReceived(10 + AckBitmap::WINDOW));
+  REQUIRE(bitmap.contains(10));
+  REQUIRE(bitmap.getOldest() == 10);
+
+  REQUIRE(bitmap.markReceived(11 + AckBitmap::WINDOW));
+  REQUIRE(!bitmap.contains(10));
+  REQUIRE(bitmap.contains(10 + AckBitmap::WINDOW));
+
+  // Too old to track
+  REQUIRE(!bitmap.markReceived(5));
+
+  // A big jump clears everything behind it
+  REQUIRE(bitmap.markReceived(1000));
+  REQUIRE(bitmap.contains(1000));
+  REQUIRE(!bitmap.contains(11 + AckBitmap::WINDOW));
+  REQUIRE(bitmap.getBits() == 0);
+}
+}  // namespace wga
@@ -0,0 +1,41 @@
+#include "Headers.hpp"
+
+#include "BarrierReorderBuffer.hpp"
+#include "TestHelpers.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("BarrierReorderBufferInOrder") {
+  BarrierReorderBuffer buffer;
+  REQUIRE(payloads(buffer.push(IdPayload(RpcId(0, 1), "A"), 0)) ==
+          vector<string>({"A"}));
+  REQUIRE(payloads(buffer.push(IdPayload(RpcId(0, 2), "B"), 0)) ==
+          vector<string>({"B"}));
+  REQUIRE(payloads(buffer.push(IdPayload(RpcId(1, 3), "C"), 2)) ==
+          vector<string>({"C"}));
+  REQUIRE(buffer.empty());
+}
+
+TEST_CASE("BarrierReorderBufferHoldsGenerations") {
+  BarrierReorderBuffer buffer;
+  // Generation 0 has two requests, generation 1 has one, generation 3 has
+  // one (2 was empty).
+  REQUIRE(buffer.push(IdPayload(RpcId(3, 5), "E"), 3).empty());
+  REQUIRE(buffer.push(IdPayload(RpcId(1, 3), "C"), 2).empty());
+  REQUIRE(buffer.size() == 2);
+  REQUIRE(buffer.contains(RpcId(3, 5)));
+
+  // Requests within the open generation go straight through
+  REQUIRE(payloads(buffer.push(IdPayload(RpcId(0, 2), "B"), 0)) ==
+          vector<string>({"B"}));
+  REQUIRE(buffer.size() == 2);
+
+  // The last request of generation 0 releases everything behind it
+  REQUIRE(payloads(buffer.push(IdPayload(RpcId(0, 1), "A"), 0)) ==
+          vector<string>({"A", "C", "E"}));
+  REQUIRE(buffer.empty());
+  REQUIRE(!buffer.contains(RpcId(3, 5)));
+}
+}  // namespace wga
@@ -0,0 +1,881 @@
+#include "Headers.hpp"
+
+#include "BiDirectionalRpc.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+// Keeps every datagram instead of putting it on the wire, and only flushes
+// when the test says so.
+class CapturingRpc : public BiDirectionalRpc {
+ public:
+  CapturingRpc() : BiDirectionalRpc(false) {}
+
+  vector<string> sent;
+
+  void deliverTo(CapturingRpc& other) {
+    for (const auto& it : sent) {
+      other.receive(it);
+    }
+    sent.clear();
+  }
+
+  bool hasPendingAcknowledge() { return acknowledgePending; }
+  void acknowledge() { sendAcknowledge(); }
+  void publish() { publishStats(monotonicTimeMicros()); }
+
+ protected:
+  virtual void send(const PacketBufferPtr& packet) {
+    sent.push_back(packet->toString());
+  }
+  virtual void scheduleFlush() {}
+  virtual void scheduleAcknowledge() {}
+};
+
+// Only lets flush() send sendBudget bytes at a time
+class BudgetRpc : public CapturingRpc {
+ public:
+  BudgetRpc() : sendBudget(numeric_limits<int64_t>::max()) {}
+
+  int64_t sendBudget;
+
+ protected:
+  virtual int64_t getSendBudget() { return sendBudget; }
+};
+
+// Sends parity over every two packets, whatever the loss
+class ParityRpc : public CapturingRpc {
+ public:
+  ParityRpc() {
+    enableForwardErrorCorrection();
+    parityEncoder.configure(2, 1);
+  }
+};
+
+// Seals packets by xoring them with a key behind a copy of the key, which
+// is enough to tell sealed packets apart and to catch the wrong key.
+class SealingRpc : public CapturingRpc {
+ public:
+  SealingRpc() : key('K'), canOpen(true) {}
+
+  char key;
+  bool canOpen;
+
+ protected:
+  virtual bool sealPacket(PacketBuffer* packet) {
+    size_t length = packet->size();
+    char* start = packet->prepend(1);
+    start[0] = key;
+    for (size_t a = 1; a <= length; a++) {
+      start[a] ^= key;
+    }
+    return true;
+  }
+  virtual PacketOpenResult openPacket(const char* sealed, size_t size,
+                                      string* opened) {
+    if (!canOpen) {
+      return PACKET_UNREADABLE;
+    }
+    if (!size || sealed[0] != key) {
+      return PACKET_FORGED;
+    }
+    opened->assign(sealed + 1, size - 1);
+    for (auto& it : *opened) {
+      it ^= key;
+    }
+    return PACKET_OPENED;
+  }
+  virtual bool validatePacket(RpcHeader type, const RpcId& rpcId,
+                              const string& payload) {
+    return processingSealedPacket ||
+           (type == REQUEST && rpcId == SESSION_KEY_RPCID);
+  }
+  virtual bool requiresSealedPackets() { return true; }
+};
+
+// Pretends every caller is a foreign thread, so one-way requests and barriers
+// wait in the submission queue until the test flushes.
+class ForeignThreadRpc : public CapturingRpc {
+ protected:
+  virtual bool isOwnerThread() { return false; }
+  virtual void scheduleDrain() {}
+};
+
+TEST_CASE("BiDirectionalRpcCoalescesRpcs") {
+  CapturingRpc client, server;
+  for (int a = 0; a < 20; a++) {
+    client.request(string("REQUEST_") + to_string(a));
+  }
+  REQUIRE(client.sent.empty());
+  client.flush();
+  REQUIRE(client.sent.size() == 1);
+
+  client.deliverTo(server);
+  int numRequests = 0;
+  while (server.hasIncomingRequest()) {
+    auto idPayload = server.getFirstIncomingRequest();
+    server.reply(idPayload.id, "REPLY");
+    numRequests++;
+  }
+  REQUIRE(numRequests == 20);
+  server.flush();
+  REQUIRE(server.sent.size() == 1);
+
+  server.deliverTo(client);
+  int numReplies = 0;
+  while (client.hasIncomingReply()) {
+    client.getFirstIncomingReply();
+    numReplies++;
+  }
+  REQUIRE(numReplies == 20);
+}
+
+TEST_CASE("BiDirectionalRpcSequencesRpcIds") {
+  CapturingRpc client, server;
+  client.enableSequencedRpcIds(0);
+  server.enableSequencedRpcIds(1);
+  vector<RpcId> clientIds;
+  for (int a = 0; a < 3; a++) {
+    clientIds.push_back(client.request(string("REQUEST_") + to_string(a)));
+  }
+  auto serverId = server.request("SERVER_REQUEST");
+  for (int a = 0; a < 3; a++) {
+    REQUIRE(clientIds[a].isSequenced());
+    REQUIRE(clientIds[a].getSequenceSide() == 0);
+    REQUIRE(clientIds[a].getSequence() == uint64_t(a + 1));
+  }
+  // The same sequence number from the other side is a different id
+  REQUIRE(serverId.isSequenced());
+  REQUIRE(serverId.getSequenceSide() == 1);
+  REQUIRE(serverId.getSequence() == 1);
+  REQUIRE(serverId != clientIds[0]);
+
+  client.flush();
+  vector<string> packets = client.sent;
+  client.deliverTo(server);
+  server.flush();
+  server.deliverTo(client);
+  REQUIRE(client.hasIncomingRequest());
+  auto idPayload = client.getFirstIncomingRequest();
+  REQUIRE(idPayload.id == serverId);
+  client.reply(idPayload.id, "SERVER_REPLY");
+
+  set<RpcId> requestIds;
+  while (server.hasIncomingRequest()) {
+    idPayload = server.getFirstIncomingRequest();
+    requestIds.insert(idPayload.id);
+    server.reply(idPayload.id, "REPLY");
+  }
+  REQUIRE(requestIds == set<RpcId>(clientIds.begin(), clientIds.end()));
+
+  // Duplicates are caught by the sequence window
+  for (const auto& it : packets) {
+    server.receive(it);
+  }
+  REQUIRE(!server.hasIncomingRequest());
+
+  server.flush();
+  server.deliverTo(client);
+  client.flush();
+  client.deliverTo(server);
+  for (const auto& it : clientIds) {
+    REQUIRE(client.hasIncomingReplyWithId(it));
+  }
+  REQUIRE(server.hasIncomingReplyWithId(serverId));
+}
+
+TEST_CASE("BiDirectionalRpcMixesSequencedAndRandomIds") {
+  CapturingRpc client, server;
+  client.enableSequencedRpcIds(0);
+  auto sequencedId = client.request("SEQUENCED");
+  auto randomId = server.request("RANDOM");
+  REQUIRE(sequencedId.isSequenced());
+  REQUIRE(!randomId.isSequenced());
+
+  client.flush();
+  client.deliverTo(server);
+  server.flush();
+  server.deliverTo(client);
+  REQUIRE(server.hasIncomingRequest());
+  auto idPayload = server.getFirstIncomingRequest();
+  REQUIRE(idPayload.id == sequencedId);
+  server.reply(idPayload.id, "SEQUENCED_REPLY");
+  REQUIRE(client.hasIncomingRequest());
+  idPayload = client.getFirstIncomingRequest();
+  REQUIRE(idPayload.id == randomId);
+  client.reply(idPayload.id, "RANDOM_REPLY");
+
+  client.flush();
+  client.deliverTo(server);
+  server.flush();
+  server.deliverTo(client);
+  REQUIRE(client.hasIncomingReplyWithId(sequencedId));
+  REQUIRE(server.hasIncomingReplyWithId(randomId));
+}
+
+TEST_CASE("BiDirectionalRpcRespectsMaxPacketSize") {
+  CapturingRpc client, server;
+  client.setMaxPacketSize(1200);
+  for (int a = 0; a < 10; a++) {
+    client.request(string(500, 'a' + a));
+  }
+  client.flush();
+  REQUIRE(client.sent.size() == 5);
+  for (const auto& it : client.sent) {
+    REQUIRE(it.length() <= 1200);
+  }
+
+  // An rpc bigger than a packet goes out in pieces
+  client.sent.clear();
+  client.request(string(2000, 'z'));
+  client.request("SMALL");
+  client.flush();
+  REQUIRE(client.sent.size() == 2);
+  for (const auto& it : client.sent) {
+    REQUIRE(it.length() <= 1200);
+  }
+
+  client.deliverTo(server);
+  vector<string> payloads;
+  while (server.hasIncomingRequest()) {
+    auto idPayload = server.getFirstIncomingRequest();
+    server.reply(idPayload.id, "OK");
+    payloads.push_back(idPayload.payload);
+  }
+  sort(payloads.begin(), payloads.end());
+  REQUIRE(payloads == vector<string>({"SMALL", string(2000, 'z')}));
+}
+
+TEST_CASE("BiDirectionalRpcResendsMissingFragments") {
+  CapturingRpc client, server;
+  client.setMaxPacketSize(600);
+  string payload;
+  for (int a = 0; a < 3000; a++) {
+    payload += char('a' + (a % 26));
+  }
+  client.request(payload);
+  client.flush();
+  REQUIRE(client.sent.size() > 4);
+
+  // Lose one piece
+  client.sent.erase(client.sent.begin() + 2);
+  client.deliverTo(server);
+  REQUIRE(!server.hasIncomingRequest());
+  server.acknowledge();
+  server.deliverTo(client);
+
+  // Only the missing piece goes out again
+  client.resendOldestOutgoingMessage();
+  REQUIRE(client.sent.size() == 1);
+  client.deliverTo(server);
+  REQUIRE(server.hasIncomingRequest());
+  REQUIRE(server.getFirstIncomingRequest().payload == payload);
+}
+
+TEST_CASE("BiDirectionalRpcDiscoversPathMtu") {
+  CapturingRpc client, server;
+  client.enableMtuDiscovery();
+  REQUIRE(client.getMaxPacketSize() == 1200);
+  client.heartbeat();
+  // The probe and the heartbeat ping
+  REQUIRE(client.sent.size() == 2);
+  REQUIRE(client.sent[0].length() > 1200);
+  REQUIRE(client.sent[0].length() <= 1326);
+  client.deliverTo(server);
+  server.acknowledge();
+  server.deliverTo(client);
+  REQUIRE(client.getMaxPacketSize() == 1326);
+}
+
+TEST_CASE("BiDirectionalRpcMixesRequestsAndReplies") {
+  CapturingRpc client, server;
+  client.request("FIRST");
+  client.flush();
+  client.deliverTo(server);
+
+  auto idPayload = server.getFirstIncomingRequest();
+  server.reply(idPayload.id, "FIRST_REPLY");
+  server.request("SECOND");
+  server.flush();
+  REQUIRE(server.sent.size() == 1);
+
+  server.deliverTo(client);
+  REQUIRE(client.hasIncomingReply());
+  REQUIRE(client.getFirstIncomingReply().payload == "FIRST_REPLY");
+  REQUIRE(client.hasIncomingRequest());
+  REQUIRE(client.getFirstIncomingRequest().payload == "SECOND");
+}
+
+TEST_CASE("BiDirectionalRpcDrainsSubmissions") {
+  ForeignThreadRpc client;
+  CapturingRpc server;
+  vector<string> delivered;
+  server.setRequestHandler([&](const IdPayload& idPayload) {
+    delivered.push_back(idPayload.payload);
+    server.replyOneWay(idPayload.id);
+  });
+  thread producer([&client]() {
+    client.requestOneWay("FIRST");
+    client.requestOneWay("SECOND");
+    client.barrier();
+    client.requestOneWay("THIRD");
+  });
+  producer.join();
+  REQUIRE(client.hasWork());
+  REQUIRE(client.sent.empty());
+
+  client.flush();
+  REQUIRE(client.sent.size() == 1);
+  client.deliverTo(server);
+  REQUIRE(delivered == vector<string>({"FIRST", "SECOND", "THIRD"}));
+}
+
+TEST_CASE("BiDirectionalRpcHoldsLaterBarriers") {
+  CapturingRpc client, server;
+  vector<string> delivered;
+  server.setRequestHandler([&](const IdPayload& idPayload) {
+    delivered.push_back(idPayload.payload);
+    server.replyOneWay(idPayload.id);
+  });
+
+  client.requestOneWay("BEFORE");
+  client.flush();
+  string firstPacket = client.sent.back();
+  client.barrier();
+  client.requestOneWay("AFTER_1");
+  client.requestOneWay("AFTER_2");
+  client.flush();
+  // Both generations are in flight at once
+  REQUIRE(client.sent.size() == 2);
+  string secondPacket = client.sent.back();
+  client.sent.clear();
+
+  // The later generation arrives first and waits
+  server.receive(secondPacket);
+  REQUIRE(delivered.empty());
+  REQUIRE(server.hasWork());
+
+  server.receive(firstPacket);
+  REQUIRE(delivered.size() == 3);
+  REQUIRE(delivered[0] == "BEFORE");
+}
+
+TEST_CASE("BiDirectionalRpcRefusesRequestsFromOlderBarriers") {
+  CapturingRpc client, server;
+  RpcId before = client.request("BEFORE");
+  client.barrier();
+  client.request("AFTER");
+  REQUIRE(!client.requestWithId(
+      IdPayload(RpcId(before.barrier, before.id + 1), "LATE")));
+
+  client.flush();
+  client.deliverTo(server);
+  vector<string> payloads;
+  while (server.hasIncomingRequest()) {
+    auto idPayload = server.getFirstIncomingRequest();
+    payloads.push_back(idPayload.payload);
+    server.replyOneWay(idPayload.id);
+  }
+  sort(payloads.begin(), payloads.end());
+  REQUIRE(payloads == vector<string>({"AFTER", "BEFORE"}));
+}
+
+TEST_CASE("BiDirectionalRpcPushesToHandlers") {
+  CapturingRpc client, server;
+  vector<string> requestsSeen;
+  server.setRequestHandler([&](const IdPayload& idPayload) {
+    requestsSeen.push_back(idPayload.payload);
+    // Handlers run outside the lock and may reply right away
+    server.reply(idPayload.id, idPayload.payload + "_REPLY");
+  });
+  // Replies are handed to an executor that runs them later
+  vector<function<void()>> deferred;
+  vector<string> repliesSeen;
+  client.setReplyHandler(
+      [&](const IdPayload& idPayload) {
+        repliesSeen.push_back(idPayload.payload);
+      },
+      [&](function<void()> f) { deferred.push_back(f); });
+
+  auto rpcId = client.request("HELLO");
+  client.flush();
+  client.deliverTo(server);
+  REQUIRE(requestsSeen == vector<string>({"HELLO"}));
+  REQUIRE(!server.hasIncomingRequest());
+
+  server.flush();
+  server.deliverTo(client);
+  REQUIRE(repliesSeen.empty());
+  REQUIRE(deferred.size() == 1);
+  deferred[0]();
+  REQUIRE(repliesSeen == vector<string>({"HELLO_REPLY"}));
+  // The handler consumed the reply
+  REQUIRE(!client.hasIncomingReply());
+  REQUIRE(client.hasProcessedReplyWithId(rpcId));
+}
+
+TEST_CASE("BiDirectionalRpcBootstrapsTheClock") {
+  CapturingRpc client, server;
+  client.startClockBootstrap();
+  REQUIRE(!client.isClockBootstrapped());
+
+  // Spaced out, and only a few waiting on replies at once.  The probe clock
+  // is ours, so this doesn't depend on how fast the test runs.
+  int64_t now = monotonicTimeMicros();
+  client.sendClockProbes(now);
+  client.sendClockProbes(now + 1000);
+  client.flush();
+  REQUIRE(client.sent.size() == 1);
+  for (int a = 0; a < 10; a++) {
+    now += 6 * 1000;
+    client.sendClockProbes(now);
+    client.flush();
+  }
+  REQUIRE(client.sent.size() == 4);
+  REQUIRE(client.getClockBootstrapProgress() == 0.0);
+
+  int rounds = 0;
+  while (!client.isClockBootstrapped()) {
+    REQUIRE(rounds++ < 100);
+    client.deliverTo(server);
+    server.flush();
+    server.deliverTo(client);
+    REQUIRE(client.getClockBootstrapProgress() > 0.0);
+    now += 6 * 1000;
+    client.sendClockProbes(now);
+    client.flush();
+  }
+  REQUIRE(client.getClockBootstrapProgress() == 1.0);
+  // Done, nothing more goes out
+  client.sent.clear();
+  now += 6 * 1000;
+  client.sendClockProbes(now);
+  client.flush();
+  REQUIRE(client.sent.empty());
+}
+
+TEST_CASE("BiDirectionalRpcTimesTheClockFromTheFirstSend") {
+  BudgetRpc client;
+  CapturingRpc server;
+  client.sendBudget = 0;
+  client.request("PING");
+  client.flush();
+  REQUIRE(client.sent.empty());
+  // Time spent waiting to go out is not time on the wire
+  microsleep(200 * 1000);
+  client.sendBudget = numeric_limits<int64_t>::max();
+  client.flush();
+  REQUIRE(client.sent.size() == 1);
+  // Answered as soon as it arrives
+  client.deliverTo(server);
+  server.flush();
+  server.deliverTo(client);
+  REQUIRE(client.hasIncomingReply());
+  REQUIRE(client.getLatency().first < 50 * 1000);
+}
+
+TEST_CASE("BiDirectionalRpcExpiresLostClockProbes") {
+  CapturingRpc client, server;
+  client.startClockBootstrap();
+  int64_t now = monotonicTimeMicros();
+  for (int a = 0; a < 5; a++) {
+    client.sendClockProbes(now);
+    client.flush();
+    now += 6 * 1000;
+  }
+  // The most that can wait on replies
+  REQUIRE(client.sent.size() == 4);
+  client.sent.clear();
+
+  // Later packets get through, so the probes are lost
+  for (int a = 0; a < 3; a++) {
+    client.requestOneWay("LATER");
+    client.flush();
+  }
+  client.deliverTo(server);
+  server.acknowledge();
+  server.deliverTo(client);
+
+  // Their slots go to new probes
+  client.sendClockProbes(now);
+  client.flush();
+  REQUIRE(client.sent.size() == 1);
+}
+
+TEST_CASE("BiDirectionalRpcUnreliable") {
+  CapturingRpc client, server;
+  client.sendUnreliable("U1");
+  client.sendUnreliable("U2");
+  client.flush();
+  REQUIRE(client.sent.size() == 1);
+  string packet = client.sent[0];
+  client.deliverTo(server);
+  // Nothing to retire, so nothing to acknowledge
+  REQUIRE(!server.hasPendingAcknowledge());
+  REQUIRE(!client.hasWork());
+
+  // A duplicated datagram doesn't deliver twice
+  server.receive(packet);
+  vector<string> received;
+  while (server.hasIncomingUnreliable()) {
+    auto message = server.getFirstIncomingUnreliable();
+    REQUIRE(!message.sequenced);
+    received.push_back(message.payload);
+  }
+  REQUIRE(received == vector<string>({"U1", "U2"}));
+
+  // Rides along with rpcs, which still get acknowledged
+  client.request("RELIABLE");
+  client.sendUnreliable("U3");
+  client.flush();
+  REQUIRE(client.sent.size() == 1);
+  client.deliverTo(server);
+  REQUIRE(server.hasPendingAcknowledge());
+  REQUIRE(server.hasIncomingRequest());
+  REQUIRE(server.getFirstIncomingUnreliable().payload == "U3");
+}
+
+TEST_CASE("BiDirectionalRpcUnreliableSequenced") {
+  CapturingRpc client, server;
+  vector<string> packets;
+  for (int a = 1; a <= 3; a++) {
+    client.sendUnreliableSequenced(7, string("STATE_") + to_string(a));
+    client.sendUnreliableSequenced(8, string("OTHER_") + to_string(a));
+    client.flush();
+    packets.push_back(client.sent.back());
+  }
+
+  vector<string> received;
+  server.setUnreliableHandler([&](const UnreliableMessage& message) {
+    REQUIRE(message.sequenced);
+    received.push_back(message.payload);
+  });
+  // Late arrivals lose to newer state on the same channel
+  server.receive(packets[0]);
+  server.receive(packets[2]);
+  server.receive(packets[1]);
+  REQUIRE(received == vector<string>({"STATE_1", "OTHER_1", "STATE_3",
+                                      "OTHER_3"}));
+}
+
+TEST_CASE("BiDirectionalRpcOrderedStreams") {
+  CapturingRpc client, server;
+  client.openStream(5, PRIORITY_NORMAL, true);
+  vector<string> delivered;
+  server.setRequestHandler([&](const IdPayload& idPayload) {
+    delivered.push_back(idPayload.payload);
+    server.replyOneWay(idPayload.id);
+  });
+
+  vector<string> packets;
+  client.requestOneWay("ORDERED_1", 5);
+  client.flush();
+  packets.push_back(client.sent.back());
+  client.requestOneWay("ORDERED_2", 5);
+  client.requestOneWay("UNORDERED", 6);
+  client.flush();
+  packets.push_back(client.sent.back());
+  client.sent.clear();
+
+  // The gap on stream 5 doesn't hold up stream 6
+  server.receive(packets[1]);
+  REQUIRE(delivered == vector<string>({"UNORDERED"}));
+  REQUIRE(server.hasWork());
+  server.receive(packets[0]);
+  REQUIRE(delivered ==
+          vector<string>({"UNORDERED", "ORDERED_1", "ORDERED_2"}));
+}
+
+TEST_CASE("BiDirectionalRpcServesPriorityFirst") {
+  BudgetRpc client;
+  CapturingRpc server;
+  client.openStream(5, PRIORITY_LOW, false);
+  client.openStream(6, PRIORITY_HIGH, false);
+  vector<string> delivered;
+  server.setRequestHandler([&](const IdPayload& idPayload) {
+    delivered.push_back(idPayload.payload);
+    server.replyOneWay(idPayload.id);
+  });
+
+  client.setMaxPacketSize(600);
+  client.sendBudget = 700;
+  client.requestOneWay(string(500, 'L'), 5);
+  client.requestOneWay(string(500, 'H'), 6);
+  client.flush();
+  // Only one packet fits, and it goes to the high priority stream
+  REQUIRE(client.sent.size() == 1);
+  client.deliverTo(server);
+  REQUIRE(delivered == vector<string>({string(500, 'H')}));
+
+  // The rest waits for budget instead of being dropped
+  REQUIRE(client.hasWork());
+  client.sendBudget = numeric_limits<int64_t>::max();
+  client.flush();
+  client.deliverTo(server);
+  REQUIRE(delivered.size() == 2);
+  REQUIRE(delivered[1] == string(500, 'L'));
+}
+
+TEST_CASE("BiDirectionalRpcTimesRetransmitsFromTheFirstSend") {
+  BudgetRpc client;
+  client.sendBudget = 0;
+  client.request("HELD");
+  client.flush();
+  REQUIRE(client.sent.empty());
+  // Never sent, so there is nothing to resend
+  client.resendOldestOutgoingMessage();
+  REQUIRE(client.sent.empty());
+  REQUIRE(client.getRetransmitCount() == 0);
+
+  client.sendBudget = numeric_limits<int64_t>::max();
+  client.flush();
+  REQUIRE(client.sent.size() == 1);
+  client.resendOldestOutgoingMessage();
+  REQUIRE(client.sent.size() == 2);
+  REQUIRE(client.getRetransmitCount() == 1);
+}
+
+TEST_CASE("BiDirectionalRpcRebuildsLostPacketsFromParity") {
+  ParityRpc client;
+  ParityRpc server;
+  // The server only starts keeping packets once parity shows up
+  client.requestOneWay("WARMUP_1");
+  client.flush();
+  client.requestOneWay("WARMUP_2");
+  client.flush();
+  REQUIRE(client.sent.size() == 3);
+  client.deliverTo(server);
+  while (server.hasIncomingRequest()) {
+    server.replyOneWay(server.getFirstIncomingRequest().id);
+  }
+  REQUIRE(server.getRecoveredPacketCount() == 0);
+
+  client.request("FIRST");
+  client.flush();
+  client.request("SECOND");
+  client.flush();
+  // Two data packets and their parity
+  REQUIRE(client.sent.size() == 3);
+
+  // The first one is lost, parity brings it back without a resend
+  server.receive(client.sent[1]);
+  server.receive(client.sent[2]);
+  client.sent.clear();
+  REQUIRE(server.getRecoveredPacketCount() == 1);
+  vector<string> payloads;
+  while (server.hasIncomingRequest()) {
+    IdPayload idPayload = server.getFirstIncomingRequest();
+    payloads.push_back(idPayload.payload);
+    server.reply(idPayload.id, "OK");
+  }
+  sort(payloads.begin(), payloads.end());
+  REQUIRE(payloads == vector<string>({"FIRST", "SECOND"}));
+
+  // Both packets are acknowledged, so nothing is resent
+  server.flush();
+  server.deliverTo(client);
+  REQUIRE(client.getRetransmitCount() == 0);
+  REQUIRE(client.hasIncomingReply());
+
+  // The loss still counts, or parity would turn itself off
+  client.publish();
+  REQUIRE(client.getStats().lossRate > 0);
+}
+
+TEST_CASE("BiDirectionalRpcCountsTransportStats") {
+  CapturingRpc client, server;
+  client.request("FIRST");
+  client.flush();
+  client.request("SECOND");
+  client.flush();
+  REQUIRE(client.sent.size() == 2);
+  vector<string> packets = client.sent;
+  client.sent.clear();
+
+  // Out of order, then a duplicate
+  server.receive(packets[1]);
+  server.receive(packets[0]);
+  server.receive(packets[0]);
+  server.publish();
+  ConnectionStats stats = server.getStats();
+  REQUIRE(stats.packetsReceived == 3);
+  REQUIRE(stats.packetsReordered == 1);
+  REQUIRE(stats.duplicatePackets == 1);
+  REQUIRE(stats.duplicateRpcs == 1);
+  REQUIRE(stats.deliveredBytes == int64_t(strlen("FIRST") + strlen("SECOND")));
+
+  while (server.hasIncomingRequest()) {
+    server.reply(server.getFirstIncomingRequest().id, "OK");
+  }
+  server.flush();
+  server.deliverTo(client);
+  client.publish();
+  stats = client.getStats();
+  REQUIRE(stats.packetsSent == 2);
+  REQUIRE(stats.bytesSent ==
+          int64_t(packets[0].size() + packets[1].size()));
+  REQUIRE(stats.packetsLost == 0);
+  REQUIRE(stats.rttP50 >= 0);
+  REQUIRE(stats.congestionWindow > 0);
+}
+
+TEST_CASE("BiDirectionalRpcSealsWholePackets") {
+  SealingRpc client, server;
+  for (int a = 0; a < 5; a++) {
+    client.request(string("SECRET_") + to_string(a));
+  }
+  client.flush();
+  REQUIRE(client.sent.size() == 1);
+  REQUIRE((unsigned char)client.sent[0][0] == SEALED);
+  REQUIRE(client.sent[0].find("SECRET") == string::npos);
+
+  client.deliverTo(server);
+  int numRequests = 0;
+  while (server.hasIncomingRequest()) {
+    auto idPayload = server.getFirstIncomingRequest();
+    REQUIRE(idPayload.payload.find("SECRET_") == 0);
+    server.reply(idPayload.id, "REPLY");
+    numRequests++;
+  }
+  REQUIRE(numRequests == 5);
+  server.flush();
+  for (const auto& it : server.sent) {
+    REQUIRE((unsigned char)it[0] == SEALED);
+  }
+  server.deliverTo(client);
+  REQUIRE(client.hasIncomingReply());
+}
+
+TEST_CASE("BiDirectionalRpcSendsTheSessionKeyAlone") {
+  SealingRpc client, server;
+  client.request("FIRST");
+  client.requestWithId(IdPayload(SESSION_KEY_RPCID, "SESSION_KEY"),
+                       CONTROL_STREAM);
+  client.request("SECOND");
+  client.flush();
+  REQUIRE(client.sent.size() == 2);
+  // The session key goes first and in the clear, with nothing else
+  REQUIRE((unsigned char)client.sent[0][0] == DATA);
+  REQUIRE(client.sent[0].find("SESSION_KEY") != string::npos);
+  REQUIRE(client.sent[0].find("FIRST") == string::npos);
+  REQUIRE((unsigned char)client.sent[1][0] == SEALED);
+
+  client.deliverTo(server);
+  int numRequests = 0;
+  while (server.hasIncomingRequest()) {
+    server.reply(server.getFirstIncomingRequest().id, "OK");
+    numRequests++;
+  }
+  REQUIRE(numRequests == 3);
+}
+
+TEST_CASE("BiDirectionalRpcDropsPacketsThatDontOpen") {
+  SealingRpc client, server;
+  client.request("FIRST");
+  client.flush();
+  string packet = client.sent[0];
+  client.sent.clear();
+
+  // Without the key yet, the packet is dropped but nobody is blamed
+  server.canOpen = false;
+  REQUIRE(server.receive(packet));
+  REQUIRE(!server.hasIncomingRequest());
+
+  // The wrong key is
+  server.canOpen = true;
+  server.key = 'X';
+  REQUIRE(!server.receive(packet));
+  REQUIRE(!server.hasIncomingRequest());
+
+  // So are frames that should have been sealed and weren't
+  CapturingRpc plain;
+  plain.request("FORGED");
+  plain.flush();
+  REQUIRE(!server.receive(plain.sent[0]));
+  REQUIRE(!server.hasIncomingRequest());
+
+  // And unsealed packets without frames, whose ack bitmap would retire
+  // rpcs that never arrived
+  server.request("IN_FLIGHT");
+  server.flush();
+  server.sent.clear();
+  MessageWriter writer;
+  writer.start();
+  writer.writePrimitive<unsigned char>(DATA);
+  writer.writePrimitive<uint64_t>(1);
+  writer.writePrimitive<uint64_t>(1);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<uint64_t>(0);
+  string frameless = writer.finish();
+  REQUIRE(!server.receive(frameless));
+  server.resendOldestOutgoingMessage();
+  REQUIRE(server.sent.size() == 1);
+  server.sent.clear();
+
+  writer.start();
+  writer.writePrimitive<unsigned char>(PARITY);
+  writer.writePrimitive<uint64_t>(1);
+  writer.writePrimitive<string>("");
+  writer.writePrimitive<uint32_t>(0);
+  writer.writePrimitive<string>("");
+  REQUIRE(!server.receive(writer.finish()));
+
+  // Only the session key comes in the clear
+  server.key = 'K';
+  SealingRpc other;
+  other.requestWithId(IdPayload(SESSION_KEY_RPCID, "SESSION_KEY"),
+                      CONTROL_STREAM);
+  other.flush();
+  REQUIRE((unsigned char)other.sent[0][0] == DATA);
+  REQUIRE(server.receive(other.sent[0]));
+  REQUIRE(server.hasIncomingRequestWithId(SESSION_KEY_RPCID));
+}
+TEST_CASE("BiDirectionalRpcTrustsNoAcksOnUnsealedPackets") {
+  SealingRpc server;
+  server.request("IN_FLIGHT");
+  server.flush();
+  server.sent.clear();
+
+  // A session key anyone could have sent, with an ack bitmap for the
+  // packet in flight
+  MessageWriter writer;
+  writer.start();
+  writer.writePrimitive<unsigned char>(DATA);
+  writer.writePrimitive<uint64_t>(1);
+  writer.writePrimitive<uint64_t>(1);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<unsigned char>(REQUEST);
+  writer.writeClass<RpcId>(SESSION_KEY_RPCID);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<uint32_t>(CONTROL_STREAM);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<string>("SESSION_KEY");
+  REQUIRE(server.receive(writer.finish()));
+  REQUIRE(server.hasIncomingRequestWithId(SESSION_KEY_RPCID));
+  server.resendOldestOutgoingMessage();
+  REQUIRE(server.sent.size() == 1);
+  server.sent.clear();
+
+  // Nor on unsealed acks
+  writer.start();
+  writer.writePrimitive<unsigned char>(ACKNOWLEDGE);
+  writer.writePrimitive<uint64_t>(1);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<string>("");
+  REQUIRE(server.receive(writer.finish()));
+  server.resendOldestOutgoingMessage();
+  REQUIRE(server.sent.size() == 1);
+}
+
+TEST_CASE("BiDirectionalRpcDropsUnknownHeaders") {
+  CapturingRpc server;
+  MessageWriter writer;
+  writer.start();
+  writer.writePrimitive<unsigned char>(99);
+  writer.writePrimitive<uint64_t>(1);
+  REQUIRE(!server.receive(writer.finish()));
+}
+}  // namespace wga
@@ -0,0 +1,70 @@
+#include "Headers.hpp"
+
+#include "BoundedMpscQueue.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("BoundedMpscQueueSimple") {
+  BoundedMpscQueue<string> queue(4);
+  REQUIRE(queue.empty());
+  REQUIRE(queue.tryPush("A"));
+  REQUIRE(queue.tryPush("B"));
+  REQUIRE(queue.tryPush("C"));
+  REQUIRE(queue.tryPush("D"));
+  // Full
+  REQUIRE(!queue.tryPush("E"));
+  REQUIRE(!queue.empty());
+
+  string s;
+  REQUIRE(queue.tryPop(s));
+  REQUIRE(s == "A");
+  REQUIRE(queue.tryPush("E"));
+  for (string expected : {"B", "C", "D", "E"}) {
+    REQUIRE(queue.tryPop(s));
+    REQUIRE(s == expected);
+  }
+  REQUIRE(!queue.tryPop(s));
+  REQUIRE(queue.empty());
+}
+
+TEST_CASE("BoundedMpscQueueManyProducers") {
+  const int NUM_PRODUCERS = 4;
+  const int NUM_ITEMS = 100 * 1000;
+  BoundedMpscQueue<int64_t> queue(1024);
+  vector<shared_ptr<thread>> producers;
+  for (int a = 0; a < NUM_PRODUCERS; a++) {
+    producers.push_back(make_shared<thread>([&queue, a, NUM_ITEMS]() {
+      for (int b = 0; b < NUM_ITEMS; b++) {
+        int64_t item = int64_t(a) * NUM_ITEMS + b;
+        while (!queue.tryPush(item)) {
+          this_thread::yield();
+        }
+      }
+    }));
+  }
+
+  // Every producer's items must come out in the order it pushed them
+  vector<int64_t> lastSeen(NUM_PRODUCERS, -1);
+  bool inOrder = true;
+  int numPopped = 0;
+  while (numPopped < NUM_PRODUCERS * NUM_ITEMS) {
+    int64_t item;
+    if (!queue.tryPop(item)) {
+      this_thread::yield();
+      continue;
+    }
+    int producer = int(item / NUM_ITEMS);
+    int64_t index = item % NUM_ITEMS;
+    inOrder &= (index == lastSeen[producer] + 1);
+    lastSeen[producer] = index;
+    numPopped++;
+  }
+  for (auto it : producers) {
+    it->join();
+  }
+  REQUIRE(inOrder);
+  REQUIRE(queue.empty());
+}
+}  // namespace wga
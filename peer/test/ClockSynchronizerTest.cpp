@@ -333,4 +333,27 @@ TEST_CASE("ClockSynchronizerEightWay") {
   }
 }
 
+TEST_CASE("ClockSynchronizerRestoresState") {
+  shared_ptr<FakeTimeHandler> requesterTimeHandler(new FakeTimeHandler());
+  shared_ptr<FakeTimeHandler> responderTimeHandler(new FakeTimeHandler());
+  ClockSynchronizer sync(requesterTimeHandler, true, false);
+  ClockSynchronizer resumed(requesterTimeHandler, true, false);
+  REQUIRE(!resumed.isBootstrapped());
+
+  SECTION("Unsettled") {
+    // Nothing worth keeping yet
+    resumed.restoreState(sync.getState());
+    REQUIRE(!resumed.isBootstrapped());
+  }
+
+  SECTION("Settled") {
+    simulate(requesterTimeHandler, responderTimeHandler, sync, 0, 1, 0);
+    REQUIRE(sync.isBootstrapped());
+    resumed.restoreState(sync.getState());
+    REQUIRE(resumed.isBootstrapped());
+    REQUIRE(resumed.getPing() == Approx(sync.getPing()));
+    REQUIRE(resumed.getSmoothedRtt() == Approx(sync.getSmoothedRtt()));
+  }
+}
+
 }  // namespace wga
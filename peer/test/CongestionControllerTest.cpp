@@ -0,0 +1,88 @@
+#include "Headers.hpp"
+
+#include "CongestionController.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+namespace {
+// Keeps the window full for a while on a path with the given round trip.
+// Returns when the last packet was acknowledged.
+int64_t fillWindow(CongestionController& controller, int64_t now,
+                   int64_t rtt, int rounds) {
+  for (int round = 0; round < rounds; round++) {
+    vector<int64_t> sent;
+    while (controller.getBytesInFlight() + 1000 <=
+           controller.getCongestionWindow()) {
+      controller.onPacketSent(1000, true, now);
+      sent.push_back(now);
+    }
+    now += rtt;
+    for (auto sendTime : sent) {
+      controller.onPacketAcknowledged(1000, sendTime, now);
+    }
+  }
+  return now;
+}
+}  // namespace
+
+TEST_CASE("CongestionControllerGrowsWithoutQueuing") {
+  CongestionController controller(1000);
+  int64_t initialWindow = controller.getCongestionWindow();
+  fillWindow(controller, 0, 50 * 1000, 20);
+  REQUIRE(controller.getCongestionWindow() > initialWindow);
+  REQUIRE(controller.getBytesInFlight() == 0);
+  REQUIRE(controller.getSendingRate() > 0);
+}
+
+TEST_CASE("CongestionControllerBacksOffFromQueuing") {
+  CongestionController controller(1000);
+  int64_t now = fillWindow(controller, 0, 50 * 1000, 20);
+  int64_t window = controller.getCongestionWindow();
+  // The round trip climbs well past the target queuing delay
+  fillWindow(controller, now, 150 * 1000, 5);
+  REQUIRE(controller.getQueuingDelay() > 0);
+  REQUIRE(controller.getCongestionWindow() < window);
+}
+
+TEST_CASE("CongestionControllerHalvesOncePerRoundTrip") {
+  CongestionController controller(1000);
+  for (int a = 0; a < 5; a++) {
+    controller.onPacketSent(1000, true, 0);
+  }
+  int64_t window = controller.getCongestionWindow();
+  controller.onPacketLost(1000, 0, 1000);
+  REQUIRE(controller.getCongestionWindow() == window / 2);
+  // More losses from before the cut don't cut again
+  controller.onPacketLost(1000, 0, 2000);
+  controller.onPacketLost(1000, 0, 3000);
+  REQUIRE(controller.getCongestionWindow() == window / 2);
+  REQUIRE(controller.getBytesInFlight() == 2000);
+
+  // A loss sent after the cut does
+  controller.onPacketSent(1000, true, 4000);
+  controller.onPacketLost(1000, 4000, 5000);
+  REQUIRE(controller.getCongestionWindow() == window / 4);
+}
+
+TEST_CASE("CongestionControllerPaces") {
+  CongestionController controller(1000);
+  int64_t now = 0;
+  controller.getSendBudget(now);
+  // The initial burst goes out right away, after that the pacer makes the
+  // sender wait
+  while (controller.getSendBudget(now) >= 1000) {
+    controller.onPacketSent(1000, false, now);
+  }
+  int64_t delay = controller.getPacingDelay(1000, now);
+  REQUIRE(delay > 0);
+  REQUIRE(delay < 100 * 1000);
+  REQUIRE(controller.getSendBudget(now + delay) >= 1000);
+
+  // Acks and control packets can overdraw the bucket, which just makes the
+  // wait longer
+  controller.onPacketSent(5000, false, now);
+  REQUIRE(controller.getPacingDelay(1000, now) > delay);
+}
+}  // namespace wga
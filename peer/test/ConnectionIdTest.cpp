@@ -0,0 +1,43 @@
+#include "Headers.hpp"
+
+#include "ConnectionId.hpp"
+#include "EndpointRoutingTable.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("ConnectionIdRoundTrips") {
+  for (uint32_t connectionId : {1U, 0xC1C1C1C1U, 0xFFFFFFFFU}) {
+    string packet = makeConnectionIdPrefix(connectionId) + "PACKET";
+    REQUIRE(packet.substr(0, WGA_MAGIC.length()) == WGA_MAGIC);
+    string contents = packet.substr(WGA_MAGIC.length());
+    uint32_t readId = 0;
+    REQUIRE(readConnectionId(contents.data(), contents.size(), &readId));
+    REQUIRE(readId == connectionId);
+    REQUIRE(contents.substr(1 + CONNECTION_ID_SIZE) == "PACKET");
+  }
+}
+
+TEST_CASE("ConnectionIdIgnoresPlainPackets") {
+  uint32_t connectionId = 0;
+  // A DATA packet as it follows the magic without an id
+  string contents = string(1, char(4)) + "0123456789";
+  REQUIRE(!readConnectionId(contents.data(), contents.size(), &connectionId));
+  // Too short to hold an id
+  contents = string(1, char(CONNECTION_ID_MARKER)) + "12";
+  REQUIRE(!readConnectionId(contents.data(), contents.size(), &connectionId));
+}
+
+TEST_CASE("ConnectionIdRoutesWithoutAnEndpoint") {
+  RoutingTable<uint32_t, int> table;
+  auto connection = make_shared<int>(1);
+  REQUIRE(table.add(0xC0FFEE, connection));
+  string contents =
+      makeConnectionIdPrefix(0xC0FFEE).substr(WGA_MAGIC.length());
+  uint32_t connectionId = 0;
+  REQUIRE(readConnectionId(contents.data(), contents.size(), &connectionId));
+  REQUIRE(table.find(connectionId) == connection);
+  REQUIRE(table.find(connectionId + 1).get() == NULL);
+}
+}  // namespace wga
@@ -0,0 +1,52 @@
+#include "Headers.hpp"
+
+#include "ConnectionStats.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("ConnectionStatsPercentiles") {
+  ConnectionStatsPublisher publisher;
+  // More samples than are kept, only the newest count
+  for (int a = 0; a < 1000; a++) {
+    publisher.addRttSample(1000 * 1000);
+  }
+  for (int a = 1; a <= 256; a++) {
+    publisher.addRttSample(a * 1000);
+  }
+  publisher.publish(ConnectionStats(), 1000);
+  ConnectionStats stats = publisher.getPublished();
+  REQUIRE(stats.sampleTime == 1000);
+  REQUIRE(stats.rttP50 == Approx(128 * 1000).margin(1000));
+  REQUIRE(stats.rttP90 == Approx(230 * 1000).margin(1000));
+  REQUIRE(stats.rttP99 == Approx(253 * 1000).margin(1000));
+}
+
+TEST_CASE("ConnectionStatsRates") {
+  ConnectionStatsPublisher publisher;
+  ConnectionStats counters;
+  int64_t now = 0;
+  REQUIRE(publisher.isPublishDue(100 * 1000));
+  // 1000 bytes every 100ms, half of it delivered
+  for (int a = 0; a < 30; a++) {
+    now += 100 * 1000;
+    counters.bytesSent += 1000;
+    counters.deliveredBytes += 500;
+    publisher.publish(counters, now);
+    REQUIRE(!publisher.isPublishDue(now + 1000));
+  }
+  ConnectionStats stats = publisher.getPublished();
+  REQUIRE(stats.bytesSent == 30 * 1000);
+  REQUIRE(stats.sendBytesPerSecond == Approx(10 * 1000));
+  REQUIRE(stats.goodputBytesPerSecond == Approx(5 * 1000));
+  REQUIRE(stats.retransmitsPerSecond == 0);
+
+  // The rate follows the last second, not the whole history
+  for (int a = 0; a < 20; a++) {
+    now += 100 * 1000;
+    publisher.publish(counters, now);
+  }
+  REQUIRE(publisher.getPublished().sendBytesPerSecond == 0);
+}
+}  // namespace wga
@@ -0,0 +1,86 @@
+#include "Headers.hpp"
+
+#include "CryptoHandler.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+// Two handlers that exchanged session keys, both sealing with counters
+static pair<shared_ptr<CryptoHandler>, shared_ptr<CryptoHandler>>
+makeCounterNoncePair() {
+  auto firstKey = CryptoHandler::generateKey();
+  auto secondKey = CryptoHandler::generateKey();
+  auto first = make_shared<CryptoHandler>(firstKey.second, secondKey.first);
+  auto second = make_shared<CryptoHandler>(secondKey.second, firstKey.first);
+  REQUIRE(
+      second->receiveIncomingSessionKey(first->generateOutgoingSessionKey()));
+  REQUIRE(
+      first->receiveIncomingSessionKey(second->generateOutgoingSessionKey()));
+  first->enableCounterNonces();
+  second->enableCounterNonces();
+  return make_pair(first, second);
+}
+
+static string sealMessage(CryptoHandler* handler, const string& message) {
+  string sealed(handler->getSealHeadroom(), '\0');
+  sealed += message;
+  handler->sealInPlace(&sealed[0], sealed.size());
+  return sealed;
+}
+
+TEST_CASE("CryptoHandlerSealsWithCounterNonces") {
+  auto handlers = makeCounterNoncePair();
+  REQUIRE(handlers.first->getSealHeadroom() ==
+          CryptoHandler::COUNTER_SEAL_HEADROOM);
+  string opened;
+  for (int a = 1; a <= 10; a++) {
+    string message = "MESSAGE " + to_string(a);
+    string sealed = sealMessage(handlers.first.get(), message);
+    REQUIRE(sealed.size() ==
+            CryptoHandler::COUNTER_SEAL_HEADROOM + message.size());
+    // The low bytes of the counter lead, in the clear
+    REQUIRE((unsigned char)sealed[0] == a);
+    REQUIRE(sealed.substr(CryptoHandler::COUNTER_SEAL_HEADROOM) != message);
+    REQUIRE(!handlers.second->isReplayed(sealed.data(), sealed.size()));
+    REQUIRE(handlers.second->openInto(sealed.data(), sealed.size(), &opened));
+    REQUIRE(opened == message);
+  }
+  // The other direction counts on its own
+  string sealed = sealMessage(handlers.second.get(), "REPLY");
+  REQUIRE((unsigned char)sealed[0] == 1);
+  REQUIRE(handlers.first->openInto(sealed.data(), sealed.size(), &opened));
+  REQUIRE(opened == "REPLY");
+}
+
+TEST_CASE("CryptoHandlerRefusesReplayedCounters") {
+  auto handlers = makeCounterNoncePair();
+  string first = sealMessage(handlers.first.get(), "FIRST");
+  string second = sealMessage(handlers.first.get(), "SECOND");
+  string third = sealMessage(handlers.first.get(), "THIRD");
+  string opened;
+
+  // Out of order is fine, twice is not
+  REQUIRE(handlers.second->openInto(third.data(), third.size(), &opened));
+  REQUIRE(handlers.second->isReplayed(third.data(), third.size()));
+  bool replayed = false;
+  REQUIRE(!handlers.second->openInto(third.data(), third.size(), &opened,
+                                     &replayed));
+  REQUIRE(replayed);
+  REQUIRE(!handlers.second->isReplayed(first.data(), first.size()));
+  REQUIRE(handlers.second->openInto(first.data(), first.size(), &opened));
+  REQUIRE(opened == "FIRST");
+
+  // A forgery doesn't use up its counter
+  string forged = second;
+  forged.back() ^= 1;
+  replayed = false;
+  REQUIRE(!handlers.second->openInto(forged.data(), forged.size(), &opened,
+                                     &replayed));
+  REQUIRE(!replayed);
+  REQUIRE(!handlers.second->isReplayed(second.data(), second.size()));
+  REQUIRE(handlers.second->openInto(second.data(), second.size(), &opened));
+  REQUIRE(opened == "SECOND");
+  REQUIRE(handlers.second->isReplayed(second.data(), second.size()));
+}
+}  // namespace wga
@@ -0,0 +1,214 @@
+#include "Headers.hpp"
+
+#include "CryptoPipeline.hpp"
+#include "DatagramBatch.hpp"
+#include "EncryptedMultiEndpointHandler.hpp"
+#include "PortMultiplexer.hpp"
+#include "TestHelpers.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("CryptoPipelineKeepsOrderPerOwner") {
+  const int OWNERS = 8;
+  const int PIECES = 500;
+  vector<vector<int>> seen(OWNERS);
+  atomic<int> running[OWNERS];
+  atomic<int> finished(0);
+  atomic<bool> overlapped(false);
+  for (int a = 0; a < OWNERS; a++) {
+    running[a] = 0;
+  }
+  {
+    CryptoPipeline pipeline(4);
+    vector<shared_ptr<Strand>> lanes;
+    for (int owner = 0; owner < OWNERS; owner++) {
+      lanes.push_back(pipeline.makeLane());
+    }
+    for (int piece = 0; piece < PIECES; piece++) {
+      for (int owner = 0; owner < OWNERS; owner++) {
+        pipeline.run(lanes[owner], [&, owner, piece]() {
+          if (running[owner]++ != 0) {
+            overlapped = true;
+          }
+          seen[owner].push_back(piece);
+          running[owner]--;
+          finished++;
+        });
+      }
+    }
+    while (finished < OWNERS * PIECES) {
+      std::this_thread::yield();
+    }
+  }
+  REQUIRE(!overlapped);
+  for (int owner = 0; owner < OWNERS; owner++) {
+    REQUIRE(int(seen[owner].size()) == PIECES);
+    for (int piece = 0; piece < PIECES; piece++) {
+      REQUIRE(seen[owner][piece] == piece);
+    }
+  }
+}
+
+TEST_CASE("CryptoPipelineRunsOwnersInParallel") {
+  atomic<bool> firstStarted(false);
+  atomic<bool> secondRan(false);
+  atomic<bool> release(false);
+  // Declared last so its threads finish before the flags go away
+  CryptoPipeline pipeline(2);
+  auto first = pipeline.makeLane();
+  auto second = pipeline.makeLane();
+  pipeline.run(first, [&]() {
+    firstStarted = true;
+    // Only finishes once the other owner got a thread of its own
+    while (!release) {
+      std::this_thread::yield();
+    }
+  });
+  while (!firstStarted) {
+    std::this_thread::yield();
+  }
+  pipeline.run(second, [&]() { secondRan = true; });
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (!secondRan && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::yield();
+  }
+  // Before checking, so a failure doesn't leave the pool waiting forever
+  release = true;
+  REQUIRE(secondRan);
+}
+
+// Runs f on the connection's strand and waits for it
+void runOnStrand(const shared_ptr<UdpBiDirectionalRpc>& rpc,
+                 const function<void()>& f) {
+  atomic<bool> ran(false);
+  rpc->getStrand()->post([&]() {
+    f();
+    ran = true;
+  });
+  REQUIRE(waitUntil([&]() { return bool(ran); }));
+}
+
+shared_ptr<NetEngine> makePipelinedEngine() {
+  ENABLE_CRYPTO_PIPELINE = true;
+  auto netEngine = make_shared<NetEngine>();
+  ENABLE_CRYPTO_PIPELINE = false;
+  netEngine->start();
+  REQUIRE(netEngine->getCryptoPipeline() != NULL);
+  return netEngine;
+}
+
+TEST_CASE("CryptoPipelineSealsAndOpensPackets") {
+  auto netEngine = makePipelinedEngine();
+  auto firstSocket = openLoopbackSocket(netEngine);
+  auto secondSocket = openLoopbackSocket(netEngine);
+  auto firstKey = CryptoHandler::generateKey();
+  auto secondKey = CryptoHandler::generateKey();
+  auto firstCrypto = make_shared<CryptoHandler>(firstKey.second,
+                                                secondKey.first);
+  auto secondCrypto = make_shared<CryptoHandler>(secondKey.second,
+                                                 firstKey.first);
+  auto first = make_shared<LoopbackHandler>(
+      netEngine, firstSocket, firstCrypto, secondSocket->local_endpoint());
+  auto second = make_shared<LoopbackHandler>(
+      netEngine, secondSocket, secondCrypto, firstSocket->local_endpoint());
+  // Each opens what comes in on the pipeline too
+  auto firstMultiplexer = make_shared<PortMultiplexer>(netEngine, firstSocket);
+  auto secondMultiplexer =
+      make_shared<PortMultiplexer>(netEngine, secondSocket);
+  firstMultiplexer->addRecipient(first);
+  secondMultiplexer->addRecipient(second);
+
+  first->sendSessionKey();
+  second->sendSessionKey();
+  REQUIRE(waitUntil([&]() {
+    return first->readyToSend() && second->readyToSend() &&
+           first->isSealing() && second->isSealing();
+  }));
+  REQUIRE(firstCrypto->hasCounterNonces());
+
+  // Every packet waits for its seal on the way to the socket
+  const int PACKETS = 50;
+  for (int a = 0; a < PACKETS; a++) {
+    first->requestOneWay(string("REQUEST_") + to_string(a));
+  }
+  set<string> received;
+  REQUIRE(waitUntil([&]() {
+    while (second->hasIncomingRequest()) {
+      auto idPayload = second->getFirstIncomingRequest();
+      received.insert(idPayload.payload);
+      second->replyOneWay(idPayload.id);
+    }
+    return int(received.size()) == PACKETS;
+  }));
+
+  firstMultiplexer->closeSocket();
+  secondMultiplexer->closeSocket();
+  // Before anything the io threads use goes away
+  netEngine->shutdown();
+}
+
+TEST_CASE("CryptoPipelineDropsPacketsSealedForOldKeys") {
+  auto netEngine = makePipelinedEngine();
+  CryptoPipeline* pipeline = netEngine->getCryptoPipeline();
+  auto senderSocket = openLoopbackSocket(netEngine);
+  auto receiverSocket = openLoopbackSocket(netEngine);
+  auto myKey = CryptoHandler::generateKey();
+  auto otherKey = CryptoHandler::generateKey();
+  SessionTicket ticket;
+  ticket.secret.fill(7);
+  ticket.capabilities =
+      CAPABILITY_PACKET_ENCRYPTION | CAPABILITY_COUNTER_NONCES;
+  SessionTicketCache::store(myKey.first, otherKey.first, ticket);
+  auto sender = make_shared<LoopbackHandler>(
+      netEngine, senderSocket,
+      make_shared<CryptoHandler>(myKey.second, otherKey.first),
+      receiverSocket->local_endpoint());
+
+  // Holds everything the sender hands the pipeline
+  atomic<bool> release(false);
+  pipeline->run(sender->getCryptoLane(), [&]() {
+    while (!release) {
+      std::this_thread::yield();
+    }
+  });
+  // Sealed packets wait for the pipeline with room for counter nonces
+  runOnStrand(sender, [&]() {
+    REQUIRE(sender->resumeSession());
+    sender->requestOneWay("RESUMED");
+    sender->flush();
+  });
+  REQUIRE(sender->isSealing());
+  // Then the other side never answers, and the keys are gone before the
+  // pipeline gets to them
+  runOnStrand(sender, [&]() { sender->expireResumption(); });
+  REQUIRE(!sender->isSealing());
+  runOnStrand(sender, [&]() {});
+  release = true;
+
+  // Only the handshake makes it out, in the clear
+  DatagramReceiveRing ring;
+  bool gotSealed = false;
+  int datagrams = 0;
+  auto handler = [&](const char* data, size_t size,
+                     const udp::endpoint& from) {
+    REQUIRE(size > WGA_MAGIC.length());
+    if ((unsigned char)data[WGA_MAGIC.length()] == SEALED) {
+      gotSealed = true;
+    }
+    datagrams++;
+  };
+  REQUIRE(waitUntil([&]() {
+    ring.drain(*receiverSocket, handler);
+    return datagrams >= 2;
+  }));
+  microsleep(100 * 1000);
+  ring.drain(*receiverSocket, handler);
+  REQUIRE(!gotSealed);
+
+  runOnStrand(sender, [&]() { senderSocket->close(); });
+  receiverSocket->close();
+  netEngine->shutdown();
+}
+}  // namespace wga
@@ -0,0 +1,133 @@
+#include "Headers.hpp"
+
+#include "DatagramBatch.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+namespace {
+udp::socket* openLoopbackSocket(asio::io_service& ioService) {
+  return new udp::socket(ioService,
+                         udp::endpoint(asio::ip::address_v4::loopback(), 0));
+}
+
+PacketBufferPtr makePacket(const string& contents) {
+  auto packet = PacketBufferPool::acquire();
+  packet->append(contents);
+  return packet;
+}
+}  // namespace
+
+TEST_CASE("DatagramBatchSendsAndReceives") {
+  asio::io_service ioService;
+  unique_ptr<udp::socket> sender(openLoopbackSocket(ioService));
+  unique_ptr<udp::socket> receiver(openLoopbackSocket(ioService));
+  vector<PacketBufferPtr> packets;
+  for (int a = 0; a < 40; a++) {
+    packets.push_back(makePacket(string("PACKET_") + to_string(a)));
+  }
+  int sendSyscalls = sendDatagramBatch(*sender, receiver->local_endpoint(),
+                                       "MAGIC", packets);
+  if (useBatchedIo()) {
+    REQUIRE(sendSyscalls == 1);
+  }
+
+  vector<string> received;
+  DatagramReceiveRing ring;
+  while (received.size() < packets.size()) {
+    ring.drain(*receiver, [&](const char* data, size_t size,
+                              const udp::endpoint& from) {
+      REQUIRE(from == sender->local_endpoint());
+      received.push_back(string(data, size));
+    });
+  }
+  for (int a = 0; a < int(packets.size()); a++) {
+    REQUIRE(received[a] == "MAGIC" + packets[a]->toString());
+  }
+}
+
+TEST_CASE("DatagramBatchSkipsOnlyTheBadDatagram") {
+  asio::io_service ioService;
+  unique_ptr<udp::socket> sender(openLoopbackSocket(ioService));
+  unique_ptr<udp::socket> receiver(openLoopbackSocket(ioService));
+  // Too big for any datagram, the ones around it still go out
+  vector<PacketBufferPtr> packets = {makePacket("FIRST"),
+                                     makePacket(string(70 * 1024, 'x')),
+                                     makePacket("LAST")};
+  vector<PacketBufferPtr> unsent;
+  sendDatagramBatch(*sender, receiver->local_endpoint(), "MAGIC", packets,
+                    &unsent);
+  REQUIRE(unsent.empty());
+
+  vector<string> received;
+  DatagramReceiveRing ring;
+  while (received.size() < 2) {
+    ring.drain(*receiver, [&](const char* data, size_t size,
+                              const udp::endpoint& from) {
+      received.push_back(string(data, size));
+    });
+  }
+  REQUIRE(received == vector<string>({"MAGICFIRST", "MAGICLAST"}));
+}
+
+// Not run by default.  Eight peers send a few datagrams each per game frame
+// to one host, and the host reads them all back, like a busy session.
+TEST_CASE("DatagramBatchSyscallsPerFrame", "[.][benchmark]") {
+  const int PEERS = 8;
+  const int PACKETS_PER_PEER = 3;
+  const int FRAMES = 600;
+  asio::io_service ioService;
+  unique_ptr<udp::socket> host(openLoopbackSocket(ioService));
+  vector<unique_ptr<udp::socket>> peers;
+  for (int a = 0; a < PEERS; a++) {
+    peers.emplace_back(openLoopbackSocket(ioService));
+  }
+  vector<PacketBufferPtr> packets;
+  for (int a = 0; a < PACKETS_PER_PEER; a++) {
+    packets.push_back(makePacket(string(400, 'x')));
+  }
+  DatagramReceiveRing ring;
+  array<char, 64 * 1024> buffer;
+
+  for (bool batched : {false, true}) {
+    bool wasEnabled = ENABLE_BATCHED_IO;
+    ENABLE_BATCHED_IO = batched;
+    int64_t sendSyscalls = 0;
+    int64_t receiveSyscalls = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < FRAMES; frame++) {
+      for (auto& peer : peers) {
+        sendSyscalls += sendDatagramBatch(*peer, host->local_endpoint(),
+                                          "WGAMAGIC", packets);
+      }
+      int received = 0;
+      while (received < PEERS * PACKETS_PER_PEER) {
+        if (batched) {
+          receiveSyscalls += ring.drain(
+              *host, [&](const char* data, size_t size,
+                         const udp::endpoint& from) { received++; });
+        } else {
+          udp::endpoint from;
+          host->receive_from(asio::buffer(buffer), from);
+          receiveSyscalls++;
+          received++;
+        }
+      }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    ENABLE_BATCHED_IO = wasEnabled;
+    LOG(INFO) << (batched ? "batched" : "one at a time") << ": "
+              << double(sendSyscalls) / FRAMES << " send and "
+              << double(receiveSyscalls) / FRAMES
+              << " receive system calls per frame, "
+              << double(elapsed.count()) / FRAMES << " us per frame";
+    if (batched && useBatchedIo()) {
+      REQUIRE(sendSyscalls == PEERS * FRAMES);
+    } else {
+      REQUIRE(sendSyscalls == PEERS * PACKETS_PER_PEER * FRAMES);
+    }
+  }
+}
+}  // namespace wga
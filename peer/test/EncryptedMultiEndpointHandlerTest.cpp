@@ -0,0 +1,619 @@
+#include "Headers.hpp"
+
+#include "EncryptedMultiEndpointHandler.hpp"
+#include "PortMultiplexer.hpp"
+#include "TestHelpers.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+// Keeps every datagram instead of putting it on the wire, and only flushes
+// when the test says so.
+class CapturingHandler : public EncryptedMultiEndpointHandler {
+ public:
+  CapturingHandler(shared_ptr<NetEngine> netEngine,
+                   shared_ptr<CryptoHandler> cryptoHandler)
+      : EncryptedMultiEndpointHandler(
+            NULL, netEngine, cryptoHandler,
+            {udp::endpoint(asio::ip::address_v4::loopback(), 1)}, false) {}
+
+  vector<string> sent;
+
+  void deliverTo(CapturingHandler& other) {
+    for (const auto& it : sent) {
+      other.receive(it);
+    }
+    sent.clear();
+  }
+
+  bool isCompressing() { return compressionEnabled; }
+  bool hasCounterNonces() { return cryptoHandler->hasCounterNonces(); }
+  bool isResumed() { return resumedSession; }
+  bool isSealing() { return packetEncryptionEnabled; }
+  // As if the other side never answered our resumption
+  void expireResumption() {
+    checkTimeouts(monotonicTimeMicros() + 60 * 1000 * 1000);
+  }
+  udp::endpoint getActiveEndpoint() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return activeEndpoint;
+  }
+  void acknowledge() { sendAcknowledge(); }
+  uint64_t getLastPacketNumber() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return nextPacketNumber - 1;
+  }
+
+ protected:
+  virtual void send(const PacketBufferPtr& packet) {
+    sent.push_back(packet->toString());
+  }
+  virtual bool isOwnerThread() { return true; }
+  virtual void scheduleDrain() { drainSubmissions(); }
+  virtual void scheduleFlush() {}
+  virtual void schedulePacedFlush() {}
+  virtual void scheduleAcknowledge() {}
+  virtual void scheduleRetransmit(int64_t deadline) {}
+  virtual int64_t getSendBudget() { return numeric_limits<int64_t>::max(); }
+};
+
+// Two ends of one session
+class HandlerPair {
+ public:
+  explicit HandlerPair(bool handshakeNow = true)
+      : HandlerPair(CryptoHandler::generateKey(), CryptoHandler::generateKey(),
+                    handshakeNow) {}
+
+  // A new session between the same two peers
+  HandlerPair(const pair<PublicKey, PrivateKey>& firstKey,
+              const pair<PublicKey, PrivateKey>& secondKey, bool handshakeNow)
+      : netEngine(new NetEngine()) {
+    netEngine->start();
+    first.reset(new CapturingHandler(
+        netEngine, shared_ptr<CryptoHandler>(new CryptoHandler(
+                       firstKey.second, secondKey.first))));
+    second.reset(new CapturingHandler(
+        netEngine, shared_ptr<CryptoHandler>(new CryptoHandler(
+                       secondKey.second, firstKey.first))));
+    if (handshakeNow) {
+      handshake();
+    }
+  }
+
+  void handshake() {
+    first->sendSessionKey();
+    second->sendSessionKey();
+    exchange();
+  }
+
+  // Flushes, delivers and acknowledges in both directions
+  void exchange() {
+    for (int a = 0; a < 3; a++) {
+      first->flush();
+      second->flush();
+      first->deliverTo(*second);
+      second->deliverTo(*first);
+      first->acknowledge();
+      second->acknowledge();
+      first->deliverTo(*second);
+      second->deliverTo(*first);
+    }
+  }
+
+  // Sends a request each way and checks that it arrives
+  void checkRequests(const string& payload) {
+    first->requestOneWay(payload);
+    second->requestOneWay(payload);
+    first->flush();
+    second->flush();
+    first->deliverTo(*second);
+    second->deliverTo(*first);
+    REQUIRE(first->hasIncomingRequest());
+    REQUIRE(first->getFirstIncomingRequest().payload == payload);
+    REQUIRE(second->hasIncomingRequest());
+    REQUIRE(second->getFirstIncomingRequest().payload == payload);
+    exchange();
+  }
+
+  shared_ptr<NetEngine> netEngine;
+  shared_ptr<CapturingHandler> first;
+  shared_ptr<CapturingHandler> second;
+};
+
+// Keys of two peers that finished a handshake, so both hold a ticket
+pair<pair<PublicKey, PrivateKey>, pair<PublicKey, PrivateKey>>
+makeTicketedPeers() {
+  auto firstKey = CryptoHandler::generateKey();
+  auto secondKey = CryptoHandler::generateKey();
+  HandlerPair pair(firstKey, secondKey, true);
+  REQUIRE(pair.first->isSealing());
+  return make_pair(firstKey, secondKey);
+}
+
+TEST_CASE("EncryptedMultiEndpointHandlerNegotiatesSequencedRpcIds") {
+  HandlerPair pair;
+  REQUIRE(pair.first->hasSequencedRpcIds());
+  REQUIRE(pair.second->hasSequencedRpcIds());
+
+  // Each side allocates from its own half of the id space
+  auto firstId = pair.first->request("FIRST");
+  auto secondId = pair.second->request("SECOND");
+  REQUIRE(firstId.isSequenced());
+  REQUIRE(secondId.isSequenced());
+  REQUIRE(firstId.getSequenceSide() != secondId.getSequenceSide());
+  pair.exchange();
+  REQUIRE(pair.first->hasIncomingRequest());
+  REQUIRE(pair.first->getFirstIncomingRequest().id == secondId);
+  REQUIRE(pair.second->hasIncomingRequest());
+  REQUIRE(pair.second->getFirstIncomingRequest().id == firstId);
+}
+
+TEST_CASE("EncryptedMultiEndpointHandlerNegotiatesCompression") {
+  HandlerPair pair;
+  REQUIRE(pair.first->readyToSend());
+  REQUIRE(pair.second->readyToSend());
+  REQUIRE(pair.first->isCompressing());
+  REQUIRE(pair.second->isCompressing());
+
+  string payload;
+  for (int a = 0; a < 8; a++) {
+    payload += "playerPosition:" + to_string(a) + ",playerVelocity:" +
+               to_string(a * 3) + ";";
+  }
+
+  // Without a dictionary
+  pair.first->requestOneWay(payload);
+  pair.first->flush();
+  REQUIRE(pair.first->sent.size() == 1);
+  int64_t sizeWithoutDictionary = int64_t(pair.first->sent[0].size());
+  pair.first->deliverTo(*pair.second);
+  REQUIRE(pair.second->hasIncomingRequest());
+  auto idPayload = pair.second->getFirstIncomingRequest();
+  REQUIRE(idPayload.payload == payload);
+  pair.second->replyOneWay(idPayload.id);
+  pair.exchange();
+
+  // The dictionary goes out first, and the request is still compressed
+  // without it because the other side may not have it yet
+  pair.first->primeCompressionDictionary(
+      {"playerPosition:", ",playerVelocity:"});
+  pair.first->requestOneWay(payload);
+  pair.first->flush();
+  pair.first->deliverTo(*pair.second);
+  REQUIRE(pair.second->hasIncomingRequest());
+  idPayload = pair.second->getFirstIncomingRequest();
+  REQUIRE(idPayload.payload == payload);
+  pair.second->replyOneWay(idPayload.id);
+  REQUIRE(!pair.second->hasIncomingRequest());
+  pair.exchange();
+
+  // Acknowledged, so now it is used
+  pair.first->requestOneWay(payload);
+  pair.first->flush();
+  REQUIRE(pair.first->sent.size() == 1);
+  REQUIRE(int64_t(pair.first->sent[0].size()) < sizeWithoutDictionary);
+  pair.first->deliverTo(*pair.second);
+  REQUIRE(pair.second->hasIncomingRequest());
+  REQUIRE(pair.second->getFirstIncomingRequest().payload == payload);
+  REQUIRE(pair.first->getCompressionBytesSaved() > 0);
+}
+
+TEST_CASE("EncryptedMultiEndpointHandlerDropsReplayedPackets") {
+  HandlerPair pair;
+  REQUIRE(pair.first->hasCounterNonces());
+  REQUIRE(pair.second->hasCounterNonces());
+
+  pair.first->requestOneWay("ONCE");
+  pair.first->flush();
+  REQUIRE(pair.first->sent.size() == 1);
+  string sealed = pair.first->sent[0];
+  pair.first->sent.clear();
+  REQUIRE((unsigned char)sealed[0] == SEALED);
+  REQUIRE(pair.second->receive(sealed) == RECEIVE_AUTHENTICATED);
+  REQUIRE(pair.second->hasIncomingRequest());
+  auto idPayload = pair.second->getFirstIncomingRequest();
+  REQUIRE(idPayload.payload == "ONCE");
+  pair.second->replyOneWay(idPayload.id);
+
+  // Refused by its counter before anything is decrypted, so even a
+  // tampered copy is only a harmless duplicate
+  REQUIRE(pair.second->receive(sealed) == RECEIVE_ACCEPTED);
+  string tampered = sealed;
+  tampered.back() ^= 1;
+  REQUIRE(pair.second->receive(tampered) == RECEIVE_ACCEPTED);
+  REQUIRE(!pair.second->hasIncomingRequest());
+
+  // A fresh counter that doesn't open is a forgery
+  pair.first->requestOneWay("TWICE");
+  pair.first->flush();
+  REQUIRE(pair.first->sent.size() == 1);
+  tampered = pair.first->sent[0];
+  pair.first->sent.clear();
+  tampered.back() ^= 1;
+  REQUIRE(pair.second->receive(tampered) == RECEIVE_INVALID);
+  REQUIRE(!pair.second->hasIncomingRequest());
+}
+
+// Hands datagrams straight to the connection they name
+class TestMultiplexer : public PortMultiplexer {
+ public:
+  explicit TestMultiplexer(shared_ptr<NetEngine> netEngine)
+      : PortMultiplexer(netEngine,
+                        shared_ptr<udp::socket>(new udp::socket(
+                            *netEngine->getIoService(),
+                            udp::endpoint(asio::ip::address_v4::loopback(),
+                                          0)))) {}
+
+  void receiveFrom(uint32_t connectionId, const string& packet,
+                   const udp::endpoint& from) {
+    handleConnectionPacket(connectionId, packet.data(), packet.size(), from);
+  }
+
+  // A datagram without a connection id
+  void receiveFrom(const string& packet, const udp::endpoint& from) {
+    string datagram = WGA_MAGIC + packet;
+    handlePacket(datagram.data(), datagram.size(), from);
+  }
+};
+
+TEST_CASE("EncryptedMultiEndpointHandlerOnlyMigratesOnFreshPackets") {
+  HandlerPair pair(false);
+  auto multiplexer = make_shared<TestMultiplexer>(pair.netEngine);
+  // Gives the second handler a connection id before the handshake
+  multiplexer->addRecipient(pair.second);
+  uint32_t connectionId = pair.second->getLocalConnectionId();
+  REQUIRE(connectionId);
+  pair.handshake();
+  udp::endpoint home = pair.second->getActiveEndpoint();
+  udp::endpoint attacker(asio::ip::address_v4::loopback(), 2);
+  udp::endpoint roamed(asio::ip::address_v4::loopback(), 3);
+
+  pair.first->requestOneWay("FIRST");
+  pair.first->flush();
+  REQUIRE(pair.first->sent.size() == 1);
+  string sealed = pair.first->sent[0];
+  pair.first->sent.clear();
+  REQUIRE((unsigned char)sealed[0] == SEALED);
+  multiplexer->receiveFrom(connectionId, sealed, home);
+  REQUIRE(pair.second->hasIncomingRequest());
+
+  // Captured and sent again from somewhere else
+  multiplexer->receiveFrom(connectionId, sealed, attacker);
+  REQUIRE(pair.second->getActiveEndpoint() == home);
+
+  // A packet with no frames, which nothing authenticates
+  MessageWriter writer;
+  writer.start();
+  writer.writePrimitive<unsigned char>(DATA);
+  writer.writePrimitive<uint64_t>(1000);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<uint64_t>(0);
+  multiplexer->receiveFrom(connectionId, writer.finish(), attacker);
+  REQUIRE(pair.second->getActiveEndpoint() == home);
+
+  // The other side really moved
+  pair.first->requestOneWay("SECOND");
+  pair.first->flush();
+  REQUIRE(pair.first->sent.size() == 1);
+  multiplexer->receiveFrom(connectionId, pair.first->sent[0], roamed);
+  pair.first->sent.clear();
+  REQUIRE(pair.second->getActiveEndpoint() == roamed);
+}
+
+TEST_CASE("EncryptedMultiEndpointHandlerOnlyRoutesClaimedEndpoints") {
+  HandlerPair pair;
+  HandlerPair other;
+  auto multiplexer = make_shared<TestMultiplexer>(pair.netEngine);
+  // Tried first, but has the wrong key
+  multiplexer->addRecipient(other.second);
+  multiplexer->addRecipient(pair.second);
+  udp::endpoint stranger(asio::ip::address_v4::loopback(), 4);
+
+  // Nothing unsealed proves who it is for
+  MessageWriter writer;
+  writer.start();
+  writer.writePrimitive<unsigned char>(DATA);
+  writer.writePrimitive<uint64_t>(1000);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<uint64_t>(0);
+  multiplexer->receiveFrom(writer.finish(), stranger);
+  REQUIRE(!other.second->hasEndpointAndResurrectIfFound(stranger));
+  REQUIRE(!pair.second->hasEndpointAndResurrectIfFound(stranger));
+
+  pair.first->requestOneWay("CLAIMED");
+  pair.first->flush();
+  REQUIRE(pair.first->sent.size() == 1);
+  multiplexer->receiveFrom(pair.first->sent[0], stranger);
+  pair.first->sent.clear();
+  // Handed over on the recipient's strand
+  for (int a = 0; a < 1000 && pair.second->getActiveEndpoint() != stranger;
+       a++) {
+    microsleep(1000);
+  }
+  REQUIRE(pair.second->getActiveEndpoint() == stranger);
+  REQUIRE(pair.second->hasIncomingRequest());
+  REQUIRE(pair.second->getFirstIncomingRequest().payload == "CLAIMED");
+  REQUIRE(!other.second->hasEndpointAndResurrectIfFound(stranger));
+}
+
+TEST_CASE("EncryptedMultiEndpointHandlerDropsUnsealedAcks") {
+  HandlerPair pair;
+  REQUIRE(pair.second->isSealing());
+  pair.second->requestOneWay("IN_FLIGHT");
+  pair.second->flush();
+  pair.second->sent.clear();
+
+  // An ack from before sealing still decrypts, but its bitmap is anyone's
+  MessageWriter writer;
+  writer.start();
+  writer.writePrimitive<unsigned char>(ACKNOWLEDGE);
+  writer.writePrimitive<uint64_t>(pair.second->getLastPacketNumber());
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<string>(
+      pair.first->getCryptoHandler()->encrypt("ACK_OK"));
+  REQUIRE(pair.second->receive(writer.finish()));
+  pair.second->resendOldestOutgoingMessage();
+  REQUIRE(pair.second->sent.size() == 1);
+}
+
+TEST_CASE("EncryptedMultiEndpointHandlerResumesSessions") {
+  auto keys = makeTicketedPeers();
+  HandlerPair pair(keys.first, keys.second, false);
+  REQUIRE(pair.first->resumeSession());
+  REQUIRE(pair.first->readyToSend());
+  REQUIRE(pair.second->resumeSession());
+  pair.exchange();
+  REQUIRE(pair.first->isResumed());
+  REQUIRE(pair.second->isResumed());
+  REQUIRE(pair.first->readyToReceive());
+  REQUIRE(pair.second->readyToReceive());
+  // Everything the last session agreed on is back
+  REQUIRE(pair.first->hasSequencedRpcIds());
+  REQUIRE(pair.second->hasSequencedRpcIds());
+  REQUIRE(pair.first->hasForwardErrorCorrection());
+  REQUIRE(pair.second->hasForwardErrorCorrection());
+  REQUIRE(pair.first->hasCounterNonces());
+  REQUIRE(pair.second->hasCounterNonces());
+  REQUIRE(pair.first->request("RESUMED").isSequenced());
+  pair.checkRequests("RESUMED");
+}
+
+// An unsealed packet with one handshake rpc, which anyone could send
+string forgeHandshake(uint64_t packetNumber, const RpcId& rpcId,
+                      const PublicKey& publicKey, const string& secret) {
+  MessageWriter payloadWriter;
+  payloadWriter.start();
+  payloadWriter.writePrimitive(CryptoHandler::keyToString(publicKey));
+  payloadWriter.writePrimitive(secret);
+  if (rpcId == RESUME_SESSION_RPCID) {
+    Nonce nonce;
+    nonce.fill(9);
+    payloadWriter.writePrimitive(CryptoHandler::keyToString(nonce));
+  }
+  payloadWriter.writePrimitive<uint32_t>(0);
+  payloadWriter.writePrimitive<uint32_t>(0);
+
+  MessageWriter writer;
+  writer.start();
+  writer.writePrimitive<unsigned char>(DATA);
+  writer.writePrimitive<uint64_t>(packetNumber);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<unsigned char>(REQUEST);
+  writer.writeClass<RpcId>(rpcId);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<uint32_t>(CONTROL_STREAM);
+  writer.writePrimitive<uint64_t>(0);
+  writer.writePrimitive<string>(payloadWriter.finish());
+  return writer.finish();
+}
+
+TEST_CASE("EncryptedMultiEndpointHandlerIgnoresForgedHandshakes") {
+  auto keys = makeTicketedPeers();
+  HandlerPair pair(keys.first, keys.second, false);
+  SessionKey junkSecret;
+  junkSecret.fill(9);
+  string forgedResume =
+      forgeHandshake(1000, RESUME_SESSION_RPCID, keys.second.first,
+                     CryptoHandler::getTicketId(junkSecret));
+  EncryptedSessionKey junkKey;
+  junkKey.fill(9);
+  string forgedKey = forgeHandshake(1001, SESSION_KEY_RPCID, keys.second.first,
+                                    CryptoHandler::keyToString(junkKey));
+
+  // Before we start, a resumption with some other ticket leaves ours alone
+  pair.first->receive(forgedResume);
+  REQUIRE(pair.first->resumeSession());
+
+  // Once we started, neither a resumption with some other ticket nor a
+  // session key that doesn't open makes us fall back
+  pair.first->receive(forgedResume);
+  REQUIRE(pair.first->isResumed());
+  pair.first->receive(forgedKey);
+  REQUIRE(pair.first->isResumed());
+  REQUIRE(pair.first->isSealing());
+
+  REQUIRE(pair.second->resumeSession());
+  pair.exchange();
+  REQUIRE(pair.first->isResumed());
+  REQUIRE(pair.second->isResumed());
+  pair.checkRequests("RESUMED");
+}
+
+TEST_CASE("EncryptedMultiEndpointHandlerFallsBackFromOneSidedTickets") {
+  auto keys = makeTicketedPeers();
+  // The second side lost its ticket
+  REQUIRE(SessionTicketCache::take(keys.second.first, keys.first.first));
+  HandlerPair pair(keys.first, keys.second, false);
+  REQUIRE(pair.first->resumeSession());
+  REQUIRE(!pair.second->resumeSession());
+  pair.second->sendSessionKey();
+  pair.exchange();
+  REQUIRE(!pair.first->isResumed());
+  REQUIRE(pair.first->readyToSend());
+  REQUIRE(pair.second->readyToSend());
+  REQUIRE(pair.first->isCompressing());
+  REQUIRE(pair.first->isSealing());
+  pair.checkRequests("HANDSHAKE");
+}
+
+TEST_CASE("EncryptedMultiEndpointHandlerGivesUpOnSilentResumptions") {
+  auto keys = makeTicketedPeers();
+  HandlerPair pair(keys.first, keys.second, false);
+  REQUIRE(pair.first->resumeSession());
+  REQUIRE(pair.first->isCompressing());
+  REQUIRE(pair.first->isSealing());
+  pair.first->flush();
+  // The other side has some other ticket and can't read our half
+  pair.first->sent.clear();
+
+  // Nothing from the ticket survives into the handshake
+  pair.first->expireResumption();
+  REQUIRE(!pair.first->isResumed());
+  REQUIRE(!pair.first->isCompressing());
+  REQUIRE(!pair.first->isSealing());
+  REQUIRE(!pair.first->getCryptoHandler()->hasCounterNonces());
+  REQUIRE(!pair.first->hasSequencedRpcIds());
+  REQUIRE(!pair.first->hasForwardErrorCorrection());
+  REQUIRE(!pair.first->readyToSend());
+
+  // Their ticket is gone too, so they answer with a handshake
+  SessionTicketCache::take(keys.second.first, keys.first.first);
+  REQUIRE(!pair.second->resumeSession());
+  pair.second->sendSessionKey();
+  pair.exchange();
+  REQUIRE(pair.first->readyToSend());
+  REQUIRE(pair.second->readyToSend());
+  REQUIRE(pair.first->isCompressing());
+  REQUIRE(pair.first->isSealing());
+  pair.checkRequests("HANDSHAKE");
+}
+
+// Two peers on loopback sockets, each behind its own multiplexer
+class LoopbackPair {
+ public:
+  LoopbackPair(const pair<PublicKey, PrivateKey>& firstKey,
+               const pair<PublicKey, PrivateKey>& secondKey,
+               int ioThreads = 1)
+      : netEngine(new NetEngine(ioThreads)) {
+    netEngine->start();
+    auto firstSocket = openLoopbackSocket(netEngine);
+    auto secondSocket = openLoopbackSocket(netEngine);
+    first = make_shared<LoopbackHandler>(
+        netEngine, firstSocket,
+        make_shared<CryptoHandler>(firstKey.second, secondKey.first),
+        secondSocket->local_endpoint());
+    second = make_shared<LoopbackHandler>(
+        netEngine, secondSocket,
+        make_shared<CryptoHandler>(secondKey.second, firstKey.first),
+        firstSocket->local_endpoint());
+    firstMultiplexer = make_shared<PortMultiplexer>(netEngine, firstSocket);
+    secondMultiplexer = make_shared<PortMultiplexer>(netEngine, secondSocket);
+  }
+
+  ~LoopbackPair() {
+    firstMultiplexer->closeSocket();
+    secondMultiplexer->closeSocket();
+    // Before anything the io threads use goes away
+    netEngine->shutdown();
+  }
+
+  // Starts receiving, once both sides picked how to start the session
+  void connect() {
+    firstMultiplexer->addRecipient(first);
+    secondMultiplexer->addRecipient(second);
+  }
+
+  bool ready() {
+    return first->readyToSend() && second->readyToSend() &&
+           first->readyToReceive() && second->readyToReceive() &&
+           first->isSealing() && second->isSealing();
+  }
+
+  // Sends a request each way and waits for both to arrive
+  void checkRequests(const string& payload) {
+    first->requestOneWay(payload);
+    second->requestOneWay(payload);
+    bool firstGot = false;
+    bool secondGot = false;
+    REQUIRE(waitUntil([&]() {
+      if (first->hasIncomingRequest()) {
+        auto idPayload = first->getFirstIncomingRequest();
+        REQUIRE(idPayload.payload == payload);
+        first->replyOneWay(idPayload.id);
+        firstGot = true;
+      }
+      if (second->hasIncomingRequest()) {
+        auto idPayload = second->getFirstIncomingRequest();
+        REQUIRE(idPayload.payload == payload);
+        second->replyOneWay(idPayload.id);
+        secondGot = true;
+      }
+      return firstGot && secondGot;
+    }));
+  }
+
+  shared_ptr<NetEngine> netEngine;
+  shared_ptr<LoopbackHandler> first;
+  shared_ptr<LoopbackHandler> second;
+  shared_ptr<PortMultiplexer> firstMultiplexer;
+  shared_ptr<PortMultiplexer> secondMultiplexer;
+};
+
+TEST_CASE("EncryptedMultiEndpointHandlerResumesOverSockets") {
+  auto keys = makeTicketedPeers();
+  LoopbackPair pair(keys.first, keys.second);
+  REQUIRE(pair.first->resumeSession());
+  REQUIRE(pair.second->resumeSession());
+  pair.connect();
+  REQUIRE(waitUntil([&]() { return pair.ready(); }));
+  REQUIRE(pair.first->isResumed());
+  REQUIRE(pair.second->isResumed());
+  REQUIRE(pair.first->hasSequencedRpcIds());
+  REQUIRE(pair.first->hasForwardErrorCorrection());
+  pair.checkRequests("RESUMED");
+}
+
+TEST_CASE("EncryptedMultiEndpointHandlerFallsBackOverSockets") {
+  auto keys = makeTicketedPeers();
+  // The second side lost its ticket, and this time offers less than the
+  // ticket remembers
+  REQUIRE(SessionTicketCache::take(keys.second.first, keys.first.first));
+  LoopbackPair pair(keys.first, keys.second);
+  pair.second->leaveOutCapabilities(CAPABILITY_SEQUENCED_RPC_IDS |
+                                    CAPABILITY_FORWARD_ERROR_CORRECTION);
+  REQUIRE(pair.first->resumeSession());
+  REQUIRE(pair.first->hasSequencedRpcIds());
+  REQUIRE(pair.first->hasForwardErrorCorrection());
+  REQUIRE(!pair.second->resumeSession());
+  pair.second->sendSessionKey();
+  pair.connect();
+  REQUIRE(
+      waitUntil([&]() { return pair.ready() && !pair.first->isResumed(); }));
+  // Only what the handshake agreed on
+  REQUIRE(!pair.first->hasSequencedRpcIds());
+  REQUIRE(!pair.first->hasForwardErrorCorrection());
+  REQUIRE(!pair.second->hasSequencedRpcIds());
+  REQUIRE(!pair.first->request("HANDSHAKE").isSequenced());
+  pair.checkRequests("HANDSHAKE");
+}
+
+TEST_CASE("EncryptedMultiEndpointHandlerSharesSocketsAcrossIoThreads") {
+  // Each connection runs on its own strand and sends on the multiplexer's,
+  // which also waits on the socket for packets
+  LoopbackPair pair(CryptoHandler::generateKey(),
+                    CryptoHandler::generateKey(), 4);
+  pair.first->sendSessionKey();
+  pair.second->sendSessionKey();
+  pair.connect();
+  REQUIRE(waitUntil([&]() { return pair.ready(); }));
+  for (int a = 0; a < 50; a++) {
+    pair.checkRequests(string("REQUEST_") + to_string(a));
+  }
+}
+}  // namespace wga
@@ -0,0 +1,77 @@
+#include "Headers.hpp"
+
+#include "EndpointRoutingTable.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+namespace {
+udp::endpoint makeEndpoint(const string& address, int port) {
+  return udp::endpoint(asio::ip::make_address(address), port);
+}
+}  // namespace
+
+TEST_CASE("EndpointRoutingTableRoutes") {
+  EndpointRoutingTable<int> table;
+  auto first = make_shared<int>(1);
+  auto second = make_shared<int>(2);
+  auto endpoint = makeEndpoint("10.0.0.1", 2000);
+  REQUIRE(table.find(endpoint).get() == NULL);
+
+  REQUIRE(table.add(endpoint, first));
+  REQUIRE(table.add(makeEndpoint("10.0.0.1", 2001), second));
+  REQUIRE(table.find(endpoint) == first);
+  REQUIRE(table.find(makeEndpoint("10.0.0.1", 2001)) == second);
+  REQUIRE(table.find(makeEndpoint("10.0.0.2", 2000)).get() == NULL);
+
+  // First come, first served
+  REQUIRE(table.add(endpoint, first));
+  REQUIRE(!table.add(endpoint, second));
+  REQUIRE(table.find(endpoint) == first);
+
+  // Only the owner can take the route away
+  table.remove(endpoint, second.get());
+  REQUIRE(table.find(endpoint) == first);
+  table.remove(endpoint, first.get());
+  REQUIRE(table.find(endpoint).get() == NULL);
+  REQUIRE(table.size() == 1);
+}
+
+TEST_CASE("EndpointRoutingTableForgetsDeadConnections") {
+  EndpointRoutingTable<int> table;
+  auto endpoint = makeEndpoint("10.0.0.1", 2000);
+  auto first = make_shared<int>(1);
+  table.add(endpoint, first);
+  first.reset();
+  REQUIRE(table.find(endpoint).get() == NULL);
+  auto second = make_shared<int>(2);
+  REQUIRE(table.add(endpoint, second));
+  REQUIRE(table.find(endpoint) == second);
+}
+
+TEST_CASE("EndpointRoutingTableReadsWhileWriting") {
+  EndpointRoutingTable<int> table;
+  auto owner = make_shared<int>(1);
+  auto stable = makeEndpoint("10.0.0.1", 1);
+  table.add(stable, owner);
+  atomic<bool> done(false);
+  atomic<int64_t> misses(0);
+  std::thread reader([&]() {
+    while (!done) {
+      if (table.find(stable) != owner) {
+        misses++;
+      }
+    }
+  });
+  for (int a = 0; a < 2000; a++) {
+    auto endpoint = makeEndpoint("10.0.1.1", 1000 + a);
+    table.add(endpoint, owner);
+    table.remove(endpoint, owner.get());
+  }
+  done = true;
+  reader.join();
+  REQUIRE(misses == 0);
+  REQUIRE(table.size() == 1);
+}
+}  // namespace wga
@@ -42,7 +42,7 @@ class FlakyRpcTest {
           done = false;
         }
         LOG(ERROR) << "Can't teardown, still has work";
-        it->resendRandomOutgoingMessage();
+        it->resendOldestOutgoingMessage();
       }
       if (done) {
         break;
@@ -0,0 +1,158 @@
+#include "Headers.hpp"
+
+#include "ForwardErrorCorrection.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("ParityRebuildsOneLostPacket") {
+  ParityEncoder encoder;
+  encoder.configure(3, 1);
+  vector<string> packets = {"FIRST", "THE_SECOND_ONE", "3"};
+  ParityGroup parity;
+  REQUIRE(!encoder.add(10, packets[0], &parity));
+  REQUIRE(!encoder.add(11, packets[1], &parity));
+  REQUIRE(encoder.add(13, packets[2], &parity));
+  REQUIRE(parity.getPacketNumbers() == vector<uint64_t>({10, 11, 13}));
+
+  for (int lost = 0; lost < 3; lost++) {
+    ParityDecoder decoder(64);
+    AckBitmap received;
+    uint64_t packetNumber;
+    string packet;
+    decoder.activate();
+    auto numbers = parity.getPacketNumbers();
+    for (int a = 0; a < 3; a++) {
+      if (a != lost) {
+        decoder.addPacket(numbers[a], packets[a]);
+        received.markReceived(numbers[a]);
+      }
+    }
+    REQUIRE(decoder.recover(parity, received, &packetNumber, &packet));
+    REQUIRE(packetNumber == numbers[lost]);
+    REQUIRE(packet == packets[lost]);
+  }
+}
+
+TEST_CASE("ParityNeedsAllButOne") {
+  ParityEncoder encoder;
+  encoder.configure(3, 1);
+  ParityGroup parity;
+  encoder.add(1, "A", &parity);
+  encoder.add(2, "B", &parity);
+  REQUIRE(encoder.add(3, "C", &parity));
+
+  ParityDecoder decoder(64);
+  AckBitmap received;
+  uint64_t packetNumber;
+  string packet;
+  decoder.activate();
+  decoder.addPacket(1, "A");
+  received.markReceived(1);
+  // Two missing is more than XOR can fix
+  REQUIRE(!decoder.recover(parity, received, &packetNumber, &packet));
+  // Nothing missing leaves nothing to do
+  decoder.addPacket(2, "B");
+  decoder.addPacket(3, "C");
+  REQUIRE(!decoder.recover(parity, received, &packetNumber, &packet));
+}
+
+TEST_CASE("ParityDecoderWaitsForParity") {
+  ParityEncoder encoder;
+  encoder.configure(2, 1);
+  ParityGroup first, second;
+  encoder.add(1, "A", &first);
+  REQUIRE(encoder.add(2, "B", &first));
+  encoder.add(3, "C", &second);
+  REQUIRE(encoder.add(4, "D", &second));
+
+  ParityDecoder decoder(4);
+  AckBitmap received;
+  uint64_t packetNumber;
+  string packet;
+  // Nothing is kept before the first parity packet
+  decoder.addPacket(2, "B");
+  received.markReceived(2);
+  REQUIRE(!decoder.isActive());
+  REQUIRE(!decoder.recover(first, received, &packetNumber, &packet));
+  REQUIRE(decoder.isActive());
+  decoder.addPacket(4, "D");
+  received.markReceived(4);
+  REQUIRE(decoder.recover(second, received, &packetNumber, &packet));
+  REQUIRE(packet == "C");
+
+  // Stops again once parity does
+  for (uint64_t a = 5; a < 10; a++) {
+    decoder.addPacket(a, "E");
+  }
+  REQUIRE(!decoder.isActive());
+}
+
+TEST_CASE("ParityInterleavesAgainstBursts") {
+  ParityEncoder encoder;
+  encoder.configure(2, 2);
+  vector<ParityGroup> groups;
+  for (uint64_t a = 1; a <= 4; a++) {
+    ParityGroup parity;
+    if (encoder.add(a, string("PACKET_") + to_string(a), &parity)) {
+      groups.push_back(parity);
+    }
+  }
+  // Packets 1 and 3 share a group, as do 2 and 4, so losing 1 and 2
+  // together costs each group one packet
+  REQUIRE(groups.size() == 2);
+  REQUIRE(groups[0].getPacketNumbers() == vector<uint64_t>({1, 3}));
+  REQUIRE(groups[1].getPacketNumbers() == vector<uint64_t>({2, 4}));
+
+  ParityDecoder decoder(64);
+  AckBitmap received;
+  uint64_t packetNumber;
+  string packet;
+  decoder.activate();
+  decoder.addPacket(3, "PACKET_3");
+  decoder.addPacket(4, "PACKET_4");
+  received.markReceived(3);
+  received.markReceived(4);
+  REQUIRE(decoder.recover(groups[0], received, &packetNumber, &packet));
+  REQUIRE(packet == "PACKET_1");
+  REQUIRE(decoder.recover(groups[1], received, &packetNumber, &packet));
+  REQUIRE(packet == "PACKET_2");
+}
+
+TEST_CASE("ParityAdaptsToLoss") {
+  LossEstimator loss;
+  ParityEncoder encoder;
+  for (int a = 0; a < 1000; a++) {
+    loss.addOutcome(false);
+  }
+  encoder.adapt(loss);
+  // A clean link pays nothing
+  REQUIRE(!encoder.enabled());
+
+  // One in ten lost, two at a time
+  for (int a = 0; a < 1000; a++) {
+    loss.addOutcome(a % 20 < 2);
+    encoder.adapt(loss);
+  }
+  REQUIRE(loss.getLossRate() > 0.05);
+  REQUIRE(loss.getMeanBurstLength() == Approx(2.0).epsilon(0.01));
+  REQUIRE(encoder.enabled());
+  REQUIRE(encoder.getGroupSize() <= 4);
+  REQUIRE(encoder.getDepth() == 2);
+
+  // Backs off slowly once the losses stop, then turns off
+  int groupSize = encoder.getGroupSize();
+  for (int a = 0; a < 300; a++) {
+    loss.addOutcome(false);
+    encoder.adapt(loss);
+  }
+  REQUIRE(encoder.enabled());
+  REQUIRE(encoder.getGroupSize() <= groupSize + 2);
+  for (int a = 0; a < 100 * 1000 && encoder.enabled(); a++) {
+    loss.addOutcome(false);
+    encoder.adapt(loss);
+  }
+  REQUIRE(!encoder.enabled());
+}
+}  // namespace wga
@@ -0,0 +1,81 @@
+#include "Headers.hpp"
+
+#include "FragmentBuffer.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("FragmentBufferRoundTrip") {
+  string frame;
+  for (int a = 0; a < 1000; a++) {
+    frame += char('a' + (a % 26));
+  }
+  OutgoingFragments fragments(frame, 300);
+  REQUIRE(fragments.getCount() == 4);
+  REQUIRE(fragments.getPiece(3).size() == 100);
+
+  FragmentReassembler reassembler(4096);
+  string whole;
+  // Out of order, with a duplicate
+  for (uint32_t index : {2, 0, 2, 3}) {
+    REQUIRE(reassembler.add(1, RpcId(0, 1), fragments.getOffset(index),
+                            fragments.getFrameSize(),
+                            fragments.getPiece(index),
+                            &whole) == FRAGMENT_STORED);
+  }
+  REQUIRE(reassembler.add(1, RpcId(0, 1), fragments.getOffset(1),
+                          fragments.getFrameSize(), fragments.getPiece(1),
+                          &whole) == FRAGMENT_COMPLETE);
+  REQUIRE(whole == frame);
+  REQUIRE(reassembler.empty());
+  REQUIRE(reassembler.getReservedBytes() == 0);
+}
+
+TEST_CASE("FragmentBufferAcknowledgeAcrossSplits") {
+  OutgoingFragments fragments(string(1000, 'x'), 400);
+  REQUIRE(!fragments.acknowledge(0, 400));
+  REQUIRE(fragments.isAcknowledged(0));
+
+  // Splitting smaller starts over, but an ack of an old, bigger piece still
+  // covers the new pieces inside it.
+  fragments.split(200);
+  REQUIRE(fragments.getCount() == 5);
+  REQUIRE(!fragments.acknowledge(400, 400));
+  REQUIRE(fragments.isAcknowledged(2));
+  REQUIRE(fragments.isAcknowledged(3));
+  REQUIRE(!fragments.isAcknowledged(0));
+  REQUIRE(!fragments.acknowledge(0, 400));
+  REQUIRE(fragments.acknowledge(800, 200));
+  REQUIRE(fragments.complete());
+
+  // Pieces from both splits go back together
+  FragmentReassembler reassembler(4096);
+  string whole;
+  REQUIRE(reassembler.add(2, RpcId(0, 1), 0, 1000, string(400, 'x'),
+                          &whole) == FRAGMENT_STORED);
+  REQUIRE(reassembler.add(2, RpcId(0, 1), 200, 1000, string(200, 'x'),
+                          &whole) == FRAGMENT_STORED);
+  REQUIRE(reassembler.add(2, RpcId(0, 1), 400, 1000, string(600, 'x'),
+                          &whole) == FRAGMENT_COMPLETE);
+  REQUIRE(whole == string(1000, 'x'));
+}
+
+TEST_CASE("FragmentBufferRefusesWhenFull") {
+  FragmentReassembler reassembler(1500);
+  string whole;
+  REQUIRE(reassembler.add(1, RpcId(0, 1), 0, 1000, string(100, 'a'),
+                          &whole) == FRAGMENT_STORED);
+  // A second partial frame doesn't fit next to the first
+  REQUIRE(reassembler.add(1, RpcId(0, 2), 0, 1000, string(100, 'b'),
+                          &whole) == FRAGMENT_REFUSED);
+  // Pieces of the first still go in
+  REQUIRE(reassembler.add(1, RpcId(0, 1), 100, 1000, string(900, 'a'),
+                          &whole) == FRAGMENT_COMPLETE);
+  REQUIRE(reassembler.add(1, RpcId(0, 2), 0, 1000, string(100, 'b'),
+                          &whole) == FRAGMENT_STORED);
+  // Past the end of the frame
+  REQUIRE(reassembler.add(1, RpcId(0, 3), 900, 1000, string(200, 'c'),
+                          &whole) == FRAGMENT_REFUSED);
+}
+}  // namespace wga
@@ -0,0 +1,113 @@
+#include "Headers.hpp"
+
+#include "UdpBiDirectionalRpc.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+// Only here for its strand, nothing is ever sent
+class StrandRpc : public UdpBiDirectionalRpc {
+ public:
+  explicit StrandRpc(shared_ptr<NetEngine> netEngine)
+      : UdpBiDirectionalRpc(
+            netEngine,
+            shared_ptr<udp::socket>(new udp::socket(
+                *netEngine->getIoService(),
+                udp::endpoint(asio::ip::address_v4::loopback(), 0))),
+            false) {}
+
+  bool ownsThread() { return isOwnerThread(); }
+};
+
+// Handlers of one connection, checking that they run alone and that only
+// they see themselves as the owner
+class StrandWork {
+ public:
+  StrandWork(shared_ptr<StrandRpc> _rpc, shared_ptr<StrandRpc> _otherRpc)
+      : rpc(_rpc),
+        otherRpc(_otherRpc),
+        running(0),
+        overlaps(0),
+        notOwner(0),
+        otherOwner(0),
+        finished(0) {}
+
+  function<void()> makeHandler() {
+    return [this]() {
+      if (running.fetch_add(1) != 0) {
+        overlaps++;
+      }
+      if (!rpc->ownsThread()) {
+        notOwner++;
+      }
+      if (otherRpc->ownsThread()) {
+        otherOwner++;
+      }
+      // Long enough for another io thread to come in if it could
+      this_thread::sleep_for(chrono::microseconds(200));
+      running--;
+      finished++;
+    };
+  }
+
+  shared_ptr<StrandRpc> rpc;
+  shared_ptr<StrandRpc> otherRpc;
+  atomic<int> running;
+  atomic<int> overlaps;
+  atomic<int> notOwner;
+  atomic<int> otherOwner;
+  atomic<int> finished;
+};
+
+TEST_CASE("NetEngineRunsEachConnectionOnItsStrand") {
+  shared_ptr<NetEngine> netEngine(new NetEngine(4));
+  netEngine->start();
+  auto first = make_shared<StrandRpc>(netEngine);
+  auto second = make_shared<StrandRpc>(netEngine);
+  StrandWork firstWork(first, second);
+  StrandWork secondWork(second, first);
+  // Nobody else is the owner, so calls from here go through the queue
+  REQUIRE(!first->ownsThread());
+  REQUIRE(!second->ownsThread());
+
+  const int HANDLERS = 100;
+  vector<unique_ptr<asio::steady_timer>> timers;
+  atomic<int> unownedRuns(0);
+  atomic<int> unownedOwners(0);
+  auto start = chrono::steady_clock::now();
+  for (int a = 0; a < HANDLERS; a++) {
+    for (auto work : {&firstWork, &secondWork}) {
+      work->rpc->getStrand()->post(work->makeHandler());
+      timers.emplace_back(netEngine->createTimer(
+          start + chrono::microseconds(100 * (a % 10))));
+      timers.back()->async_wait(work->rpc->getStrand()->wrap(
+          [handler = work->makeHandler()](const asio::error_code& error) {
+            handler();
+          }));
+    }
+    // Off both strands, on some io thread
+    netEngine->post([&]() {
+      if (first->ownsThread() || second->ownsThread()) {
+        unownedOwners++;
+      }
+      unownedRuns++;
+    });
+  }
+
+  auto deadline = chrono::steady_clock::now() + chrono::seconds(30);
+  while ((firstWork.finished < 2 * HANDLERS ||
+          secondWork.finished < 2 * HANDLERS || unownedRuns < HANDLERS) &&
+         chrono::steady_clock::now() < deadline) {
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  for (auto work : {&firstWork, &secondWork}) {
+    REQUIRE(work->finished == 2 * HANDLERS);
+    REQUIRE(work->overlaps == 0);
+    REQUIRE(work->notOwner == 0);
+    REQUIRE(work->otherOwner == 0);
+  }
+  REQUIRE(unownedRuns == HANDLERS);
+  REQUIRE(unownedOwners == 0);
+}
+}  // namespace wga
@@ -0,0 +1,103 @@
+#include "Headers.hpp"
+
+#include "MessageWriter.hpp"
+#include "PacketBuffer.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("PacketBufferPrependsIntoHeadroom") {
+  PacketBuffer packet;
+  packet.append("FRAMES");
+  const char* frames = packet.data();
+  packet.prepend("HEADER", 6);
+  REQUIRE(packet.toString() == "HEADERFRAMES");
+  // The frames stayed where they were written
+  REQUIRE(packet.data() + 6 == frames);
+
+  // Running out of headroom still works, it just moves the bytes
+  string bigHeader(PacketBuffer::HEADROOM * 2, 'H');
+  packet.prepend(bigHeader.data(), bigHeader.size());
+  REQUIRE(packet.toString() == bigHeader + "HEADERFRAMES");
+
+  packet.clear();
+  REQUIRE(packet.empty());
+}
+
+TEST_CASE("PacketBufferGrows") {
+  PacketBuffer packet;
+  string big(PacketBuffer::INITIAL_CAPACITY * 3, 'x');
+  packet.append("A");
+  packet.append(big);
+  REQUIRE(packet.size() == big.size() + 1);
+  REQUIRE(packet.toString() == "A" + big);
+}
+
+TEST_CASE("MessageWriterWritesIntoPackets") {
+  PacketBuffer packet;
+  MessageWriter writer;
+  writer.start(&packet);
+  writer.writePrimitive<string>("BODY");
+  size_t bodySize = packet.size();
+  REQUIRE(writer.size() == int64_t(bodySize));
+  const char* body = packet.data();
+  writer.start();
+  writer.writePrimitive<uint64_t>(7);
+  writer.finishInFront(&packet);
+  REQUIRE(writer.size() == 0);
+  // The body was packed where it stays
+  REQUIRE(packet.data() + (packet.size() - bodySize) == body);
+
+  MessageWriter expected;
+  expected.start();
+  expected.writePrimitive<uint64_t>(7);
+  expected.writePrimitive<string>("BODY");
+  REQUIRE(packet.toString() == expected.finish());
+}
+
+TEST_CASE("PacketBufferPoolRecycles") {
+  const PacketBuffer* first;
+  {
+    auto packet = PacketBufferPool::acquire();
+    packet->append("STALE");
+    first = packet.get();
+  }
+  int64_t pooled = PacketBufferPool::getPooledCount();
+  REQUIRE(pooled >= 1);
+  auto packet = PacketBufferPool::acquire();
+  REQUIRE(packet.get() == first);
+  REQUIRE(packet->empty());
+  REQUIRE(PacketBufferPool::getPooledCount() == pooled - 1);
+}
+
+TEST_CASE("PacketBufferPoolSharesAcrossThreads") {
+  // Empty this thread's free list
+  vector<PacketBufferPtr> held;
+  while (PacketBufferPool::getPooledCount() > 0) {
+    held.push_back(PacketBufferPool::acquire());
+  }
+
+  // Another thread releases enough to hand a batch to the depot
+  std::thread([]() {
+    vector<PacketBufferPtr> packets;
+    for (size_t a = 0; a < 2 * PacketBufferPool::BATCH_SIZE; a++) {
+      packets.push_back(PacketBufferPool::acquire());
+    }
+  }).join();
+
+  auto packet = PacketBufferPool::acquire();
+  REQUIRE(PacketBufferPool::getPooledCount() ==
+          int64_t(PacketBufferPool::BATCH_SIZE) - 1);
+
+  // Copies share one buffer, which goes back once the last copy is gone
+  auto copy = packet;
+  REQUIRE(copy.get() == packet.get());
+  packet.reset();
+  REQUIRE(PacketBufferPool::getPooledCount() ==
+          int64_t(PacketBufferPool::BATCH_SIZE) - 1);
+  copy.reset();
+  REQUIRE(PacketBufferPool::getPooledCount() ==
+          int64_t(PacketBufferPool::BATCH_SIZE));
+}
+}  // namespace wga
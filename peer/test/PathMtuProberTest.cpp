@@ -0,0 +1,101 @@
+#include "Headers.hpp"
+
+#include "PathMtuProber.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("PathMtuProberSearches") {
+  // The path carries 1400 bytes
+  PathMtuProber prober(1200, 1452);
+  int64_t now = 0;
+  while (true) {
+    int64_t size = prober.getProbeSize(now);
+    if (!size) {
+      break;
+    }
+    REQUIRE(prober.isSearching());
+    if (size <= 1400) {
+      prober.onProbeSent(size, now + 1000);
+      prober.onProbeAcknowledged(size, now);
+      now += 1000;
+      continue;
+    }
+    // The same size is tried three times before giving up on it
+    for (int a = 0; a < 3; a++) {
+      REQUIRE(prober.getProbeSize(now) == size);
+      prober.onProbeSent(size, now + 1000);
+      now += 1000;
+      prober.checkTimeout(now);
+    }
+  }
+  REQUIRE(!prober.isSearching());
+  REQUIRE(prober.getMtu() <= 1400);
+  REQUIRE(prober.getMtu() > 1400 - 16);
+
+  // Nothing more to do until it is time to look for a bigger mtu again
+  REQUIRE(prober.getProbeSize(now + 1000) == 0);
+  REQUIRE(prober.getProbeSize(now + 601 * 1000 * 1000LL) > 1400);
+
+  prober.onBlackHole(now);
+  REQUIRE(prober.getMtu() == 1200);
+}
+
+TEST_CASE("PathMtuProberWaitsForTheProbe") {
+  PathMtuProber prober(1200, 1452);
+  int64_t size = prober.getProbeSize(0);
+  REQUIRE(size == 1326);
+  prober.onProbeSent(size, 1000);
+  REQUIRE(prober.getProbeSize(500) == 0);
+  prober.checkTimeout(500);
+  REQUIRE(prober.getProbeSize(500) == 0);
+  // A late ack still counts
+  prober.checkTimeout(1000);
+  prober.onProbeAcknowledged(size, 1500);
+  REQUIRE(prober.getMtu() == 1326);
+}
+
+TEST_CASE("PathMtuProberFindsBlackHoles") {
+  PathMtuProber prober(1200, 1452);
+  int64_t size = prober.getProbeSize(0);
+  prober.onProbeSent(size, 1000);
+  prober.onProbeAcknowledged(size, 0);
+  REQUIRE(prober.getMtu() == size);
+
+  // Plain loss hits small packets too
+  for (int a = 0; a < 10; a++) {
+    prober.onPacketLost(size);
+    prober.onPacketLost(1000);
+  }
+  REQUIRE(!prober.isBlackHole());
+  // A big packet getting through clears the count
+  prober.onPacketAcknowledged(size);
+  prober.onPacketAcknowledged(1000);
+  prober.onPacketLost(size);
+  prober.onPacketLost(size);
+  REQUIRE(!prober.isBlackHole());
+  prober.onPacketLost(size);
+  REQUIRE(prober.isBlackHole());
+
+  int64_t now = 1000;
+  prober.onBlackHole(now);
+  REQUIRE(prober.getMtu() == 1200);
+  REQUIRE(!prober.isBlackHole());
+  // Waits before searching again, and longer after the next black hole
+  REQUIRE(prober.getProbeSize(now) == 0);
+  now += 30 * 1000 * 1000LL;
+  size = prober.getProbeSize(now);
+  REQUIRE(size > 1200);
+  prober.onProbeSent(size, now + 1000);
+  prober.onProbeAcknowledged(size, now);
+  for (int a = 0; a < 3; a++) {
+    prober.onPacketLost(size);
+  }
+  prober.onPacketAcknowledged(1000);
+  REQUIRE(prober.isBlackHole());
+  prober.onBlackHole(now);
+  REQUIRE(prober.getProbeSize(now + 30 * 1000 * 1000LL) == 0);
+  REQUIRE(prober.getProbeSize(now + 60 * 1000 * 1000LL) > 1200);
+}
+}  // namespace wga
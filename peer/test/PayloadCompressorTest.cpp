@@ -0,0 +1,76 @@
+#include "Headers.hpp"
+
+#include "PayloadCompressor.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("PayloadCompressorRoundTrip") {
+  string input;
+  for (int a = 0; a < 200; a++) {
+    input += "button" + to_string(a % 7) + "=" + to_string(a % 2) + ";";
+  }
+  input += string(100, 'x');
+  string block = PayloadCompressor::compressBlock("", input);
+  REQUIRE(block.size() < input.size() / 3);
+  REQUIRE(*PayloadCompressor::decompressBlock("", block, input.size()) ==
+          input);
+
+  // Truncated or mis-sized blocks are rejected
+  REQUIRE(!PayloadCompressor::decompressBlock("", block, input.size() + 1));
+  REQUIRE(!PayloadCompressor::decompressBlock(
+      "", block.substr(0, block.size() / 2), input.size()));
+
+  string empty = PayloadCompressor::compressBlock("", "");
+  REQUIRE(*PayloadCompressor::decompressBlock("", empty, 0) == "");
+}
+
+TEST_CASE("PayloadCompressorDecodesPastItsReservation") {
+  // Bigger than what is set aside up front
+  string input;
+  for (int a = 0; a < 40000; a++) {
+    input += "axis" + to_string(a % 13) + ";";
+  }
+  string block = PayloadCompressor::compressBlock("", input);
+  REQUIRE(*PayloadCompressor::decompressBlock("", block, input.size()) ==
+          input);
+
+  // A tiny block claiming a huge payload is turned away once it runs out
+  string small = PayloadCompressor::compressBlock("", "axis0;");
+  REQUIRE(!PayloadCompressor::decompressBlock("", small, 32 * 1024 * 1024));
+}
+
+TEST_CASE("PayloadCompressorUsesDictionary") {
+  string dictionary = "button0button1button2axis_xaxis_y";
+  string input = "axis_ybutton2button0axis_xbutton1button2";
+  string withoutDictionary = PayloadCompressor::compressBlock("", input);
+  string withDictionary = PayloadCompressor::compressBlock(dictionary, input);
+  REQUIRE(withDictionary.size() < withoutDictionary.size());
+  REQUIRE(*PayloadCompressor::decompressBlock(dictionary, withDictionary,
+                                              input.size()) == input);
+
+  PayloadCompressor sender, receiver;
+  sender.setOutgoingDictionary(1, dictionary);
+  receiver.addIncomingDictionary(1, dictionary);
+  string encoded = sender.compress(input);
+  REQUIRE(encoded[0] == PAYLOAD_COMPRESSED);
+  REQUIRE(*receiver.decompress(encoded) == input);
+  REQUIRE(sender.getBytesSaved() > 0);
+
+  // The receiver doesn't know this dictionary
+  PayloadCompressor stranger;
+  REQUIRE(!stranger.decompress(encoded));
+}
+
+TEST_CASE("PayloadCompressorBypasses") {
+  PayloadCompressor sender, receiver;
+  string input = "q8#Zp";
+  string encoded = sender.compress(input);
+  REQUIRE(encoded[0] == PAYLOAD_RAW);
+  REQUIRE(encoded.size() == input.size() + 1);
+  REQUIRE(*receiver.decompress(encoded) == input);
+  REQUIRE(sender.getBypassedPayloads() == 1);
+  REQUIRE(sender.getBytesSaved() == -1);
+}
+}  // namespace wga
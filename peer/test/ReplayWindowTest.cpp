@@ -0,0 +1,50 @@
+#include "Headers.hpp"
+
+#include "ReplayWindow.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("ReplayWindowRefusesRepeats") {
+  ReplayWindow window;
+  REQUIRE(!window.canAccept(0));
+  for (uint64_t counter = 1; counter <= 100; counter++) {
+    REQUIRE(window.canAccept(counter));
+    window.accept(counter);
+    REQUIRE(!window.canAccept(counter));
+  }
+  REQUIRE(window.getHighest() == 100);
+  REQUIRE(!window.canAccept(50));
+}
+
+TEST_CASE("ReplayWindowTakesReorderedCounters") {
+  ReplayWindow window;
+  window.accept(10);
+  // Skipped over, so still welcome
+  REQUIRE(window.canAccept(5));
+  window.accept(5);
+  REQUIRE(!window.canAccept(5));
+  REQUIRE(window.canAccept(9));
+
+  // Too far behind to tell, so refused
+  window.accept(10 + ReplayWindow::WINDOW_BITS);
+  REQUIRE(!window.canAccept(9));
+  // Slots we moved over forget what they held
+  REQUIRE(window.canAccept(10 + ReplayWindow::WINDOW_BITS - 1));
+}
+
+TEST_CASE("ReplayWindowExpandsTruncatedCounters") {
+  ReplayWindow window;
+  REQUIRE(window.expand(1) == 1);
+  uint64_t base = (1ULL << 32) - 10;
+  window.accept(base);
+  // Wrapped past the low 32 bits
+  REQUIRE(window.expand(5) == (1ULL << 32) + 5);
+  // A little behind, before the wrap
+  REQUIRE(window.expand(uint32_t(base - 3)) == base - 3);
+  window.accept((1ULL << 32) + 5);
+  REQUIRE(window.expand(uint32_t(base)) == base);
+  REQUIRE(window.expand(6) == (1ULL << 32) + 6);
+}
+}  // namespace wga
@@ -0,0 +1,41 @@
+#include "Headers.hpp"
+
+#include "RttEstimator.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("RttEstimatorConverges") {
+  RttEstimator estimator;
+  int64_t initialTimeout = estimator.getRetransmissionTimeout();
+  REQUIRE(initialTimeout > 0);
+
+  for (int a = 0; a < 100; a++) {
+    estimator.addSample(50 * 1000.0);
+  }
+  REQUIRE(estimator.getSmoothedRtt() == Approx(50 * 1000.0));
+  // Steady samples leave only the clock granularity as slack
+  int64_t timeout = estimator.getRetransmissionTimeout();
+  REQUIRE(timeout >= 50 * 1000);
+  REQUIRE(timeout < 60 * 1000);
+
+  // Jittery samples widen the timeout
+  for (int a = 0; a < 100; a++) {
+    estimator.addSample((a % 2) ? 20 * 1000.0 : 80 * 1000.0);
+  }
+  REQUIRE(estimator.getRetransmissionTimeout() > timeout);
+}
+
+TEST_CASE("RttEstimatorBackoff") {
+  RttEstimator estimator;
+  estimator.addSample(100 * 1000.0);
+  int64_t timeout = estimator.getRetransmissionTimeout();
+  REQUIRE(estimator.getRetransmissionTimeout(0) == timeout);
+  REQUIRE(estimator.getRetransmissionTimeout(1) == timeout * 2);
+  REQUIRE(estimator.getRetransmissionTimeout(2) == timeout * 4);
+  // Backoff is capped
+  REQUIRE(estimator.getRetransmissionTimeout(100) ==
+          estimator.getRetransmissionTimeout(200));
+}
+}  // namespace wga
@@ -0,0 +1,186 @@
+#include "Headers.hpp"
+
+#include "SessionTicket.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+inline PublicKey makeTestKey(uint8_t seed) {
+  PublicKey key;
+  key.fill(seed);
+  return key;
+}
+
+TEST_CASE("SessionTicketsAreTakenOnce") {
+  SessionTicketCache::clear();
+  SessionTicket ticket;
+  ticket.secret.fill(7);
+  ticket.capabilities = 0x31;
+  SessionTicketCache::store(makeTestKey(1), makeTestKey(2), ticket);
+  REQUIRE(SessionTicketCache::size() == 1);
+
+  // Keyed on both sides of the session
+  REQUIRE(!SessionTicketCache::take(makeTestKey(2), makeTestKey(1)));
+  auto taken = SessionTicketCache::take(makeTestKey(1), makeTestKey(2));
+  REQUIRE(taken);
+  REQUIRE(taken->secret == ticket.secret);
+  REQUIRE(taken->capabilities == ticket.capabilities);
+  REQUIRE(!SessionTicketCache::take(makeTestKey(1), makeTestKey(2)));
+  REQUIRE(SessionTicketCache::size() == 0);
+}
+
+TEST_CASE("SessionTicketsKeepTheLatestSession") {
+  SessionTicketCache::clear();
+  SessionTicket first;
+  first.secret.fill(1);
+  SessionTicket second;
+  second.secret.fill(2);
+  SessionTicketCache::store(makeTestKey(1), makeTestKey(2), first);
+  SessionTicketCache::store(makeTestKey(1), makeTestKey(2), second);
+  SessionTicketCache::store(makeTestKey(1), makeTestKey(3), first);
+  REQUIRE(SessionTicketCache::size() == 2);
+  REQUIRE(SessionTicketCache::take(makeTestKey(1), makeTestKey(2))->secret ==
+          second.secret);
+  REQUIRE(SessionTicketCache::take(makeTestKey(1), makeTestKey(3))->secret ==
+          first.secret);
+}
+
+TEST_CASE("SessionTicketsCarryClockState") {
+  SessionTicketCache::clear();
+  ClockState clockState;
+  clockState.baselineOffset = 1234;
+  clockState.count = 20;
+  // Nothing to update without a ticket
+  SessionTicketCache::updateClockState(makeTestKey(1), makeTestKey(2),
+                                       clockState);
+  REQUIRE(SessionTicketCache::size() == 0);
+
+  SessionTicketCache::store(makeTestKey(1), makeTestKey(2), SessionTicket());
+  SessionTicketCache::updateClockState(makeTestKey(1), makeTestKey(2),
+                                       clockState);
+  auto taken = SessionTicketCache::take(makeTestKey(1), makeTestKey(2));
+  REQUIRE(taken);
+  REQUIRE(taken->clockState.baselineOffset == 1234);
+  REQUIRE(taken->clockState.count == 20);
+}
+
+TEST_CASE("SessionTicketsAreTakenByTheirId") {
+  SessionTicketCache::clear();
+  SessionTicket ticket;
+  ticket.secret.fill(7);
+  SessionTicketCache::store(makeTestKey(1), makeTestKey(2), ticket);
+  SessionKey otherSecret;
+  otherSecret.fill(8);
+  REQUIRE(!SessionTicketCache::take(makeTestKey(1), makeTestKey(2),
+                                    CryptoHandler::getTicketId(otherSecret)));
+  REQUIRE(SessionTicketCache::size() == 1);
+  REQUIRE(SessionTicketCache::take(makeTestKey(1), makeTestKey(2),
+                                   CryptoHandler::getTicketId(ticket.secret)));
+  REQUIRE(SessionTicketCache::size() == 0);
+}
+
+// Two ends of a session, before either has a session key
+class CryptoPair {
+ public:
+  CryptoPair()
+      : firstKey(CryptoHandler::generateKey()),
+        secondKey(CryptoHandler::generateKey()) {
+    restart();
+  }
+
+  // A new session between the same two peers
+  void restart() {
+    first.reset(new CryptoHandler(firstKey.second, secondKey.first));
+    second.reset(new CryptoHandler(secondKey.second, firstKey.first));
+  }
+
+  void handshake() {
+    REQUIRE(
+        second->receiveIncomingSessionKey(first->generateOutgoingSessionKey()));
+    REQUIRE(
+        first->receiveIncomingSessionKey(second->generateOutgoingSessionKey()));
+  }
+
+  pair<PublicKey, PrivateKey> firstKey;
+  pair<PublicKey, PrivateKey> secondKey;
+  shared_ptr<CryptoHandler> first;
+  shared_ptr<CryptoHandler> second;
+};
+
+// Seals a message on one side and opens it on the other
+bool sealAndOpen(CryptoHandler* from, CryptoHandler* to,
+                 const string& message) {
+  string sealed(from->getSealHeadroom(), '\0');
+  sealed += message;
+  from->sealInPlace(&sealed[0], sealed.size());
+  string opened;
+  return to->openInto(sealed.data(), sealed.size(), &opened) &&
+         opened == message;
+}
+
+TEST_CASE("SessionTicketsResumeOnBothSides") {
+  CryptoPair pair;
+  pair.handshake();
+  SessionKey secret = pair.first->getResumptionSecret();
+  REQUIRE(secret == pair.second->getResumptionSecret());
+  REQUIRE(CryptoHandler::getTicketId(secret) ==
+          CryptoHandler::getTicketId(pair.second->getResumptionSecret()));
+
+  pair.restart();
+  Nonce firstNonce;
+  randombytes_buf(firstNonce.data(), firstNonce.size());
+  Nonce secondNonce;
+  randombytes_buf(secondNonce.data(), secondNonce.size());
+  // Each side can send as soon as its own half is out
+  pair.first->resumeOutgoingSessionKey(secret, firstNonce);
+  pair.second->resumeIncomingSessionKey(secret, firstNonce);
+  string message = "RESUMED";
+  auto decrypted = pair.second->decrypt(pair.first->encrypt(message));
+  REQUIRE(decrypted);
+  REQUIRE(*decrypted == message);
+
+  pair.second->resumeOutgoingSessionKey(secret, secondNonce);
+  pair.first->resumeIncomingSessionKey(secret, secondNonce);
+  pair.first->enableCounterNonces();
+  pair.second->enableCounterNonces();
+  for (int a = 0; a < 10; a++) {
+    REQUIRE(sealAndOpen(pair.first.get(), pair.second.get(),
+                        "FIRST " + to_string(a)));
+    REQUIRE(sealAndOpen(pair.second.get(), pair.first.get(),
+                        "SECOND " + to_string(a)));
+  }
+  // The resumed session has a secret of its own
+  REQUIRE(pair.first->getResumptionSecret() ==
+          pair.second->getResumptionSecret());
+  REQUIRE(pair.first->getResumptionSecret() != secret);
+}
+
+TEST_CASE("SessionTicketsFallBackWhenOneSideHasNone") {
+  CryptoPair pair;
+  pair.handshake();
+  SessionKey secret = pair.first->getResumptionSecret();
+
+  // Only the first side kept its ticket
+  pair.restart();
+  Nonce nonce;
+  randombytes_buf(nonce.data(), nonce.size());
+  pair.first->resumeOutgoingSessionKey(secret, nonce);
+  pair.first->enableCounterNonces();
+  string sealed(pair.first->getSealHeadroom(), '\0');
+  sealed += "RESUMED";
+  pair.first->sealInPlace(&sealed[0], sealed.size());
+  REQUIRE(!pair.second->canDecrypt());
+
+  // Starts over from nothing, in the mode the handshake picks
+  pair.first->clearSessionKeys();
+  REQUIRE(!pair.first->canEncrypt());
+  REQUIRE(!pair.first->hasCounterNonces());
+  pair.handshake();
+  REQUIRE(sealAndOpen(pair.first.get(), pair.second.get(), "HANDSHAKE"));
+  REQUIRE(sealAndOpen(pair.second.get(), pair.first.get(), "HANDSHAKE"));
+  // Nothing sealed before the fallback opens with the new keys
+  string opened;
+  REQUIRE(!pair.second->openInto(sealed.data(), sealed.size(), &opened));
+}
+}  // namespace wga
@@ -0,0 +1,40 @@
+#include "Headers.hpp"
+
+#include "StreamReorderBuffer.hpp"
+#include "TestHelpers.hpp"
+
+#undef CHECK
+#include "Catch2/single_include/catch2/catch.hpp"
+
+namespace wga {
+TEST_CASE("StreamReorderBufferUnordered") {
+  StreamReorderBuffer buffer;
+  REQUIRE(payloads(buffer.push(IdPayload(RpcId(0, 2), "B"), 1, 0)) ==
+          vector<string>({"B"}));
+  REQUIRE(payloads(buffer.push(IdPayload(RpcId(0, 1), "A"), 1, 0)) ==
+          vector<string>({"A"}));
+  REQUIRE(buffer.empty());
+}
+
+TEST_CASE("StreamReorderBufferHoldsGaps") {
+  StreamReorderBuffer buffer;
+  REQUIRE(buffer.push(IdPayload(RpcId(0, 3), "C"), 5, 3).empty());
+  REQUIRE(buffer.push(IdPayload(RpcId(0, 2), "B"), 5, 2).empty());
+  REQUIRE(buffer.size() == 2);
+  REQUIRE(buffer.contains(RpcId(0, 3)));
+
+  // Another stream doesn't wait on the gap
+  REQUIRE(payloads(buffer.push(IdPayload(RpcId(0, 10), "X"), 6, 1)) ==
+          vector<string>({"X"}));
+
+  REQUIRE(payloads(buffer.push(IdPayload(RpcId(0, 1), "A"), 5, 1)) ==
+          vector<string>({"A", "B", "C"}));
+  REQUIRE(buffer.empty());
+  REQUIRE(!buffer.contains(RpcId(0, 3)));
+
+  // A resend of something already passed on goes straight through
+  REQUIRE(payloads(buffer.push(IdPayload(RpcId(0, 2), "B"), 5, 2)) ==
+          vector<string>({"B"}));
+  REQUIRE(buffer.empty());
+}
+}  // namespace wga
@@ -0,0 +1,75 @@
+#ifndef __TEST_HELPERS_H__
+#define __TEST_HELPERS_H__
+
+#include "Headers.hpp"
+
+#include "EncryptedMultiEndpointHandler.hpp"
+#include "NetEngine.hpp"
+#include "RpcId.hpp"
+
+namespace wga {
+// The payloads handed out by a reorder buffer, in the order it gave them
+inline vector<string> payloads(const vector<IdPayload>& idPayloads) {
+  vector<string> retval;
+  for (const auto& it : idPayloads) {
+    retval.push_back(it.payload);
+  }
+  return retval;
+}
+
+inline shared_ptr<udp::socket> openLoopbackSocket(
+    shared_ptr<NetEngine> netEngine) {
+  return shared_ptr<udp::socket>(
+      new udp::socket(*netEngine->getIoService(),
+                      udp::endpoint(asio::ip::address_v4::loopback(), 0)));
+}
+
+// Gives up after five seconds
+inline bool waitUntil(const function<bool()>& done) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (!done()) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    microsleep(1000);
+  }
+  return true;
+}
+
+// Talks to one other peer over a real socket, through the io threads like
+// any peer.  It never retransmits, so the io threads run out of work once
+// the sockets close.
+class LoopbackHandler : public EncryptedMultiEndpointHandler {
+ public:
+  LoopbackHandler(shared_ptr<NetEngine> netEngine,
+                  shared_ptr<udp::socket> localSocket,
+                  shared_ptr<CryptoHandler> cryptoHandler,
+                  const udp::endpoint& otherEndpoint)
+      : EncryptedMultiEndpointHandler(localSocket, netEngine, cryptoHandler,
+                                      {otherEndpoint}, false) {}
+
+  bool isResumed() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return resumedSession;
+  }
+  bool isSealing() {
+    lock_guard<recursive_mutex> guard(mutex);
+    return packetEncryptionEnabled;
+  }
+  // Leaves out what the other side doesn't have to understand
+  void leaveOutCapabilities(uint32_t capabilities) {
+    lock_guard<recursive_mutex> guard(mutex);
+    myCapabilities &= ~capabilities;
+  }
+  // As if the other side never answered our resumption
+  void expireResumption() {
+    lock_guard<recursive_mutex> guard(mutex);
+    checkTimeouts(monotonicTimeMicros() + 60 * 1000 * 1000);
+  }
+
+ protected:
+  virtual void scheduleRetransmit(int64_t deadline) {}
+};
+}  // namespace wga
+
+#endif  // __TEST_HELPERS_H__